@@ -234,7 +234,7 @@ impl ToString for JsInstruction {
     }
 }
 pub struct Sleigh {
-    spec: Option<String>,
+    spec: Option<&'static [u8]>,
     code: Option<Vec<u8>>,
 }
 
@@ -252,7 +252,7 @@ impl Sleigh {
             rust_code.push(code as u8)
         }
 
-        let spec = Option::from(arch(spec.value().as_str()).unwrap().to_string());
+        let spec = Option::from(arch(spec.value().as_str()).unwrap());
         let code = Option::from(rust_code);
 
         Ok(Self { spec, code })
@@ -568,7 +568,7 @@ declare_types! {
 
             let mut loader = PlainLoadImage::from_buf(code.as_ref(), _start);
             sleigh_builder.loader(&mut loader);
-            sleigh_builder.spec(spec.as_ref());
+            sleigh_builder.spec(spec);
 
             let mut asm_emit = CollectingAssemblyEmit::default();
             let mut pcode_emit = CollectingPcodeEmit::default();
@@ -260,7 +260,7 @@ impl PyInstruction {
 // This class use init Sleigh
 #[pyclass]
 pub struct Sleigh {
-    spec: Option<String>,
+    spec: Option<&'static [u8]>,
     code: Option<Vec<u8>>,
     mode: Option<Mode>
 }
@@ -273,7 +273,7 @@ impl Sleigh {
         let sp: &str = spec.extract().unwrap();
         let spec = arch(sp);
         let codes: Vec<u8> = code.extract().unwrap();
-        let spec = Option::from(spec.unwrap().to_string());
+        let spec = Option::from(spec.unwrap());
         let mode = {
             let mode =Mode::try_from(mode);
             mode.ok()
@@ -289,7 +289,7 @@ impl Sleigh {
         let mut sleigh_builder = SleighBuilder::default();
         let mut loader = PlainLoadImage::from_buf(self.code.as_ref().unwrap().as_ref(), start);
         sleigh_builder.loader(&mut loader);
-        sleigh_builder.spec(self.spec.as_ref().unwrap().as_str());
+        sleigh_builder.spec(self.spec.unwrap());
         sleigh_builder.mode(self.mode.unwrap());
 
         let mut asm_emit = CollectingAssemblyEmit::default();
@@ -14,6 +14,7 @@
 // limitations under the License.
 //
 use filetime::FileTime;
+use std::collections::HashMap;
 use std::env;
 use std::fs;
 use std::path::{Path, PathBuf};
@@ -21,6 +22,8 @@ use std::process::Command;
 use walkdir::WalkDir;
 
 const DECOMPILER_SOURCE_BASE_CXX: &[&str] = &[
+    "xmlpack.cc",
+    "xmlstream.cc",
     "space.cc",
     "float.cc",
     "address.cc",
@@ -50,6 +53,7 @@ const DECOMPILER_SOURCE_BASE_CXX: &[&str] = &[
     "jumptable.cc",
     "emulate.cc",
     "emulateutil.cc",
+    "emulatemicro.cc",
     "flow.cc",
     "userop.cc",
     "funcdata.cc",
@@ -165,10 +169,43 @@ fn need_recompile_obj(source: &Path) -> bool {
     need_recompile(source, &path)
 }
 
-fn need_recompile_sla(source: &Path) -> bool {
+/// Where sleighc records the files (the spec and its includes) each `.sla` was compiled from.
+const SLA_MANIFEST: &str = "sla.deps";
+
+fn sla_path_from_spec_path(source: &Path) -> PathBuf {
     let mut path = Path::new("sla").join(source.file_name().unwrap());
     path.set_extension("sla");
+    path
+}
+
+/// The files each `.sla` was compiled from by the last build.
+fn read_sla_manifest() -> HashMap<PathBuf, Vec<PathBuf>> {
+    let text = fs::read_to_string(SLA_MANIFEST).unwrap_or_default();
+    text.lines()
+        .filter_map(|line| {
+            let mut parts = line.splitn(2, ": ");
+            let sla = PathBuf::from(parts.next()?);
+            let deps = parts
+                .next()?
+                .split_whitespace()
+                .map(PathBuf::from)
+                .collect();
+            Some((sla, deps))
+        })
+        .collect()
+}
+
+fn need_recompile_sla(source: &Path, manifest: &HashMap<PathBuf, Vec<PathBuf>>) -> bool {
+    let path = sla_path_from_spec_path(source);
+    // Without a record of its includes, compile it again to get one
+    let deps = match manifest.get(&path) {
+        Some(deps) => deps,
+        None => return true,
+    };
     need_recompile(source, &path)
+        || deps
+            .iter()
+            .any(|dep| !dep.exists() || need_recompile(dep, &path))
 }
 
 fn obj_path_from_src_path(src_path: &Path) -> PathBuf {
@@ -320,33 +357,106 @@ fn compile_lib() {
         .compile("sleigh");
 }
 
-fn sleighc_compile(source: &Path, out: &Path) {
+/// Compile all the `(spec, sla)` pairs with a single sleighc, which runs as many
+/// compilations at once as cargo gives us jobs and updates the manifest. A spec that
+/// fails does not stop the others, but it fails the build once they are all done.
+fn sleighc_compile(specs: &[(PathBuf, PathBuf)]) {
     let sleighc = Path::new(&std::env::var("OUT_DIR").unwrap()).join("sleighc");
-
-    Command::new(sleighc)
-        .arg(source)
-        .arg(out)
-        .spawn()
-        .unwrap()
-        .wait()
+    let jobs = env::var("NUM_JOBS")
+        .ok()
+        .and_then(|n| n.parse::<usize>().ok())
+        .unwrap_or(1);
+
+    let status = Command::new(sleighc)
+        .arg("-p") // packed output, decoded without re-parsing the xml
+        .arg(format!("-j{}", jobs))
+        .arg(format!("-M{}", SLA_MANIFEST))
+        .arg("-b")
+        .args(specs.iter().flat_map(|(spec, sla)| vec![spec, sla]))
+        .status()
         .unwrap();
+    if !status.success() {
+        // sleighc drops the specs that failed from the manifest
+        let manifest = read_sla_manifest();
+        let failed: Vec<String> = specs
+            .iter()
+            .filter(|(spec, _)| need_recompile_sla(spec, &manifest))
+            .map(|(spec, _)| spec.display().to_string())
+            .collect();
+        panic!(
+            "sleighc failed ({}) to compile:\n  {}",
+            status,
+            failed.join("\n  ")
+        );
+    }
 }
 
-/// This will generate ".sla" file in the directory of its sleigh counterpart.
+/// The architectures picked with `SLEIGHCRAFT_PRESETS` (comma separated), all if unset.
+/// It must agree with the names `def_sla_load_preset!` embeds.
+fn selected_presets() -> Option<Vec<String>> {
+    println!("cargo:rerun-if-env-changed=SLEIGHCRAFT_PRESETS");
+    env::var("SLEIGHCRAFT_PRESETS").ok().map(|names| {
+        names
+            .split(',')
+            .map(|name| name.trim().to_lowercase())
+            .collect()
+    })
+}
+
+fn is_selected(path: &Path, selected: &Option<Vec<String>>) -> bool {
+    let selected = match selected {
+        Some(selected) => selected,
+        None => return true,
+    };
+    path.file_stem()
+        .and_then(|stem| stem.to_str())
+        .map(|stem| selected.contains(&stem.to_lowercase()))
+        .unwrap_or(false)
+}
+
+/// This will generate ".sla" files from the specs in the directory, only for the ones
+/// whose spec or included files changed since they were last compiled.
 fn sleighc_compile_sla(sleigh_dir: &PathBuf) {
     let _ = std::fs::create_dir("sla");
+    let manifest = read_sla_manifest();
+    let selected = selected_presets();
+
+    let specs: Vec<_> = WalkDir::new(sleigh_dir)
+        .into_iter()
+        .map(|entry| entry.unwrap().into_path())
+        .filter(|path| path.extension().map(|e| e == "slaspec").unwrap_or(false))
+        .filter(|path| is_selected(path, &selected))
+        .filter(|path| need_recompile_sla(path, &manifest))
+        .map(|path| {
+            let sla = sla_path_from_spec_path(&path);
+            (path, sla)
+        })
+        .collect();
+    if !specs.is_empty() {
+        sleighc_compile(&specs);
+    }
+}
 
-    for entry in WalkDir::new(sleigh_dir).into_iter() {
-        let from_path = entry.as_ref().unwrap().path();
-        let to_path = PathBuf::from("sla").join(from_path.file_name().unwrap());
-        if from_path.extension().map(|e| e == "sla").unwrap_or(false)
-            && need_recompile_sla(from_path)
-        {
-            sleighc_compile(from_path, &to_path);
+/// With the `compressed` feature, the presets are embedded deflated, from a `.sla.z`
+/// kept next to each `.sla`.
+#[cfg(feature = "compressed")]
+fn compress_sla() {
+    for entry in fs::read_dir("sla").unwrap() {
+        let path = entry.unwrap().path();
+        if path.extension().map(|e| e != "sla").unwrap_or(true) {
+            continue;
+        }
+        let target = path.with_extension("sla.z");
+        if need_recompile(&path, &target) {
+            let data = fs::read(&path).unwrap();
+            fs::write(&target, miniz_oxide::deflate::compress_to_vec(&data, 9)).unwrap();
         }
     }
 }
 
+#[cfg(not(feature = "compressed"))]
+fn compress_sla() {}
+
 /// As for now, the sleighc should have been compiled already.
 /// We are free to call the sleighc and generate the sla file we want.
 fn generate_sla() {
@@ -355,9 +465,16 @@ fn generate_sla() {
         &std::env::var("CARGO_MANIFEST_DIR").unwrap()
     ));
     sleighc_compile_sla(&sleigh_dir);
+    compress_sla();
 }
 
 fn main() {
+    // Listing anything turns off the default of running again on any change in the
+    // package, so everything the build reads is listed
+    println!("cargo:rerun-if-changed=build.rs");
+    println!("cargo:rerun-if-changed=src/sleigh.rs");
+    println!("cargo:rerun-if-changed=src/cpp");
+    println!("cargo:rerun-if-changed=src/sleigh");
     compile_lib();
     compile_compiler();
     generate_sla();
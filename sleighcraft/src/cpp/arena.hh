@@ -0,0 +1,132 @@
+/**
+ *  Copyright 2021 StarCrossTech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/// \file arena.hh
+/// \brief Bump allocation for the many small objects of a loaded SLEIGH specification
+
+#ifndef __CPUI_ARENA__
+#define __CPUI_ARENA__
+
+#include "types.h"
+#include <cstddef>
+#include <new>
+
+/// \brief A bump allocator whose memory is all released at once when it is destroyed
+///
+/// Memory is handed out from large blocks in allocation order, so objects allocated one
+/// after another (an op template and its operands, say) sit next to each other. Nothing is
+/// released before the arena itself is destroyed.
+///
+/// A SleighBase restoring a specification makes its arena the \e current one for the thread
+/// (see Scope), and objects deriving from ArenaObject are then allocated from it.
+class SleighArena {
+  /// \brief Header of a block of memory, followed by the memory handed out
+  struct alignas(std::max_align_t) Block {
+    Block *next;		///< The block allocated before this one
+  };
+  enum { block_size = 256*1024 };	///< Size of a normal block
+  Block *blocks;		///< The most recent block
+  char *cur;			///< Next free byte of the most recent block
+  char *end;			///< End of the most recent block
+
+  /// \brief The arena objects are allocated from on this thread, or null for the heap
+  static SleighArena *&current(void) {
+    static thread_local SleighArena *arena = (SleighArena *)0;
+    return arena;
+  }
+
+  /// \brief Allocate a new block with at least the given size of usable memory
+  char *newBlock(size_t size) {
+    size_t total = sizeof(Block) + size;
+    Block *block = (Block *)::operator new(total);
+    block->next = blocks;
+    blocks = block;
+    return (char *)block + sizeof(Block);
+  }
+public:
+  static const size_t alignment = alignof(std::max_align_t);	///< Alignment of every allocation
+
+  /// \brief Make an arena current for the calling thread, for the lifetime of \b this
+  class Scope {
+    SleighArena *saved;		///< The arena that was current before
+  public:
+    Scope(SleighArena *arena) { saved = current(); current() = arena; }	///< Constructor given the arena
+    ~Scope(void) { current() = saved; }	///< Restore the previous arena
+  };
+
+  SleighArena(void) { blocks = (Block *)0; cur = (char *)0; end = (char *)0; }	///< Construct an empty arena
+
+  /// \brief Destructor, releasing all the memory at once
+  ~SleighArena(void) {
+    while(blocks != (Block *)0) {
+      Block *next = blocks->next;
+      ::operator delete(blocks);
+      blocks = next;
+    }
+  }
+
+  /// \brief Allocate memory, aligned for any object
+  ///
+  /// \param size is the number of bytes needed
+  /// \return the memory
+  void *allocate(size_t size) {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    if (size > (size_t)(end - cur)) {
+      if (size > block_size / 4)	// Big requests get a block of their own
+	return newBlock(size);
+      cur = newBlock(block_size);
+      end = cur + block_size;
+    }
+    void *res = cur;
+    cur += size;
+    return res;
+  }
+
+  static SleighArena *getCurrent(void) { return current(); }	///< Get the arena current for the calling thread
+private:
+  SleighArena(const SleighArena &op2);			///< Not copyable
+  SleighArena &operator=(const SleighArena &op2);	///< Not assignable
+};
+
+/// \brief Base of classes allocated from the current SleighArena, if there is one
+///
+/// Each allocation is preceded by a word recording where it came from, so objects from
+/// the heap and from an arena can be deleted the same way. Deleting an arena object
+/// only runs its destructor, the memory goes when the arena is destroyed.
+class ArenaObject {
+  enum { header = SleighArena::alignment };	///< Bytes in front of each object
+public:
+  /// \brief Allocate from the current arena, or from the heap if there is none
+  static void *operator new(size_t size) {
+    SleighArena *arena = SleighArena::getCurrent();
+    char *base;
+    if (arena != (SleighArena *)0)
+      base = (char *)arena->allocate(size + header);
+    else
+      base = (char *)::operator new(size + header);
+    *(uintp *)base = (arena != (SleighArena *)0) ? 1 : 0;
+    return base + header;
+  }
+
+  /// \brief Release the memory of a heap object, nothing is done for arena objects
+  static void operator delete(void *ptr) {
+    if (ptr == (void *)0) return;
+    char *base = (char *)ptr - header;
+    if (*(uintp *)base == 0)
+      ::operator delete(base);
+  }
+};
+
+#endif
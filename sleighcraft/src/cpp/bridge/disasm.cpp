@@ -16,68 +16,480 @@
 #include "disasm.h"
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
 #include "proxies/address_proxy.hh"
+#include "xmlpack.hh"
 
-void SleighProxy::set_spec(const rust::Str spec_content, int mode) {
-    stringstream ss;
-    ss << spec_content;
+// Read the spec (xml text or packed) straight from the buffer, it is restored as it is read
+// rather than from a whole DOM tree
+static std::unique_ptr<XmlStream> open_spec_stream(rust::Slice<const uint8_t> spec_content) {
+    return std::unique_ptr<XmlStream>(xml_stream(spec_content.data(), spec_content.size()));
+}
 
-    Element *root = storage.parseDocument(ss)->getRoot();
-    storage.registerTag(root);
+SleighProxy::SleighProxy(LoadImage *ld, ContextInternal *context, const std::shared_ptr<SleighLanguageProxy> &lang):
+    language(lang), loader(ld), ctx(context), translator(new Sleigh(ld, context, &lang->language)) {
+    // Nothing to restore, this only registers the context variables and sets up the caches
+    translator->initialize(storage);
+}
 
-    translator.initialize(storage);
+// The x86 context for a mode. Addresses take the size of the mode, but operands stay 32-bit in
+// 64-bit mode unless a REX.W prefix widens them, as x86-64.pspec sets it up
+static void set_mode_context(Sleigh *trans, int mode) {
+    trans->setContextDefault("addrsize", mode);
+    trans->setContextDefault("opsize", (mode == 2) ? 1 : mode);
+    if (mode == 2)
+        trans->setContextDefault("bit64", 1);
+}
 
+void SleighProxy::set_mode(int mode) {
     if (mode != 0) {
-        this->ctx.setVariableDefault("addrsize",mode);
-        this->ctx.setVariableDefault("opsize",mode);
+        // Through the translator, so instructions parsed in another mode are not reused
+        set_mode_context(translator.get(), mode);
+    }
+}
+
+void SleighProxy::set_parser_cache(int32_t size, int32_t policy) {
+    try {
+        translator->setParserCache(size, policy);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+void SleighProxy::set_translation_cache(int32_t size) {
+    try {
+        translator->setTranslationCache(size);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+uint64_t SleighProxy::translation_cache_hits() const {
+    auto transcache = translator->getTranslationCache();
+    return transcache ? transcache->getHits() : 0;
+}
+
+uint64_t SleighProxy::translation_cache_misses() const {
+    auto transcache = translator->getTranslationCache();
+    return transcache ? transcache->getMisses() : 0;
+}
+
+void SleighProxy::invalidate_bytes(uint64_t start, uint64_t size) {
+    // Split huge ranges, the core takes an int4 size
+    while (size > 0) {
+        auto chunk = std::min<uint64_t>(size, 0x40000000);
+        translator->invalidateBytes(Address(translator->getDefaultCodeSpace(), start), (int4)chunk);
+        start += chunk;
+        size -= chunk;
+    }
+}
+
+void SleighProxy::set_spec(rust::Slice<const uint8_t> spec_content, int mode) {
+    try {
+        translator->initialize(*open_spec_stream(spec_content));
+    } catch (XmlError &e) {
+        throw std::invalid_argument("XmlError: " + e.explain);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
     }
 
+    set_mode(mode);
 }
 
 void SleighProxy::setSpecFromPath(const rust::Str path,int mode) {
-    string cxxpath = string(path);
-    Element *root = storage.openDocument(cxxpath)->getRoot();
-    storage.registerTag(root);
+    XmlFileBuffer file(string(path));
+    std::unique_ptr<XmlStream> stream(xml_stream(file.getData(), file.getSize()));
+    translator->initialize(*stream);
+
+    set_mode(mode);
+}
+
+std::shared_ptr<SleighLanguageProxy> new_sleigh_language(rust::Slice<const uint8_t> spec_content) {
+    std::shared_ptr<SleighLanguageProxy> lang(new SleighLanguageProxy());
+    try {
+        lang->language.initialize(*open_spec_stream(spec_content));
+    } catch (XmlError &e) {
+        throw std::invalid_argument("XmlError: " + e.explain);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+    return lang;
+}
+
+// The file is mapped rather than read, and restored straight from the mapping
+std::shared_ptr<SleighLanguageProxy> new_sleigh_language_from_file(const rust::Str path) {
+    std::shared_ptr<SleighLanguageProxy> lang(new SleighLanguageProxy());
+    try {
+        XmlFileBuffer file(string(path));
+        std::unique_ptr<XmlStream> stream(xml_stream(file.getData(), file.getSize()));
+        lang->language.initialize(*stream);
+    } catch (XmlError &e) {
+        throw std::invalid_argument("XmlError: " + e.explain);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+    return lang;
+}
+
+// The whole DOM tree is built first, so this takes any xml the bison parser does and not
+// only what sleighc writes
+std::shared_ptr<SleighLanguageProxy> new_sleigh_language_from_tree(rust::Slice<const uint8_t> spec_content) {
+    std::shared_ptr<SleighLanguageProxy> lang(new SleighLanguageProxy());
+    try {
+        DocumentStorage tree;
+        Document *doc;
+        if (XmlPack::isPacked(spec_content.data(), spec_content.size()))
+            doc = tree.unpackDocument(spec_content.data(), spec_content.size());
+        else {
+            std::istringstream s(string((const char *)spec_content.data(), spec_content.size()));
+            doc = tree.parseDocument(s);
+        }
+        tree.registerTag(doc->getRoot());
+        lang->language.initialize(tree);
+    } catch (XmlError &e) {
+        throw std::invalid_argument("XmlError: " + e.explain);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+    return lang;
+}
+
+rust::String SleighLanguageProxy::to_xml() const {
+    std::ostringstream s;
+    language.saveXml(s);
+    return rust::String(s.str());
+}
+
+void SleighProxy::add_segment(uint64_t start, rust::Slice<const uint8_t> data) {
+    SpanLoadImage *span = dynamic_cast<SpanLoadImage *>(loader.get());
+    if (span == nullptr)
+        throw std::logic_error("Segments can only be added to a decoder created over a span");
+    try {
+        span->addSegment(start, data.data(), data.size());
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+// Number of bytes `decode_with` decodes from the given address
+uint64_t SleighProxy::image_size(uint64_t start) {
+    SpanLoadImage *span = dynamic_cast<SpanLoadImage *>(loader.get());
+    if (span != nullptr)
+        return span->getContiguousSize(start);
+    return static_cast<RustLoadImageProxy *>(loader.get())->bufSize();
+}
+
+// The context database kinds that can be picked for a proxy
+static ContextInternal *new_context_database(int32_t kind) {
+    switch (kind) {
+    case 0: return new ContextInternal();
+    case 1: return new ContextIntervals();
+    default: throw std::invalid_argument("Unknown context database kind");
+    }
+}
+
+void SleighProxy::freeze_context() {
+    ContextIntervals *intervals = dynamic_cast<ContextIntervals *>(ctx.get());
+    if (intervals == nullptr)
+        throw std::logic_error("Only an interval context database can be frozen");
+    intervals->freeze();
+}
+
+unique_ptr<EmulatorProxy> SleighProxy::new_emulator() {
+    try {
+        return unique_ptr<EmulatorProxy>(new EmulatorProxy(translator.get(), loader.get()));
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+static unique_ptr<SleighProxy> proxy_with_language(LoadImage *ld, const std::shared_ptr<SleighLanguageProxy> &lang, int mode, ContextInternal *ctx) {
+    unique_ptr<SleighProxy> proxy;
+    try {
+        proxy.reset(new SleighProxy(ld, ctx, lang));
+        proxy->set_mode(mode);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+    return proxy;
+}
 
-    translator.initialize(storage);
+unique_ptr<SleighProxy> new_sleigh_proxy_with_language(RustLoadImage &ld, const std::shared_ptr<SleighLanguageProxy> &lang, int mode, int32_t context) {
+    ContextInternal *ctx = new_context_database(context);
+    return proxy_with_language(new RustLoadImageProxy(ld), lang, mode, ctx);
+}
 
-    this->ctx.setVariableDefault("addrsize",mode); // Address size is 32-bit
-    this->ctx.setVariableDefault("opsize",mode); // Operand size is 32-bit
+unique_ptr<SleighProxy> new_sleigh_proxy_span_with_language(const std::shared_ptr<SleighLanguageProxy> &lang, int mode, int32_t context) {
+    ContextInternal *ctx = new_context_database(context);
+    return proxy_with_language(new SpanLoadImage(), lang, mode, ctx);
 }
 
-unique_ptr<SleighProxy> new_sleigh_proxy(RustLoadImage &ld) {
-    unique_ptr<SleighProxy> proxy(new SleighProxy(ld));
+unique_ptr<SleighProxy> new_sleigh_proxy(RustLoadImage &ld, int32_t context) {
+    ContextInternal *ctx = new_context_database(context);
+    unique_ptr<SleighProxy> proxy(new SleighProxy(new RustLoadImageProxy(ld), ctx));
+    return proxy;
+}
+
+unique_ptr<SleighProxy> new_sleigh_proxy_span(int32_t context) {
+    ContextInternal *ctx = new_context_database(context);
+    unique_ptr<SleighProxy> proxy(new SleighProxy(new SpanLoadImage(), ctx));
     return proxy;
 }
 
 void SleighProxy::decode_with(RustAssemblyEmit& asm_emit, RustPcodeEmit& pcode_emit, uint64_t start) {
+    decode_range(asm_emit, pcode_emit, start, start + image_size(start));
+}
+
+uint64_t SleighProxy::decode_range(RustAssemblyEmit& asm_emit, RustPcodeEmit& pcode_emit, uint64_t start, uint64_t end) {
 
     auto assemblyEmit = RustAssemblyEmitProxy{asm_emit};
     auto pcodeEmit = RustPcodeEmitProxy{pcode_emit};
 
-    Address address(translator.getDefaultCodeSpace(), start);
+    Address address(translator->getDefaultCodeSpace(), start);
 
     auto length = 0;
-    auto buf_used = 0;
-    auto buf_size = loader.bufSize();
+    uint64_t cur = start;
 
-    while (buf_used < buf_size) {
+    // Instructions starting before `end` are decoded in full, even if they run past it
+    while (cur < end) {
         try {
-            length = translator.printAssembly(assemblyEmit, address);
-            translator.oneInstruction(pcodeEmit, address);
+            // The p-code of the delay slots comes with the branch, only their assembly is left
+            length = translator->decodeInstruction(assemblyEmit, pcodeEmit, address, lengths);
+            Address slot = address + lengths[0];
+            for (size_t i = 1; i < lengths.size(); ++i)
+                slot = slot + translator->printAssembly(assemblyEmit, slot);
             address = address + length;
-            buf_used = buf_used + length;
+            cur = cur + length;
 
         } catch (BadDataError &e) {
             throw std::invalid_argument("BadDataError");
         } catch (UnimplError &e) {
             throw std::logic_error("UnimplError");  // Pcode is not implemented for this constructor
+        } catch (LowlevelError &e) {
+            throw std::invalid_argument("LowlevelError: " + e.explain);
         }
 
         //TODO: implement exception
 
     }
 
+    return cur;
+}
+
+uint64_t SleighProxy::decode_pcode(PcodeBufferProxy& buffer, uint64_t start, uint64_t end) {
+
+    if (buffer.space_names.empty())
+        buffer.set_spaces(translator.get());
+
+    Address address(translator->getDefaultCodeSpace(), start);
+    uint64_t cur = start;
+
+    while (cur < end) {
+        size_t nops = buffer.opcodes.size();
+        size_t ninsns = buffer.insn_addrs.size();
+        try {
+            buffer.insn_addrs.push_back(address.getOffset());
+            auto length = translator->oneInstruction(buffer, address, lengths);
+            buffer.push_lengths(lengths);
+            address = address + length;
+            cur = cur + length;
+
+        } catch (BadDataError &e) {
+            buffer.truncate(nops, ninsns);
+            throw std::invalid_argument("BadDataError");
+        } catch (UnimplError &e) {
+            buffer.truncate(nops, ninsns);
+            throw std::logic_error("UnimplError");  // Pcode is not implemented for this constructor
+        } catch (LowlevelError &e) {
+            buffer.truncate(nops, ninsns);
+            throw std::invalid_argument("LowlevelError: " + e.explain);
+        }
+    }
+
+    return cur;
+}
+
+uint64_t SleighProxy::decode_asm(AssemblyBufferProxy& buffer, uint64_t start, uint64_t end) {
+
+    Address address(translator->getDefaultCodeSpace(), start);
+    uint64_t cur = start;
+
+    while (cur < end) {
+        size_t ninsns = buffer.insn_addrs.size();
+        try {
+            int4 bodystart;
+            auto length = translator->printAssembly(buffer.text, bodystart, address);
+            buffer.offsets.push_back(bodystart);
+            buffer.offsets.push_back(buffer.text.size());
+            buffer.insn_addrs.push_back(address.getOffset());
+            buffer.insn_lengths.push_back(length);
+            address = address + length;
+            cur = cur + length;
+
+        } catch (BadDataError &e) {
+            buffer.truncate(ninsns);
+            throw std::invalid_argument("BadDataError");
+        } catch (UnimplError &e) {
+            buffer.truncate(ninsns);
+            throw std::logic_error("UnimplError");  // Pcode is not implemented for this constructor
+        } catch (LowlevelError &e) {
+            buffer.truncate(ninsns);
+            throw std::invalid_argument("LowlevelError: " + e.explain);
+        }
+    }
+
+    return cur;
+}
+
+
+// Does op `op` of the buffer transfer control out of its instruction. Branches to a constant
+// are relative jumps between the ops of the same instruction.
+static bool leaves_instruction(const PcodeBufferProxy& buffer, size_t op, uint32_t constindex) {
+    switch ((OpCode)buffer.opcodes[op]) {
+    case CPUI_BRANCH:
+    case CPUI_CBRANCH:
+    case CPUI_CALL:
+        return buffer.var_spaces[buffer.op_vars[op] + buffer.op_outputs[op]] != constindex;
+    case CPUI_BRANCHIND:
+    case CPUI_CALLIND:
+    case CPUI_RETURN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint64_t SleighProxy::decode_block(PcodeBufferProxy& buffer, uint64_t start, uint32_t max_insns) {
+
+    if (buffer.space_names.empty())
+        buffer.set_spaces(translator.get());
+    uint32_t constindex = translator->getConstantSpace()->getIndex();
+
+    Address address(translator->getDefaultCodeSpace(), start);
+
+    for (uint32_t i = 0; i < max_insns; ++i) {
+        size_t nops = buffer.opcodes.size();
+        size_t ninsns = buffer.insn_addrs.size();
+        int4 fallthrough;
+        try {
+            buffer.insn_addrs.push_back(address.getOffset());
+            fallthrough = translator->oneInstruction(buffer, address, lengths);
+            buffer.push_lengths(lengths);
+
+        // Only the first instruction failing is an error, otherwise the block ends before it
+        } catch (BadDataError &e) {
+            buffer.truncate(nops, ninsns);
+            if (i == 0)
+                throw std::invalid_argument("BadDataError");
+            break;
+        } catch (UnimplError &e) {
+            buffer.truncate(nops, ninsns);
+            if (i == 0)
+                throw std::logic_error("UnimplError");  // Pcode is not implemented for this constructor
+            break;
+        } catch (LowlevelError &e) {
+            buffer.truncate(nops, ninsns);
+            if (i == 0)
+                throw std::invalid_argument("LowlevelError: " + e.explain);
+            break;
+        }
+
+        for (size_t op = nops; op < buffer.opcodes.size(); ++op) {
+            if (leaves_instruction(buffer, op, constindex))
+                return (address + fallthrough).getOffset();     // Past the delay slots too
+        }
+        address = address + fallthrough;
+    }
+
+    return address.getOffset();
+}
+
+// Drop everything from the given instruction on
+void AssemblyBufferProxy::truncate(size_t ninsns) {
+    text.truncate(offsets[2 * ninsns]);
+    offsets.resize(2 * ninsns + 1);
+    insn_addrs.resize(ninsns);
+    insn_lengths.resize(ninsns);
+}
+
+unique_ptr<AssemblyBufferProxy> new_assembly_buffer() {
+    return unique_ptr<AssemblyBufferProxy>(new AssemblyBufferProxy());
+}
+
+// PcodeBufferProxy
+void PcodeBufferProxy::dump(const Address &addr, OpCode opc, VarnodeData *outvar, VarnodeData *vars, int4 isize) {
+    opcodes.push_back(opc);
+    op_insns.push_back(insn_addrs.size() - 1);
+    op_outputs.push_back(outvar != (VarnodeData *)0);
+    if (outvar != (VarnodeData *)0) {
+        var_spaces.push_back(outvar->space->getIndex());
+        var_offsets.push_back(outvar->offset);
+        var_sizes.push_back(outvar->size);
+    }
+    for (auto i = 0; i < isize; ++i) {
+        var_spaces.push_back(vars[i].space->getIndex());
+        var_offsets.push_back(vars[i].offset);
+        var_sizes.push_back(vars[i].size);
+    }
+    if ((opc == CPUI_LOAD || opc == CPUI_STORE) && isize > 0) {
+        // The first input encodes a pointer to the space, which means nothing outside of this process
+        size_t slot = var_offsets.size() - isize;
+        var_offsets[slot] = Address::getSpaceFromConst(vars[0].getAddr())->getIndex();
+    }
+    op_vars.push_back(var_offsets.size());
+}
+
+// Finish the instruction whose address was pushed before translating it, given the lengths from
+// Sleigh::oneInstruction. Each delay slot gets an entry of its own, flagged and without any op.
+void PcodeBufferProxy::push_lengths(const vector<int4> &lengths) {
+    uint64_t addr = insn_addrs.back();
+    insn_lengths.push_back(lengths[0]);
+    insn_delay_slots.push_back(0);
+    for (size_t i = 1; i < lengths.size(); ++i) {
+        addr += insn_lengths.back();
+        insn_addrs.push_back(addr);
+        insn_lengths.push_back(lengths[i]);
+        insn_delay_slots.push_back(1);
+    }
+}
+
+void PcodeBufferProxy::clear(void) {
+    truncate(0, 0);
+}
+
+// Drop everything from the given op and instruction on
+void PcodeBufferProxy::truncate(size_t nops, size_t ninsns) {
+    size_t nvars = op_vars[nops];
+    opcodes.resize(nops);
+    op_insns.resize(nops);
+    op_outputs.resize(nops);
+    op_vars.resize(nops + 1);
+    var_spaces.resize(nvars);
+    var_offsets.resize(nvars);
+    var_sizes.resize(nvars);
+    insn_addrs.resize(ninsns);
+    insn_lengths.resize(ninsns);
+    insn_delay_slots.resize(ninsns);
+}
+
+void PcodeBufferProxy::set_spaces(const AddrSpaceManager *manager) {
+    space_names.clear();
+    for (auto i = 0; i < manager->numSpaces(); ++i) {
+        AddrSpace *spc = manager->getSpace(i);
+        space_names.push_back(spc == (AddrSpace *)0 ? string() : spc->getName());
+    }
+}
+
+const string& PcodeBufferProxy::get_space_name(uint32_t index) const {
+    static const string unknown;
+    return index < space_names.size() ? space_names[index] : unknown;
+}
+
+unique_ptr<PcodeBufferProxy> new_pcode_buffer() {
+    return unique_ptr<PcodeBufferProxy>(new PcodeBufferProxy());
 }
 
 // RustLoadImageProxy
@@ -126,3 +538,581 @@ void RustPcodeEmitProxy::dump(const Address &addr, OpCode opc, VarnodeData *outv
 
     rustPcodeEmit.dump(addr_proxy, opcodes, outvar_proxy, vars_vec);
 }
+
+// Recursive descent
+
+namespace {
+
+// One bit per mapped byte, set once a worker has claimed the instruction starting there
+class VisitedMap {
+    struct Range {
+        uint64_t start;
+        uint64_t size;
+        unique_ptr<std::atomic<uint64_t>[]> bits;
+    };
+    vector<Range> ranges;   // One per segment, sorted by address
+
+    const Range *find(uint64_t addr) const {
+        auto iter = std::upper_bound(ranges.begin(), ranges.end(), addr,
+                                     [](uint64_t a, const Range &r) { return a < r.start; });
+        if (iter == ranges.begin()) return nullptr;
+        --iter;
+        return (addr - iter->start < iter->size) ? &*iter : nullptr;
+    }
+public:
+    enum { claimed, visited, unmapped };
+
+    VisitedMap(const SpanLoadImage &image) {
+        for (int4 i = 0; i < image.numSegments(); ++i) {
+            Range range;
+            range.start = image.getSegmentStart(i);
+            range.size = image.getSegmentSize(i);
+            range.bits.reset(new std::atomic<uint64_t>[(range.size + 63) / 64]());
+            ranges.push_back(std::move(range));
+        }
+    }
+
+    // Only one caller gets `claimed` for a given address
+    int claim(uint64_t addr) {
+        const Range *range = find(addr);
+        if (range == nullptr) return unmapped;
+        uint64_t off = addr - range->start;
+        uint64_t bit = (uint64_t)1 << (off & 63);
+        uint64_t old = range->bits[off >> 6].fetch_or(bit, std::memory_order_relaxed);
+        return (old & bit) ? visited : claimed;
+    }
+
+    bool is_visited(uint64_t addr) const {
+        const Range *range = find(addr);
+        if (range == nullptr) return false;
+        uint64_t off = addr - range->start;
+        return (range->bits[off >> 6].load(std::memory_order_relaxed) >> (off & 63)) & 1;
+    }
+};
+
+// Addresses left to explore, one deque per worker. A worker takes the newest of its own
+// addresses, and when it has none, steals the oldest one of another worker.
+class WorkQueue {
+    struct Deque {
+        std::mutex lock;
+        std::deque<uint64_t> items;
+    };
+    vector<unique_ptr<Deque>> deques;
+    std::atomic<int64_t> pending;   // Pushed but not done yet, so more may be coming
+public:
+    WorkQueue(uint32_t workers): pending(0) {
+        for (uint32_t i = 0; i < workers; ++i)
+            deques.emplace_back(new Deque());
+    }
+
+    void push(uint32_t worker, uint64_t addr) {
+        pending.fetch_add(1);
+        std::lock_guard<std::mutex> guard(deques[worker]->lock);
+        deques[worker]->items.push_back(addr);
+    }
+
+    // Returns false once every address pushed is done
+    bool pop(uint32_t worker, uint64_t &addr) {
+        for (;;) {
+            for (size_t i = 0; i < deques.size(); ++i) {
+                Deque &deque(*deques[(worker + i) % deques.size()]);
+                std::lock_guard<std::mutex> guard(deque.lock);
+                if (deque.items.empty()) continue;
+                if (i == 0) {
+                    addr = deque.items.back();
+                    deque.items.pop_back();
+                } else {
+                    addr = deque.items.front();
+                    deque.items.pop_front();
+                }
+                return true;
+            }
+            if (pending.load() == 0) return false;
+            std::this_thread::yield();
+        }
+    }
+
+    void done() { pending.fetch_sub(1); }
+};
+
+// Collects where control goes after an instruction from its p-code
+class FlowEmit: public PcodeEmit {
+public:
+    AddrSpace *codespace;
+    vector<pair<uint64_t, uint8_t>> targets;    // Direct targets in the code space and the edge kind
+    bool flow;              // Some op transfers control out of the instruction
+    bool terminates;        // The last of them does not fall through
+
+    FlowEmit(AddrSpace *spc): codespace(spc) { clear(); }
+
+    void clear(void) {
+        targets.clear();
+        flow = false;
+        terminates = false;
+    }
+
+    virtual void dump(const Address &addr, OpCode opc, VarnodeData *outvar, VarnodeData *vars, int4 isize) {
+        switch (opc) {
+        case CPUI_BRANCH:
+        case CPUI_CBRANCH:
+        case CPUI_CALL:
+            if (vars[0].space->getType() == IPTR_CONSTANT)
+                return;     // Relative jump between the ops of the instruction
+            if (vars[0].space == codespace) {
+                uint8_t kind = (opc == CPUI_BRANCH) ? DescentProxy::edge_branch :
+                               (opc == CPUI_CBRANCH) ? DescentProxy::edge_cbranch : DescentProxy::edge_call;
+                targets.push_back(make_pair(vars[0].offset, kind));
+            }
+            flow = true;
+            terminates = (opc == CPUI_BRANCH);
+            break;
+        case CPUI_BRANCHIND:
+        case CPUI_RETURN:
+            flow = true;
+            terminates = true;
+            break;
+        case CPUI_CALLIND:
+            flow = true;
+            terminates = false;
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+struct DescentInsn {
+    uint64_t addr;
+    uint32_t length;        // Of the instruction alone
+    uint32_t fall;          // Up to the next instruction executed, past any delay slots
+    bool terminates;        // Control does not go on at addr + fall
+
+    bool operator<(const DescentInsn &op2) const { return addr < op2.addr; }
+};
+
+struct DescentEdge {
+    uint64_t from;
+    uint64_t to;
+    uint8_t kind;
+
+    bool operator<(const DescentEdge &op2) const {
+        if (from != op2.from) return from < op2.from;
+        if (to != op2.to) return to < op2.to;
+        return kind < op2.kind;
+    }
+};
+
+// What one decoder session found
+struct DescentWorker {
+    Sleigh *translator;
+    unique_ptr<FlowEmit> flow;
+    vector<int4> lengths;       // Of the last instruction and its delay slots
+    vector<DescentInsn> insns;
+    vector<DescentEdge> edges;
+    vector<uint64_t> calls;
+    vector<uint64_t> bad;
+    std::exception_ptr error;
+};
+
+// Decode forward from `start` until control does not fall through, or into an address already claimed.
+// Delay slots are translated with their branch and listed after it without being claimed: a flow
+// reaching the same address from elsewhere must still go on past it.
+void descend(DescentWorker &w, uint32_t index, WorkQueue &queue, VisitedMap &visited, uint64_t start) {
+    Sleigh *trans = w.translator;
+    FlowEmit &flow(*w.flow);
+    Address addr(trans->getDefaultCodeSpace(), start);
+
+    for (;;) {
+        uint64_t cur = addr.getOffset();
+        int claim = visited.claim(cur);
+        if (claim == VisitedMap::unmapped) {
+            w.bad.push_back(cur);
+            return;
+        }
+        if (claim == VisitedMap::visited)
+            return;             // Whoever claimed it goes on from there
+        flow.clear();
+        int4 fall;
+        try {
+            fall = trans->oneInstruction(flow, addr, w.lengths);
+        } catch (LowlevelError &e) {    // Including BadDataError and UnimplError
+            w.bad.push_back(cur);
+            return;
+        }
+        DescentInsn insn = {cur, (uint32_t)w.lengths[0], (uint32_t)fall, flow.terminates};
+        w.insns.push_back(insn);
+        uint64_t slot = cur + w.lengths[0];
+        for (size_t i = 1; i < w.lengths.size(); ++i) {
+            uint32_t length = w.lengths[i];
+            w.insns.push_back({slot, length, length, false});
+            slot += length;
+        }
+
+        for (auto &target : flow.targets) {
+            w.edges.push_back({cur, target.first, target.second});
+            if (target.second == DescentProxy::edge_call)
+                w.calls.push_back(target.first);
+            if (!visited.is_visited(target.first))
+                queue.push(index, target.first);
+        }
+        if (flow.flow && !flow.terminates)
+            w.edges.push_back({cur, (addr + fall).getOffset(), DescentProxy::edge_fall});
+
+        if (flow.terminates)
+            return;
+        addr = addr + fall;
+    }
+}
+
+}
+
+void SleighProxy::explore(DescentProxy& result, rust::Slice<const uint64_t> entries, uint32_t threads) {
+    SpanLoadImage *span = dynamic_cast<SpanLoadImage *>(loader.get());
+    if (span == nullptr)
+        throw std::logic_error("Recursive descent needs a decoder created over a span");
+    if (threads == 0 || !language)
+        threads = 1;            // More decoders can only be bound to a shared language
+    // Where a decoded instruction can set the context of others (like an ARM blx switching its
+    // target to thumb), what a worker decodes would depend on what the others got to first
+    if (language && language->language.hasContextCommits())
+        threads = 1;
+
+    // The first decoder is this proxy's, the others share its language and its (read-only) image,
+    // and decode with a copy of its context, of the same kind
+    vector<unique_ptr<ContextInternal>> contexts;
+    vector<unique_ptr<Sleigh>> translators;
+    vector<DescentWorker> workers(threads);
+    try {
+        for (uint32_t i = 0; i < threads; ++i) {
+            Sleigh *trans = translator.get();
+            if (i > 0) {
+                bool intervals = dynamic_cast<ContextIntervals *>(ctx.get()) != nullptr;
+                contexts.emplace_back(intervals ? new ContextIntervals() : new ContextInternal());
+                translators.emplace_back(new Sleigh(loader.get(), contexts.back().get(), &language->language));
+                trans = translators.back().get();
+                DocumentStorage empty;
+                trans->initialize(empty);       // Registers the variables, so copy after
+                contexts.back()->copyFrom(*ctx);
+            }
+            workers[i].translator = trans;
+            workers[i].flow.reset(new FlowEmit(trans->getDefaultCodeSpace()));
+        }
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+
+    VisitedMap visited(*span);
+    WorkQueue queue(threads);
+    for (size_t i = 0; i < entries.size(); ++i)
+        queue.push(i % threads, entries[i]);
+
+    auto run = [&](uint32_t index) {
+        DescentWorker &w(workers[index]);
+        try {
+            uint64_t addr;
+            while (queue.pop(index, addr)) {
+                descend(w, index, queue, visited, addr);
+                queue.done();
+            }
+        } catch (...) {
+            w.error = std::current_exception();
+            queue.done();       // Let the others finish
+        }
+    };
+    vector<std::thread> pool;
+    for (uint32_t i = 1; i < threads; ++i)
+        pool.emplace_back(run, i);
+    run(0);
+    for (auto &t : pool)
+        t.join();
+    for (auto &w : workers) {
+        if (w.error)
+            std::rethrow_exception(w.error);
+    }
+
+    // Merge what the workers found
+    vector<DescentInsn> insns;
+    vector<DescentEdge> edges;
+    vector<uint64_t> funcs(entries.begin(), entries.end());
+    result = DescentProxy();
+    for (auto &w : workers) {
+        insns.insert(insns.end(), w.insns.begin(), w.insns.end());
+        edges.insert(edges.end(), w.edges.begin(), w.edges.end());
+        funcs.insert(funcs.end(), w.calls.begin(), w.calls.end());
+        result.bad_addrs.insert(result.bad_addrs.end(), w.bad.begin(), w.bad.end());
+    }
+    // A delay slot may also have been decoded as the start of a flow, keep one of each
+    std::sort(insns.begin(), insns.end());
+    insns.erase(std::unique(insns.begin(), insns.end(), [](const DescentInsn &a, const DescentInsn &b) {
+        return a.addr == b.addr;
+    }), insns.end());
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end(), [](const DescentEdge &a, const DescentEdge &b) {
+        return a.from == b.from && a.to == b.to && a.kind == b.kind;
+    }), edges.end());
+    std::sort(funcs.begin(), funcs.end());
+    funcs.erase(std::unique(funcs.begin(), funcs.end()), funcs.end());
+    std::sort(result.bad_addrs.begin(), result.bad_addrs.end());
+    result.bad_addrs.erase(std::unique(result.bad_addrs.begin(), result.bad_addrs.end()), result.bad_addrs.end());
+
+    for (auto &insn : insns) {
+        result.insn_addrs.push_back(insn.addr);
+        result.insn_lengths.push_back(insn.length);
+    }
+    for (auto &edge : edges) {
+        result.edge_from.push_back(edge.from);
+        result.edge_to.push_back(edge.to);
+        result.edge_kinds.push_back(edge.kind);
+    }
+
+    // A function is everything reachable from its entry without following calls
+    auto find = [&](uint64_t addr) -> int64_t {
+        auto iter = std::lower_bound(result.insn_addrs.begin(), result.insn_addrs.end(), addr);
+        if (iter == result.insn_addrs.end() || *iter != addr) return -1;
+        return iter - result.insn_addrs.begin();
+    };
+    // Last function (plus one) that reached each instruction, at 2*i as a delay slot and 2*i+1 otherwise
+    vector<uint32_t> stamp(2 * insns.size(), 0);
+    vector<uint32_t> stack;
+    for (uint64_t entry : funcs) {
+        if (find(entry) < 0) continue;                // Never decoded, it is in bad_addrs
+        uint32_t mark = result.func_entries.size() + 1;
+        size_t start = result.func_insns.size();
+        result.func_entries.push_back(entry);
+        result.func_first.push_back(start);
+        auto visit = [&](uint64_t addr, bool delayslot) {
+            int64_t i = find(addr);
+            if (i < 0) return;
+            uint32_t key = 2 * i + (delayslot ? 0 : 1);
+            if (stamp[key] != mark) {
+                stamp[key] = mark;
+                stack.push_back(key);
+            }
+        };
+        visit(entry, false);
+        while (!stack.empty()) {
+            uint32_t key = stack.back();
+            stack.pop_back();
+            result.func_insns.push_back(key / 2);
+            if ((key & 1) == 0)
+                continue;               // A delay slot, its branch accounts for what follows
+            const DescentInsn &insn(insns[key / 2]);
+            for (uint64_t addr = insn.addr + insn.length; addr < insn.addr + insn.fall; ) {
+                int64_t j = find(addr);
+                if (j < 0) break;
+                visit(addr, true);
+                addr += insns[j].length;
+            }
+            if (!insn.terminates)
+                visit(insn.addr + insn.fall, false);
+            DescentEdge first = {insn.addr, 0, 0};
+            for (auto iter = std::lower_bound(edges.begin(), edges.end(), first);
+                 iter != edges.end() && iter->from == insn.addr; ++iter) {
+                if (iter->kind == DescentProxy::edge_branch || iter->kind == DescentProxy::edge_cbranch)
+                    visit(iter->to, false);
+            }
+        }
+        std::sort(result.func_insns.begin() + start, result.func_insns.end());
+        result.func_insns.erase(std::unique(result.func_insns.begin() + start, result.func_insns.end()),
+                                result.func_insns.end());
+    }
+    result.func_first.push_back(result.func_insns.size());
+}
+
+unique_ptr<DescentProxy> new_descent_result() {
+    return unique_ptr<DescentProxy>(new DescentProxy());
+}
+
+// EmulatorProxy
+// Spaces holding more than this stay paged rather than get a flat array
+static const uint64_t max_array_size = 1 << 24;
+
+// Number of bytes at the start of a space that emulation can reach, or 0 if it is not known.
+// Small spaces are held whole, otherwise a space is held as far as the language's registers or
+// temporaries go, unless it is the data space, which loads and stores can reach anywhere.
+static uint64_t space_extent(const Sleigh *trans, AddrSpace *spc, const map<VarnodeData, string> &regs) {
+    if (spc->getHighest() < max_array_size)
+        return spc->getHighest() + 1;
+    if (spc == trans->getDefaultDataSpace())
+        return 0;
+    if (spc == trans->getUniqueSpace()) {
+        uint64_t extent = trans->getUniqueBase();
+        uint64_t mask = trans->getUniqueAllocationMask();
+        if (mask == 0)
+            return extent;
+        // Offsets are or'ed with (address & mask) << 4, so they stay below the next power of two
+        uint64_t top = std::max(extent - 1, (mask << 4) | 0xf);
+        extent = 1;
+        while (extent <= top)
+            extent <<= 1;
+        return extent;
+    }
+    uint64_t extent = 0;
+    for (auto &reg : regs) {
+        if (reg.first.space == spc)
+            extent = std::max(extent, reg.first.offset + reg.first.size);
+    }
+    return extent;
+}
+
+EmulatorProxy::EmulatorProxy(Sleigh *t, LoadImage *loader): trans(t), memstate(t), breaktable(t), stopper(this) {
+    // Every space starts out zero except the code space, read from the image until written.
+    // Registers and temporaries get flat arrays, as most varnodes read and written live there.
+    AddrSpace *codespace = trans->getDefaultCodeSpace();
+    image.reset(new MemoryImage(codespace, 8, 4096, loader));
+    map<VarnodeData, string> regs;
+    trans->getAllRegisters(regs);
+    for (auto i = 0; i < trans->numSpaces(); ++i) {
+        AddrSpace *spc = trans->getSpace(i);
+        if (spc == (AddrSpace *)0)
+            continue;
+        if (spc->getType() != IPTR_PROCESSOR && spc->getType() != IPTR_INTERNAL)
+            continue;
+        uint64_t extent = (spc == codespace) ? 0 : space_extent(trans, spc, regs);
+        if (extent != 0 && extent <= max_array_size)
+            banks.emplace_back(new MemoryArray(spc, 8, 4096, extent));
+        else {
+            MemoryBank *underlie = (spc == codespace) ? image.get() : (MemoryBank *)0;
+            banks.emplace_back(new MemoryPageOverlay(spc, 8, 4096, underlie));
+        }
+        memstate.setMemoryBank(banks.back().get());
+    }
+    emulator.reset(new EmulateMicro(trans, &memstate, &breaktable));
+}
+
+bool EmulatorProxy::StopCallBack::pcodeCallback(PcodeOpRaw *op) {
+    owner->stop = stop_userop;
+    owner->stopuserop = op->getInput(0)->offset;
+    emulate->setHalt(true);
+    return true;            // The rest of the instruction is still executed
+}
+
+bool EmulatorProxy::StopCallBack::addressCallback(const Address &addr) {
+    if (owner->resuming || owner->breakpoints.count(addr.getOffset()) == 0)
+        return false;
+    owner->stop = stop_breakpoint;
+    emulate->setHalt(true);
+    return true;            // The instruction is not executed
+}
+
+void EmulatorProxy::set_pc(uint64_t addr) {
+    ready = false;
+    stop = stop_steps;
+    try {
+        emulator->setExecuteAddress(Address(trans->getDefaultCodeSpace(), addr));
+    } catch (BadDataError &e) {
+        throw std::invalid_argument("BadDataError");
+    } catch (UnimplError &e) {
+        throw std::logic_error("UnimplError");  // Pcode is not implemented for this constructor
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+    ready = true;
+}
+
+uint64_t EmulatorProxy::get_register(rust::Str name) const {
+    try {
+        const VarnodeData &reg(trans->getRegister(string(name)));
+        if (reg.size > sizeof(uintb))
+            throw LowlevelError("Register is too large: " + string(name));
+        return memstate.getValue(reg.space, reg.offset, reg.size);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+void EmulatorProxy::set_register(rust::Str name, uint64_t val) {
+    try {
+        const VarnodeData &reg(trans->getRegister(string(name)));
+        if (reg.size > sizeof(uintb))
+            throw LowlevelError("Register is too large: " + string(name));
+        memstate.setValue(reg.space, reg.offset, reg.size, val);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+void EmulatorProxy::read_memory(uint64_t addr, rust::Slice<uint8_t> buf) const {
+    try {
+        memstate.getChunk(buf.data(), trans->getDefaultCodeSpace(), addr, buf.size());
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+void EmulatorProxy::write_memory(uint64_t addr, rust::Slice<const uint8_t> data) {
+    try {
+        memstate.setChunk(data.data(), trans->getDefaultCodeSpace(), addr, data.size());
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+}
+
+void EmulatorProxy::snapshot() {
+    memstate.snapshot();
+    savedready = ready;
+    savedpc = ready ? get_pc() : 0;
+}
+
+void EmulatorProxy::restore() {
+    memstate.restore();
+    if (savedready)
+        set_pc(savedpc);
+    else {
+        ready = false;
+        stop = stop_steps;
+    }
+}
+
+void EmulatorProxy::add_breakpoint(uint64_t addr) {
+    if (breakpoints.insert(addr).second)
+        breaktable.registerAddressCallback(Address(trans->getDefaultCodeSpace(), addr), &stopper);
+}
+
+// The break table cannot forget a callback, it is only ignored from then on
+void EmulatorProxy::remove_breakpoint(uint64_t addr) {
+    breakpoints.erase(addr);
+}
+
+uint32_t EmulatorProxy::stop_at_userop(rust::Str name) {
+    try {
+        breaktable.registerPcodeCallback(string(name), &stopper);
+    } catch (LowlevelError &e) {
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+    vector<string> names;
+    trans->getUserOpNames(names);
+    return std::find(names.begin(), names.end(), string(name)) - names.begin();
+}
+
+uint64_t EmulatorProxy::run(uint64_t max_steps) {
+    if (!ready)
+        throw std::logic_error("The program counter must be set before running");
+    if (max_steps == 0)
+        return 0;
+    resuming = (stop == stop_breakpoint);
+    stop = stop_steps;
+    emulator->setHalt(false);
+
+    uint64_t steps = 0;
+    try {
+        // A halting breakpoint does not count its instruction, a halting user-defined op does
+        if (resuming) {
+            steps = emulator->executeInstructions(1);
+            resuming = false;
+        }
+        if (!emulator->getHalt() && steps < max_steps)
+            steps += emulator->executeInstructions(max_steps - steps);
+    // The state is left in the middle of the failing instruction, set_pc must be called again
+    } catch (BadDataError &e) {
+        ready = false;
+        throw std::invalid_argument("BadDataError");
+    } catch (UnimplError &e) {
+        ready = false;
+        throw std::logic_error("UnimplError");  // Pcode is not implemented for this constructor
+    } catch (LowlevelError &e) {
+        ready = false;
+        throw std::invalid_argument("LowlevelError: " + e.explain);
+    }
+    return steps;
+}
@@ -17,9 +17,12 @@
 #define BRIDGE_DISASM_H
 
 #include "sleigh.hh"
-#include "emulate.hh"
+#include "emulatemicro.hh"
+#include "memstate.hh"
 #include "loadimage.hh"
+#include "xmlstream.hh"
 #include <memory>
+#include <set>
 #include "rust/cxx.h"
 #include "sleighcraft/src/sleigh.rs.h"
 
@@ -92,24 +95,231 @@ public:
 
 };
 
+// P-code of a batch of instructions, stored column by column so that Rust can read it through
+// slices, without a callback or any allocation per op.
+class PcodeBufferProxy: public PcodeEmit {
+public:
+    // One entry per op. The varnodes of op `i` are [op_vars[i], op_vars[i+1]), the output first if there is one.
+    vector<uint8_t> opcodes;
+    vector<uint32_t> op_insns;          // index of the instruction the op belongs to
+    vector<uint8_t> op_outputs;         // 1 if the op has an output varnode
+    vector<uint32_t> op_vars;           // always one entry longer than the ops
+    // One entry per varnode. The space operand of LOAD/STORE is turned into a space index.
+    vector<uint32_t> var_spaces;        // AddrSpace index, see space_names
+    vector<uint64_t> var_offsets;
+    vector<uint32_t> var_sizes;
+    // One entry per instruction
+    vector<uint64_t> insn_addrs;
+    vector<uint32_t> insn_lengths;
+    vector<uint8_t> insn_delay_slots;   // 1 if in the delay slot of the branch before it, whose ops include its own
+    // Names of the spaces by index, filled once by the first decoder using this buffer
+    vector<string> space_names;
+
+    PcodeBufferProxy(void) { op_vars.push_back(0); }
+    virtual void dump(const Address &addr,OpCode opc,VarnodeData *outvar,VarnodeData *vars,int4 isize);
+    void clear(void);
+    void truncate(size_t nops, size_t ninsns);
+    void push_lengths(const vector<int4> &lengths);
+    void set_spaces(const AddrSpaceManager *manager);
+
+    rust::Slice<const uint8_t> get_opcodes() const { return {opcodes.data(), opcodes.size()}; }
+    rust::Slice<const uint32_t> get_op_insns() const { return {op_insns.data(), op_insns.size()}; }
+    rust::Slice<const uint8_t> get_op_outputs() const { return {op_outputs.data(), op_outputs.size()}; }
+    rust::Slice<const uint32_t> get_op_vars() const { return {op_vars.data(), op_vars.size()}; }
+    rust::Slice<const uint32_t> get_var_spaces() const { return {var_spaces.data(), var_spaces.size()}; }
+    rust::Slice<const uint64_t> get_var_offsets() const { return {var_offsets.data(), var_offsets.size()}; }
+    rust::Slice<const uint32_t> get_var_sizes() const { return {var_sizes.data(), var_sizes.size()}; }
+    rust::Slice<const uint64_t> get_insn_addrs() const { return {insn_addrs.data(), insn_addrs.size()}; }
+    rust::Slice<const uint32_t> get_insn_lengths() const { return {insn_lengths.data(), insn_lengths.size()}; }
+    rust::Slice<const uint8_t> get_insn_delay_slots() const { return {insn_delay_slots.data(), insn_delay_slots.size()}; }
+    const string& get_space_name(uint32_t index) const;
+};
+
+// Disassembly of a batch of instructions, all the text written into one arena that keeps its
+// memory when cleared. Rust reads the text and the offsets delimiting each piece through slices.
+class AssemblyBufferProxy {
+public:
+    PrintBuffer text;
+    // The mnemonic of instruction `i` is text[offsets[2i], offsets[2i+1]), its body runs up to offsets[2i+2]
+    vector<uint32_t> offsets;
+    vector<uint64_t> insn_addrs;
+    vector<uint32_t> insn_lengths;
+
+    AssemblyBufferProxy(void) { offsets.push_back(0); }
+    void clear(void) { truncate(0); }
+    void truncate(size_t ninsns);
+    rust::Slice<const uint8_t> get_text() const { return {(const uint8_t *)text.data(), (size_t)text.size()}; }
+    rust::Slice<const uint32_t> get_offsets() const { return {offsets.data(), offsets.size()}; }
+    rust::Slice<const uint64_t> get_asm_addrs() const { return {insn_addrs.data(), insn_addrs.size()}; }
+    rust::Slice<const uint32_t> get_asm_lengths() const { return {insn_lengths.data(), insn_lengths.size()}; }
+};
+
+// Result of a recursive descent disassembly, read by Rust through slices. Instructions, functions,
+// edges and bad addresses are each sorted by address.
+class DescentProxy {
+public:
+    // Kinds of edges
+    enum { edge_fall = 0, edge_branch = 1, edge_cbranch = 2, edge_call = 3 };
+
+    vector<uint64_t> insn_addrs;
+    vector<uint32_t> insn_lengths;
+    // Function `i` starts at func_entries[i]. Its instructions are func_insns[func_first[i]..func_first[i+1]],
+    // indices into insn_addrs. An instruction shared by several functions is listed in each.
+    vector<uint64_t> func_entries;
+    vector<uint32_t> func_first;
+    vector<uint32_t> func_insns;
+    // Control transfers out of an instruction: branch and call targets, and the fall through
+    // of instructions that may branch or call
+    vector<uint64_t> edge_from;
+    vector<uint64_t> edge_to;
+    vector<uint8_t> edge_kinds;
+    // Addresses the flow reached that could not be decoded (or are not mapped)
+    vector<uint64_t> bad_addrs;
+
+    rust::Slice<const uint64_t> get_insn_addrs() const { return {insn_addrs.data(), insn_addrs.size()}; }
+    rust::Slice<const uint32_t> get_insn_lengths() const { return {insn_lengths.data(), insn_lengths.size()}; }
+    rust::Slice<const uint64_t> get_func_entries() const { return {func_entries.data(), func_entries.size()}; }
+    rust::Slice<const uint32_t> get_func_first() const { return {func_first.data(), func_first.size()}; }
+    rust::Slice<const uint32_t> get_func_insns() const { return {func_insns.data(), func_insns.size()}; }
+    rust::Slice<const uint64_t> get_edge_from() const { return {edge_from.data(), edge_from.size()}; }
+    rust::Slice<const uint64_t> get_edge_to() const { return {edge_to.data(), edge_to.size()}; }
+    rust::Slice<const uint8_t> get_edge_kinds() const { return {edge_kinds.data(), edge_kinds.size()}; }
+    rust::Slice<const uint64_t> get_bad_addrs() const { return {bad_addrs.data(), bad_addrs.size()}; }
+};
+
+// A spec loaded once and shared (read-only) by any number of SleighProxy decoders, possibly on different threads.
+class SleighLanguageProxy {
+public:
+    SleighLanguage language;
+
+    // Write the spec back out as xml text, as sleighc does
+    rust::String to_xml() const;
+};
+
+// A p-code emulator over the translator and the image of a SleighProxy. Writes go to pages
+// overlaying the image, while instructions are always decoded from the image itself.
+// Runs stay in C++ until they stop, see the stop_ kinds. Instructions are lowered once into
+// cached blocks, as the image they are decoded from never changes.
+class EmulatorProxy {
+public:
+    // Why the last run stopped
+    enum { stop_steps = 0, stop_breakpoint = 1, stop_userop = 2 };
+
+    EmulatorProxy(Sleigh *trans, LoadImage *loader);
+
+    uint64_t get_pc() const { return emulator->getExecuteAddress().getOffset(); }
+    void set_pc(uint64_t addr);
+    uint64_t get_register(rust::Str name) const;
+    void set_register(rust::Str name, uint64_t val);
+    // Memory of the default code space
+    void read_memory(uint64_t addr, rust::Slice<uint8_t> buf) const;
+    void write_memory(uint64_t addr, rust::Slice<const uint8_t> data);
+    // Stop before the instruction at addr is executed
+    void add_breakpoint(uint64_t addr);
+    void remove_breakpoint(uint64_t addr);
+    // Stop after the instruction calling the user-defined op, returns the index of the op
+    uint32_t stop_at_userop(rust::Str name);
+    // Execute at most max_steps instructions, returns how many were
+    uint64_t run(uint64_t max_steps);
+    uint8_t get_stop() const { return stop; }
+    // Save the memory, the registers and the program counter. Only the pages of memory
+    // written since are copied back by restore
+    void snapshot();
+    // Go back to the last snapshot, or to the initial state (with no program counter) if none
+    void restore();
+    uint32_t get_stop_userop() const { return stopuserop; }
+
+private:
+    // Halts the emulator for a breakpoint or a user-defined op
+    class StopCallBack: public BreakCallBack {
+    public:
+        EmulatorProxy *owner;
+        StopCallBack(EmulatorProxy *o): owner(o) {}
+        virtual bool pcodeCallback(PcodeOpRaw *op);
+        virtual bool addressCallback(const Address &addr);
+    };
+
+    Sleigh *trans;
+    MemoryState memstate;
+    BreakTableCallBack breaktable;
+    std::unique_ptr<MemoryImage> image;
+    vector<std::unique_ptr<MemoryBank>> banks;
+    StopCallBack stopper;
+    std::set<uint64_t> breakpoints;     // Registered with the break table and not removed since
+    std::unique_ptr<EmulateMicro> emulator;
+    bool ready = false;                 // The current instruction is translated, unset by errors
+    bool resuming = false;              // Step over the breakpoint the last run stopped at
+    uint8_t stop = stop_steps;
+    uint32_t stopuserop = 0;
+    bool savedready = false;            // The program counter was set at the last snapshot
+    uint64_t savedpc = 0;
+};
+
 class SleighProxy {
 public:
-    SleighProxy(RustLoadImage &ld): loader(ld), translator(&loader, &this->ctx) {}
+    // The proxy owns the load image and the context database
+    SleighProxy(LoadImage *ld, ContextInternal *context): loader(ld), ctx(context), translator(new Sleigh(ld, context)) {}
+    SleighProxy(LoadImage *ld, ContextInternal *context, const std::shared_ptr<SleighLanguageProxy> &lang);
 
     void setSpecFromPath(const rust::Str path, int mode);
-    void set_spec(const rust::Str spec_content, int mode);
+    void set_spec(rust::Slice<const uint8_t> spec_content, int mode);
+    void set_mode(int mode);
+    // Map caller owned bytes, only for proxies created over a SpanLoadImage
+    void add_segment(uint64_t start, rust::Slice<const uint8_t> data);
     void decode_with(RustAssemblyEmit& asm_emit, RustPcodeEmit& pcode_emit, uint64_t start);
+    // Decode every instruction that starts in [start, end), returns the address following the last one
+    uint64_t decode_range(RustAssemblyEmit& asm_emit, RustPcodeEmit& pcode_emit, uint64_t start, uint64_t end);
+    // Same as decode_range, but only p-code is produced and it is appended to the buffer
+    uint64_t decode_pcode(PcodeBufferProxy& buffer, uint64_t start, uint64_t end);
+    // Append the p-code of at most max_insns instructions from start, stopping after the first one
+    // whose p-code branches, calls or returns. Returns the address following the block.
+    uint64_t decode_block(PcodeBufferProxy& buffer, uint64_t start, uint32_t max_insns);
+    // Follow control flow from the entries over all the mapped segments, with `threads` decoders sharing
+    // the language. Only for proxies created over a SpanLoadImage. The result is replaced.
+    void explore(DescentProxy& result, rust::Slice<const uint64_t> entries, uint32_t threads);
+    // Same as decode_range, but only the assembly is produced and it is appended to the buffer
+    uint64_t decode_asm(AssemblyBufferProxy& buffer, uint64_t start, uint64_t end);
+    // Keep `size` parsed instructions around, evicted by the given DisassemblyCache policy
+    void set_parser_cache(int32_t size, int32_t policy);
+    uint64_t parser_cache_hits() const { return translator->getParserCache()->getHits(); }
+    uint64_t parser_cache_misses() const { return translator->getParserCache()->getMisses(); }
+    // Keep the p-code of `size` translated instructions around, 0 disables the cache
+    void set_translation_cache(int32_t size);
+    uint64_t translation_cache_hits() const;
+    uint64_t translation_cache_misses() const;
+    // Forget what was decoded from bytes in [start, start + size) of the code space
+    void invalidate_bytes(uint64_t start, uint64_t size);
+    // Switch context lookups to a sorted array of the current split points, only for proxies created
+    // with a ContextIntervals database. Lookups go back to the map if a split point is added later.
+    void freeze_context();
+    // An emulator sharing the translator and the image, which must outlive it
+    unique_ptr<EmulatorProxy> new_emulator();
 
 private:
-    RustLoadImageProxy loader;
-    Sleigh translator;
-    ContextInternal ctx;
+    uint64_t image_size(uint64_t start);
+
+    vector<int4> lengths;   // Of the last instruction decoded and its delay slots
+
+    // Declared first so the shared language outlives the translator bound to it
+    std::shared_ptr<SleighLanguageProxy> language;
+    std::unique_ptr<LoadImage> loader;
+    std::unique_ptr<ContextInternal> ctx;
+    std::unique_ptr<Sleigh> translator;
     DocumentStorage storage;
 };
 
 //unique_ptr<SleighProxy> proxy_from_spec(rust::Str path, RustLoadImage &ld, RustAssemblyEmit &asm_emit, RustPcodeEmit &rustPcodeEmit);
 //unique_ptr<SleighProxy> proxy_from_spec_path(rust::Str spec_content, RustLoadImage &ld, RustAssemblyEmit &asm_emit, RustPcodeEmit &rustPcodeEmit);
 std::unique_ptr<RustLoadImageProxy> from_rust(RustLoadImage& load_image);
-unique_ptr<SleighProxy> new_sleigh_proxy(RustLoadImage &ld);
+unique_ptr<SleighProxy> new_sleigh_proxy(RustLoadImage &ld, int32_t context);
+std::shared_ptr<SleighLanguageProxy> new_sleigh_language(rust::Slice<const uint8_t> spec_content);
+std::shared_ptr<SleighLanguageProxy> new_sleigh_language_from_file(const rust::Str path);
+std::shared_ptr<SleighLanguageProxy> new_sleigh_language_from_tree(rust::Slice<const uint8_t> spec_content);
+unique_ptr<PcodeBufferProxy> new_pcode_buffer();
+unique_ptr<AssemblyBufferProxy> new_assembly_buffer();
+unique_ptr<DescentProxy> new_descent_result();
+unique_ptr<SleighProxy> new_sleigh_proxy_span(int32_t context);
+unique_ptr<SleighProxy> new_sleigh_proxy_span_with_language(const std::shared_ptr<SleighLanguageProxy> &lang, int mode, int32_t context);
+unique_ptr<SleighProxy> new_sleigh_proxy_with_language(RustLoadImage &ld, const std::shared_ptr<SleighLanguageProxy> &lang, int mode, int32_t context);
 
 #endif
\ No newline at end of file
@@ -35,6 +35,7 @@ class TypeOpProxy;
 class VariableProxy;
 class InstructionProxy;
 class SleighProxy;
+class SleighLanguageProxy;
 class RustLoadImage;
 class RustAssemblyEmit;
 class RustPcodeEmit;
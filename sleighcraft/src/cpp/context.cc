@@ -17,10 +17,38 @@
 #include "slghsymbol.hh"
 #include "translate.hh"
 
+void PrintBuffer::appendHex(uintb val)
+
+{
+  char tmp[2*sizeof(uintb)];
+  int4 i = sizeof(tmp);
+  do {
+    tmp[--i] = "0123456789abcdef"[val & 0xf];
+    val >>= 4;
+  } while(val != 0);
+  buf.append(tmp + i,sizeof(tmp) - i);
+}
+
+void PrintBuffer::appendSignedHex(intb val)
+
+{
+  if (val >= 0) {
+    buf.append("0x",2);
+    appendHex((uintb)val);
+  }
+  else {				// Print the magnitude, which does not overflow as unsigned
+    buf.append("-0x",3);
+    appendHex((uintb)0 - (uintb)val);
+  }
+}
+
 ParserContext::ParserContext(ContextCache *ccache)
 
 {
   parsestate = 0;
+  bytes = buf;
+  numbytes = sizeof(buf);
+  overrun = false;
   contcache = ccache;
   if (ccache != (ContextCache *)0) {
     contextsize = ccache->getDatabase()->getContextSize();
@@ -47,32 +75,55 @@ uintm ParserContext::getInstructionBytes(int4 bytestart,int4 size,uint4 off) con
 
 {				// Get bytes from the instruction stream into a intm
 				// (assuming big endian format)
+				// Bytes past the ones fetched read as zero
   off += bytestart;
   if (off >=16)
     throw BadDataError("Instruction is using more than 16 bytes"); 
-  const uint1 *ptr = buf + off;
+  const uint1 *ptr = bytes + off;
+  int4 avail = numbytes - (int4)off;
   uintm res = 0;
   for(int4 i=0;i<size;++i) {
     res <<= 8;
-    res |= ptr[i];
+    if (i < avail)
+      res |= ptr[i];
   }
+  if (size > avail)
+    overrun = true;
   return res;
 }
 
+void ParserContext::getInstructionWindow(int4 bytestart,int4 size,uint4 off,uint1 *res) const
+
+{				// Copy 16 bytes of the instruction stream into res,
+				// bytes past the ones fetched are zero. Only the
+				// first size bytes are meaningful to the caller
+  off += bytestart;
+  int4 num = (off < numbytes) ? numbytes - off : 0;
+  if (size > num)
+    overrun = true;
+  if (num > 0)
+    memcpy(res,bytes + off,num);
+  memset(res + num,0,16 - num);
+}
+
 uintm ParserContext::getInstructionBits(int4 startbit,int4 size,uint4 off) const
 
 {
   off += (startbit/8);
   if (off >= 16)
     throw BadDataError("Instruction is using more than 16 bytes");
-  const uint1 *ptr = buf + off;
+  const uint1 *ptr = bytes + off;
+  int4 avail = numbytes - (int4)off;
   startbit = startbit % 8;
   int4 bytesize = (startbit+size-1)/8 + 1;
   uintm res = 0;
   for(int4 i=0;i<bytesize;++i) {
     res <<= 8;
-    res |= ptr[i];
+    if (i < avail)
+      res |= ptr[i];
   }
+  if (bytesize > avail)
+    overrun = true;
   res <<= 8*(sizeof(uintm)-bytesize)+startbit; // Move starting bit to highest position
   res >>= 8*sizeof(uintm)-size;	// Shift to bottom of intm
   return res;
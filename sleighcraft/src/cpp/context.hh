@@ -62,6 +62,25 @@ struct ContextSet {		// Instructions for setting a global context value
   bool flow;			// Does the new context flow from its set point
 };
 
+// A growable character buffer that disassembly is printed into instead of an ostream.
+// Clearing keeps the storage, so once it has grown, printing does not allocate.
+// Positions from size() delimit the text of each instruction.
+class PrintBuffer {
+  string buf;
+public:
+  void clear(void) { buf.clear(); }
+  void truncate(int4 sz) { buf.resize(sz); }	// Remove everything after the given position
+  int4 size(void) const { return buf.size(); }
+  const char *data(void) const { return buf.data(); }
+  string str(int4 start,int4 end) const { return buf.substr(start,end-start); }
+  const string &str(void) const { return buf; }
+  PrintBuffer &operator<<(const string &val) { buf.append(val); return *this; }
+  PrintBuffer &operator<<(const char *val) { buf.append(val); return *this; }
+  PrintBuffer &operator<<(char val) { buf.push_back(val); return *this; }
+  void appendHex(uintb val);	// Lower case digits, no prefix
+  void appendSignedHex(intb val); // With 0x or -0x prefix
+};
+
 class ParserWalker;		// Forward declaration
 class ParserWalkerChange;
 
@@ -78,6 +97,9 @@ private:
   int4 parsestate;
   AddrSpace *const_space;
   uint1 buf[16];		// Buffer of bytes in the instruction stream
+  const uint1 *bytes;		// The instruction bytes, either buf or memory owned by the caller
+  int4 numbytes;		// Number of bytes fetched at bytes, any later ones read as zero
+  mutable bool overrun;		// Has the parse read any byte past the ones fetched
   uintm *context;		// Pointer to local context
   int4 contextsize;		// Number of entries in context array
   ContextCache *contcache;   // Interface for getting/setting context
@@ -93,6 +115,10 @@ public:
   ParserContext(ContextCache *ccache);
   ~ParserContext(void) { if (context != (uintm *)0) delete [] context; }
   uint1 *getBuffer(void) { return buf; }
+  void fillBuffer(int4 size) { bytes = buf; numbytes = size; overrun = false; } // Read the first size bytes loaded into buf
+  void setBytes(const uint1 *ptr,int4 size) { bytes = ptr; numbytes = size; overrun = false; } // Read straight from memory of the caller
+  const uint1 *getBytes(void) const { return bytes; }
+  bool isOverrun(void) const { return overrun; }
   void initialize(int4 maxstate,int4 maxparam,AddrSpace *spc);
   int4 getParserState(void) const { return parsestate; }
   void setParserState(int4 st) { parsestate = st; }
@@ -103,6 +129,7 @@ public:
   void setCalladdr(const Address &ad) { calladdr = ad; }
   void addCommit(TripleSymbol *sym,int4 num,uintm mask,bool flow,ConstructState *point);
   void clearCommits(void) { contextcommit.clear(); }
+  int4 numCommits(void) const { return contextcommit.size(); }
   void applyCommits(void);
   const Address &getAddr(void) const { return addr; }
   const Address &getNaddr(void) const { return naddr; }
@@ -111,6 +138,7 @@ public:
   AddrSpace *getCurSpace(void) const { return addr.getSpace(); }
   AddrSpace *getConstSpace(void) const { return const_space; }
   uintm getInstructionBytes(int4 byteoff,int4 numbytes,uint4 off) const;
+  void getInstructionWindow(int4 byteoff,int4 numbytes,uint4 off,uint1 *res) const;
   uintm getContextBytes(int4 byteoff,int4 numbytes) const;
   uintm getInstructionBits(int4 startbit,int4 size,uint4 off) const;
   uintm getContextBits(int4 startbit,int4 size) const;
@@ -152,6 +180,8 @@ public:
   int4 getLength(void) const { return const_context->getLength(); }
   uintm getInstructionBytes(int4 byteoff,int4 numbytes) const {
     return const_context->getInstructionBytes(byteoff,numbytes,point->offset); }
+  void getInstructionWindow(int4 byteoff,int4 numbytes,uint1 *res) const {
+    const_context->getInstructionWindow(byteoff,numbytes,point->offset,res); }
   uintm getContextBytes(int4 byteoff,int4 numbytes) const {
     return const_context->getContextBytes(byteoff,numbytes); }
   uintm getInstructionBits(int4 startbit,int4 size) const {
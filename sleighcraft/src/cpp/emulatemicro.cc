@@ -0,0 +1,694 @@
+/**
+ *  Copyright 2021 StarCrossTech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "emulatemicro.hh"
+
+const int4 EmulateMicro::maxBlockInstructions = 64;
+
+/// \brief Emitter handing each p-code op of an instruction to EmulateMicro::lowerOp()
+class EmulateMicro::MicroEmit : public PcodeEmit {
+  EmulateMicro *emu;		///< The emulator lowering the ops
+  MicroBlock *blk;		///< The block receiving the micro-ops
+  PcodeEmitCache &rawemit;	///< Emitter building the raw ops the block needs
+public:
+  MicroEmit(EmulateMicro *e,MicroBlock *b,PcodeEmitCache &raw) : rawemit(raw) { emu = e; blk = b; }	///< Constructor
+  virtual void dump(const Address &addr,OpCode opc,VarnodeData *outvar,VarnodeData *vars,int4 isize) {
+    emu->lowerOp(blk,opc,outvar,vars,isize,rawemit,addr); }
+};
+
+MicroBlock::~MicroBlock(void)
+
+{
+  truncate(0,0,0);
+}
+
+/// Used to drop the partial translation of an instruction that failed.
+/// \param nops is the number of micro-ops to keep
+/// \param nraw is the number of raw ops to keep
+/// \param nvars is the number of raw varnodes to keep
+void MicroBlock::truncate(int4 nops,int4 nraw,int4 nvars)
+
+{
+  ops.resize(nops);
+  for(int4 i=nraw;i<rawops.size();++i)
+    delete rawops[i];
+  rawops.resize(nraw);
+  for(int4 i=nvars;i<rawvars.size();++i)
+    delete rawvars[i];
+  rawvars.resize(nvars);
+}
+
+/// \param t is the SLEIGH translator
+/// \param s is the MemoryState the emulator should manipulate
+/// \param b is the table of breakpoints the emulator should invoke
+EmulateMicro::EmulateMicro(Translate *t,MemoryState *s,BreakTable *b)
+  : EmulateMemory(s)
+{
+  trans = t;
+  OpBehavior::registerInstructions(inst,t);
+  breaktable = b;
+  breaktable->setEmulate(this);
+  curblock = (MicroBlock *)0;
+  curinsn = 0;
+  redirected = false;
+}
+
+EmulateMicro::~EmulateMicro(void)
+
+{
+  deleteBlocks();
+  for(int4 i=0;i<inst.size();++i) {
+    OpBehavior *t_op = inst[i];
+    if (t_op != (OpBehavior *)0)
+      delete t_op;
+  }
+}
+
+void EmulateMicro::deleteBlocks(void)
+
+{
+  map<Address,MicroBlock *>::iterator iter;
+  for(iter=blocks.begin();iter!=blocks.end();++iter)
+    delete (*iter).second;
+  blocks.clear();
+  curblock = (MicroBlock *)0;
+}
+
+/// Varnodes that are in a MemoryArray bank, and have one of the sizes read as a single integer, are
+/// accessed through a pointer to their bytes.
+/// \param res is the resolved varnode to fill in
+/// \param vn is the varnode
+/// \param isinput is \b true if the varnode is read, so that a constant can be inlined
+void EmulateMicro::lowerVarnode(MicroVarnode &res,const VarnodeData &vn,bool isinput) const
+
+{
+  res.ptr = (uint1 *)0;
+  res.space = vn.space;
+  res.offset = vn.offset;
+  res.size = vn.size;
+  res.kind = MicroVarnode::state;
+  if (vn.space->getType() == IPTR_CONSTANT) {
+    if (isinput)
+      res.kind = MicroVarnode::constant;
+    return;
+  }
+  MemoryArray *arr = memstate->getMemoryArray(vn.space);
+  if (arr == (MemoryArray *)0 || !arr->contains(vn.offset,vn.size))
+    return;
+  bool bswap = ((HOST_ENDIAN==1) != vn.space->isBigEndian());
+  switch(vn.size) {
+  case 1:
+    res.kind = MicroVarnode::array1;
+    break;
+  case 2:
+    res.kind = bswap ? MicroVarnode::array2_swap : MicroVarnode::array2;
+    break;
+  case 4:
+    res.kind = bswap ? MicroVarnode::array4_swap : MicroVarnode::array4;
+    break;
+  case 8:
+    res.kind = bswap ? MicroVarnode::array8_swap : MicroVarnode::array8;
+    break;
+  default:
+    return;
+  }
+  res.ptr = arr->getBytes() + vn.offset;
+}
+
+/// Every p-code op becomes exactly one micro-op, so that relative branches can be resolved
+/// by counting ops.  A relative branch holds its raw displacement in \b target until the whole
+/// instruction is lowered.
+/// \param blk is the block receiving the micro-op
+/// \param opc is the opcode of the p-code op
+/// \param outvar is the output varnode or null
+/// \param vars is the array of input varnodes
+/// \param isize is the number of input varnodes
+/// \param rawemit builds raw ops for the ops executed through a PcodeOpRaw
+/// \param addr is the address of the instruction
+void EmulateMicro::lowerOp(MicroBlock *blk,OpCode opc,VarnodeData *outvar,VarnodeData *vars,int4 isize,
+			   PcodeEmitCache &rawemit,const Address &addr)
+{
+  blk->ops.push_back(MicroOp());
+  MicroOp &op(blk->ops.back());
+  op.target = 0;
+  op.mask = 0;
+  op.spc = (AddrSpace *)0;
+  op.array = (MemoryArray *)0;
+  op.behave = inst[opc];
+  op.raw = (PcodeOpRaw *)0;
+  op.out.kind = MicroVarnode::state;
+  op.out.size = 0;
+  if (outvar != (VarnodeData *)0) {
+    lowerVarnode(op.out,*outvar,false);
+    op.mask = calc_mask(outvar->size);
+  }
+  for(int4 i=0;i<2;++i) {
+    if (i < isize)
+      lowerVarnode(op.in[i],vars[i],true);
+    else {
+      op.in[i].kind = MicroVarnode::constant;
+      op.in[i].offset = 0;
+      op.in[i].size = 0;
+    }
+  }
+
+  switch(opc) {
+  case CPUI_COPY:
+    op.code = MicroOp::copy;
+    break;
+  case CPUI_LOAD:
+    op.code = MicroOp::load;
+    op.spc = Address::getSpaceFromConst(vars[0].getAddr());
+    op.array = memstate->getMemoryArray(op.spc);
+    lowerVarnode(op.in[0],vars[1],true);
+    break;
+  case CPUI_STORE:
+    op.code = MicroOp::store;
+    op.spc = Address::getSpaceFromConst(vars[0].getAddr());
+    op.array = memstate->getMemoryArray(op.spc);
+    lowerVarnode(op.in[0],vars[1],true);
+    lowerVarnode(op.in[1],vars[2],true);
+    break;
+  case CPUI_BRANCH:
+  case CPUI_CBRANCH:
+    if (vars[0].space->getType() == IPTR_CONSTANT) {
+      op.code = (opc == CPUI_BRANCH) ? MicroOp::branch_rel : MicroOp::cbranch_rel;
+      op.target = (int4)(uintm)vars[0].offset;
+    }
+    else {
+      op.code = (opc == CPUI_BRANCH) ? MicroOp::branch : MicroOp::cbranch;
+      op.spc = vars[0].space;
+    }
+    break;
+  case CPUI_CALL:
+    op.code = MicroOp::call;
+    op.spc = vars[0].space;
+    break;
+  case CPUI_BRANCHIND:
+  case CPUI_RETURN:
+    op.code = MicroOp::branchind;
+    break;
+  case CPUI_CALLIND:
+    op.code = MicroOp::callind;
+    break;
+  case CPUI_CALLOTHER:
+    op.code = MicroOp::callother;
+    rawemit.dump(addr,opc,outvar,vars,isize);
+    op.raw = blk->rawops.back();
+    break;
+  case CPUI_INT_EQUAL:
+    op.code = MicroOp::int_equal;
+    break;
+  case CPUI_INT_NOTEQUAL:
+    op.code = MicroOp::int_notequal;
+    break;
+  case CPUI_INT_SLESS:
+    op.code = MicroOp::int_sless;
+    break;
+  case CPUI_INT_SLESSEQUAL:
+    op.code = MicroOp::int_slessequal;
+    break;
+  case CPUI_INT_LESS:
+    op.code = MicroOp::int_less;
+    break;
+  case CPUI_INT_LESSEQUAL:
+    op.code = MicroOp::int_lessequal;
+    break;
+  case CPUI_INT_ZEXT:
+    op.code = MicroOp::int_zext;
+    break;
+  case CPUI_INT_SEXT:
+    op.code = MicroOp::int_sext;
+    break;
+  case CPUI_INT_ADD:
+    op.code = MicroOp::int_add;
+    break;
+  case CPUI_INT_SUB:
+    op.code = MicroOp::int_sub;
+    break;
+  case CPUI_INT_CARRY:
+    op.code = MicroOp::int_carry;
+    break;
+  case CPUI_INT_SCARRY:
+    op.code = MicroOp::int_scarry;
+    break;
+  case CPUI_INT_SBORROW:
+    op.code = MicroOp::int_sborrow;
+    break;
+  case CPUI_INT_2COMP:
+    op.code = MicroOp::int_2comp;
+    break;
+  case CPUI_INT_NEGATE:
+    op.code = MicroOp::int_negate;
+    break;
+  case CPUI_INT_XOR:
+    op.code = MicroOp::int_xor;
+    break;
+  case CPUI_INT_AND:
+    op.code = MicroOp::int_and;
+    break;
+  case CPUI_INT_OR:
+    op.code = MicroOp::int_or;
+    break;
+  case CPUI_INT_LEFT:
+    op.code = MicroOp::int_left;
+    break;
+  case CPUI_INT_RIGHT:
+    op.code = MicroOp::int_right;
+    break;
+  case CPUI_INT_SRIGHT:
+    op.code = MicroOp::int_sright;
+    break;
+  case CPUI_INT_MULT:
+    op.code = MicroOp::int_mult;
+    break;
+  case CPUI_BOOL_NEGATE:
+    op.code = MicroOp::bool_negate;
+    break;
+  case CPUI_BOOL_XOR:
+    op.code = MicroOp::bool_xor;
+    break;
+  case CPUI_BOOL_AND:
+    op.code = MicroOp::bool_and;
+    break;
+  case CPUI_BOOL_OR:
+    op.code = MicroOp::bool_or;
+    break;
+  case CPUI_PIECE:
+    op.code = MicroOp::piece;
+    break;
+  case CPUI_SUBPIECE:
+    op.code = MicroOp::subpiece;
+    break;
+  default:
+    if (op.behave == (OpBehavior *)0 || op.behave->isSpecial()) {
+      op.code = MicroOp::special;
+      rawemit.dump(addr,opc,outvar,vars,isize);
+      op.raw = blk->rawops.back();
+    }
+    else
+      op.code = op.behave->isUnary() ? MicroOp::unary : MicroOp::binary;
+    break;
+  }
+}
+
+/// Instructions are translated until one can branch, call or return, or until one cannot be
+/// translated.  The error for that instruction is only raised if execution reaches it, unless it is
+/// the first in the block.
+/// \param addr is the address of the first instruction
+/// \return the new block
+MicroBlock *EmulateMicro::translateBlock(const Address &addr)
+
+{
+  MicroBlock *blk = new MicroBlock();
+  PcodeEmitCache rawemit(blk->rawops,blk->rawvars,inst,0);
+  MicroEmit emit(this,blk,rawemit);
+  Address cur(addr);
+  for(int4 count=0;count<maxBlockInstructions;++count) {
+    MicroInstruction insn;
+    insn.addr = cur;
+    insn.start = blk->ops.size();
+    int4 nraw = blk->rawops.size();
+    int4 nvars = blk->rawvars.size();
+    try {
+      insn.length = trans->oneInstruction(emit,cur);
+    }
+    catch(LowlevelError &err) {
+      if (count == 0) {
+	delete blk;
+	throw;
+      }
+      blk->truncate(insn.start,nraw,nvars);
+      break;
+    }
+    insn.end = blk->ops.size();
+    bool leaves = false;
+    for(int4 i=insn.start;i<insn.end;++i) {
+      MicroOp &op(blk->ops[i]);
+      switch(op.code) {
+      case MicroOp::branch_rel:
+      case MicroOp::cbranch_rel: {
+	uintm id = (uintm)op.target + (uintm)(i - insn.start);
+	int4 index = id;
+	if (index < 0 || index > insn.end - insn.start)
+	  op.code = MicroOp::bad_branch;
+	else
+	  op.target = insn.start + index;
+	break;
+      }
+      case MicroOp::branch:
+      case MicroOp::cbranch:
+      case MicroOp::branchind:
+      case MicroOp::call:
+      case MicroOp::callind:
+	leaves = true;
+	break;
+      default:
+	break;
+      }
+    }
+    blk->insns.push_back(insn);
+    if (leaves) break;
+    cur = cur + insn.length;
+  }
+  return blk;
+}
+
+/// The block starting at the address is looked up, or translated, and the block control last
+/// moved to from the current block is tried first.
+/// \param addr is the address of the next instruction
+void EmulateMicro::moveTo(const Address &addr)
+
+{
+  current_address = addr;
+  MicroBlock *from = curblock;
+  curblock = (MicroBlock *)0;	// Stays unset if the translation fails
+  MicroBlock *blk;
+  if (from != (MicroBlock *)0 && from->succ != (MicroBlock *)0 && from->succ->insns[0].addr == addr)
+    blk = from->succ;
+  else {
+    map<Address,MicroBlock *>::const_iterator iter = blocks.find(addr);
+    if (iter != blocks.end())
+      blk = (*iter).second;
+    else {
+      blk = translateBlock(addr);
+      blocks[addr] = blk;
+    }
+    if (from != (MicroBlock *)0)
+      from->succ = blk;
+  }
+  curblock = blk;
+  curinsn = 0;
+}
+
+/// The instruction is translated now, if it is not already, so an address that cannot be
+/// decoded throws an exception here.
+/// \param addr is the address where execution should continue
+void EmulateMicro::setExecuteAddress(const Address &addr)
+
+{
+  redirected = true;
+  curblock = (MicroBlock *)0;
+  moveTo(addr);
+}
+
+/// The current instruction is translated again, so this can throw the same as setExecuteAddress().
+void EmulateMicro::clearBlocks(void)
+
+{
+  bool translated = (curblock != (MicroBlock *)0);
+  deleteBlocks();
+  if (translated)
+    moveTo(current_address);
+}
+
+/// \param op is the raw op, whose behavior is \e special or missing
+void EmulateMicro::executeRaw(PcodeOpRaw *op)
+
+{
+  currentOp = op;
+  currentBehave = op->getBehavior();
+  if (currentBehave == (OpBehavior *)0)	// Presumably a NO-OP
+    return;
+  switch(currentBehave->getOpcode()) {
+  case CPUI_MULTIEQUAL:
+    executeMultiequal();
+    break;
+  case CPUI_INDIRECT:
+    executeIndirect();
+    break;
+  case CPUI_SEGMENTOP:
+    executeSegmentOp();
+    break;
+  case CPUI_CPOOLREF:
+    executeCpoolRef();
+    break;
+  case CPUI_NEW:
+    executeNew();
+    break;
+  default:
+    throw LowlevelError("Bad special op");
+  }
+}
+
+/// The micro-ops of the current instruction are run, and execution moves to the instruction that
+/// follows it, or to the destination of the branch that was taken.  The integer ops compute the same
+/// as their OpBehavior.
+void EmulateMicro::executeBlockInstruction(void)
+
+{
+  const MicroInstruction &insn(curblock->insns[curinsn]);
+  const MicroOp *ops = curblock->ops.data();
+  int4 i = insn.start;
+  while(i < insn.end) {
+    const MicroOp &op(ops[i]);
+    switch(op.code) {
+    case MicroOp::copy:
+      setValue(op.out,getValue(op.in[0]));
+      break;
+    case MicroOp::load: {
+      uintb off = AddrSpace::addressToByte(getValue(op.in[0]),op.spc->getWordSize());
+      uintb res;
+      if (op.array != (MemoryArray *)0 && op.array->contains(off,op.out.size))
+	res = op.array->getArrayValue(off,op.out.size);
+      else
+	res = memstate->getValue(op.spc,off,op.out.size);
+      setValue(op.out,res);
+      break;
+    }
+    case MicroOp::store: {
+      uintb val = getValue(op.in[1]);
+      uintb off = AddrSpace::addressToByte(getValue(op.in[0]),op.spc->getWordSize());
+      if (op.array != (MemoryArray *)0 && op.array->contains(off,op.in[1].size))
+	op.array->setArrayValue(off,op.in[1].size,val);
+      else
+	memstate->setValue(op.spc,off,op.in[1].size,val);
+      break;
+    }
+    case MicroOp::branch:
+    case MicroOp::call:
+      moveTo(Address(op.spc,op.in[0].offset));
+      return;
+    case MicroOp::branch_rel:
+      i = op.target;
+      continue;
+    case MicroOp::cbranch:
+      if (getValue(op.in[1]) != 0) {
+	moveTo(Address(op.spc,op.in[0].offset));
+	return;
+      }
+      break;
+    case MicroOp::cbranch_rel:
+      if (getValue(op.in[1]) != 0) {
+	i = op.target;
+	continue;
+      }
+      break;
+    case MicroOp::branchind:
+    case MicroOp::callind:
+      moveTo(Address(insn.addr.getSpace(),getValue(op.in[0])));
+      return;
+    case MicroOp::callother:
+      redirected = false;
+      if (!breaktable->doPcodeOpBreak(op.raw))
+	throw LowlevelError("Userop not hooked");
+      if (redirected)		// The breakpoint moved execution
+	return;
+      break;
+    case MicroOp::int_equal:
+      setValue(op.out,(getValue(op.in[0]) == getValue(op.in[1])) ? 1 : 0);
+      break;
+    case MicroOp::int_notequal:
+      setValue(op.out,(getValue(op.in[0]) != getValue(op.in[1])) ? 1 : 0);
+      break;
+    case MicroOp::int_sless:
+    case MicroOp::int_slessequal: {
+      uintb in1 = getValue(op.in[0]);
+      uintb in2 = getValue(op.in[1]);
+      uintb signbit = ((uintb)0x80) << 8*(op.in[0].size-1);
+      uintb res;
+      if ((in1 & signbit) != (in2 & signbit))
+	res = ((in1 & signbit) != 0) ? 1 : 0;
+      else if (op.code == MicroOp::int_sless)
+	res = (in1 < in2) ? 1 : 0;
+      else
+	res = (in1 <= in2) ? 1 : 0;
+      setValue(op.out,res);
+      break;
+    }
+    case MicroOp::int_less:
+      setValue(op.out,(getValue(op.in[0]) < getValue(op.in[1])) ? 1 : 0);
+      break;
+    case MicroOp::int_lessequal:
+      setValue(op.out,(getValue(op.in[0]) <= getValue(op.in[1])) ? 1 : 0);
+      break;
+    case MicroOp::int_zext:
+      setValue(op.out,getValue(op.in[0]));
+      break;
+    case MicroOp::int_sext:
+      setValue(op.out,sign_extend(getValue(op.in[0]),op.in[0].size,op.out.size));
+      break;
+    case MicroOp::int_add:
+      setValue(op.out,(getValue(op.in[0]) + getValue(op.in[1])) & op.mask);
+      break;
+    case MicroOp::int_sub:
+      setValue(op.out,(getValue(op.in[0]) - getValue(op.in[1])) & op.mask);
+      break;
+    case MicroOp::int_carry: {
+      uintb in1 = getValue(op.in[0]);
+      uintb in2 = getValue(op.in[1]);
+      setValue(op.out,(in1 > ((in1 + in2) & calc_mask(op.in[0].size))) ? 1 : 0);
+      break;
+    }
+    case MicroOp::int_scarry: {
+      uintb in1 = getValue(op.in[0]);
+      uintb in2 = getValue(op.in[1]);
+      int4 sign = op.in[0].size*8 - 1;
+      uintb a = (in1 >> sign) & 1;
+      uintb b = (in2 >> sign) & 1;
+      uintb r = ((in1 + in2) >> sign) & 1;
+      setValue(op.out,(r ^ a) & (a ^ b ^ 1));
+      break;
+    }
+    case MicroOp::int_sborrow: {
+      uintb in1 = getValue(op.in[0]);
+      uintb in2 = getValue(op.in[1]);
+      int4 sign = op.in[0].size*8 - 1;
+      uintb a = (in1 >> sign) & 1;
+      uintb b = (in2 >> sign) & 1;
+      uintb r = ((in1 - in2) >> sign) & 1;
+      setValue(op.out,(a ^ r) & (r ^ b ^ 1));
+      break;
+    }
+    case MicroOp::int_2comp:
+      setValue(op.out,uintb_negate(getValue(op.in[0])-1,op.in[0].size));
+      break;
+    case MicroOp::int_negate:
+      setValue(op.out,uintb_negate(getValue(op.in[0]),op.in[0].size));
+      break;
+    case MicroOp::int_xor:
+    case MicroOp::bool_xor:
+      setValue(op.out,getValue(op.in[0]) ^ getValue(op.in[1]));
+      break;
+    case MicroOp::int_and:
+    case MicroOp::bool_and:
+      setValue(op.out,getValue(op.in[0]) & getValue(op.in[1]));
+      break;
+    case MicroOp::int_or:
+    case MicroOp::bool_or:
+      setValue(op.out,getValue(op.in[0]) | getValue(op.in[1]));
+      break;
+    case MicroOp::int_left: {
+      uintb in1 = getValue(op.in[0]);
+      uintb in2 = getValue(op.in[1]);
+      setValue(op.out,(in2 >= op.out.size*8) ? 0 : (in1 << in2) & op.mask);
+      break;
+    }
+    case MicroOp::int_right: {
+      uintb in1 = getValue(op.in[0]);
+      uintb in2 = getValue(op.in[1]);
+      setValue(op.out,(in2 >= op.out.size*8) ? 0 : (in1 & op.mask) >> in2);
+      break;
+    }
+    case MicroOp::int_sright: {
+      uintb in1 = getValue(op.in[0]);
+      uintb in2 = getValue(op.in[1]);
+      bool negative = signbit_negative(in1,op.in[0].size);
+      uintb res;
+      if (in2 >= op.out.size*8)
+	res = negative ? op.mask : 0;
+      else {
+	res = in1 >> in2;
+	if (negative) {
+	  uintb mask = calc_mask(op.in[0].size);
+	  res |= (mask >> in2) ^ mask;
+	}
+      }
+      setValue(op.out,res);
+      break;
+    }
+    case MicroOp::unary:
+    case MicroOp::binary:
+      if (op.behave->isUnary())
+	setValue(op.out,op.behave->evaluateUnary(op.out.size,op.in[0].size,getValue(op.in[0])));
+      else
+	setValue(op.out,op.behave->evaluateBinary(op.out.size,op.in[0].size,getValue(op.in[0]),
+						  getValue(op.in[1])));
+      break;
+    case MicroOp::int_mult:
+      setValue(op.out,(getValue(op.in[0]) * getValue(op.in[1])) & op.mask);
+      break;
+    case MicroOp::bool_negate:
+      setValue(op.out,getValue(op.in[0]) ^ 1);
+      break;
+    case MicroOp::piece:
+      setValue(op.out,(getValue(op.in[0]) << ((op.out.size-op.in[0].size)*8)) | getValue(op.in[1]));
+      break;
+    case MicroOp::subpiece: {
+      uintb in2 = getValue(op.in[1]);
+      setValue(op.out,(in2 >= sizeof(uintb)) ? 0 : (getValue(op.in[0]) >> (in2*8)) & op.mask);
+      break;
+    }
+    case MicroOp::special:
+      executeRaw(op.raw);
+      break;
+    case MicroOp::bad_branch:
+      throw LowlevelError("Bad intra-instruction branch");
+    }
+    i += 1;
+  }
+  if (curinsn + 1 < curblock->insns.size()) {
+    curinsn += 1;
+    current_address = curblock->insns[curinsn].addr;
+  }
+  else
+    moveTo(insn.addr + insn.length);
+}
+
+/// If execution is at an address with a breakpoint, the breakpoint is invoked and the instruction is
+/// only executed if the breakpoint does not replace it.
+void EmulateMicro::executeInstruction(void)
+
+{
+  if (curblock == (MicroBlock *)0)
+    throw LowlevelError("No instruction to execute");
+  if (breaktable->doAddressBreak(current_address))
+    return;
+  executeBlockInstruction();
+}
+
+/// This is the same as calling executeInstruction() \b count times, stopping as soon as the
+/// emulator is halted.  An instruction replaced by a breakpoint counts as executed, unless the
+/// breakpoint halted the emulator.  The halt state is not cleared first.
+/// \param count is the most instructions to execute
+/// \return the number of instructions executed
+uintb EmulateMicro::executeInstructions(uintb count)
+
+{
+  uintb done = 0;
+  while(done < count) {
+    if (curblock == (MicroBlock *)0)
+      throw LowlevelError("No instruction to execute");
+    if (breaktable->doAddressBreak(current_address)) {
+      if (emu_halted) break;
+      done += 1;
+      continue;
+    }
+    executeBlockInstruction();
+    done += 1;
+    if (emu_halted) break;
+  }
+  return done;
+}
@@ -0,0 +1,257 @@
+/**
+ *  Copyright 2021 StarCrossTech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/// \file emulatemicro.hh
+/// \brief An emulator running p-code lowered ahead of time into cached blocks of micro-ops
+
+#ifndef __CPUI_EMULATEMICRO__
+#define __CPUI_EMULATEMICRO__
+
+#include "emulate.hh"
+
+/// \brief A varnode resolved for execution
+///
+/// Varnodes of 1, 2, 4 or 8 bytes held in a MemoryArray bank are accessed through a pointer to
+/// their bytes.  Constants carry their value.  Anything else goes through the MemoryState.
+struct MicroVarnode {
+  /// How the varnode is accessed
+  enum {
+    state = 0,			///< Through the MemoryState
+    constant = 1,		///< The value is \b offset
+    array1 = 2,			///< A byte in a flat array
+    array2 = 3,			///< 2 bytes in a flat array, in host order
+    array4 = 4,			///< 4 bytes in a flat array, in host order
+    array8 = 5,			///< 8 bytes in a flat array, in host order
+    array2_swap = 6,		///< 2 bytes in a flat array, in the other order
+    array4_swap = 7,		///< 4 bytes in a flat array, in the other order
+    array8_swap = 8		///< 8 bytes in a flat array, in the other order
+  };
+  uint1 *ptr;			///< The bytes of an array varnode
+  AddrSpace *space;		///< The space of the varnode
+  uintb offset;			///< The offset of the varnode, or the value of a constant
+  int4 size;			///< Number of bytes in the varnode
+  int4 kind;			///< How the varnode is accessed
+};
+
+/// \brief A p-code op lowered for execution
+///
+/// The opcode is mapped to a handler specialized for it, and the destination of a branch
+/// within the instruction is resolved to the index of the target micro-op.
+struct MicroOp {
+  /// The handler executing the op
+  enum {
+    copy, load, store, branch, branch_rel, cbranch, cbranch_rel, branchind, call, callind, callother,
+    int_equal, int_notequal, int_sless, int_slessequal, int_less, int_lessequal, int_zext, int_sext,
+    int_add, int_sub, int_carry, int_scarry, int_sborrow, int_2comp, int_negate, int_xor, int_and,
+    int_or, int_left, int_right, int_sright, int_mult, bool_negate, bool_xor, bool_and, bool_or,
+    piece, subpiece,
+    unary,			///< Any other unary op, evaluated by its OpBehavior
+    binary,			///< Any other binary op, evaluated by its OpBehavior
+    special,			///< Any other special op, executed by EmulateMemory
+    bad_branch			///< A branch to outside of its instruction
+  };
+  int4 code;			///< The handler
+  int4 target;			///< Index of the micro-op a relative branch goes to
+  uintb mask;			///< Mask of the output size
+  MicroVarnode out;		///< The output, if any
+  MicroVarnode in[2];		///< The inputs, without the space of a LOAD or STORE
+  AddrSpace *spc;		///< The space of a LOAD or STORE, or of an absolute branch destination
+  MemoryArray *array;		///< The flat array bank of a LOAD or STORE space, if it has one
+  OpBehavior *behave;		///< The behavior of a \e unary or \e binary op
+  PcodeOpRaw *raw;		///< The raw op for a \e callother or \e special op
+};
+
+/// \brief A machine instruction within a MicroBlock
+struct MicroInstruction {
+  Address addr;			///< Address of the instruction
+  int4 length;			///< Number of bytes to the fall-through address
+  int4 start;			///< Index of the first micro-op of the instruction
+  int4 end;			///< Index after the last micro-op of the instruction
+};
+
+/// \brief A straight line run of machine instructions, lowered into micro-ops
+///
+/// A block ends after the first instruction that can leave it other than by falling through,
+/// or before an instruction that could not be translated.
+struct MicroBlock {
+  vector<MicroOp> ops;		///< Micro-ops of every instruction in the block
+  vector<MicroInstruction> insns;	///< The instructions
+  vector<PcodeOpRaw *> rawops;	///< Raw ops referenced by micro-ops
+  vector<VarnodeData *> rawvars;	///< Varnodes of the raw ops
+  MicroBlock *succ;		///< The block control last moved to from \b this, or null
+  MicroBlock(void) { succ = (MicroBlock *)0; }	///< Construct an empty block
+  ~MicroBlock(void);		///< Destructor
+  void truncate(int4 nops,int4 nraw,int4 nvars);	///< Drop the micro-ops and raw ops past the given counts
+};
+
+/// \brief An emulator executing cached, pre-decoded p-code
+///
+/// This runs the same machine state as EmulatePcodeCache with the same breakpoints, but
+/// translates each block of instructions once.  The p-code of every instruction in a block is lowered
+/// into MicroOps that refer directly to the bytes of registers and temporaries in MemoryArray
+/// banks and carry constants inline.  Execution is a single loop switching on the handler of each
+/// micro-op, with no allocation and no virtual call for the common integer ops.
+///
+/// Blocks are kept by address for the life of the emulator.  They are not updated when the
+/// load image, the context or the memory banks change, which requires a call to clearBlocks().
+/// Address breakpoints are checked before every instruction.  Halting the emulator during an
+/// instruction lets the instruction finish, and stops execution before the next one.
+class EmulateMicro : public EmulateMemory {
+  class MicroEmit;		///< Emitter lowering the p-code of an instruction into a block
+  friend class MicroEmit;
+  Translate *trans;		///< The SLEIGH translator
+  vector<OpBehavior *> inst;	///< Map from OpCode to OpBehavior
+  BreakTable *breaktable;	///< The table of breakpoints
+  map<Address,MicroBlock *> blocks;	///< Translated blocks, by address of their first instruction
+  MicroBlock *curblock;		///< The block holding the current instruction, or null
+  int4 curinsn;			///< Index of the current instruction in \b curblock
+  Address current_address;	///< Address of the current instruction
+  bool redirected;		///< Set when a callback moves execution to another address
+  static const int4 maxBlockInstructions;	///< Most instructions translated into one block
+  MicroBlock *translateBlock(const Address &addr);	///< Translate the instructions from the given address
+  void lowerVarnode(MicroVarnode &res,const VarnodeData &vn,bool isinput) const;	///< Resolve a varnode
+  void lowerOp(MicroBlock *blk,OpCode opc,VarnodeData *outvar,VarnodeData *vars,int4 isize,
+	       PcodeEmitCache &rawemit,const Address &addr);	///< Lower one p-code op
+  void moveTo(const Address &addr);	///< Continue execution at the given address
+  void executeBlockInstruction(void);	///< Execute the current instruction
+  void executeRaw(PcodeOpRaw *op);	///< Execute a \e special op through EmulateMemory
+  void deleteBlocks(void);	///< Free every translated block
+  uintb getValue(const MicroVarnode &vn) const;	///< Read a resolved varnode
+  void setValue(const MicroVarnode &vn,uintb val);	///< Write a resolved varnode
+  static uint2 swap2(uint2 val) { return (uint2)((val >> 8) | (val << 8)); }	///< Swap 2 bytes
+  static uint4 swap4(uint4 val);	///< Swap 4 bytes
+  static uint8 swap8(uint8 val);	///< Swap 8 bytes
+protected:
+  virtual void fallthruOp(void) {}	///< Unused, as control flow is resolved by the micro-ops
+public:
+  EmulateMicro(Translate *t,MemoryState *s,BreakTable *b);	///< Constructor
+  ~EmulateMicro(void);
+  virtual void setExecuteAddress(const Address &addr);	///< Set the address of the next instruction
+  virtual Address getExecuteAddress(void) const { return current_address; }	///< Get the address of the next instruction
+  void clearBlocks(void);	///< Drop every translated block
+  int4 numBlocks(void) const { return blocks.size(); }	///< Get the number of translated blocks
+  void executeInstruction(void);	///< Execute a single machine instruction
+  uintb executeInstructions(uintb count);	///< Execute machine instructions until halted or done
+};
+
+/// \param val is the value
+/// \return the value with the order of its 4 bytes reversed
+inline uint4 EmulateMicro::swap4(uint4 val)
+
+{
+  val = ((val >> 8) & 0x00ff00ff) | ((val & 0x00ff00ff) << 8);
+  return (val >> 16) | (val << 16);
+}
+
+/// \param val is the value
+/// \return the value with the order of its 8 bytes reversed
+inline uint8 EmulateMicro::swap8(uint8 val)
+
+{
+  return ((uint8)swap4((uint4)val) << 32) | swap4((uint4)(val >> 32));
+}
+
+/// \param vn is the resolved varnode
+/// \return the value it holds
+inline uintb EmulateMicro::getValue(const MicroVarnode &vn) const
+
+{
+  switch(vn.kind) {
+  case MicroVarnode::constant:
+    return vn.offset;
+  case MicroVarnode::array1:
+    return *vn.ptr;
+  case MicroVarnode::array2: {
+    uint2 val;
+    memcpy(&val,vn.ptr,2);
+    return val;
+  }
+  case MicroVarnode::array4: {
+    uint4 val;
+    memcpy(&val,vn.ptr,4);
+    return val;
+  }
+  case MicroVarnode::array8: {
+    uint8 val;
+    memcpy(&val,vn.ptr,8);
+    return val;
+  }
+  case MicroVarnode::array2_swap: {
+    uint2 val;
+    memcpy(&val,vn.ptr,2);
+    return swap2(val);
+  }
+  case MicroVarnode::array4_swap: {
+    uint4 val;
+    memcpy(&val,vn.ptr,4);
+    return swap4(val);
+  }
+  case MicroVarnode::array8_swap: {
+    uint8 val;
+    memcpy(&val,vn.ptr,8);
+    return swap8(val);
+  }
+  default:
+    break;
+  }
+  return memstate->getValue(vn.space,vn.offset,vn.size);
+}
+
+/// \param vn is the resolved varnode
+/// \param val is the value to write, truncated to the size of the varnode
+inline void EmulateMicro::setValue(const MicroVarnode &vn,uintb val)
+
+{
+  switch(vn.kind) {
+  case MicroVarnode::array1:
+    *vn.ptr = (uint1)val;
+    return;
+  case MicroVarnode::array2: {
+    uint2 tmp = (uint2)val;
+    memcpy(vn.ptr,&tmp,2);
+    return;
+  }
+  case MicroVarnode::array4: {
+    uint4 tmp = (uint4)val;
+    memcpy(vn.ptr,&tmp,4);
+    return;
+  }
+  case MicroVarnode::array8: {
+    uint8 tmp = (uint8)val;
+    memcpy(vn.ptr,&tmp,8);
+    return;
+  }
+  case MicroVarnode::array2_swap: {
+    uint2 tmp = swap2((uint2)val);
+    memcpy(vn.ptr,&tmp,2);
+    return;
+  }
+  case MicroVarnode::array4_swap: {
+    uint4 tmp = swap4((uint4)val);
+    memcpy(vn.ptr,&tmp,4);
+    return;
+  }
+  case MicroVarnode::array8_swap: {
+    uint8 tmp = swap8((uint8)val);
+    memcpy(vn.ptr,&tmp,8);
+    return;
+  }
+  default:
+    break;
+  }
+  memstate->setValue(vn.space,vn.offset,vn.size,val);
+}
+
+#endif
@@ -164,18 +164,23 @@ uintm ContextDatabase::getVariable(const string &nm,const Address &addr) const
 /// \param num is the index of the word (within the context blob) of the context variable
 /// \param mask is the mask delimiting the context variable (within its word)
 /// \param value is the (already shifted) value being set
-void ContextDatabase::setContextChangePoint(const Address &addr,int4 num,uintm mask,uintm value)
+/// \return \b true if the variable held a different value anywhere in the painted range
+bool ContextDatabase::setContextChangePoint(const Address &addr,int4 num,uintm mask,uintm value)
 
 {
   vector<uintm *> contvec;
+  bool changed = false;
   getRegionToChangePoint(contvec,addr,num,mask);
   for(uint4 i=0;i<contvec.size();++i) {
     uintm *newcontext = contvec[i];
     uintm val = newcontext[ num ];
+    if ((val & mask) != value)
+      changed = true;
     val &= ~mask;			// Clear range to zero
     val |= value;
     newcontext[ num ] = val;
   }
+  return changed;
 }
 
 /// \brief Set a context variable value over a given range of addresses
@@ -187,13 +192,19 @@ void ContextDatabase::setContextChangePoint(const Address &addr,int4 num,uintm m
 /// \param num is the index of the word (within the context blob) of the context variable
 /// \param mask is the mask delimiting the context variable (within its word)
 /// \param value is the (already shifted) value being set
-void ContextDatabase::setContextRegion(const Address &addr1,const Address &addr2,
+/// \return \b true if the variable held a different value anywhere in the range
+bool ContextDatabase::setContextRegion(const Address &addr1,const Address &addr2,
 				       int4 num,uintm mask,uintm value)
 {
   vector<uintm *> vec;
+  bool changed = false;
   getRegionForSet(vec,addr1,addr2,num,mask);
-  for(uint4 i=0;i<vec.size();++i)
+  for(uint4 i=0;i<vec.size();++i) {
+    if ((vec[i][num] & mask) != value)
+      changed = true;
     vec[i][num] = (vec[i][num] & ~mask) | value;
+  }
+  return changed;
 }
 
 /// \brief Set a context variable by name over a given range of addresses
@@ -314,6 +325,16 @@ ContextInternal::FreeArray &ContextInternal::FreeArray::operator=(const FreeArra
   return *this;
 }
 
+/// Unlike assignment, the mask of explicitly set variables is copied too.
+/// \param op2 is the context blob being copied
+void ContextInternal::FreeArray::copy(const FreeArray &op2)
+
+{
+  *this = op2;
+  for(int4 i=0;i<size;++i)
+    mask[i] = op2.mask[i];
+}
+
 /// \brief Write out a single context block as an XML tag
 ///
 /// The blob is broken up into individual values and written out as a series
@@ -536,6 +557,22 @@ void ContextInternal::restoreXml(const Element *el,const AddrSpaceManager *manag
   }
 }
 
+/// The context variables, the default context, every split point and the tracked register
+/// sets are all copied, so \b this then answers every query exactly as the other database.
+/// \param op2 is the database to copy
+void ContextInternal::copyFrom(const ContextInternal &op2)
+
+{
+  size = op2.size;
+  variables = op2.variables;
+  database.clear();
+  database.defaultValue().copy(op2.database.defaultValue());
+  partmap<Address,FreeArray>::const_iterator iter;
+  for(iter=op2.database.begin();iter!=op2.database.end();++iter)
+    database.split((*iter).first).copy((*iter).second);
+  trackbase = op2.trackbase;
+}
+
 void ContextInternal::restoreFromSpec(const Element *el,const AddrSpaceManager *manage)
 
 {
@@ -566,6 +603,118 @@ void ContextInternal::restoreFromSpec(const Element *el,const AddrSpaceManager *
   }
 }
 
+/// The split points are searched with their space index and offset, which orders them
+/// the same way as the Address keys of the map.
+/// \param addr is the given address
+/// \return the index of the first split point coming after the address, or the number of split points
+int4 ContextIntervals::search(const Address &addr) const
+
+{
+  int4 spc = addr.getSpace()->getIndex();
+  uintb off = addr.getOffset();
+  int4 min = 0;
+  int4 max = points.size();
+  while(min < max) {
+    int4 mid = (min + max) / 2;
+    const SplitPoint &pt(points[mid]);
+    if ((pt.space > spc)||((pt.space == spc)&&(pt.offset > off)))
+      max = mid;
+    else
+      min = mid + 1;
+  }
+  return min;
+}
+
+/// \param addr is the given address
+/// \return \b true if a blob starts exactly at the address
+bool ContextIntervals::isSplit(const Address &addr) const
+
+{
+  partmap<Address,FreeArray>::const_iterator iter = database.begin(addr);
+  return ((iter != database.end())&&((*iter).first == addr));
+}
+
+void ContextIntervals::getRegionForSet(vector<uintm *> &res,const Address &addr1,const Address &addr2,
+				       int4 num,uintm mask)
+{
+  if (frozen) {
+    if (!isSplit(addr1) || (!addr2.isInvalid() && !isSplit(addr2)))
+      thaw();			// The map is getting a new split point
+  }
+  ContextInternal::getRegionForSet(res,addr1,addr2,num,mask);
+}
+
+void ContextIntervals::getRegionToChangePoint(vector<uintm *> &res,const Address &addr,int4 num,uintm mask)
+
+{
+  if (frozen && !isSplit(addr))
+    thaw();
+  ContextInternal::getRegionToChangePoint(res,addr,num,mask);
+}
+
+/// The blobs themselves stay in the map, only pointers to them are collected. The array must be
+/// rebuilt (by calling this again) after the database is thawed.
+void ContextIntervals::freeze(void)
+
+{
+  points.clear();
+  partmap<Address,FreeArray>::const_iterator iter;
+  for(iter=database.begin();iter!=database.end();++iter) {
+    SplitPoint pt;
+    pt.space = (*iter).first.getSpace()->getIndex();
+    pt.offset = (*iter).first.getOffset();
+    pt.array = (*iter).second.array;
+    points.push_back(pt);
+  }
+  frozen = true;
+}
+
+/// The copy is frozen if the other database is a frozen ContextIntervals.
+/// \param op2 is the database to copy
+void ContextIntervals::copyFrom(const ContextInternal &op2)
+
+{
+  thaw();			// The blobs are all replaced
+  ContextInternal::copyFrom(op2);
+  const ContextIntervals *intervals = dynamic_cast<const ContextIntervals *>(&op2);
+  if (intervals != (const ContextIntervals *)0 && intervals->isFrozen())
+    freeze();
+}
+
+void ContextIntervals::registerVariable(const string &nm,int4 sbit,int4 ebit)
+
+{
+  thaw();			// The default blob may get reallocated
+  ContextInternal::registerVariable(nm,sbit,ebit);
+}
+
+const uintm *ContextIntervals::getContext(const Address &addr) const
+
+{
+  if (!frozen)
+    return ContextInternal::getContext(addr);
+  int4 i = search(addr);
+  return (i == 0) ? getDefaultValue() : points[i-1].array;
+}
+
+const uintm *ContextIntervals::getContext(const Address &addr,uintb &first,uintb &last) const
+
+{
+  if (!frozen)
+    return ContextInternal::getContext(addr,first,last);
+  int4 i = search(addr);
+  int4 spc = addr.getSpace()->getIndex();
+  if ((i == 0)||(points[i-1].space != spc))
+    first = 0;
+  else
+    first = points[i-1].offset;
+  if ((i == points.size())||(points[i].space != spc))
+    last = addr.getSpace()->getHighest();
+  else
+    last = points[i].offset - 1;
+  return (i == 0) ? getDefaultValue() : points[i-1].array;
+}
+
 /// \param db is the context database that will be encapsulated
 ContextCache::ContextCache(ContextDatabase *db)
 
@@ -590,6 +739,32 @@ void ContextCache::getContext(const Address &addr,uintm *buf) const
     buf[i] = context[i];
 }
 
+/// \brief Find the last address painted by a change point
+///
+/// The partitions of the database are walked from the change point for as long as the variable
+/// holds the new value.  This covers the whole painted range, and possibly some addresses after
+/// it that held the value already.
+/// \param addr is the change point
+/// \param num is the word index of the context variable
+/// \param mask is the mask delimiting the context variable
+/// \param value is the (already shifted) value that was set
+/// \return the offset of the last address holding the value
+uintb ContextCache::findPaintedEnd(const Address &addr,int4 num,uintm mask,uintm value) const
+
+{
+  AddrSpace *spc = addr.getSpace();
+  uintb off = addr.getOffset();
+  uintb rangefirst,rangelast;
+  for(;;) {
+    const uintm *blob = database->getContext(Address(spc,off),rangefirst,rangelast);
+    if ((blob[num] & mask) != value)
+      return off - 1;		// Not at the change point itself, which always holds the value
+    if (rangelast >= spc->getHighest())
+      return rangelast;
+    off = rangelast + 1;
+  }
+}
+
 /// \brief Change the value of a context variable at the given address with no bound
 ///
 /// The context value is set starting at the given address and \e paints memory up
@@ -602,9 +777,11 @@ void ContextCache::setContext(const Address &addr,int4 num,uintm mask,uintm valu
 
 {
   if (!allowset) return;
-  database->setContextChangePoint(addr,num,mask,value);
+  bool changed = database->setContextChangePoint(addr,num,mask,value);
   if ((addr.getSpace()==curspace)&&(first<=addr.getOffset())&&(last>=addr.getOffset()))
     curspace = (AddrSpace *)0;	// Invalidate cache
+  if (changed)
+    changes.push_back(Range(addr.getSpace(),addr.getOffset(),findPaintedEnd(addr,num,mask,value)));
 }
 
 /// \brief Change the value of a context variable across an explicit address range
@@ -620,7 +797,9 @@ void ContextCache::setContext(const Address &addr1,const Address &addr2,int4 num
 
 {
   if (!allowset) return;
-  database->setContextRegion(addr1,addr2,num,mask,value);
+  bool changed = database->setContextRegion(addr1,addr2,num,mask,value);
+  if (changed && addr1.getOffset() < addr2.getOffset())
+    changes.push_back(Range(addr1.getSpace(),addr1.getOffset(),addr2.getOffset()-1));
   if ((addr1.getSpace()==curspace)&&(first<=addr1.getOffset())&&(last>=addr1.getOffset()))
     curspace = (AddrSpace *)0;	// Invalidate cache
   if ((first<=addr2.getOffset())&&(last>=addr2.getOffset()))
@@ -241,8 +241,8 @@ public:
   uintm getDefaultValue(const string &nm) const;	///< Retrieve the default value for a context variable
   void setVariable(const string &nm,const Address &addr,uintm value);	///< Set a context value at the given address
   uintm getVariable(const string &nm,const Address &addr) const;	///< Retrieve a context value at the given address
-  void setContextChangePoint(const Address &addr,int4 num,uintm mask,uintm value);
-  void setContextRegion(const Address &addr1,const Address &addr2,int4 num,uintm mask,uintm value);
+  bool setContextChangePoint(const Address &addr,int4 num,uintm mask,uintm value);
+  bool setContextRegion(const Address &addr1,const Address &addr2,int4 num,uintm mask,uintm value);
   void setVariableRegion(const string &nm,const Address &begad,
 			 const Address &endad,uintm value);
   uintb getTrackedValue(const VarnodeData &mem,const Address &point) const;
@@ -254,7 +254,7 @@ public:
 /// indicates a \e split point, where the value of a context variable was explicitly changed.
 /// Sets of tracked registers are held in a separate partition map.
 class ContextInternal : public ContextDatabase {
-
+protected:
   /// \brief A context blob, holding context values across some range of code addresses
   ///
   /// This is an internal object that allocates the actual "array of words" for a context blob.
@@ -268,6 +268,7 @@ class ContextInternal : public ContextDatabase {
     ~FreeArray(void) { if (size!=0) { delete [] array; delete [] mask; } }	///< Destructor
     void reset(int4 sz);	///< Resize the context blob, preserving old values
     FreeArray &operator=(const FreeArray &op2);	///< Assignment operator
+    void copy(const FreeArray &op2);		///< Copy the values and which of them are explicitly set
   };
 
   int4 size;			///< Number of words in a context blob (for this architecture)
@@ -299,13 +300,49 @@ public:
   virtual void saveXml(ostream &s) const;
   virtual void restoreXml(const Element *el,const AddrSpaceManager *manage);
   virtual void restoreFromSpec(const Element *el,const AddrSpaceManager *manage);
+  virtual void copyFrom(const ContextInternal &op2);	///< Replace everything in \b this with the contents of another database
+};
+
+/// \brief A ContextInternal that can be frozen into a flat array of split points for fast lookups
+///
+/// Once the context has been laid down (after analysis, or once the spec defaults are set), freeze()
+/// copies the split points into an array sorted by address. Lookups are then a binary search
+/// over that array instead of a walk down the std::map, and they hand back the blobs held by the
+/// map directly, so values written in place at existing split points stay visible.  Anything that
+/// adds a split point (or resizes the blobs) \e thaws the database, which goes back to the map
+/// until it is frozen again.
+class ContextIntervals : public ContextInternal {
+  /// \brief A split point in the frozen array
+  struct SplitPoint {
+    int4 space;			///< Index of the address space of the split point
+    uintb offset;		///< Offset of the split point
+    const uintm *array;		///< The context blob starting at the split point
+  };
+  vector<SplitPoint> points;	///< Split points sorted by address, if frozen
+  bool frozen;			///< \b true if lookups go through \b points
+  int4 search(const Address &addr) const;	///< Index of the first split point after the given address
+  bool isSplit(const Address &addr) const;	///< Is there a split point at the given address
+  virtual void getRegionForSet(vector<uintm *> &res,const Address &addr1,
+			       const Address &addr2,int4 num,uintm mask);
+  virtual void getRegionToChangePoint(vector<uintm *> &res,const Address &addr,int4 num,uintm mask);
+public:
+  ContextIntervals(void) { frozen = false; }	///< Constructor
+  void freeze(void);				///< Build the array of split points
+  void thaw(void) { frozen = false; points.clear(); }	///< Go back to lookups in the map
+  bool isFrozen(void) const { return frozen; }	///< Are lookups going through the array of split points
+  virtual void registerVariable(const string &nm,int4 sbit,int4 ebit);
+  virtual const uintm *getContext(const Address &addr) const;
+  virtual const uintm *getContext(const Address &addr,uintb &first,uintb &last) const;
+  virtual void copyFrom(const ContextInternal &op2);
 };
 
 /// \brief A helper class for caching the active context blob to minimize database lookups
 ///
 /// This merely caches the last retrieved context blob ("array of words") and the range of
 /// addresses over which the blob is valid.  It encapsulates the ContextDatabase itself and
-/// exposes a minimal interface (getContext() and setContext()).
+/// exposes a minimal interface (getContext() and setContext()).  The address ranges where a
+/// setContext() call actually changed a value are recorded, so that anything decoded under the
+/// old values can be discarded (see getChanges()).
 class ContextCache {
   ContextDatabase *database;		///< The encapsulated context database
   bool allowset;			///< If set to \b false, and setContext() call is dropped
@@ -313,6 +350,8 @@ class ContextCache {
   mutable uintb first;			///< Starting offset of the current valid range
   mutable uintb last;			///< Ending offset of the current valid range
   mutable const uintm *context;		///< The current cached context blob
+  vector<Range> changes;		///< Address ranges whose context was changed through this cache
+  uintb findPaintedEnd(const Address &addr,int4 num,uintm mask,uintm value) const;	///< Find the last address painted by a change point
 public:
   ContextCache(ContextDatabase *db);	///< Construct given a context database
   ContextDatabase *getDatabase(void) const { return database; }		///< Retrieve the encapsulated database object
@@ -320,6 +359,9 @@ public:
   void getContext(const Address &addr,uintm *buf) const;	///< Retrieve the context blob for the given address
   void setContext(const Address &addr,int4 num,uintm mask,uintm value);
   void setContext(const Address &addr1,const Address &addr2,int4 num,uintm mask,uintm value);
+  void invalidate(void) { curspace = (AddrSpace *)0; }	///< Note a change made directly to the database
+  const vector<Range> &getChanges(void) const { return changes; }	///< Get the ranges whose context changed since clearChanges()
+  void clearChanges(void) { changes.clear(); }		///< Forget the recorded context changes
 };
 
 #endif
@@ -110,3 +110,135 @@ void RawLoadImage::loadFill(uint1 *ptr,int4 size,const Address &addr)
     throw DataUnavailError(errmsg.str());
   }
 }
+
+/// \param off is the offset to look up
+/// \return the index of the segment containing the offset, or -1 if it is not mapped
+int4 SpanLoadImage::findSegment(uintb off) const
+
+{
+  int4 min = 0;
+  int4 max = segments.size();
+  while(min < max) {		// Find the first segment starting after off
+    int4 mid = (min + max) / 2;
+    if (segments[mid].start <= off)
+      min = mid + 1;
+    else
+      max = mid;
+  }
+  if (min == 0) return -1;
+  const Segment &seg(segments[min-1]);
+  if (off - seg.start >= seg.size) return -1;
+  return min-1;
+}
+
+/// Segments may be added in any order but must not overlap.
+/// \param start is the address of the first byte
+/// \param data points to the bytes, which are not copied
+/// \param size is the number of bytes
+void SpanLoadImage::addSegment(uintb start,const uint1 *data,uintb size)
+
+{
+  if (size == 0) return;
+  vector<Segment>::iterator iter = segments.begin();
+  while(iter != segments.end() && (*iter).start < start)
+    ++iter;
+  if (iter != segments.end() && start + size > (*iter).start)
+    throw LowlevelError("Overlapping segments in load image");
+  if (iter != segments.begin()) {
+    const Segment &prev(*(iter-1));
+    if (prev.start + prev.size > start)
+      throw LowlevelError("Overlapping segments in load image");
+  }
+  Segment seg;
+  seg.start = start;
+  seg.size = size;
+  seg.data = data;
+  segments.insert(iter,seg);
+}
+
+/// Adjacent segments count as one contiguous range.
+/// \param off is the starting offset
+/// \return the number of bytes that can be read before reaching an unmapped byte
+uintb SpanLoadImage::getContiguousSize(uintb off) const
+
+{
+  int4 i = findSegment(off);
+  if (i < 0) return 0;
+  uintb end = segments[i].start + segments[i].size;
+  for(++i;i<segments.size();++i) {
+    if (segments[i].start != end) break;
+    end += segments[i].size;
+  }
+  return end - off;
+}
+
+void SpanLoadImage::loadFill(uint1 *ptr,int4 size,const Address &addr)
+
+{
+  uintb cur = addr.getOffset();
+  int4 i = findSegment(cur);
+  if (i < 0) {
+    ostringstream errmsg;
+    errmsg << "Unable to load " << dec << size << " bytes at " << addr.getShortcut();
+    addr.printRaw(errmsg);
+    throw DataUnavailError(errmsg.str());
+  }
+  while(size > 0) {
+    if (i >= segments.size()) {	// Past the last segment
+      memset(ptr,0,size);
+      return;
+    }
+    const Segment &seg(segments[i]);
+    if (cur < seg.start) {	// Gap before the next segment
+      uintb gap = seg.start - cur;
+      if (gap >= size) {
+	memset(ptr,0,size);
+	return;
+      }
+      memset(ptr,0,gap);
+      ptr += gap;
+      size -= gap;
+      cur = seg.start;
+    }
+    uintb len = seg.start + seg.size - cur;
+    if (len > size)
+      len = size;
+    memcpy(ptr,seg.data + (cur - seg.start),len);
+    ptr += len;
+    size -= len;
+    cur += len;
+    i += 1;
+  }
+}
+
+/// Only the bytes of the segment containing the address are viewed, even if the next
+/// segment is adjacent.
+/// \param addr is the address of the first byte
+/// \param size receives the number of bytes left in the segment
+/// \return the bytes in place, or null if the address is not mapped
+const uint1 *SpanLoadImage::viewBytes(const Address &addr,uintb &size) const
+
+{
+  int4 i = findSegment(addr.getOffset());
+  if (i < 0) {
+    size = 0;
+    return (const uint1 *)0;
+  }
+  const Segment &seg(segments[i]);
+  uintb skip = addr.getOffset() - seg.start;
+  size = seg.size - skip;
+  return seg.data + skip;
+}
+
+string SpanLoadImage::getArchType(void) const
+
+{
+  return "unknown";
+}
+
+void SpanLoadImage::adjustVma(long adjust)
+
+{
+  for(int4 i=0;i<segments.size();++i)
+    segments[i].start += adjust;
+}
@@ -76,6 +76,7 @@ public:
   virtual ~LoadImage(void);	///< LoadImage destructor
   const string &getFileName(void) const; ///< Get the name of the LoadImage
   virtual void loadFill(uint1 *ptr,int4 size,const Address &addr)=0; ///< Get data from the LoadImage
+  virtual const uint1 *viewBytes(const Address &addr,uintb &size) const; ///< Get data held in memory, without copying it
   virtual void openSymbols(void) const; ///< Prepare to read symbols
   virtual void closeSymbols(void) const; ///< Stop reading symbols
   virtual bool getNextSymbol(LoadImageFunc &record) const; ///< Get the next symbol record
@@ -108,6 +109,34 @@ public:
   virtual void adjustVma(long adjust);
 };
 
+/// \brief A loadimage over blocks of memory owned by the caller
+///
+/// Each segment maps a contiguous block of bytes to a range of addresses. Nothing is copied, and
+/// bytes are read with a plain memory copy or viewed in place, so the memory must stay valid and
+/// unchanged for as long as the image is in use.  The first byte of any request must be mapped, but the
+/// rest of the request may run past the end of a segment, where it is filled with zeros.
+class SpanLoadImage : public LoadImage {
+  /// \brief A contiguous block of mapped bytes
+  struct Segment {
+    uintb start;		///< Address of the first byte
+    uintb size;			///< Number of bytes in the block
+    const uint1 *data;		///< The bytes
+  };
+  vector<Segment> segments;	///< Mapped blocks, sorted by address
+  int4 findSegment(uintb off) const;	///< Find the segment containing the given offset
+public:
+  SpanLoadImage(void) : LoadImage("nofile") {}	///< Construct an image with nothing mapped
+  void addSegment(uintb start,const uint1 *data,uintb size);	///< Map a block of bytes
+  uintb getContiguousSize(uintb off) const;	///< Number of mapped bytes from the given offset on
+  int4 numSegments(void) const { return segments.size(); }	///< Get the number of mapped blocks
+  uintb getSegmentStart(int4 i) const { return segments[i].start; }	///< Get the address of the i-th block (in address order)
+  uintb getSegmentSize(int4 i) const { return segments[i].size; }	///< Get the number of bytes in the i-th block
+  virtual void loadFill(uint1 *ptr,int4 size,const Address &addr);
+  virtual const uint1 *viewBytes(const Address &addr,uintb &size) const;
+  virtual string getArchType(void) const;
+  virtual void adjustVma(long adjust);
+};
+
 /// For the base class there is no relevant initialization except
 /// the name of the image.
 /// \param f is the name of the image
@@ -140,6 +169,17 @@ inline void LoadImage::openSymbols(void) const {
 inline void LoadImage::closeSymbols(void) const {
 }
 
+/// An image that holds its bytes in memory can hand them out in place, which saves
+/// copying them with loadFill().  The bytes stay valid for as long as the image is
+/// unchanged.  The default has no bytes in memory.
+/// \param addr is the address of the first byte
+/// \param size receives the number of contiguous bytes that can be read
+/// \return the bytes, or null if they must be read with loadFill()
+inline const uint1 *LoadImage::viewBytes(const Address &addr,uintb &size) const {
+  size = 0;
+  return (const uint1 *)0;
+}
+
 /// This method is used to read out an individual symbol record,
 /// LoadImageFunc, from the load image.  Right now, the only
 /// information that can be read out are function starts and the
@@ -356,6 +356,20 @@ void MemoryBank::getChunk(uintb offset,int4 size,uint1 *res) const
   }
 }
 
+/// The default bank cannot save its contents, and throws an exception.
+void MemoryBank::snapshot(void)
+
+{
+  throw LowlevelError("Memory bank does not support snapshots: "+space->getName());
+}
+
+/// The default bank cannot save its contents, and throws an exception.
+void MemoryBank::restore(void)
+
+{
+  throw LowlevelError("Memory bank does not support snapshots: "+space->getName());
+}
+
 /// Find an aligned word from the bank.  First an attempt is made to fetch the data from the
 /// LoadImage.  If this fails, the value is returned as 0.
 /// \param addr is the address of the word to fetch
@@ -418,23 +432,7 @@ void MemoryPageOverlay::insert(uintb addr,uintb val)
 
 {
   uintb pageaddr = addr & ~((uintb)(getPageSize()-1));
-  map<uintb,uint1 *>::iterator iter;
-
-  uint1 *pageptr;
-
-  iter = page.find(pageaddr);
-  if (iter != page.end())
-    pageptr = (*iter).second;
-  else {
-    pageptr = new uint1[getPageSize()];
-    page[pageaddr] = pageptr;
-    if (underlie == (MemoryBank *)0) {
-      for(int4 i=0;i<getPageSize();++i)
-	pageptr[i] = 0;
-    }
-    else
-      underlie->getPage(pageaddr,pageptr,0,getPageSize());
-  }
+  uint1 *pageptr = getWritablePage(pageaddr,true);
   
   uintb pageoffset = addr & ((uintb)(getPageSize()-1));
   deconstructValue(pageptr + pageoffset,val,getWordSize(),getSpace()->isBigEndian());
@@ -449,16 +447,14 @@ uintb MemoryPageOverlay::find(uintb addr) const
 
 {
   uintb pageaddr = addr & ~((uintb)(getPageSize()-1));
-  map<uintb,uint1 *>::const_iterator iter;
-
-  iter = page.find(pageaddr);
-  if (iter == page.end()) {
+  int4 slot = findSlot(pageaddr);
+  if (slot < 0) {
     if (underlie == (MemoryBank *)0)
       return (uintb)0;
     return underlie->find(addr);
   }
 
-  const uint1 *pageptr = (*iter).second;
+  const uint1 *pageptr = table[slot].bytes;
 
   uintb pageoffset = addr & ((uintb)(getPageSize()-1));
   return constructValue(pageptr+pageoffset,getWordSize(),getSpace()->isBigEndian());
@@ -474,10 +470,8 @@ uintb MemoryPageOverlay::find(uintb addr) const
 void MemoryPageOverlay::getPage(uintb addr,uint1 *res,int4 skip,int4 size) const
 
 {
-  map<uintb,uint1 *>::const_iterator iter;
-
-  iter = page.find(addr);
-  if (iter == page.end()) {
+  int4 slot = findSlot(addr);
+  if (slot < 0) {
     if (underlie == (MemoryBank *)0) {
       for(int4 i=0;i<size;++i)
 	res[i] = 0;
@@ -486,7 +480,7 @@ void MemoryPageOverlay::getPage(uintb addr,uint1 *res,int4 skip,int4 size) const
     underlie->getPage(addr,res,skip,size);
     return;
   }
-  const uint1 *pageptr = (*iter).second;
+  const uint1 *pageptr = table[slot].bytes;
   memcpy(res,pageptr+skip,size);
 }
 
@@ -500,26 +494,110 @@ void MemoryPageOverlay::getPage(uintb addr,uint1 *res,int4 skip,int4 size) const
 void MemoryPageOverlay::setPage(uintb addr,const uint1 *val,int4 skip,int4 size)
 
 {
-  map<uintb,uint1 *>::iterator iter;
-  uint1 *pageptr;
-
-  iter = page.find(addr);
-  if (iter == page.end()) {
-    pageptr = new uint1[getPageSize()];
-    page[addr] = pageptr;
-    if (size != getPageSize()) {
-      if (underlie == (MemoryBank *)0) {
-	for(int4 i=0;i<getPageSize();++i)
-	  pageptr[i] = 0;
-      }
-      else
-	underlie->getPage(addr,pageptr,0,getPageSize());
+  uint1 *pageptr = getWritablePage(addr,size != getPageSize());
+
+  memcpy(pageptr+skip,val,size);
+}
+
+/// The table is grown to keep it at most half full, so probing always ends at an empty slot.
+/// \param addr is the aligned offset of the page
+/// \param bytes is the bytes of the page
+/// \return the slot of the page
+int4 MemoryPageOverlay::addPage(uintb addr,uint1 *bytes)
+
+{
+  if (2 * (numpages + 1) > table.size())
+    resizeTable(tablebits + 1);
+  int4 mask = table.size() - 1;
+  int4 slot = homeSlot(addr);
+  while(table[slot].bytes != (uint1 *)0)
+    slot = (slot + 1) & mask;
+  Page &pg(table[slot]);
+  pg.addr = addr;
+  pg.bytes = bytes;
+  pg.dirty = true;
+  numpages += 1;
+  lastslot = slot;
+  return slot;
+}
+
+/// The pages following in the same run of slots are shifted back into the hole where needed, so
+/// that each stays reachable from its home slot.  The bytes of the page are not released.
+/// \param slot is the slot of the page
+void MemoryPageOverlay::removePage(int4 slot)
+
+{
+  int4 mask = table.size() - 1;
+  int4 hole = slot;
+  int4 cur = (slot + 1) & mask;
+  while(table[cur].bytes != (uint1 *)0) {
+    int4 home = homeSlot(table[cur].addr);
+    if (((cur - home) & mask) >= ((cur - hole) & mask)) {
+      table[hole] = table[cur];
+      hole = cur;
     }
+    cur = (cur + 1) & mask;
   }
-  else
-    pageptr = (*iter).second;
+  table[hole].bytes = (uint1 *)0;
+  numpages -= 1;
+}
 
-  memcpy(pageptr+skip,val,size);
+/// \param bits is log2 of the new number of slots
+void MemoryPageOverlay::resizeTable(int4 bits)
+
+{
+  vector<Page> old;
+  old.swap(table);
+  Page empty;
+  empty.addr = 0;
+  empty.bytes = (uint1 *)0;
+  empty.dirty = false;
+  table.assign((size_t)1 << bits,empty);
+  tablebits = bits;
+  lastslot = 0;
+  int4 mask = table.size() - 1;
+  for(int4 i=0;i<old.size();++i) {
+    if (old[i].bytes == (uint1 *)0) continue;
+    int4 slot = homeSlot(old[i].addr);
+    while(table[slot].bytes != (uint1 *)0)
+      slot = (slot + 1) & mask;
+    table[slot] = old[i];
+  }
+}
+
+/// A page that does not exist yet is created, and one still shared with the snapshot is copied.
+/// Either way the page is marked as \e dirty.
+/// \param addr is the aligned offset of the page
+/// \param fill is \b false if the whole page is about to be overwritten, so its contents can be left undefined
+/// \return the bytes of the page
+uint1 *MemoryPageOverlay::getWritablePage(uintb addr,bool fill)
+
+{
+  int4 slot = findSlot(addr);
+  if (slot >= 0) {
+    Page &pg(table[slot]);
+    if (pg.dirty)
+      return pg.bytes;
+    uint1 *pageptr = slab.allocate();
+    if (fill)
+      memcpy(pageptr,pg.bytes,getPageSize());
+    pg.bytes = pageptr;		// The snapshot keeps the old bytes
+    pg.dirty = true;
+    dirty.push_back(addr);
+    return pageptr;
+  }
+  uint1 *pageptr = slab.allocate();
+  addPage(addr,pageptr);
+  dirty.push_back(addr);
+  if (fill) {
+    if (underlie == (MemoryBank *)0) {
+      for(int4 i=0;i<getPageSize();++i)
+	pageptr[i] = 0;
+    }
+    else
+      underlie->getPage(addr,pageptr,0,getPageSize());
+  }
+  return pageptr;
 }
 
 /// A page overlay memory bank needs all the parameters for a generic memory bank
@@ -529,18 +607,84 @@ void MemoryPageOverlay::setPage(uintb addr,const uint1 *val,int4 skip,int4 size)
 /// \param ps is the number of bytes in a page (must be power of 2)
 /// \param ul is the underlying MemoryBank
 MemoryPageOverlay::MemoryPageOverlay(AddrSpace *spc,int4 ws,int4 ps,MemoryBank *ul)
-  : MemoryBank(spc,ws,ps)
+  : MemoryBank(spc,ws,ps), slab(ps)
 {
   underlie = ul;
+  numpages = 0;
+  pageshift = 0;
+  while((1 << pageshift) < ps)
+    pageshift += 1;
+  resizeTable(4);
 }
 
-MemoryPageOverlay::~MemoryPageOverlay(void)
+/// The dirty pages replace their old version in the snapshot, and every page is then shared.
+void MemoryPageOverlay::snapshot(void)
 
 {
-  map<uintb,uint1 *>::iterator iter;
+  for(int4 i=0;i<dirty.size();++i) {
+    Page &pg(table[findSlot(dirty[i])]);
+    uint1 *&savedptr(saved[dirty[i]]);
+    if (savedptr != (uint1 *)0)
+      slab.release(savedptr);
+    savedptr = pg.bytes;
+    pg.dirty = false;
+  }
+  dirty.clear();
+}
 
-  for(iter=page.begin();iter!=page.end();++iter)
-    delete [] (*iter).second;
+/// Each dirty page goes back to the version shared with the snapshot, or is dropped if it did
+/// not exist at the time of the snapshot.
+void MemoryPageOverlay::restore(void)
+
+{
+  for(int4 i=0;i<dirty.size();++i) {
+    int4 slot = findSlot(dirty[i]);
+    slab.release(table[slot].bytes);
+    map<uintb,uint1 *>::const_iterator siter = saved.find(dirty[i]);
+    if (siter == saved.end())
+      removePage(slot);
+    else {
+      table[slot].bytes = (*siter).second;
+      table[slot].dirty = false;
+    }
+  }
+  dirty.clear();
+}
+
+/// \param ps is the number of bytes in a page
+PageSlab::PageSlab(int4 ps)
+
+{
+  pagesize = ps;
+  slabpages = (ps >= 0x10000) ? 1 : 0x10000 / ps;
+  used = slabpages;
+}
+
+PageSlab::~PageSlab(void)
+
+{
+  for(int4 i=0;i<slabs.size();++i)
+    delete [] slabs[i];
+}
+
+/// A released page is reused first, otherwise the page is taken from the last slab, and a new
+/// slab is allocated once it is used up.
+/// \return the page, whose bytes are left uninitialized
+uint1 *PageSlab::allocate(void)
+
+{
+  if (!freepages.empty()) {
+    uint1 *res = freepages.back();
+    freepages.pop_back();
+    return res;
+  }
+  if (used == slabpages) {
+    slabs.push_back(new uint1[(size_t)pagesize * slabpages]);
+    used = 0;
+  }
+  uint1 *res = slabs.back() + (size_t)pagesize * used;
+  used += 1;
+  return res;
 }
 
 /// Write the value into the hashtable, using \b addr as a key.
@@ -598,7 +742,8 @@ uintb MemoryHashOverlay::find(uintb addr) const
 /// \param hashsize is the maximum number of entries in the hashtable
 /// \param ul is the underlying memory bank being overlayed
 MemoryHashOverlay::MemoryHashOverlay(AddrSpace *spc,int4 ws,int4 ps,int4 hashsize,MemoryBank *ul)
-  : MemoryBank(spc,ws,ps), address(hashsize,0xBADBEEF), value(hashsize,0)
+  : MemoryBank(spc,ws,ps), address(hashsize,0xBADBEEF), value(hashsize,0),
+    savedaddress(hashsize,0xBADBEEF), savedvalue(hashsize,0)
 {
   underlie = ul;
   collideskip = 1023;
@@ -611,9 +756,113 @@ MemoryHashOverlay::MemoryHashOverlay(AddrSpace *spc,int4 ws,int4 ps,int4 hashsiz
   }
 }
 
+/// The whole table is saved, so the cost is proportional to its size.
+void MemoryHashOverlay::snapshot(void)
+
+{
+  savedaddress = address;
+  savedvalue = value;
+}
+
+/// The whole table is brought back, so the cost is proportional to its size.
+void MemoryHashOverlay::restore(void)
+
+{
+  address = savedaddress;
+  value = savedvalue;
+}
+
+/// The array is zero filled and rounded up to a whole number of pages.
+/// \param spc is the address space associated with the memory bank
+/// \param ws is the number of bytes in the preferred wordsize (must be power of 2)
+/// \param ps is the number of bytes in a page (must be power of 2)
+/// \param size is the number of bytes to hold, starting from offset 0
+MemoryArray::MemoryArray(AddrSpace *spc,int4 ws,int4 ps,uintb size)
+  : MemoryBank(spc,ws,ps)
+{
+  limit = (size + ps - 1) & ~((uintb)(ps-1));
+  bytes = new uint1[limit]();
+  saved = (uint1 *)0;
+  bswap = ((HOST_ENDIAN==1) != spc->isBigEndian());
+}
+
+MemoryArray::~MemoryArray(void)
+
+{
+  delete [] bytes;
+  if (saved != (uint1 *)0)
+    delete [] saved;
+}
+
+/// The whole array is saved, so the cost is proportional to its size.
+void MemoryArray::snapshot(void)
+
+{
+  if (saved == (uint1 *)0)
+    saved = new uint1[limit];
+  memcpy(saved,bytes,limit);
+}
+
+/// The bytes are copied back in place, so pointers to them stay valid.  Without a snapshot, the
+/// array is filled with zeros again.
+void MemoryArray::restore(void)
+
+{
+  if (saved == (uint1 *)0)
+    memset(bytes,0,limit);
+  else
+    memcpy(bytes,saved,limit);
+}
+
+/// \param addr is the aligned address of the word to be written
+/// \param val is the value to be written at that word
+void MemoryArray::insert(uintb addr,uintb val)
+
+{
+  if (addr >= limit)
+    throw LowlevelError("Writing past the end of memory array: "+getSpace()->getName());
+  deconstructValue(bytes + addr,val,getWordSize(),getSpace()->isBigEndian());
+}
+
+/// \param addr is the aligned offset of the word
+/// \return the retrieved value
+uintb MemoryArray::find(uintb addr) const
+
+{
+  if (addr >= limit)
+    throw LowlevelError("Reading past the end of memory array: "+getSpace()->getName());
+  return constructValue(bytes + addr,getWordSize(),getSpace()->isBigEndian());
+}
+
+/// \param addr is the aligned offset of the page
+/// \param res is the pointer to where retrieved bytes should be stored
+/// \param skip is the offset \e into \e the \e page from where bytes should be retrieved
+/// \param size is the number of bytes to retrieve
+void MemoryArray::getPage(uintb addr,uint1 *res,int4 skip,int4 size) const
+
+{
+  if (addr >= limit)
+    throw LowlevelError("Reading past the end of memory array: "+getSpace()->getName());
+  memcpy(res,bytes + addr + skip,size);
+}
+
+/// \param addr is the aligned offset of the page to write
+/// \param val is a pointer to bytes to be written into the page
+/// \param skip is the offset \e into \e the \e page where bytes should be written
+/// \param size is the number of bytes to write
+void MemoryArray::setPage(uintb addr,const uint1 *val,int4 skip,int4 size)
+
+{
+  if (addr >= limit)
+    throw LowlevelError("Writing past the end of memory array: "+getSpace()->getName());
+  memcpy(bytes + addr + skip,val,size);
+}
+
 /// MemoryBanks associated with specific address spaces must be registers with this MemoryState
 /// via this method.  Each address space that will be used during emulation must be registered
-/// separately.  The MemoryState object does \e not assume responsibility for freeing the MemoryBank
+/// separately.  The MemoryState object does \e not assume responsibility for freeing the MemoryBank.
+/// Varnodes in a MemoryArray bank are then read and written without going through the generic
+/// MemoryBank routines.
 /// \param bank is a pointer to the MemoryBank to be registered
 void MemoryState::setMemoryBank(MemoryBank *bank)
 
@@ -621,10 +870,13 @@ void MemoryState::setMemoryBank(MemoryBank *bank)
   AddrSpace *spc = bank->getSpace();
   int4 index = spc->getIndex();
 
-  while(index >= memspace.size())
+  while(index >= memspace.size()) {
     memspace.push_back((MemoryBank *)0);
+    arrays.push_back((MemoryArray *)0);
+  }
 
   memspace[index] = bank;
+  arrays[index] = dynamic_cast<MemoryArray *>(bank);
 }
 
 /// Any MemoryBank that has been registered with this MemoryState can be retrieved via this
@@ -733,3 +985,29 @@ void MemoryState::setChunk(const uint1 *val,AddrSpace *spc,uintb off,int4 size)
   mspace->setChunk(off,size,val);
 }
 
+
+/// Every registered MemoryBank saves its contents, see MemoryBank::snapshot().  The cost
+/// depends on the kind of bank.  Temporaries only live within a single machine instruction, so
+/// the bank of the \e unique space is skipped.
+void MemoryState::snapshot(void)
+
+{
+  for(int4 i=0;i<memspace.size();++i) {
+    if (memspace[i] == (MemoryBank *)0) continue;
+    if (memspace[i]->getSpace()->getType() == IPTR_INTERNAL) continue;
+    memspace[i]->snapshot();
+  }
+}
+
+/// Every registered MemoryBank brings back the contents saved by the last call to snapshot(),
+/// or its initial contents if there was none.  A MemoryPageOverlay only reverts the pages
+/// written since.  The bank of the \e unique space is left as it is.
+void MemoryState::restore(void)
+
+{
+  for(int4 i=0;i<memspace.size();++i) {
+    if (memspace[i] == (MemoryBank *)0) continue;
+    if (memspace[i]->getSpace()->getType() == IPTR_INTERNAL) continue;
+    memspace[i]->restore();
+  }
+}
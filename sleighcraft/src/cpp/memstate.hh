@@ -55,6 +55,8 @@ public:
   uintb getValue(uintb offset,int4 size) const; ///< Retrieve the value encoded in a (small) range of bytes
   void setChunk(uintb offset,int4 size,const uint1 *val); ///< Set values of an arbitrary sequence of bytes
   void getChunk(uintb offset,int4 size,uint1 *res) const; ///< Retrieve an arbitrary sequence of bytes
+  virtual void snapshot(void);	///< Save the contents of the bank, to be brought back by restore()
+  virtual void restore(void);	///< Bring back the contents saved by the last snapshot()
   static uintb constructValue(const uint1 *ptr,int4 size,bool bigendian); ///< Decode bytes to value
   static void deconstructValue(uint1 *ptr,uintb val,int4 size,bool bigendian); ///< Encode value to bytes
 };
@@ -99,6 +101,24 @@ protected:
   virtual void getPage(uintb addr,uint1 *res,int4 skip,int4 size) const; ///< Overridded getPage method
 public:
   MemoryImage(AddrSpace *spc,int4 ws,int4 ps,LoadImage *ld); ///< Constructor for a loadimage memorybank
+  virtual void snapshot(void) {}	///< Nothing to save, as the bank is read-only
+  virtual void restore(void) {}	///< Nothing to bring back, as the bank is read-only
+};
+
+/// \brief Storage for memory pages of a single size, carved out of larger slabs
+///
+/// Released pages are kept for reuse, and the slabs are only freed with the object.
+class PageSlab {
+  int4 pagesize;		///< Number of bytes in a page
+  int4 slabpages;		///< Number of pages in a slab
+  int4 used;			///< Number of pages handed out from the last slab
+  vector<uint1 *> slabs;	///< Every slab allocated
+  vector<uint1 *> freepages;	///< Released pages
+public:
+  PageSlab(int4 ps);		///< Constructor
+  ~PageSlab(void);		///< Destructor
+  uint1 *allocate(void);	///< Get an uninitialized page
+  void release(uint1 *ptr) { freepages.push_back(ptr); }	///< Give back a page, for reuse
 };
 
 /// \brief Memory bank that overlays some other memory bank, using a "copy on write" behavior.
@@ -107,9 +127,36 @@ public:
 /// a write. The underlying access routines are overridden to make optimal use
 /// of this page implementation.  The underlying memory bank can be a \b null pointer
 /// in which case, this memory bank behaves as if it were initially filled with zeros.
+///
+/// Pages are indexed by a hash table with open addressing, and the slot of the last page looked
+/// up is tried first.  Their bytes come from a PageSlab.
+///
+/// A snapshot shares the pages with the bank, and a page is copied again the first time it is
+/// written after the snapshot.  The written pages are tracked, so restoring the snapshot (and taking
+/// the next one) only costs time for the pages written since.  Before any snapshot is taken,
+/// restoring brings back the initial state.  The underlying bank is not part of the snapshot.
 class MemoryPageOverlay : public MemoryBank {
+  /// \brief An overlayed page, or an empty slot of the page table
+  struct Page {
+    uintb addr;			///< Offset of the page
+    uint1 *bytes;		///< The bytes of the page, or \b null if the slot is empty
+    bool dirty;			///< \b true if written since the last snapshot, and so not shared with it
+  };
   MemoryBank *underlie;		///< Underlying memory object
-  map<uintb,uint1 *> page;	///< Overlayed pages
+  PageSlab slab;		///< Storage for the bytes of every page, including the snapshot
+  vector<Page> table;		///< The page table, whose size is a power of 2
+  int4 tablebits;		///< log2 of the size of \b table
+  int4 numpages;		///< Number of pages in \b table, at most half its size
+  int4 pageshift;		///< log2 of the page size
+  mutable int4 lastslot;	///< Slot of the last page found
+  map<uintb,uint1 *> saved;	///< Pages as of the last snapshot, shared with \b table until written
+  vector<uintb> dirty;		///< Addresses of the \e dirty pages
+  int4 homeSlot(uintb addr) const;	///< The first slot to probe for a page
+  int4 findSlot(uintb addr) const;	///< Find the slot of a page
+  int4 addPage(uintb addr,uint1 *bytes);	///< Add a page that is not in the table
+  void removePage(int4 slot);	///< Remove the page in the given slot
+  void resizeTable(int4 bits);	///< Move the pages to a table of a new size
+  uint1 *getWritablePage(uintb addr,bool fill);	///< Get a page that is not shared with the snapshot
 protected:
   virtual void insert(uintb addr,uintb val); ///< Overridden aligned word insert
   virtual uintb find(uintb addr) const;	///< Overridden aligned word find
@@ -117,9 +164,43 @@ protected:
   virtual void setPage(uintb addr,const uint1 *val,int4 skip,int4 size); ///< Overridden setPage
 public:
   MemoryPageOverlay(AddrSpace *spc,int4 ws,int4 ps,MemoryBank *ul); ///< Constructor for page overlay
-  virtual ~MemoryPageOverlay(void);
+  virtual ~MemoryPageOverlay(void) {}	///< The pages are freed with the slab
+  virtual void snapshot(void);	///< Share every page with a new snapshot
+  virtual void restore(void);	///< Bring back the pages written since the last snapshot
 };
 
+/// Page numbers are spread over the table by Fibonacci hashing.
+/// \param addr is the aligned offset of the page
+/// \return the slot
+inline int4 MemoryPageOverlay::homeSlot(uintb addr) const
+
+{
+  uint8 key = (uint8)(addr >> pageshift);
+  return (int4)((key * 0x9e3779b97f4a7c15ULL) >> (64 - tablebits));
+}
+
+/// \param addr is the aligned offset of the page
+/// \return the slot holding the page, or -1 if it is not in the table
+inline int4 MemoryPageOverlay::findSlot(uintb addr) const
+
+{
+  const Page &last(table[lastslot]);
+  if (last.addr == addr && last.bytes != (uint1 *)0)
+    return lastslot;
+  int4 mask = table.size() - 1;
+  int4 slot = homeSlot(addr);
+  for(;;) {			// The table always has an empty slot
+    const Page &pg(table[slot]);
+    if (pg.bytes == (uint1 *)0)
+      return -1;
+    if (pg.addr == addr) {
+      lastslot = slot;
+      return slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
 /// \brief A memory bank that implements reads and writes using a hash table.
 ///
 /// The initial state of the
@@ -131,13 +212,120 @@ class MemoryHashOverlay : public MemoryBank {
   uintb collideskip;		///< How many slots to skip after a hashtable collision
   vector<uintb> address;	///< The hashtable addresses
   vector<uintb> value;		///< The hashtable values
+  vector<uintb> savedaddress;	///< The hashtable addresses as of the last snapshot
+  vector<uintb> savedvalue;	///< The hashtable values as of the last snapshot
 protected:
   virtual void insert(uintb addr,uintb val); ///< Overridden aligned word insert
   virtual uintb find(uintb addr) const;	///< Overridden aligned word find
 public:
   MemoryHashOverlay(AddrSpace *spc,int4 ws,int4 ps,int4 hashsize,MemoryBank *ul); ///< Constructor for hash overlay
+  virtual void snapshot(void);	///< Copy the hashtable
+  virtual void restore(void);	///< Copy back the hashtable
 };
 
+/// \brief A memory bank holding the start of its space in one flat array
+///
+/// Every byte from offset 0 up to a fixed limit is stored directly, so reading or writing a word
+/// is a bounds check and a copy, with no lookup.  This suits the \e register and \e unique spaces,
+/// whose extent is known from the language and which see most of the traffic during emulation.
+/// The bank starts out filled with zeros.  Accessing bytes past the limit throws an exception.
+class MemoryArray : public MemoryBank {
+  uint1 *bytes;			///< The bytes of the space, from offset 0 up to \b limit
+  uint1 *saved;			///< The bytes as of the last snapshot, or \b null if none was taken
+  uintb limit;			///< Number of bytes held (a multiple of the page size)
+  bool bswap;			///< \b true if the space and the host differ in endianness
+protected:
+  virtual void insert(uintb addr,uintb val); ///< Overridden aligned word insert
+  virtual uintb find(uintb addr) const;	///< Overridden aligned word find
+  virtual void getPage(uintb addr,uint1 *res,int4 skip,int4 size) const; ///< Overridden getPage
+  virtual void setPage(uintb addr,const uint1 *val,int4 skip,int4 size); ///< Overridden setPage
+public:
+  MemoryArray(AddrSpace *spc,int4 ws,int4 ps,uintb size); ///< Constructor for a flat array bank
+  virtual ~MemoryArray(void);
+  virtual void snapshot(void);	///< Copy the array
+  virtual void restore(void);	///< Copy back the array, in place
+  uintb getLimit(void) const { return limit; }	///< Get the number of bytes held
+  uint1 *getBytes(void) { return bytes; }	///< Get the bytes, which stay at the same place for the life of the bank
+  bool contains(uintb off,int4 size) const { return (off < limit && (uintb)size <= limit - off); }	///< Is the given range held in the array
+  uintb getArrayValue(uintb off,int4 size) const;	///< Read a value from a range held in the array
+  void setArrayValue(uintb off,int4 size,uintb val);	///< Write a value to a range held in the array
+};
+
+/// The common sizes are copied as a single integer, other sizes go through the generic MemoryBank
+/// routine.  The range must be held in the array, see contains().
+/// \param off is the offset of the first byte
+/// \param size is the number of bytes
+/// \return the decoded value
+inline uintb MemoryArray::getArrayValue(uintb off,int4 size) const
+
+{
+  const uint1 *ptr = bytes + off;
+  uintb res;
+  switch(size) {
+  case 1:
+    return *ptr;
+  case 2: {
+    uint2 val;
+    memcpy(&val,ptr,2);
+    res = val;
+    break;
+  }
+  case 4: {
+    uint4 val;
+    memcpy(&val,ptr,4);
+    res = val;
+    break;
+  }
+  case 8: {
+    uint8 val;
+    memcpy(&val,ptr,8);
+    res = val;
+    break;
+  }
+  default:
+    return getValue(off,size);
+  }
+  if (bswap)
+    res = byte_swap(res,size);
+  return res;
+}
+
+/// The common sizes are copied as a single integer, other sizes go through the generic MemoryBank
+/// routine.  The range must be held in the array, see contains().
+/// \param off is the offset of the first byte
+/// \param size is the number of bytes
+/// \param val is the value to encode
+inline void MemoryArray::setArrayValue(uintb off,int4 size,uintb val)
+
+{
+  uint1 *ptr = bytes + off;
+  if (bswap && size > 1)
+    val = byte_swap(val,size);
+  switch(size) {
+  case 1:
+    *ptr = (uint1)val;
+    break;
+  case 2: {
+    uint2 tmp = (uint2)val;
+    memcpy(ptr,&tmp,2);
+    break;
+  }
+  case 4: {
+    uint4 tmp = (uint4)val;
+    memcpy(ptr,&tmp,4);
+    break;
+  }
+  case 8: {
+    uint8 tmp = (uint8)val;
+    memcpy(ptr,&tmp,8);
+    break;
+  }
+  default:
+    setValue(off,size,val);
+    break;
+  }
+}
+
 class Translate;		// Forward declaration
 
 /// \brief All storage/state for a pcode machine
@@ -149,12 +337,14 @@ class MemoryState {
 protected:
   Translate *trans;		///< Architecture information about memory spaces
   vector<MemoryBank *> memspace; ///< Memory banks associated with each address space
+  vector<MemoryArray *> arrays;	///< The flat array banks among \b memspace, indexed the same way
 public:
   MemoryState(Translate *t);	///< A constructor for MemoryState
   ~MemoryState(void) {}
   Translate *getTranslate(void) const; ///< Get the Translate object
   void setMemoryBank(MemoryBank *bank);	///< Map a memory bank into the state
   MemoryBank *getMemoryBank(AddrSpace *spc) const; ///< Get a memory bank associated with a particular space
+  MemoryArray *getMemoryArray(AddrSpace *spc) const; ///< Get the flat array bank of a space, if it has one
   void setValue(AddrSpace *spc,uintb off,int4 size,uintb cval); ///< Set a value on the memory state
   uintb getValue(AddrSpace *spc,uintb off,int4 size) const; ///< Retrieve a memory value from the memory state
   void setValue(const string &nm,uintb cval); ///< Set a value on a named register in the memory state
@@ -163,6 +353,8 @@ public:
   uintb getValue(const VarnodeData *vn) const; ///< Get a value from a \b varnode
   void getChunk(uint1 *res,AddrSpace *spc,uintb off,int4 size) const; ///< Get a chunk of data from memory state
   void setChunk(const uint1 *val,AddrSpace *spc,uintb off,int4 size); ///< Set a chunk of data from memory state
+  void snapshot(void);		///< Save the contents of the memory banks, except for temporaries
+  void restore(void);		///< Bring back the contents of the memory banks saved by the last snapshot()
 };
 
 /// The MemoryState needs a Translate object in order to be able to convert register names
@@ -182,23 +374,48 @@ inline Translate *MemoryState::getTranslate(void) const
   return trans;
 }
 
+/// \param spc is the address space
+/// \return the MemoryArray registered for the space, or \b null if its bank is of another kind
+inline MemoryArray *MemoryState::getMemoryArray(AddrSpace *spc) const
+
+{
+  int4 index = spc->getIndex();
+  if (index >= arrays.size())
+    return (MemoryArray *)0;
+  return arrays[index];
+}
+
 /// A convenience method for setting a value directly on a varnode rather than
-/// breaking out the components
+/// breaking out the components.  A varnode held in a flat array bank is written in place.
 /// \param vn is a pointer to the varnode to be written
 /// \param cval is the value to write into the varnode
 inline void MemoryState::setValue(const VarnodeData *vn,uintb cval)
 
 {
+  int4 index = vn->space->getIndex();
+  if (index < arrays.size()) {
+    MemoryArray *arr = arrays[index];
+    if (arr != (MemoryArray *)0 && arr->contains(vn->offset,vn->size)) {
+      arr->setArrayValue(vn->offset,vn->size,cval);
+      return;
+    }
+  }
   setValue(vn->space,vn->offset,vn->size,cval);
 }
 
 /// A convenience method for reading a value directly from a varnode rather
-/// than querying for the offset and space
+/// than querying for the offset and space.  A varnode held in a flat array bank is read in place.
 /// \param vn is a pointer to the varnode to be read
 /// \return the value read from the varnode
 inline uintb MemoryState::getValue(const VarnodeData *vn) const
 
 {
+  int4 index = vn->space->getIndex();
+  if (index < arrays.size()) {
+    const MemoryArray *arr = arrays[index];
+    if (arr != (MemoryArray *)0 && arr->contains(vn->offset,vn->size))
+      return arr->getArrayValue(vn->offset,vn->size);
+  }
   return getValue(vn->space,vn->offset,vn->size);
 }
 
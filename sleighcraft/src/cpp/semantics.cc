@@ -727,6 +727,7 @@ void OpTpl::restoreXml(const Element *el,const AddrSpaceManager *manage)
     output->restoreXml(*iter,manage);
   }
   ++iter;
+  input.reserve(list.size() - 1);
   while(iter != list.end()) {
     VarnodeTpl *vn = new VarnodeTpl();
     vn->restoreXml(*iter,manage);
@@ -923,6 +924,7 @@ int4 ConstructTpl::restoreXml(const Element *el,const AddrSpaceManager *manage)
     result->restoreXml(*iter,manage);
   }
   ++iter;
+  vec.reserve(list.size() - 1);
   while(iter != list.end()) {
     OpTpl *op = new OpTpl();
     op->restoreXml(*iter,manage);
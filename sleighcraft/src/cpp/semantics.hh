@@ -17,6 +17,7 @@
 #define __SEMANTICS__
 
 #include "context.hh"
+#include "arena.hh"
 
 // We remap these opcodes for internal use during pcode generation
 
@@ -74,7 +75,7 @@ public:
   void restoreXml(const Element *el,const AddrSpaceManager *manage);
 };
 
-class VarnodeTpl {
+class VarnodeTpl : public ArenaObject {
   friend class OpTpl;
   friend class HandleTpl;
   ConstTpl space,offset,size;
@@ -104,7 +105,7 @@ public:
   void restoreXml(const Element *el,const AddrSpaceManager *manage);
 };
 
-class HandleTpl {
+class HandleTpl : public ArenaObject {
   ConstTpl space;
   ConstTpl size;
   ConstTpl ptrspace;
@@ -134,7 +135,7 @@ public:
   void restoreXml(const Element *el,const AddrSpaceManager *manage);
 };
 
-class OpTpl {
+class OpTpl : public ArenaObject {
   VarnodeTpl *output;
   OpCode opc;
   vector<VarnodeTpl *> input;
@@ -158,7 +159,7 @@ public:
   void restoreXml(const Element *el,const AddrSpaceManager *manage);
 };
 
-class ConstructTpl {
+class ConstructTpl : public ArenaObject {
   friend class SleighCompile;
 protected:
   uint4 delayslot;
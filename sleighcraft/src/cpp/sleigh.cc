@@ -302,6 +302,7 @@ SleighBuilder::SleighBuilder(ParserWalker *w,DisassemblyCache *dcache,PcodeCache
   uniq_space = uspc;
   uniquemask = umask;
   uniqueoffset = (walker->getAddr().getOffset() & uniquemask)<<4;
+  selfcontained = true;
 }
 
 void SleighBuilder::appendBuild(OpTpl *bld,int4 secnum)
@@ -336,6 +337,7 @@ void SleighBuilder::delaySlot(OpTpl *op)
   // in the middle of the current instruction
   ParserWalker *tmp = walker;
   uintb olduniqueoffset = uniqueoffset;
+  selfcontained = false;
 
   Address baseaddr = tmp->getAddr();
   int4 fallOffset = tmp->getLength();
@@ -381,6 +383,7 @@ void SleighBuilder::appendCrossBuild(OpTpl *bld,int4 secnum)
 
   ParserWalker *tmp = walker;
   uintb olduniqueoffset = uniqueoffset;
+  selfcontained = false;
 
   Address newaddr(spc,addr);
   setUniqueOffset(newaddr);
@@ -403,72 +406,349 @@ void SleighBuilder::appendCrossBuild(OpTpl *bld,int4 secnum)
 }
 
 /// \param min is the minimum number of allocations before a reuse is expected
-/// \param hashsize is the number of elements in the hash-table
-void DisassemblyCache::initialize(int4 min,int4 hashsize)
+/// \param size is the number of ParserContext objects to allocate
+void DisassemblyCache::initialize(int4 min,int4 size)
 
 {
+  if (min < 1 || size < min)
+    throw LowlevelError("Bad size for disassembly cache");
   minimumreuse = min;
+  cachesize = size;
+  uint4 hashsize = 1;
+  while(hashsize < 2*(uint4)cachesize)	// Keep the load factor at most 1/2
+    hashsize <<= 1;
   mask = hashsize-1;
-  uintb masktest = coveringmask((uintb)mask);
-  if (masktest != (uintb)mask)	// -hashsize- must be a power of 2
-    throw LowlevelError("Bad windowsize for disassembly cache");
-  list = new ParserContext *[minimumreuse];
-  nextfree = 0;
-  hashtable = new ParserContext *[hashsize];
-  for(int4 i=0;i<minimumreuse;++i) {
-    ParserContext *pos = new ParserContext(contextcache);
-    pos->initialize(75,20,constspace);
-    list[i] = pos;
+  list = new Entry[cachesize];
+  for(int4 i=0;i<cachesize;++i) {
+    Entry &entry(list[i]);
+    entry.pos = new ParserContext(contextcache);
+    entry.pos->initialize(75,20,constspace);
+    entry.hashnext = -1;
+    entry.prev = i-1;		// Start with the recency list in allocation order
+    entry.next = (i+1 < cachesize) ? i+1 : -1;
+    entry.lastuse = 0;
+    entry.referenced = false;
+    entry.hashed = false;
   }
-  ParserContext *pos = list[0];
-  for(int4 i=0;i<hashsize;++i)
-    hashtable[i] = pos;		// Make sure all hashtable positions point to a real ParserContext
+  mostrecent = 0;
+  leastrecent = cachesize-1;
+  nextfree = 0;
+  hashtable = new int4[hashsize];
+  for(uint4 i=0;i<hashsize;++i)
+    hashtable[i] = -1;
+  requests = 0;
+  hits = 0;
+  misses = 0;
 }
 
 void DisassemblyCache::free(void)
 
 {
-  for(int4 i=0;i<minimumreuse;++i)
-    delete list[i];
+  for(int4 i=0;i<cachesize;++i)
+    delete list[i].pos;
   delete [] list;
   delete [] hashtable;
 }
 
+/// Sequential addresses land in sequential buckets. The high half of the offset is folded in
+/// so that addresses differing only above 32 bits don't all collide.
+/// \param addr is the address to hash
+/// \return the index of the bucket holding the address
+uint4 DisassemblyCache::hashAddress(const Address &addr) const
+
+{
+  uintb off = addr.getOffset();
+  return ((uint4)(off ^ (off >> 32))) & mask;
+}
+
+/// \param i is the index of the entry to remove
+void DisassemblyCache::unhash(int4 i)
+
+{
+  int4 *link = &hashtable[ hashAddress(list[i].pos->getAddr()) ];
+  while(*link != i)
+    link = &list[*link].hashnext;
+  *link = list[i].hashnext;
+  list[i].hashnext = -1;
+  list[i].hashed = false;
+}
+
+/// The entry is stamped with the current request and moved to the front of the recency list.
+/// \param i is the index of the entry
+void DisassemblyCache::touch(int4 i)
+
+{
+  Entry &entry(list[i]);
+  entry.lastuse = requests;
+  entry.referenced = true;
+  if (i == mostrecent) return;
+  list[entry.prev].next = entry.next;	// Unlink
+  if (entry.next != -1)
+    list[entry.next].prev = entry.prev;
+  else
+    leastrecent = entry.prev;
+  entry.prev = -1;			// Relink at the front
+  entry.next = mostrecent;
+  list[mostrecent].prev = i;
+  mostrecent = i;
+}
+
+/// Entries used by the last \e minimumreuse requests are never chosen, whatever the policy.
+/// For \e roundrobin this holds because the cache has at least that many entries, and for \e lru
+/// because those entries are at the front of the recency list. The \e clock hand skips them
+/// explicitly, and otherwise gives every entry used since its last pass a second chance.
+/// \return the index of the entry to reuse
+int4 DisassemblyCache::findVictim(void)
+
+{
+  int4 res;
+  switch(policy) {
+  case roundrobin:
+    res = nextfree;
+    nextfree = (nextfree + 1 < cachesize) ? nextfree + 1 : 0;
+    return res;
+  case clock:
+    for(;;) {
+      Entry &entry(list[nextfree]);
+      res = nextfree;
+      nextfree = (nextfree + 1 < cachesize) ? nextfree + 1 : 0;
+      if (entry.hashed && requests - entry.lastuse < (uint4)minimumreuse)
+	continue;		// May still be in use by the instruction being built
+      if (entry.referenced) {
+	entry.referenced = false;	// Second chance
+	continue;
+      }
+      return res;
+    }
+  default:
+    return leastrecent;
+  }
+}
+
+/// If the address is not cached, an entry is chosen for reuse and reset to hold it.
+/// \param addr is the address being looked up
+/// \return the entry for the address
+DisassemblyCache::Entry &DisassemblyCache::lookup(const Address &addr)
+
+{
+  requests += 1;
+  uint4 hashindex = hashAddress(addr);
+  for(int4 i=hashtable[hashindex];i!=-1;i=list[i].hashnext) {
+    if (list[i].pos->getAddr() == addr) {
+      hits += 1;
+      touch(i);
+      return list[i];
+    }
+  }
+  misses += 1;
+  int4 i = findVictim();
+  Entry &entry(list[i]);
+  if (entry.hashed)
+    unhash(i);
+  entry.pos->setAddr(addr);
+  entry.pos->setParserState(ParserContext::uninitialized);	// Need to start over with parsing
+  entry.hashnext = hashtable[hashindex];	// Stick it into the hashtable
+  hashtable[hashindex] = i;
+  entry.hashed = true;
+  touch(i);
+  return entry;
+}
+
 /// \param ccache is the ContextCache front-end shared across all the parser contexts
 /// \param cspace is the constant address space used for minting constant Varnodes
-/// \param cachesize is the number of distinct ParserContext objects in this cache
-/// \param windowsize is the size of the ParserContext hash-table
-DisassemblyCache::DisassemblyCache(ContextCache *ccache,AddrSpace *cspace,int4 cachesize,int4 windowsize)
+/// \param size is the number of distinct ParserContext objects in this cache
+/// \param minreuse is the number of distinct addresses that must be held at once
+/// \param pol is the replacement policy
+DisassemblyCache::DisassemblyCache(ContextCache *ccache,AddrSpace *cspace,int4 size,int4 minreuse,int4 pol)
 
 {
   contextcache = ccache;
   constspace = cspace;
-  initialize(cachesize,windowsize);		// Set default settings for the cache
+  policy = pol;
+  initialize(minreuse,size);
 }
 
 /// Return a (possibly cached) ParserContext that is associated with \e addr
-/// If n different calls to this interface are made with n different Addresses, if
-///    - n <= minimumreuse   AND
-///    - all the addresses are within the windowsize (=mask+1)
-///
-/// then the cacher guarantees that you get all different ParserContext objects
+/// If n different calls to this interface are made with n different Addresses, and
+/// n <= minimumreuse, then the cacher guarantees that you get all different ParserContext objects
 /// \param addr is the Address to disassemble at
 /// \return the ParserContext associated with the address
 ParserContext *DisassemblyCache::getParserContext(const Address &addr)
 
 {
-  int4 hashindex = ((int4) addr.getOffset()) & mask;
-  ParserContext *res = hashtable[ hashindex ];
-  if (res->getAddr() == addr)
-    return res;
-  res = list[ nextfree ];
-  nextfree += 1;		// Advance the circular index
-  if (nextfree >= minimumreuse)
-    nextfree = 0;
-  res->setAddr(addr);
-  res->setParserState(ParserContext::uninitialized);	// Need to start over with parsing
-  hashtable[ hashindex ] = res;	// Stick it into the hashtable
-  return res;
+  return lookup(addr).pos;
+}
+
+/// Every parse is redone on its next use, as after a change to the default context.
+void DisassemblyCache::invalidate(void)
+
+{
+  for(int4 i=0;i<cachesize;++i)
+    list[i].pos->setParserState(ParserContext::uninitialized);
+}
+
+/// Parses are kept in the cache, but are redone on their next use.
+/// \param addr is the first modified byte
+/// \param size is the number of modified bytes
+void DisassemblyCache::invalidate(const Address &addr,int4 size)
+
+{
+  for(int4 i=0;i<cachesize;++i) {
+    ParserContext *pos = list[i].pos;
+    if (!list[i].hashed || pos->getParserState() == ParserContext::uninitialized) continue;
+    const Address &start(pos->getAddr());
+    if (start.getSpace() != addr.getSpace()) continue;
+    if (start.getOffset() < addr.getOffset() + size && addr.getOffset() < start.getOffset() + pos->getLength())
+      pos->setParserState(ParserContext::uninitialized);
+  }
+}
+
+/// An instruction is parsed with the context in effect at its starting address only, so
+/// a parse needs to be redone after a context change exactly when it starts in the changed range.
+/// \param range is the range of addresses whose context changed
+void DisassemblyCache::invalidate(const Range &range)
+
+{
+  for(int4 i=0;i<cachesize;++i) {
+    ParserContext *pos = list[i].pos;
+    if (!list[i].hashed || pos->getParserState() == ParserContext::uninitialized) continue;
+    if (range.contains(pos->getAddr()))
+      pos->setParserState(ParserContext::uninitialized);
+  }
+}
+
+/// \param size is the number of entries, rounded up to a power of 2
+/// \param csize is the number of words in a context blob
+TranslationCache::TranslationCache(int4 size,int4 csize)
+
+{
+  if (size < 1)
+    throw LowlevelError("Bad size for translation cache");
+  uint4 tablesize = 1;
+  while(tablesize < (uint4)size)
+    tablesize <<= 1;
+  mask = tablesize-1;
+  contextsize = csize;
+  table = new Entry[tablesize];
+  for(uint4 i=0;i<tablesize;++i)
+    table[i].space = (AddrSpace *)0;
+  curcontext.resize(contextsize);
+  found = (Entry *)0;
+  hits = 0;
+  misses = 0;
+}
+
+/// \brief Look for a cached translation of an instruction whose key matches
+///
+/// The instruction bytes and context blob at the address are fetched and compared with the entry.
+/// Bytes the image holds in memory are compared in place.  A match is emitted with replay(),
+/// which must be called before the cache is modified again.
+/// \param addr is the address of the instruction
+/// \param loader is the image to read the instruction bytes from
+/// \param ccache is the cache of context values
+/// \return the length of the instruction, 0 if there is no translation, or -1 if there was one
+/// for the same address and context but the bytes have changed since
+int4 TranslationCache::lookup(const Address &addr,LoadImage *loader,ContextCache *ccache)
+
+{
+  found = (Entry *)0;
+  Entry &entry(getEntry(addr));
+  if (entry.space != addr.getSpace() || entry.offset != addr.getOffset()) {
+    misses += 1;
+    return 0;
+  }
+  ccache->getContext(addr,curcontext.data());
+  for(int4 i=0;i<contextsize;++i) {
+    if (curcontext[i] != entry.context[i]) {
+      misses += 1;
+      return 0;
+    }
+  }
+  uintb avail;
+  const uint1 *bytes = loader->viewBytes(addr,avail);
+  if (bytes == (const uint1 *)0 || avail < entry.length) {
+    loader->loadFill(curbytes,entry.length,addr);	// Only the bytes the instruction covers
+    bytes = curbytes;
+  }
+  if (memcmp(bytes,entry.bytes,entry.length) != 0) {
+    entry.space = (AddrSpace *)0;
+    misses += 1;
+    return -1;
+  }
+  hits += 1;
+  found = &entry;
+  return entry.length;
+}
+
+/// \param addr is the address of the instruction
+/// \param emit is the emitter to replay the p-code to
+void TranslationCache::replay(const Address &addr,PcodeEmit &emit) const
+
+{
+  VarnodeData *vars = found->vars.data();
+  for(vector<Op>::const_iterator iter=found->ops.begin();iter!=found->ops.end();++iter) {
+    const Op &op(*iter);
+    VarnodeData *outvar = (op.outvar < 0) ? (VarnodeData *)0 : vars + op.outvar;
+    emit.dump(addr,op.opc,outvar,vars + op.invar,op.isize);
+  }
+}
+
+/// Replace the entry the address maps to with the p-code just built for the instruction.
+/// \param addr is the address of the instruction
+/// \param bytes are the instruction bytes the p-code was built from
+/// \param length is the length of the instruction in bytes
+/// \param ccache is the cache of context values
+/// \param pcode holds the p-code with relative branches resolved
+void TranslationCache::store(const Address &addr,const uint1 *bytes,int4 length,ContextCache *ccache,
+			     const PcodeCacher &pcode)
+
+{
+  if (length > (int4)sizeof(curbytes)) return;
+  Entry &entry(getEntry(addr));
+  entry.space = addr.getSpace();
+  entry.offset = addr.getOffset();
+  entry.length = length;
+  memcpy(entry.bytes,bytes,length);
+  entry.context.resize(contextsize);
+  ccache->getContext(addr,entry.context.data());
+  entry.ops.clear();
+  entry.vars.clear();			// Storage is kept, so replacing an entry rarely allocates
+  const vector<PcodeData> &issued(pcode.getIssued());
+  for(vector<PcodeData>::const_iterator iter=issued.begin();iter!=issued.end();++iter) {
+    const PcodeData &data(*iter);
+    Op op;
+    op.opc = data.opc;
+    op.outvar = -1;
+    if (data.outvar != (VarnodeData *)0) {
+      op.outvar = entry.vars.size();
+      entry.vars.push_back(*data.outvar);
+    }
+    op.invar = entry.vars.size();
+    op.isize = data.isize;
+    for(int4 i=0;i<data.isize;++i)
+      entry.vars.push_back(data.invar[i]);
+    entry.ops.push_back(op);
+  }
+}
+
+void TranslationCache::invalidate(void)
+
+{
+  for(uint4 i=0;i<=mask;++i)
+    table[i].space = (AddrSpace *)0;
+}
+
+/// \param addr is the first modified byte
+/// \param size is the number of modified bytes
+void TranslationCache::invalidate(const Address &addr,int4 size)
+
+{
+  for(uint4 i=0;i<=mask;++i) {
+    Entry &entry(table[i]);
+    if (entry.space != addr.getSpace()) continue;
+    if (entry.offset < addr.getOffset() + size && addr.getOffset() < entry.offset + entry.length)
+      entry.space = (AddrSpace *)0;
+  }
 }
 
 /// \param ld is the LoadImage to draw program bytes from
@@ -481,6 +761,33 @@ Sleigh::Sleigh(LoadImage *ld,ContextDatabase *c_db)
   context_db = c_db;
   cache = new ContextCache(c_db);
   discache = (DisassemblyCache *)0;
+  transcache = (TranslationCache *)0;
+  parser_cachesize = 0;
+  parser_policy = DisassemblyCache::lru;
+  translation_cachesize = 0;
+  fetchsize = 16;
+}
+
+/// The engine decodes using the specification held by \e lang instead of loading its own.
+/// initialize() must still be called, to register context variables and set up the caches.
+/// \param ld is the LoadImage to draw program bytes from
+/// \param c_db is the context database
+/// \param lang is the initialized, shared specification
+Sleigh::Sleigh(LoadImage *ld,ContextDatabase *c_db,const SleighLanguage *lang)
+  : SleighBase()
+
+{
+  loader = ld;
+  context_db = c_db;
+  cache = new ContextCache(c_db);
+  discache = (DisassemblyCache *)0;
+  transcache = (TranslationCache *)0;
+  parser_cachesize = 0;
+  parser_policy = DisassemblyCache::lru;
+  translation_cachesize = 0;
+  fetchsize = 16;
+  lock_guard<mutex> lock(lang->bindlock);
+  bindLanguage(lang);
 }
 
 void Sleigh::clearForDelete(void)
@@ -489,6 +796,8 @@ void Sleigh::clearForDelete(void)
   delete cache;
   if (discache != (DisassemblyCache *)0)
     delete discache;
+  if (transcache != (TranslationCache *)0)
+    delete transcache;
 }
 
 Sleigh::~Sleigh(void)
@@ -510,6 +819,7 @@ void Sleigh::reset(LoadImage *ld,ContextDatabase *c_db)
   context_db = c_db;
   cache = new ContextCache(c_db);
   discache = (DisassemblyCache *)0;
+  transcache = (TranslationCache *)0;
 }
 
 /// The .sla file from the document store is loaded and cache objects are prepared
@@ -525,13 +835,178 @@ void Sleigh::initialize(DocumentStorage &store)
   }
   else
     reregisterContext();
-  uint4 parser_cachesize = 2;
-  uint4 parser_windowsize = 32;
-  if ((maxdelayslotbytes > 1)||(unique_allocatemask != 0)) {
-    parser_cachesize = 8;
-    parser_windowsize = 256;
+  setFetchSize();
+  buildParserCache();
+  buildTranslationCache();
+}
+
+/// The .sla file is restored as it is read from the stream, without building its whole
+/// DOM tree first.  This is otherwise the same as initialize(DocumentStorage &).
+/// \param s is the stream positioned before the \<sleigh> tag
+void Sleigh::initialize(XmlStream &s)
+
+{
+  if (!isInitialized()) {
+    if (s.openElement() != "sleigh")
+      throw LowlevelError("Could not find sleigh tag");
+    restoreXml(s);
+    s.closeElement();
   }
-  discache = new DisassemblyCache(cache,getConstantSpace(),parser_cachesize,parser_windowsize);
+  else
+    reregisterContext();
+  setFetchSize();
+  buildParserCache();
+  buildTranslationCache();
+}
+
+/// Languages with short instructions, like most RISC processors, do not need the full 16 bytes
+/// a parse can look at.  Only enough bytes for the longest instruction that does not recurse
+/// through a table are fetched at first, along with the rest of the last word a pattern may test.
+void Sleigh::setFetchSize(void)
+
+{
+  fetchsize = getMaxInstructionLength();
+  if (fetchsize <= 0)
+    fetchsize = 16;
+  fetchsize += sizeof(uintm) - 1;
+  if (fetchsize > 16)
+    fetchsize = 16;
+}
+
+/// If the LoadImage holds enough of the bytes in memory, the parse reads them in place.
+/// Otherwise they are loaded into the buffer of the parse.  Either way the parse sees the
+/// same bytes, and any past them read as zero.
+/// \param pos is the parse, with its address set
+/// \param size is the number of bytes to fetch
+void Sleigh::fetchInstruction(ParserContext &pos,int4 size) const
+
+{
+  uintb avail;
+  const uint1 *bytes = loader->viewBytes(pos.getAddr(),avail);
+  if (bytes != (const uint1 *)0 && avail >= (uintb)size) {
+    pos.setBytes(bytes,size);
+    return;
+  }
+  loader->loadFill(pos.getBuffer(),size,pos.getAddr());
+  pos.fillBuffer(size);
+}
+
+/// The specification decides how many parses must be held at once, as delay slots and
+/// crossbuilds look up further instructions while one is being built. A larger size requested
+/// with setParserCache() is used if there is one.
+void Sleigh::buildParserCache(void)
+
+{
+  int4 minimumreuse = 2;
+  if ((maxdelayslotbytes > 1)||(unique_allocatemask != 0))
+    minimumreuse = 8;
+  int4 size = (parser_cachesize > minimumreuse) ? parser_cachesize : minimumreuse;
+  if (discache != (DisassemblyCache *)0)
+    delete discache;
+  discache = (DisassemblyCache *)0;
+  discache = new DisassemblyCache(cache,getConstantSpace(),size,minimumreuse,parser_policy);
+}
+
+/// Instructions that are revisited, by flow following for instance, are only parsed again
+/// once they have been evicted from the cache.  This can be called before or after initialize(),
+/// but any cached parses are lost.
+/// \param size is the number of parses to keep (0 for the smallest the specification allows)
+/// \param policy is the replacement policy, one of the DisassemblyCache policies
+void Sleigh::setParserCache(int4 size,int4 policy)
+
+{
+  if (size < 0)
+    throw LowlevelError("Bad size for disassembly cache");
+  if (policy < DisassemblyCache::roundrobin || policy > DisassemblyCache::clock)
+    throw LowlevelError("Unknown disassembly cache policy");
+  parser_cachesize = size;
+  parser_policy = policy;
+  if (discache != (DisassemblyCache *)0)
+    buildParserCache();
+}
+
+void Sleigh::buildTranslationCache(void)
+
+{
+  if (transcache != (TranslationCache *)0)
+    delete transcache;
+  transcache = (TranslationCache *)0;
+  if (translation_cachesize > 0)
+    transcache = new TranslationCache(translation_cachesize,context_db->getContextSize());
+}
+
+/// Instructions translated by oneInstruction() (or decodeInstruction()) are kept, and translating
+/// them again just replays their p-code, as long as their bytes and context have not changed.
+/// This can be called before or after initialize(), but any cached translations are lost.
+/// \param size is the number of instructions to keep (0 to disable the cache)
+void Sleigh::setTranslationCache(int4 size)
+
+{
+  if (size < 0)
+    throw LowlevelError("Bad size for translation cache");
+  translation_cachesize = size;
+  if (discache != (DisassemblyCache *)0)	// Already initialized
+    buildTranslationCache();
+}
+
+/// Changed bytes are caught anyway when a cached translation is replayed, but the
+/// parse of an instruction is reused as long as it stays cached.  Call this after
+/// writing to the program bytes, so instructions overlapping them are decoded again.
+/// \param addr is the first modified byte
+/// \param size is the number of modified bytes
+void Sleigh::invalidateBytes(const Address &addr,int4 size)
+
+{
+  if (discache != (DisassemblyCache *)0)
+    discache->invalidate(addr,size);
+  if (transcache != (TranslationCache *)0)
+    transcache->invalidate(addr,size);
+}
+
+/// The .sla file from the document store is loaded.  No context database is attached
+/// to a SleighLanguage, so context variables are registered by each bound Sleigh instead.
+/// \param store is the document store containing the main \<sleigh> tag.
+void SleighLanguage::initialize(DocumentStorage &store)
+
+{
+  if (isInitialized())
+    throw LowlevelError("Specification is already loaded");
+  const Element *el = store.getTag("sleigh");
+  if (el == (const Element *)0)
+    throw LowlevelError("Could not find sleigh tag");
+  restoreXml(el);
+}
+
+/// The .sla file is restored as it is read from the stream, without building its whole
+/// DOM tree first.
+/// \param s is the stream positioned before the \<sleigh> tag
+void SleighLanguage::initialize(XmlStream &s)
+
+{
+  if (isInitialized())
+    throw LowlevelError("Specification is already loaded");
+  if (s.openElement() != "sleigh")
+    throw LowlevelError("Could not find sleigh tag");
+  restoreXml(s);
+  s.closeElement();
+}
+
+int4 SleighLanguage::instructionLength(const Address &baseaddr) const
+
+{
+  throw LowlevelError("SleighLanguage cannot decode: bind a Sleigh engine to it");
+}
+
+int4 SleighLanguage::oneInstruction(PcodeEmit &emit,const Address &baseaddr) const
+
+{
+  throw LowlevelError("SleighLanguage cannot decode: bind a Sleigh engine to it");
+}
+
+int4 SleighLanguage::printAssembly(AssemblyEmit &emit,const Address &baseaddr) const
+
+{
+  throw LowlevelError("SleighLanguage cannot decode: bind a Sleigh engine to it");
 }
 
 /// \brief Obtain a parse tree for the instruction at the given address
@@ -561,11 +1036,30 @@ ParserContext *Sleigh::obtainContext(const Address &addr,int4 state) const
 }
 
 /// Resolve \e all the constructors involved in the instruction at the indicated address
+///
+/// Only the first few bytes of the instruction are fetched at first (see setFetchSize()).  If the
+/// parse read past them, because the instruction is longer or could only be told apart from a
+/// longer one by the bytes that were not fetched, it is done again with all 16 bytes.
 /// \param pos is the parse object that will hold the resulting tree
 void Sleigh::resolve(ParserContext &pos) const
 
 {
-  loader->loadFill(pos.getBuffer(),16,pos.getAddr());
+  fetchInstruction(pos,fetchsize);
+  if (fetchsize < 16) {
+    try {
+      resolveConstructors(pos);
+      if (!pos.isOverrun() && pos.getLength() <= fetchsize)
+	return;
+    } catch(ShortFetchError &err) {}	// Resolved again below, with all the bytes
+    fetchInstruction(pos,16);
+  }
+  resolveConstructors(pos);
+}
+
+/// \param pos is the parse object, with the instruction bytes fetched
+void Sleigh::resolveConstructors(ParserContext &pos) const
+
+{
   ParserWalkerChange walker(&pos);
   pos.deallocateState(walker);	// Clear the previous resolve and initialize the walker
   Constructor *ct,*subct;
@@ -675,48 +1169,76 @@ int4 Sleigh::instructionLength(const Address &baseaddr) const
   return pos->getLength();
 }
 
-int4 Sleigh::printAssembly(AssemblyEmit &emit,const Address &baseaddr) const
+/// \param addr is the address of the instruction about to be decoded
+void Sleigh::checkAlignment(const Address &addr) const
 
 {
-  int4 sz;
+  if (alignment != 1) {
+    if ((addr.getOffset() % alignment)!=0) {
+      ostringstream s;
+      s << "Instruction address not aligned: " << addr;
+      throw UnimplError(s.str(),0);
+    }
+  }
+}
 
-  ParserContext *pos = obtainContext(baseaddr,ParserContext::disassembly);
+/// The parse tree must be in at least the ParserContext::disassembly state.
+/// \param emit is the emitter receiving the mnemonic and body strings
+/// \param pos is the parse tree for the instruction
+void Sleigh::emitAssembly(AssemblyEmit &emit,ParserContext *pos) const
+
+{
   ParserWalker walker(pos);
   walker.baseState();
   
   Constructor *ct = walker.getConstructor();
-  ostringstream mons;
-  ct->printMnemonic(mons,walker);
-  ostringstream body;
-  ct->printBody(body,walker);
-  emit.dump(baseaddr,mons.str(),body.str());
-  sz = pos->getLength();
-  return sz;
+  printbuf.clear();
+  ct->printMnemonic(printbuf,walker);
+  int4 bodystart = printbuf.size();
+  ct->printBody(printbuf,walker);
+  emit.dump(pos->getAddr(),printbuf.str(0,bodystart),printbuf.str(bodystart,printbuf.size()));
 }
 
-int4 Sleigh::oneInstruction(PcodeEmit &emit,const Address &baseaddr) const
+/// Context committed by an instruction changes how instructions at other addresses decode.
+/// Only the cached parses starting where a value actually changed are redone; the ranges
+/// are collected by the ContextCache as the commits are applied.
+void Sleigh::invalidateContextChanges(void) const
+
+{
+  const vector<Range> &changes(cache->getChanges());
+  if (changes.empty()) return;
+  for(uint4 i=0;i<changes.size();++i)
+    discache->invalidate(changes[i]);
+  cache->clearChanges();
+}
+
+/// The parse tree must be in the ParserContext::pcode state. Context commits are
+/// applied, any delay slot instructions are obtained, and the constructor templates
+/// are built and passed to the emitter.
+/// \param emit is the emitter receiving the p-code
+/// \param pos is the parse tree for the instruction
+/// \param lengths if not null, receives the length of the instruction and of each delay slot instruction
+/// \return the length of the instruction in bytes, including any delay slots
+int4 Sleigh::emitPcode(PcodeEmit &emit,ParserContext *pos,vector<int4> *lengths) const
 
 {
   int4 fallOffset;
-  if (alignment != 1) {
-    if ((baseaddr.getOffset() % alignment)!=0) {
-      ostringstream s;
-      s << "Instruction address not aligned: " << baseaddr;
-      throw UnimplError(s.str(),0);
-    }
-  }
-  
-  ParserContext *pos = obtainContext(baseaddr,ParserContext::pcode);
   pos->applyCommits();
+  invalidateContextChanges();
   fallOffset = pos->getLength();
-  
+  if (lengths != (vector<int4> *)0)
+    lengths->push_back(fallOffset);
+
   if (pos->getDelaySlot()>0) {
     int4 bytecount = 0;
     do {
     // Do not pass pos->getNaddr() to obtainContext, as pos may have been previously cached and had naddr adjusted
       ParserContext *delaypos = obtainContext(pos->getAddr() + fallOffset,ParserContext::pcode);
       delaypos->applyCommits();
+      invalidateContextChanges();
       int4 len = delaypos->getLength();
+      if (lengths != (vector<int4> *)0)
+	lengths->push_back(len);
       fallOffset += len;
       bytecount += len;
     } while(bytecount < pos->getDelaySlot());
@@ -729,7 +1251,10 @@ int4 Sleigh::oneInstruction(PcodeEmit &emit,const Address &baseaddr) const
   try {
     builder.build(walker.getConstructor()->getTempl(),-1);
     pcode_cache.resolveRelatives();
-    pcode_cache.emit(baseaddr,&emit);
+    pcode_cache.emit(pos->getAddr(),&emit);
+    if (transcache != (TranslationCache *)0 && pos->getDelaySlot() == 0 && pos->numCommits() == 0 &&
+	builder.isSelfContained())
+      transcache->store(pos->getAddr(),pos->getBytes(),fallOffset,cache,pcode_cache);
   } catch(UnimplError &err) {
     ostringstream s;
     s << "Instruction not implemented in pcode:\n ";
@@ -737,10 +1262,11 @@ int4 Sleigh::oneInstruction(PcodeEmit &emit,const Address &baseaddr) const
     cur->baseState();
     Constructor *ct = cur->getConstructor();
     cur->getAddr().printRaw(s);
-    s << ": ";
-    ct->printMnemonic(s,*cur);
-    s << "  ";
-    ct->printBody(s,*cur);
+    PrintBuffer text;
+    ct->printMnemonic(text,*cur);
+    text << "  ";
+    ct->printBody(text,*cur);
+    s << ": " << text.str();
     err.explain = s.str();
     err.instruction_length = fallOffset;
     throw err;
@@ -748,6 +1274,174 @@ int4 Sleigh::oneInstruction(PcodeEmit &emit,const Address &baseaddr) const
   return fallOffset;
 }
 
+int4 Sleigh::printAssembly(AssemblyEmit &emit,const Address &baseaddr) const
+
+{
+  ParserContext *pos = obtainContext(baseaddr,ParserContext::disassembly);
+  emitAssembly(emit,pos);
+  return pos->getLength();
+}
+
+/// \brief Disassemble a single instruction, appending its text to a buffer
+///
+/// The mnemonic is appended followed directly by the body.  Nothing else is allocated, so
+/// a listing can be produced by calling this repeatedly on the same buffer.
+/// \param buf is the buffer receiving the text
+/// \param bodystart is set to the position in the buffer where the body starts
+/// \param baseaddr is the address of the instruction
+/// \return the length of the instruction in bytes
+int4 Sleigh::printAssembly(PrintBuffer &buf,int4 &bodystart,const Address &baseaddr) const
+
+{
+  ParserContext *pos = obtainContext(baseaddr,ParserContext::disassembly);
+  ParserWalker walker(pos);
+  walker.baseState();
+  Constructor *ct = walker.getConstructor();
+  int4 start = buf.size();
+  try {
+    ct->printMnemonic(buf,walker);
+    bodystart = buf.size();
+    ct->printBody(buf,walker);
+  } catch(...) {
+    buf.truncate(start);	// Don't leave part of the instruction behind
+    throw;
+  }
+  return pos->getLength();
+}
+
+/// If the bytes of a cached translation have changed, the parse of the instruction is dropped too,
+/// so the instruction is parsed again from its new bytes.
+/// \param addr is the address of the instruction
+/// \return the length of the instruction, or 0 if it has to be translated
+int4 Sleigh::findTranslation(const Address &addr) const
+
+{
+  int4 length = transcache->lookup(addr,loader,cache);
+  if (length < 0) {
+    discache->invalidate(addr,1);
+    length = 0;
+  }
+  return length;
+}
+
+/// \param emit is the emitter receiving the p-code
+/// \param addr is the address of the instruction
+/// \return the length of the instruction, or 0 if it has to be translated
+int4 Sleigh::replayTranslation(PcodeEmit &emit,const Address &addr) const
+
+{
+  int4 length = findTranslation(addr);
+  if (length != 0)
+    transcache->replay(addr,emit);
+  return length;
+}
+
+/// The translation cache is checked before the instruction is parsed, so that a parse made
+/// from bytes that have changed since is never printed along with the p-code of the new bytes.
+/// \param asmemit is the emitter receiving the assembly
+/// \param pcodeemit is the emitter receiving the p-code
+/// \param addr is the address of the instruction
+/// \return the length of the instruction, or 0 if it has to be translated
+int4 Sleigh::replayDecoded(AssemblyEmit &asmemit,PcodeEmit &pcodeemit,const Address &addr) const
+
+{
+  int4 length = findTranslation(addr);
+  if (length != 0) {
+    emitAssembly(asmemit,obtainContext(addr,ParserContext::disassembly));
+    transcache->replay(addr,pcodeemit);
+  }
+  return length;
+}
+
+int4 Sleigh::oneInstruction(PcodeEmit &emit,const Address &baseaddr) const
+
+{
+  checkAlignment(baseaddr);
+  if (transcache != (TranslationCache *)0) {
+    int4 length = replayTranslation(emit,baseaddr);
+    if (length != 0)
+      return length;
+  }
+  ParserContext *pos = obtainContext(baseaddr,ParserContext::pcode);
+  return emitPcode(emit,pos,(vector<int4> *)0);
+}
+
+/// This is the same as the basic oneInstruction(), but the length of each instruction translated
+/// is reported. The first entry is the instruction at the given address, and any others are the
+/// instructions in its delay slot, in address order. Their p-code is all emitted as part of the
+/// first instruction, and their parses are left in the parser cache, so they can be disassembled
+/// afterward without being decoded a second time.
+/// \param emit is the emitter receiving the p-code
+/// \param baseaddr is the address of the instruction
+/// \param lengths is cleared and then receives the instruction lengths
+/// \return the length of the instruction in bytes, including any delay slots
+int4 Sleigh::oneInstruction(PcodeEmit &emit,const Address &baseaddr,vector<int4> &lengths) const
+
+{
+  lengths.clear();
+  checkAlignment(baseaddr);
+  if (transcache != (TranslationCache *)0) {
+    int4 length = replayTranslation(emit,baseaddr);	// Instructions with delay slots are never cached
+    if (length != 0) {
+      lengths.push_back(length);
+      return length;
+    }
+  }
+  ParserContext *pos = obtainContext(baseaddr,ParserContext::pcode);
+  return emitPcode(emit,pos,&lengths);
+}
+
+/// \brief Disassemble and translate a single instruction from one parse
+///
+/// This is equivalent to calling printAssembly() followed by oneInstruction(), except that
+/// the parse is obtained from the cache only once, already prepared for p-code generation,
+/// and both the assembly and the p-code are emitted from that same ParserContext.
+/// \param asmemit is the emitter receiving the assembly
+/// \param pcodeemit is the emitter receiving the p-code
+/// \param baseaddr is the address of the instruction
+/// \return the length of the instruction in bytes, not including any delay slots
+int4 Sleigh::decodeInstruction(AssemblyEmit &asmemit,PcodeEmit &pcodeemit,const Address &baseaddr) const
+
+{
+  checkAlignment(baseaddr);
+  if (transcache != (TranslationCache *)0) {
+    int4 length = replayDecoded(asmemit,pcodeemit,baseaddr);
+    if (length != 0)
+      return length;
+  }
+  ParserContext *pos = obtainContext(baseaddr,ParserContext::pcode);	// One lookup serves both outputs
+  int4 length = pos->getLength();
+  emitAssembly(asmemit,pos);
+  emitPcode(pcodeemit,pos,(vector<int4> *)0);
+  return length;
+}
+
+/// This is the same as the basic decodeInstruction(), but the length of each instruction translated
+/// is reported as with oneInstruction(). Only the first instruction is disassembled. The delay slot
+/// instructions can be disassembled with printAssembly(), which reuses their cached parse.
+/// \param asmemit is the emitter receiving the assembly
+/// \param pcodeemit is the emitter receiving the p-code
+/// \param baseaddr is the address of the instruction
+/// \param lengths is cleared and then receives the instruction lengths
+/// \return the length of the instruction in bytes, including any delay slots
+int4 Sleigh::decodeInstruction(AssemblyEmit &asmemit,PcodeEmit &pcodeemit,const Address &baseaddr,
+			       vector<int4> &lengths) const
+
+{
+  lengths.clear();
+  checkAlignment(baseaddr);
+  if (transcache != (TranslationCache *)0) {
+    int4 length = replayDecoded(asmemit,pcodeemit,baseaddr);	// Instructions with delay slots are never cached
+    if (length != 0) {
+      lengths.push_back(length);
+      return length;
+    }
+  }
+  ParserContext *pos = obtainContext(baseaddr,ParserContext::pcode);
+  emitAssembly(asmemit,pos);
+  return emitPcode(pcodeemit,pos,&lengths);
+}
+
 void Sleigh::registerContext(const string &name,int4 sbit,int4 ebit)
 
 {
@@ -758,6 +1452,11 @@ void Sleigh::setContextDefault(const string &name,uintm val)
 
 {
   context_db->setVariableDefault(name,val);
+  cache->invalidate();
+  if (discache != (DisassemblyCache *)0)
+    discache->invalidate();
+  if (transcache != (TranslationCache *)0)
+    transcache->invalidate();
 }
 
 void Sleigh::allowContextSet(bool val) const
@@ -20,6 +20,7 @@
 #define __SLEIGH__
 
 #include "sleighbase.hh"
+#include <mutex>
 
 class LoadImage;
 
@@ -94,6 +95,7 @@ public:
   void clear(void);			///< Reset the cache so that all objects are unallocated
   void resolveRelatives(void);		///< Rewrite branch target Varnodes as \e relative offsets
   void emit(const Address &addr,PcodeEmit *emt) const;	///< Pass the cached p-code data to the emitter
+  const vector<PcodeData> &getIssued(void) const { return issued; }	///< Get the p-code ops issued so far
 };
 
 /// \brief A container for disassembly context used by the SLEIGH engine
@@ -102,20 +104,117 @@ public:
 /// a single instruction.  These all share a ContextCache which is a front end for
 /// accessing the ContextDatabase and resolving context variables from the SLEIGH spec.
 /// ParserContext objects are stored in a hash-table keyed by the address of the instruction.
+///
+/// The number of ParserContext objects is fixed when the cache is built. When an address is not
+/// in the cache, one of the objects is reused according to the replacement \e policy, and the
+/// parse it was holding is lost.  Whatever the policy, the last \e minimumreuse distinct addresses
+/// requested are never reused, which is what delay slot and crossbuild processing relies on.
 class DisassemblyCache {
+public:
+  /// \brief Policies for choosing the ParserContext to reuse
+  enum {
+    roundrobin = 0,		///< Reuse objects in circular order, regardless of use
+    lru = 1,			///< Reuse the least recently used object
+    clock = 2			///< Reuse an object not used since the last sweep of the clock hand
+  };
+private:
+  /// \brief A slot in the cache holding one ParserContext
+  struct Entry {
+    ParserContext *pos;		///< The cached parse
+    int4 hashnext;		///< Next entry in the same hash bucket (-1 for end of chain)
+    int4 prev;			///< Next more recently used entry (-1 if most recent)
+    int4 next;			///< Next less recently used entry (-1 if least recent)
+    uint4 lastuse;		///< Value of the request counter when the entry was last used
+    bool referenced;		///< Has the entry been used since the clock hand last passed it
+    bool hashed;		///< Is the entry in the hash-table
+  };
   ContextCache *contextcache;	///< Cached values from the ContextDatabase
   AddrSpace *constspace;	///< The constant address space
+  int4 policy;			///< The replacement policy
   int4 minimumreuse;		///< Can call getParserContext this many times, before a ParserContext is reused
+  int4 cachesize;		///< Number of ParserContext objects
   uint4 mask;			///< Size of the hashtable in form 2^n-1
-  ParserContext **list;		///< (circular) array of currently cached ParserContext objects
-  int4 nextfree;		///< Current end/beginning of circular list
-  ParserContext **hashtable;	///< Hashtable for looking up ParserContext via Address
-  void initialize(int4 min,int4 hashsize);	///< Initialize the hash-table of ParserContexts
+  Entry *list;			///< Array of cached ParserContext objects
+  int4 *hashtable;		///< Hashtable for looking up an entry via Address (heads of the chains)
+  int4 nextfree;		///< Clock hand, or next entry to reuse for \e roundrobin
+  int4 mostrecent;		///< Head of the recency list
+  int4 leastrecent;		///< Tail of the recency list
+  uint4 requests;		///< Number of lookups so far (wrapping)
+  uintb hits;			///< Number of lookups that found the address cached
+  uintb misses;			///< Number of lookups that needed a new parse
+  void initialize(int4 min,int4 size);	///< Initialize the hash-table of ParserContexts
   void free(void);		///< Free the hash-table of ParserContexts
+  uint4 hashAddress(const Address &addr) const;	///< Get the hash bucket for an address
+  void unhash(int4 i);		///< Remove an entry from the hash-table
+  void touch(int4 i);		///< Mark an entry as used by the current request
+  int4 findVictim(void);	///< Choose the entry to reuse
+  Entry &lookup(const Address &addr);	///< Find or allocate the entry for an address
 public:
-  DisassemblyCache(ContextCache *ccache,AddrSpace *cspace,int4 cachesize,int4 windowsize);	///< Constructor
+  DisassemblyCache(ContextCache *ccache,AddrSpace *cspace,int4 size,int4 minreuse,int4 pol);	///< Constructor
   ~DisassemblyCache(void) { free(); }	///< Destructor
   ParserContext *getParserContext(const Address &addr);		///< Get the parser for a particular Address
+  int4 getSize(void) const { return cachesize; }		///< Get the number of ParserContext objects
+  int4 getPolicy(void) const { return policy; }			///< Get the replacement policy
+  uintb getHits(void) const { return hits; }			///< Get the number of lookups that found a cached parse
+  uintb getMisses(void) const { return misses; }		///< Get the number of lookups that allocated a new parse
+  void resetStats(void) { hits = 0; misses = 0; }		///< Reset the hit and miss counters
+  void invalidate(void);				///< Discard all parses
+  void invalidate(const Address &addr,int4 size);	///< Discard parses of instructions overlapping a range of bytes
+  void invalidate(const Range &range);			///< Discard parses of instructions starting in a range
+};
+
+/// \brief A cache of the finished p-code of recently translated instructions
+///
+/// Building p-code from the constructor templates dominates the cost of translating an instruction
+/// that is already parsed, and emulators translate the same loop bodies over and over.  This keeps
+/// the p-code (with relative branches resolved) of a fixed number of instructions, so it can be
+/// replayed straight to the emitter without parsing or building.
+///
+/// An entry is keyed by the address of the instruction, the context blob in effect at the address
+/// and the instruction bytes.  All three are compared on every lookup, so a change to the context
+/// or to the program bytes is never replayed stale.  Only instructions whose p-code depends on nothing
+/// else are stored: anything with a delay slot, a crossbuild or a global context change is translated
+/// every time.  The table is direct-mapped on the address, so its memory is bounded by the number
+/// of entries.
+class TranslationCache {
+  /// \brief A p-code op of a cached instruction, referring to its Varnodes by index
+  struct Op {
+    OpCode opc;			///< The op code
+    int4 outvar;		///< Index of the output Varnode (-1 if there is none)
+    int4 invar;			///< Index of the first input Varnode
+    int4 isize;			///< Number of input Varnodes
+  };
+  /// \brief The translation of one instruction
+  struct Entry {
+    AddrSpace *space;		///< Address space of the instruction (null if the entry is empty)
+    uintb offset;		///< Offset of the instruction
+    int4 length;		///< Length of the instruction in bytes
+    uint1 bytes[16];		///< The instruction bytes (only \b length are meaningful)
+    vector<uintm> context;	///< Context blob the instruction was parsed with
+    vector<Op> ops;		///< The p-code ops in order
+    vector<VarnodeData> vars;	///< The Varnodes of all the ops
+  };
+  int4 contextsize;		///< Number of words in a context blob
+  uint4 mask;			///< Number of entries in form 2^n-1
+  Entry *table;			///< The entries, indexed by hashed address
+  vector<uintm> curcontext;	///< Context blob of the current lookup
+  uint1 curbytes[16];		///< Instruction bytes of the current lookup, if they had to be loaded
+  Entry *found;			///< Entry matched by the last lookup() (null if there was none)
+  uintb hits;			///< Number of lookups replayed from the cache
+  uintb misses;			///< Number of lookups that needed a translation
+  Entry &getEntry(const Address &addr) const { return table[(addr.getOffset() ^ (addr.getOffset()>>16)) & mask]; }	///< Get the entry an address maps to
+public:
+  TranslationCache(int4 size,int4 csize);			///< Constructor
+  ~TranslationCache(void) { delete [] table; }			///< Destructor
+  int4 lookup(const Address &addr,LoadImage *loader,ContextCache *ccache);
+  void replay(const Address &addr,PcodeEmit &emit) const;	///< Emit the p-code found by the last lookup()
+  void store(const Address &addr,const uint1 *bytes,int4 length,ContextCache *ccache,const PcodeCacher &pcode);
+  void invalidate(void);					///< Discard all translations
+  void invalidate(const Address &addr,int4 size);		///< Discard translations of instructions overlapping a range of bytes
+  int4 getSize(void) const { return mask+1; }			///< Get the number of entries
+  uintb getHits(void) const { return hits; }			///< Get the number of lookups replayed from the cache
+  uintb getMisses(void) const { return misses; }		///< Get the number of lookups that needed a translation
+  void resetStats(void) { hits = 0; misses = 0; }		///< Reset the hit and miss counters
 };
 
 /// \brief Build p-code from a pre-parsed instruction
@@ -133,6 +232,7 @@ class SleighBuilder : public PcodeBuilder {
   uintb uniqueoffset;			///< Uniquifier bits for \b this instruction
   DisassemblyCache *discache;		///< Cache of disassembled instructions
   PcodeCacher *cache;			///< Cache accumulating p-code data for the instruction
+  bool selfcontained;			///< Is the p-code built only from the instruction's own parse
   void buildEmpty(Constructor *ct,int4 secnum);
   void generateLocation(const VarnodeTpl *vntpl,VarnodeData &vn);
   AddrSpace *generatePointer(const VarnodeTpl *vntpl,VarnodeData &vn);
@@ -143,6 +243,27 @@ public:
   virtual void delaySlot(OpTpl *op);
   virtual void setLabel(OpTpl *op);
   virtual void appendCrossBuild(OpTpl *bld,int4 secnum);
+  bool isSelfContained(void) const { return selfcontained; }	///< Was the p-code built without delay slots or crossbuilds
+};
+
+/// \brief A loaded SLEIGH specification that can be shared by many Sleigh engines
+///
+/// This holds the immutable part of the engine: the symbol table, the decision trees,
+/// the constructor templates and the address spaces, restored once from a .sla file via
+/// initialize().  It cannot disassemble by itself.  Instead, any number of Sleigh objects, each with
+/// its own LoadImage, ContextDatabase and caches, can be bound to it.  Disassembly and
+/// p-code generation only read from the shared specification, so the bound engines can be
+/// used on different threads at the same time.  The SleighLanguage must outlive every
+/// engine bound to it.
+class SleighLanguage : public SleighBase {
+  friend class Sleigh;
+  mutable mutex bindlock;		///< Serializes binding of new engines
+public:
+  virtual void initialize(DocumentStorage &store);
+  void initialize(XmlStream &s);	///< Load the .sla file straight from a stream
+  virtual int4 instructionLength(const Address &baseaddr) const;
+  virtual int4 oneInstruction(PcodeEmit &emit,const Address &baseaddr) const;
+  virtual int4 printAssembly(AssemblyEmit &emit,const Address &baseaddr) const;
 };
 
 /// \brief A full SLEIGH engine
@@ -155,28 +276,63 @@ public:
 ///
 /// P-code is produced via the oneInstruction() method, provided with a PcodeEmit
 /// object and an Address.
+///
+/// Both can be produced together from a single parse via the decodeInstruction() method.
+///
+/// The engine either loads its own copy of the specification in initialize(), or is
+/// constructed bound to a shared SleighLanguage, in which case initialize() only sets up
+/// the context and caches.
 class Sleigh : public SleighBase {
   LoadImage *loader;			///< The mapped bytes in the program
   ContextDatabase *context_db;		///< Database of context values steering disassembly
   ContextCache *cache;			///< Cache of recently used context values
   mutable DisassemblyCache *discache;	///< Cache of recently parsed instructions
+  TranslationCache *transcache;		///< Cache of recently translated instructions (null if disabled)
+  mutable PrintBuffer printbuf;		///< Scratch space for printing instructions
+  int4 parser_cachesize;		///< Requested number of cached parses (0 for the default)
+  int4 parser_policy;			///< Replacement policy for cached parses
+  int4 translation_cachesize;		///< Number of cached translations (0 to disable the cache)
+  int4 fetchsize;			///< Number of bytes fetched to parse an instruction, at first
   mutable PcodeCacher pcode_cache;	///< Cache of p-code data just prior to emitting
   void clearForDelete(void);		///< Delete the context and disassembly caches
+  void buildParserCache(void);		///< Build the disassembly cache from the current settings
+  void buildTranslationCache(void);	///< Build the translation cache from the current settings
+  void setFetchSize(void);		///< Load only as many bytes as most instructions need
+  void fetchInstruction(ParserContext &pos,int4 size) const;	///< Get the bytes of the instruction to parse
+  void resolveConstructors(ParserContext &pos) const;	///< Build the parse tree from the fetched bytes
+  int4 findTranslation(const Address &addr) const;	///< Look up the cached translation of an instruction
+  int4 replayTranslation(PcodeEmit &emit,const Address &addr) const;	///< Emit cached p-code for an instruction, if there is any
+  int4 replayDecoded(AssemblyEmit &asmemit,PcodeEmit &pcodeemit,const Address &addr) const;	///< Emit assembly and cached p-code for an instruction
+  void invalidateContextChanges(void) const;	///< Discard parses made stale by committed context changes
 protected:
   ParserContext *obtainContext(const Address &addr,int4 state) const;
   void resolve(ParserContext &pos) const;	///< Generate a parse tree suitable for disassembly
   void resolveHandles(ParserContext &pos) const;	///< Prepare the parse tree for p-code generation
+  void checkAlignment(const Address &addr) const;	///< Throw if the address is not aligned for an instruction
+  void emitAssembly(AssemblyEmit &emit,ParserContext *pos) const;	///< Print assembly from a resolved parse tree
+  int4 emitPcode(PcodeEmit &emit,ParserContext *pos,vector<int4> *lengths) const;	///< Generate p-code from a handle-resolved parse tree
 public:
   Sleigh(LoadImage *ld,ContextDatabase *c_db);		///< Constructor
+  Sleigh(LoadImage *ld,ContextDatabase *c_db,const SleighLanguage *lang);	///< Construct bound to a shared specification
   virtual ~Sleigh(void);				///< Destructor
   void reset(LoadImage *ld,ContextDatabase *c_db);	///< Reset the engine for a new program
   virtual void initialize(DocumentStorage &store);
+  void initialize(XmlStream &s);	///< Load the .sla file straight from a stream
   virtual void registerContext(const string &name,int4 sbit,int4 ebit);
   virtual void setContextDefault(const string &nm,uintm val);
   virtual void allowContextSet(bool val) const;
   virtual int4 instructionLength(const Address &baseaddr) const;
   virtual int4 oneInstruction(PcodeEmit &emit,const Address &baseaddr) const;
+  int4 oneInstruction(PcodeEmit &emit,const Address &baseaddr,vector<int4> &lengths) const;	///< Translate an instruction together with its delay slot
   virtual int4 printAssembly(AssemblyEmit &emit,const Address &baseaddr) const;
+  int4 decodeInstruction(AssemblyEmit &asmemit,PcodeEmit &pcodeemit,const Address &baseaddr) const;
+  int4 decodeInstruction(AssemblyEmit &asmemit,PcodeEmit &pcodeemit,const Address &baseaddr,vector<int4> &lengths) const;	///< Decode an instruction together with its delay slot
+  int4 printAssembly(PrintBuffer &buf,int4 &bodystart,const Address &baseaddr) const;
+  void setParserCache(int4 size,int4 policy);	///< Configure the cache of parsed instructions
+  const DisassemblyCache *getParserCache(void) const { return discache; }	///< Get the cache of parsed instructions
+  void setTranslationCache(int4 size);	///< Configure the cache of translated instructions
+  const TranslationCache *getTranslationCache(void) const { return transcache; }	///< Get the cache of translated instructions (if enabled)
+  void invalidateBytes(const Address &addr,int4 size);	///< Forget what was decoded from a range of modified bytes
 };
 
 /** \page sleigh SLEIGH
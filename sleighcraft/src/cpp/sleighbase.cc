@@ -64,8 +64,11 @@ SleighBase::SleighBase(void)
 {
   root = (SubtableSymbol *)0;
   maxdelayslotbytes = 0;
+  maxinstlength = 0;
   unique_allocatemask = 0;
   numSections = 0;
+  contextcommits = false;
+  language = (const SleighBase *)0;
 }
 
 /// Assuming the symbol table is populated, iterate through the table collecting
@@ -109,7 +112,7 @@ void SleighBase::buildXrefs(vector<string> &errorPairs)
 void SleighBase::reregisterContext(void)
 
 {
-  SymbolScope *glb = symtab.getGlobalScope();
+  SymbolScope *glb = getLanguage()->symtab.getGlobalScope();
   SymbolTree::const_iterator iter;
   SleighSymbol *sym;
   for(iter=glb->begin();iter!=glb->end();++iter) {
@@ -124,9 +127,38 @@ void SleighBase::reregisterContext(void)
   }
 }
 
+/// Instead of restoring its own copy of a .sla file, \b this is set up to decode
+/// with the symbol table, decision trees and constructor templates owned by \e lang.
+/// Address spaces are shared by reference. Only the small per-processor settings are copied.
+/// The other SleighBase must be fully initialized and must outlive \b this.
+/// \param lang is the initialized SleighBase owning the specification
+void SleighBase::bindLanguage(const SleighBase *lang)
+
+{
+  if (isInitialized())
+    throw LowlevelError("Specification is already loaded");
+  if (!lang->isInitialized())
+    throw LowlevelError("Cannot bind to an uninitialized specification");
+  lang = lang->getLanguage();
+  setBigEndian(lang->isBigEndian());
+  setUniqueBase(lang->getUniqueBase());
+  alignment = lang->alignment;
+  floatformats = lang->floatformats;
+  copySpaces(lang);
+  maxdelayslotbytes = lang->maxdelayslotbytes;
+  maxinstlength = lang->maxinstlength;
+  unique_allocatemask = lang->unique_allocatemask;
+  numSections = lang->numSections;
+  contextcommits = lang->contextcommits;
+  language = lang;
+  root = lang->root;
+}
+
 void SleighBase::addRegister(const string &nm,AddrSpace *base,uintb offset,int4 size)
 
 {
+  if (language != (const SleighBase *)0)
+    throw LowlevelError("Cannot add register to a shared specification: "+nm);
   VarnodeSymbol *sym = new VarnodeSymbol(nm,base,offset,size);
   symtab.addSymbol(sym);
 }
@@ -145,6 +177,8 @@ const VarnodeData &SleighBase::getRegister(const string &nm) const
 string SleighBase::getRegisterName(AddrSpace *base,uintb off,int4 size) const
 
 {
+  if (language != (const SleighBase *)0)
+    return language->getRegisterName(base,off,size);
   VarnodeData sym;
   sym.space = base;
   sym.offset = off;
@@ -171,12 +205,20 @@ string SleighBase::getRegisterName(AddrSpace *base,uintb off,int4 size) const
 void SleighBase::getAllRegisters(map<VarnodeData,string> &reglist) const
 
 {
+  if (language != (const SleighBase *)0) {
+    language->getAllRegisters(reglist);
+    return;
+  }
   reglist = varnode_xref;
 }
 
 void SleighBase::getUserOpNames(vector<string> &res) const
 
 {
+  if (language != (const SleighBase *)0) {
+    language->getUserOpNames(res);
+    return;
+  }
   res = userop;		// Return list of all language defined user ops (with index)
 }
 
@@ -217,11 +259,13 @@ void SleighBase::saveXml(ostream &s) const
 }
 
 /// This parses the main \<sleigh> tag (from a .sla file), which includes the description
-/// of address spaces and the symbol table, with its associated decoding tables
+/// of address spaces and the symbol table, with its associated decoding tables.
+/// The symbols, patterns and templates are allocated from the arena of \b this.
 /// \param el is the root XML element
 void SleighBase::restoreXml(const Element *el)
 
 {
+  SleighArena::Scope scope(&arena);
   maxdelayslotbytes = 0;
   unique_allocatemask = 0;
   numSections = 0;
@@ -278,7 +322,116 @@ void SleighBase::restoreXml(const Element *el)
   restoreXmlSpaces(*iter,this);
   iter++;
   symtab.restoreXml(*iter,this);
+  restoreXmlTail();
+}
+
+/// This is the same as restoreXml(const Element *), but the specification is read as it
+/// is parsed instead of from a whole DOM tree. Only small pieces, like the address spaces
+/// or a single p-code template, are ever built as Element trees.
+/// \param s is the stream, with the \<sleigh> tag as its current element
+void SleighBase::restoreXml(XmlStream &s)
+
+{
+  SleighArena::Scope scope(&arena);
+  maxdelayslotbytes = 0;
+  unique_allocatemask = 0;
+  numSections = 0;
+  int4 version = 0;
+  setBigEndian(s.getAttributeValue("bigendian").toBool());
+  alignment = s.getAttributeValue("align").toSigned();
+  setUniqueBase(s.getAttributeValue("uniqbase").toUnsigned());
+  for(int4 i=0;i<s.getNumAttributes();++i) {
+    const XmlView &attrname( s.getAttributeName(i) );
+    if (attrname == "maxdelay")
+      maxdelayslotbytes = s.getAttributeValue(i).toUnsigned();
+    else if (attrname == "uniqmask")
+      unique_allocatemask = s.getAttributeValue(i).toUnsigned();
+    else if (attrname == "numsections")
+      numSections = s.getAttributeValue(i).toUnsigned();
+    else if (attrname == "version")
+      version = s.getAttributeValue(i).toSigned();
+  }
+  if (version != SLA_FORMAT_VERSION)
+    throw LowlevelError(".sla file has wrong format");
+  Element *el;
+  while(s.peekElement() != (const string *)0 && *s.peekElement() == "floatformat") {
+    el = s.readElement();
+    floatformats.emplace_back();
+    floatformats.back().restoreXml(el);
+    delete el;
+  }
+  el = s.readElement();
+  indexer.restoreXml(el);
+  delete el;
+  el = s.readElement();
+  restoreXmlSpaces(el,this);
+  delete el;
+  if (s.openElement() != "symbol_table")
+    throw LowlevelError("Missing symbol table");
+  symtab.restoreXml(s,this);
+  restoreXmlTail();
+}
+
+/// Each constructor covers its own tokens and its operands, each of which starts at a fixed
+/// distance from the start of the constructor or from the end of an earlier operand. A table
+/// met again while its own length is still being worked out is recursive, and how deep it
+/// recurses depends on context, so that reference counts for nothing. The result is then only
+/// the length of the instructions that don't recurse.
+/// \param sym is the table
+/// \param lengths holds the length of each table visited so far (-1 while it is being worked out)
+/// \return the most bytes anything decoded from the table takes, not counting recursion
+int4 SleighBase::calcMaxLength(SubtableSymbol *sym,map<SubtableSymbol *,int4> &lengths)
+
+{
+  map<SubtableSymbol *,int4>::const_iterator iter = lengths.find(sym);
+  if (iter != lengths.end())
+    return ((*iter).second < 0) ? 0 : (*iter).second;
+  lengths[sym] = -1;
+  int4 maxlen = 0;
+  vector<int4> ends;		// End of each operand, relative to the start of the constructor
+  for(int4 i=0;i<sym->getNumConstructors();++i) {
+    Constructor *ct = sym->getConstructor(i);
+    int4 len = ct->getMinimumLength();
+    int4 numoper = ct->getNumOperands();
+    ends.resize(numoper);
+    for(int4 j=0;j<numoper;++j) {
+      OperandSymbol *op = ct->getOperand(j);
+      int4 base = op->getOffsetBase();
+      int4 end = (base < 0 || base >= j) ? 0 : ends[base];	// Operands are placed after earlier ones
+      end += op->getRelativeOffset();
+      TripleSymbol *tsym = op->getDefiningSymbol();
+      if (tsym != (TripleSymbol *)0 && tsym->getType() == SleighSymbol::subtable_symbol)
+	end += calcMaxLength((SubtableSymbol *)tsym,lengths);
+      else
+	end += op->getMinimumLength();
+      ends[j] = end;
+      if (end > len)
+	len = end;
+    }
+    if (len > maxlen)
+      maxlen = len;
+  }
+  lengths[sym] = maxlen;
+  return maxlen;
+}
+
+/// The decoding root is looked up, the register cross-references are built, the
+/// length of the longest instruction is worked out and any context commit is noted.
+void SleighBase::restoreXmlTail(void)
+
+{
   root = (SubtableSymbol *)symtab.getGlobalScope()->findSymbol("instruction");
+  map<SubtableSymbol *,int4> lengths;
+  maxinstlength = calcMaxLength(root,lengths);
+  contextcommits = false;
+  map<SubtableSymbol *,int4>::const_iterator iter;
+  for(iter=lengths.begin();iter!=lengths.end();++iter) {	// Every table reachable from the root
+    SubtableSymbol *sym = (*iter).first;
+    for(int4 i=0;i<sym->getNumConstructors();++i) {
+      if (sym->getConstructor(i)->hasCommits())
+	contextcommits = true;
+    }
+  }
   vector<string> errorPairs;
   buildXrefs(errorPairs);
   if (!errorPairs.empty())
@@ -59,19 +59,31 @@ class SleighBase : public Translate {
   vector<string> userop;		///< Names of user-define p-code ops for \b this Translate object
   map<VarnodeData,string> varnode_xref;	///< A map from Varnodes in the \e register space to register names
 protected:
+  SleighArena arena;		///< Memory of the restored symbols, patterns and templates, released after \b symtab
   SubtableSymbol *root;		///< The root SLEIGH decoding symbol
   SymbolTable symtab;		///< The SLEIGH symbol table
   uint4 maxdelayslotbytes;	///< Maximum number of bytes in a delay-slot directive
+  int4 maxinstlength;		///< Most bytes an instruction takes, not counting recursive tables
   uint4 unique_allocatemask;	///< Bits that are guaranteed to be zero in the unique allocation scheme
   uint4 numSections;		///< Number of \e named sections
+  bool contextcommits;		///< Does any constructor commit context to the database
   SourceFileIndexer indexer;    ///< source file index used when generating SLEIGH constructor debug info
+  const SleighBase *language;	///< Specification shared from another SleighBase, or null if \b this owns its own
   void buildXrefs(vector<string> &errorPairs);	///< Build register map. Collect user-ops and context-fields.
   void reregisterContext(void);	///< Reregister context fields for a new executable
   void restoreXml(const Element *el);	///< Read a SLEIGH specification from XML
+  void restoreXml(XmlStream &s);	///< Read a SLEIGH specification from an XML stream
+  void restoreXmlTail(void);		///< Finish restoring once the symbol table is read
+  static int4 calcMaxLength(SubtableSymbol *sym,map<SubtableSymbol *,int4> &lengths);	///< Length of the longest instruction decoded from a table
+  void bindLanguage(const SleighBase *lang);	///< Share the specification loaded by another SleighBase
 public:
   static const uintb MAX_UNIQUE_SIZE;    ///< Maximum size of a varnode in the unique space (should match value in SleighBase.java)
   SleighBase(void);		///< Construct an uninitialized translator
   bool isInitialized(void) const { return (root != (SubtableSymbol *)0); }	///< Return \b true if \b this is initialized
+  uint4 getMaxDelaySlotBytes(void) const { return maxdelayslotbytes; }	///< Get the most bytes any delay slot covers (0 if there are none)
+  int4 getMaxInstructionLength(void) const { return maxinstlength; }	///< Get the most bytes an instruction takes, not counting recursive tables
+  bool hasContextCommits(void) const { return contextcommits; }	///< Can decoding an instruction change the context of others
+  uint4 getUniqueAllocationMask(void) const { return unique_allocatemask; }	///< Get the address bits mixed into unique offsets (0 if none are)
   virtual ~SleighBase(void) {}	///< Destructor
   virtual void addRegister(const string &nm,AddrSpace *base,uintb offset,int4 size);
   virtual const VarnodeData &getRegister(const string &nm) const;
@@ -79,9 +91,10 @@ public:
   virtual void getAllRegisters(map<VarnodeData,string> &reglist) const;
   virtual void getUserOpNames(vector<string> &res) const;
 
-  SleighSymbol *findSymbol(const string &nm) const { return symtab.findSymbol(nm); }	///< Find a specific SLEIGH symbol by name in the current scope
-  SleighSymbol *findSymbol(uintm id) const { return symtab.findSymbol(id); }	///< Find a specific SLEIGH symbol by id
-  SleighSymbol *findGlobalSymbol(const string &nm) const { return symtab.findGlobalSymbol(nm); }	///< Find a specific global SLEIGH symbol by name
+  const SleighBase *getLanguage(void) const { return (language != (const SleighBase *)0) ? language : this; }	///< Get the object owning the specification
+  SleighSymbol *findSymbol(const string &nm) const { return getLanguage()->symtab.findSymbol(nm); }	///< Find a specific SLEIGH symbol by name in the current scope
+  SleighSymbol *findSymbol(uintm id) const { return getLanguage()->symtab.findSymbol(id); }	///< Find a specific SLEIGH symbol by id
+  SleighSymbol *findGlobalSymbol(const string &nm) const { return getLanguage()->symtab.findGlobalSymbol(nm); }	///< Find a specific global SLEIGH symbol by name
   void saveXml(ostream &s) const;	///< Write out the SLEIGH specification as an XML \<sleigh> tag.
 };
 
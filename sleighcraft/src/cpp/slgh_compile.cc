@@ -15,7 +15,12 @@
  */
 #include "slgh_compile.hh"
 #include "filemanage.hh"
+#include "xmlpack.hh"
 #include <csignal>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 SleighCompile *slgh;		// Global pointer to sleigh object for use with parser
 #ifdef YYDEBUG
@@ -2003,6 +2008,7 @@ void SleighCompile::parseFromNewFile(const string &fname)
     relpath.push_back(totalpath);
   }
   lineno.push_back(1);
+  filesread.push_back(grabCurrentFilePath());
 }
 
 void SleighCompile::parsePreprocMacro(void)
@@ -2828,7 +2834,7 @@ void SleighCompile::recordNop(void)
   noplist.push_back(msg);
 }
 
-static int4 run_compilation(const char *filein,const char *fileout,SleighCompile &compiler)
+static int4 run_compilation(const char *filein,const char *fileout,SleighCompile &compiler,bool packed)
 
 {
   compiler.parseFromNewFile(filein);
@@ -2842,31 +2848,42 @@ static int4 run_compilation(const char *filein,const char *fileout,SleighCompile
   try {
     int4 parseres = yyparse();	// Try to parse
     fclose(yyin);
+    yylex_destroy();		// Make sure lexer is reset so we can parse multiple files, even after an error
     if (parseres==0)
       compiler.process();	// Do all the post-processing
     if ((parseres==0)&&(compiler.numErrors()==0)) { // If no errors
-      ofstream s(fileout);
+      ofstream s(fileout,packed ? ios::out|ios::binary : ios::out);
       if (!s) {
 	ostringstream errs;
 	errs << "Unable to open output file: " << fileout;
 	throw SleighError(errs.str());
       }
-      compiler.saveXml(s);	// Dump output xml
+      if (packed) {		// Round-trip through the DOM so the packed form matches the xml exactly
+	stringstream xml;
+	compiler.saveXml(xml);
+	Document *doc = xml_tree(xml);
+	xml_pack(s,doc->getRoot());
+	delete doc;
+      }
+      else
+	compiler.saveXml(s);	// Dump output xml
       s.close();
     }
     else {
       cerr << "No output produced" <<endl;
       return 2;
     }
-    yylex_destroy();		// Make sure lexer is reset so we can parse multiple files
   } catch(LowlevelError &err) {
     cerr << "Unrecoverable error: " << err.explain << endl;
+    if (yyin != (FILE *)0)	// Thrown while parsing
+      fclose(yyin);
+    yylex_destroy();
     return 2;
   }
   return 0;
 }
 
-static int4 run_xml(const char *filein,SleighCompile &compiler)
+static int4 run_xml(const char *filein,SleighCompile &compiler,bool packed)
 
 {
   ifstream s(filein);
@@ -2917,7 +2934,7 @@ static int4 run_xml(const char *filein,SleighCompile &compiler)
     cerr << "Output sla file was not specified in " << filein << endl;
     exit(1);
   }
-  return run_compilation(specfilein.c_str(),specfileout.c_str(),compiler);
+  return run_compilation(specfilein.c_str(),specfileout.c_str(),compiler,packed);
 }
 
 static void findSlaSpecs(vector<string> &res, const string &dir, const string &suffix)
@@ -2959,6 +2976,160 @@ static void initCompiler(SleighCompile &compiler, map<string,string> &defines, b
 	  compiler.setLargeTemporaryWarning(true);
 }
 
+/// \brief A spec to compile as part of a batch, and where its output goes
+struct CompileJob {
+  string specfile;		///< The .slaspec file
+  string slafile;		///< The .sla file to produce
+  CompileJob(const string &in,const string &out) : specfile(in), slafile(out) {}	///< Constructor
+};
+
+/// Each line of the manifest is an output file, followed by \e ": " and the space separated list of files
+/// (the spec and everything it includes) it was compiled from.
+/// \param fname is the manifest file
+/// \param entries will hold the dependency list for each output file
+static void readManifest(const string &fname,map<string,string> &entries)
+
+{
+  ifstream s(fname.c_str());
+  string line;
+  while(getline(s,line)) {
+    string::size_type pos = line.find(": ");
+    if (pos == string::npos) continue;
+    entries[line.substr(0,pos)] = line.substr(pos+2);
+  }
+}
+
+/// \param fname is the manifest file
+/// \param entries is the dependency list for each output file
+static void writeManifest(const string &fname,const map<string,string> &entries)
+
+{
+  ofstream s(fname.c_str());
+  if (!s) {
+    cerr << "Unable to write dependency manifest: " << fname << endl;
+    return;
+  }
+  map<string,string>::const_iterator iter;
+  for(iter=entries.begin();iter!=entries.end();++iter)
+    s << (*iter).first << ": " << (*iter).second << endl;
+}
+
+/// Files included more than once are only listed the first time
+/// \param files is every file read by a compilation, in order
+/// \return the dependency list for the manifest
+static string dependencyList(const vector<string> &files)
+
+{
+  set<string> seen;
+  string res;
+  for(int4 i=0;i<files.size();++i) {
+    if (!seen.insert(files[i]).second) continue;
+    if (!res.empty())
+      res += ' ';
+    res += files[i];
+  }
+  return res;
+}
+
+/// \brief Compile a batch of specs, up to \b numjobs of them at once
+///
+/// The parser keeps its state in globals, so concurrent compilations each get their own
+/// process. A child passes the files it read back to this process in a temporary file
+/// next to its output. A failed compilation does not stop the others: every spec is tried,
+/// and the ones that failed are listed at the end and dropped from the manifest, so they
+/// are compiled again next time.
+/// \param jobs are the specs to compile
+/// \param numjobs is the maximum number of compilations running at once
+/// \param compile compiles one spec, filling in the list of files read, and returns the exit code
+/// \param manifest if not null, gets the dependency list of every spec compiled successfully
+/// \return 0 if every spec compiled, the exit code of the first failed compilation otherwise
+template<typename Compile>
+static int4 run_batch(const vector<CompileJob> &jobs,int4 numjobs,Compile compile,map<string,string> *manifest)
+
+{
+  int4 retval = 0;
+  vector<int4> failed;		// Index of each job that did not compile
+  auto finish = [&](int4 index,int4 res,const string &deps) {
+    if (res == 0) {
+      if (manifest != (map<string,string> *)0)
+	(*manifest)[jobs[index].slafile] = deps;
+      return;
+    }
+    failed.push_back(index);
+    if (manifest != (map<string,string> *)0)
+      manifest->erase(jobs[index].slafile);
+    if (retval == 0)
+      retval = res;
+  };
+#ifndef _WIN32
+  if (numjobs > 1 && jobs.size() > 1) {
+    map<pid_t,int4> running;	// Child process compiling each job
+    int4 next = 0;
+    while(next < jobs.size() || !running.empty()) {
+      while(next < jobs.size() && running.size() < numjobs) {
+	cout << "Compiling (" << dec << (next+1) << " of " << dec << jobs.size() << ") " << jobs[next].specfile << endl;
+	cerr.flush();		// So the child does not print what is buffered again
+	pid_t pid = fork();
+	if (pid < 0) {
+	  cerr << "Unable to start a compilation process" << endl;
+	  break;		// Try again once a running compilation is done
+	}
+	if (pid == 0) {
+	  vector<string> files;
+	  int4 res = compile(jobs[next],files);
+	  if (res == 0) {
+	    ofstream s((jobs[next].slafile + ".deps").c_str());
+	    s << dependencyList(files) << endl;
+	  }
+	  cout.flush();
+	  cerr.flush();
+	  _exit(res);
+	}
+	running[pid] = next++;
+      }
+      if (running.empty()) {	// Nothing can be started at all
+	for(;next<jobs.size();++next)
+	  finish(next,2,"");
+	break;
+      }
+      int status;
+      pid_t pid = wait(&status);
+      if (pid < 0) break;
+      map<pid_t,int4>::iterator iter = running.find(pid);
+      if (iter == running.end()) continue;
+      int4 index = (*iter).second;
+      running.erase(iter);
+      string depsfile = jobs[index].slafile + ".deps";
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+	ifstream s(depsfile.c_str());
+	string deps;
+	getline(s,deps);
+	finish(index,0,deps);
+      }
+      else
+	finish(index,WIFEXITED(status) ? WEXITSTATUS(status) : 2,"");
+      remove(depsfile.c_str());
+    }
+  }
+  else
+#endif
+  {
+    for(int4 i=0;i<jobs.size();++i) {
+      cout << "Compiling (" << dec << (i+1) << " of " << dec << jobs.size() << ") " << jobs[i].specfile << endl;
+      vector<string> files;
+      int4 res = compile(jobs[i],files);
+      finish(i,res,(res == 0) ? dependencyList(files) : "");
+    }
+  }
+  if (!failed.empty()) {
+    sort(failed.begin(),failed.end());
+    cerr << "Failed to compile " << dec << failed.size() << " of " << dec << jobs.size() << " specifications:" << endl;
+    for(int4 i=0;i<failed.size();++i)
+      cerr << "  " << jobs[failed[i]].specfile << endl;
+  }
+  return retval;
+}
+
 static void segvHandler(int sig) {
   exit(1);			// Just die - prevents OS from popping-up a dialog
 }
@@ -2977,6 +3148,9 @@ int main(int argc,char **argv)
   if (argc < 2) {
     cerr << "USAGE: sleigh [-x] [-dNAME=VALUE] inputfile [outputfile]" << endl;
     cerr << "   -a              scan for all slaspec files recursively where inputfile is a directory" << endl;
+    cerr << "   -b              batch mode, the arguments are pairs of inputfile and outputfile" << endl;
+    cerr << "   -jN             with -a or -b, run up to N compilations at once" << endl;
+    cerr << "   -MFILE          with -a or -b, record the files each output is compiled from in FILE" << endl;
     cerr << "   -x              turns on parser debugging" << endl;
     cerr << "   -u              print warnings for unnecessary pcode instructions" << endl;
     cerr << "   -l              report pattern conflicts" << endl;
@@ -2985,6 +3159,7 @@ int main(int argc,char **argv)
     cerr << "   -e              enforce use of 'local' keyword for temporaries" << endl;
     cerr << "   -c              print warnings for all constructors with colliding operands" << endl;
     cerr << "   -o              print warnings for temporaries which are too large" << endl;
+    cerr << "   -p              write the output in the packed binary format" << endl;
     cerr << "   -DNAME=VALUE    defines a preprocessor macro NAME with value VALUE" << endl;
     exit(2);
   }
@@ -2999,14 +3174,27 @@ int main(int argc,char **argv)
   bool enableDeadTempWarning = false;
   bool enforceLocalKeyWord = false;
   bool largeTemporaryWarning = false;
+  bool packed = false;
   
   bool compileAll = false;
+  bool batch = false;
+  int4 numJobs = 1;
+  string manifestFile;
   
   int4 i;
   for(i=1;i<argc;++i) {
     if (argv[i][0] != '-') break;
     if (argv[i][1] == 'a')
       compileAll = true;
+    else if (argv[i][1] == 'b')
+      batch = true;
+    else if (argv[i][1] == 'j') {
+      numJobs = atoi(argv[i]+2);
+      if (numJobs < 1)
+	numJobs = 1;
+    }
+    else if (argv[i][1] == 'M')
+      manifestFile = argv[i]+2;
     else if (argv[i][1] == 'D') {
       string preproc(argv[i]+2);
       string::size_type pos = preproc.find('=');
@@ -3032,6 +3220,8 @@ int main(int argc,char **argv)
       enforceLocalKeyWord = true;
     else if (argv[i][1] == 'o')
     	largeTemporaryWarning = true;
+    else if (argv[i][1] == 'p')
+      packed = true;
 #ifdef YYDEBUG
     else if (argv[i][1] == 'x')
       yydebug = 1;		// Debug option
@@ -3042,34 +3232,52 @@ int main(int argc,char **argv)
     }
   }
   
-  if (compileAll) {
+  if (compileAll || batch) {
     
-    if (i< argc-1) {
-      cerr << "Too many parameters" << endl;
-      exit(1);
+    vector<CompileJob> jobs;
+    if (compileAll) {
+      if (i< argc-1) {
+	cerr << "Too many parameters" << endl;
+	exit(1);
+      }
+      const string::size_type slaspecExtLen = SLASPECEXT.length();
+
+      vector<string> slaspecs;
+      string dirStr = ".";
+      if (i != argc)
+	dirStr = argv[i];
+      findSlaSpecs(slaspecs, dirStr,SLASPECEXT);
+      cout << "Compiling " << dec << slaspecs.size() << " slaspec files in " << dirStr << endl;
+      for(int4 j=0;j<slaspecs.size();++j) {
+	string sla = slaspecs[j];
+	sla.replace(sla.length() - slaspecExtLen, slaspecExtLen, SLAEXT);
+	jobs.push_back(CompileJob(slaspecs[j],sla));
+      }
     }
-    const string::size_type slaspecExtLen = SLASPECEXT.length();
-    
-    vector<string> slaspecs;
-    string dirStr = ".";
-    if (i != argc)
-      dirStr = argv[i];
-    findSlaSpecs(slaspecs, dirStr,SLASPECEXT);
-    cout << "Compiling " << dec << slaspecs.size() << " slaspec files in " << dirStr << endl;
-    for(int4 j=0;j<slaspecs.size();++j) {
-      string slaspec = slaspecs[j];
-      cout << "Compiling (" << dec << (j+1) << " of " << dec << slaspecs.size() << ") " << slaspec << endl;
-      string sla = slaspec;
-      sla.replace(slaspec.length() - slaspecExtLen, slaspecExtLen, SLAEXT);
+    else {
+      if ((argc - i) % 2 != 0) {
+	cerr << "Batch mode needs pairs of input and output files" << endl;
+	exit(1);
+      }
+      for(;i<argc;i+=2)
+	jobs.push_back(CompileJob(argv[i],argv[i+1]));
+    }
+
+    auto compile = [&](const CompileJob &job,vector<string> &files) -> int4 {
       SleighCompile compiler;
       initCompiler(compiler, defines, enableUnnecessaryPcodeWarning, 
 		   disableLenientConflict, enableAllCollisionWarning, enableAllNopWarning,
 		   enableDeadTempWarning, enforceLocalKeyWord,largeTemporaryWarning);
-      retval = run_compilation(slaspec.c_str(),sla.c_str(),compiler);
-      if (retval != 0) {
-	return retval; // stop on first error
-      }
-    }
+      int4 res = run_compilation(job.specfile.c_str(),job.slafile.c_str(),compiler,packed);
+      files = compiler.getFilesRead();
+      return res;
+    };
+    map<string,string> manifest;
+    if (!manifestFile.empty())
+      readManifest(manifestFile,manifest);	// Keep the entries of specs not compiled this time
+    retval = run_batch(jobs,numJobs,compile,manifestFile.empty() ? (map<string,string> *)0 : &manifest);
+    if (!manifestFile.empty())
+      writeManifest(manifestFile,manifest);
     
   } else { // compile single specification
     
@@ -3109,15 +3317,15 @@ int main(int argc,char **argv)
       if (extOutPos == string::npos) { // No Extension Given...
 	fileoutExamine.append(SLAEXT);
       }
-      retval = run_compilation(fileinExamine.c_str(),fileoutExamine.c_str(),compiler);
+      retval = run_compilation(fileinExamine.c_str(),fileoutExamine.c_str(),compiler,packed);
     }else{
       //First determine whether or not to use Run_XML...
       if (autoExtInSet || extIsSLASPECEXT) { //Assumed format of at least "sleigh file" -> "sleigh file.slaspec file.sla"
 	string fileoutSTR = fileinPreExt;
 	fileoutSTR.append(SLAEXT);
-	retval = run_compilation(fileinExamine.c_str(),fileoutSTR.c_str(),compiler);
+	retval = run_compilation(fileinExamine.c_str(),fileoutSTR.c_str(),compiler,packed);
       }else{
-	retval = run_xml(fileinExamine.c_str(),compiler);
+	retval = run_xml(fileinExamine.c_str(),compiler,packed);
       }
       
     }
@@ -199,6 +199,7 @@ private:
   bool contextlock;		// If the context layout has been established yet
   vector<string> relpath;	// Relative path (to cwd) for each filename
   vector<string> filename;	// Stack of current files being parsed
+  vector<string> filesread;	// Every file opened (relative to cwd), the spec first then its includes
   vector<int4> lineno;		// Current line number for each file in stack
   map<Constructor *, Location> ctorLocationMap;	// Map constructor to its defining parse location
   map<SleighSymbol *, Location> symbolLocationMap;	// Map symbol to its defining parse location
@@ -260,6 +261,7 @@ public:
   // Lexer functions
   void calcContextLayout(void);
   string grabCurrentFilePath(void) const;
+  const vector<string> &getFilesRead(void) const { return filesread; }
   void parseFromNewFile(const string &fname);
   void parsePreprocMacro(void);
   void parseFileFinished(void);
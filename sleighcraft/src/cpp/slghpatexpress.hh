@@ -53,7 +53,7 @@ public:
 };
 
 class PatternValue;
-class PatternExpression {
+class PatternExpression : public ArenaObject {
   int4 refcount;			// Number of objects referencing this
 				// for deletion
 protected:
@@ -17,9 +17,10 @@
 #define __SLGHPATTERN__
 
 #include "context.hh"
+#include "arena.hh"
 
 // A mask/value pair viewed as two bitstreams
-class PatternBlock {
+class PatternBlock : public ArenaObject {
   int4 offset;			// Offset to non-zero byte of mask
   int4 nonzerosize;		// Last byte(+1) containing nonzero mask
   vector<uintm> maskvec;	// Mask
@@ -43,12 +44,15 @@ public:
   bool alwaysFalse(void) const { return (nonzerosize==-1); }
   bool isInstructionMatch(ParserWalker &walker) const;
   bool isContextMatch(ParserWalker &walker) const;
+  int4 getOffset(void) const { return offset; }
+  const vector<uintm> &getMaskVector(void) const { return maskvec; }
+  const vector<uintm> &getValueVector(void) const { return valvec; }
   void saveXml(ostream &s) const;
   void restoreXml(const Element *el);
 };
 
 class DisjointPattern;
-class Pattern {
+class Pattern : public ArenaObject {
 public:
   virtual ~Pattern(void) {}
   virtual Pattern *simplifyClone(void) const=0;
@@ -74,6 +78,7 @@ public:
   uintm getMask(int4 startbit,int4 size,bool context) const;
   uintm getValue(int4 startbit,int4 size,bool context) const;
   int4 getLength(bool context) const;
+  const PatternBlock *getPatternBlock(bool context) const { return getBlock(context); } // Null if no such piece
   bool specializes(const DisjointPattern *op2) const;
   bool identical(const DisjointPattern *op2) const;
   bool resolvesIntersect(const DisjointPattern *op1,const DisjointPattern *op2) const;
@@ -16,6 +16,9 @@
 #include "slghsymbol.hh"
 #include "sleighbase.hh"
 #include <cmath>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 SleighSymbol *SymbolScope::addSymbol(SleighSymbol *a)
 
@@ -225,46 +228,99 @@ void SymbolTable::restoreXml(const Element *el,SleighBase *trans)
   }
 }
 
-void SymbolTable::restoreSymbolHeader(const Element *el)
+void SymbolTable::restoreXml(XmlStream &s,SleighBase *trans)
 
-{				// Put the shell of a symbol in the symbol table
-				// in order to allow recursion
+{				// Same as above, from the open <symbol_table> element of a stream.
+				// Each symbol body is restored and dropped before the next is read
+  table.resize(s.getAttributeValue("scopesize").toUnsigned(),(SymbolScope *)0);
+  symbollist.resize(s.getAttributeValue("symbolsize").toUnsigned(),(SleighSymbol *)0);
+  for(int4 i=0;i<table.size();++i) { // Restore the scopes
+    if (s.openElement() != "scope")
+      throw SleighError("Misnumbered symbol scopes");
+    uintm id = s.getAttributeValue("id").toUnsigned();
+    uintm parent = s.getAttributeValue("parent").toUnsigned();
+    SymbolScope *parscope = (parent==id) ? (SymbolScope *)0 : table[parent];
+    table[id] = new SymbolScope( parscope, id );
+    s.closeElement();
+  }
+  curscope = table[0];		// Current scope is global
+
+				// Now restore the symbol shells
+  for(int4 i=0;i<symbollist.size();++i) {
+    s.openElement();
+    restoreSymbolHeader(s);
+  }
+				// Now restore the symbol content
+  while(s.peekElement() != (const string *)0) {
+    s.openElement();
+    SleighSymbol *sym = findSymbol(s.getAttributeValue("id").toUnsigned());
+    sym->restoreXml(s,trans);
+  }
+  s.closeElement();
+}
+
+SleighSymbol *SymbolTable::newSymbolShell(const string &headname)
+
+{				// Create the empty symbol for a header tag
   SleighSymbol *sym;
-  if (el->getName() == "userop_head")
+  if (headname == "userop_head")
     sym = new UserOpSymbol();
-  else if (el->getName() == "epsilon_sym_head")
+  else if (headname == "epsilon_sym_head")
     sym = new EpsilonSymbol();
-  else if (el->getName() == "value_sym_head")
+  else if (headname == "value_sym_head")
     sym = new ValueSymbol();
-  else if (el->getName() == "valuemap_sym_head")
+  else if (headname == "valuemap_sym_head")
     sym = new ValueMapSymbol();
-  else if (el->getName() == "name_sym_head")
+  else if (headname == "name_sym_head")
     sym = new NameSymbol();
-  else if (el->getName() == "varnode_sym_head")
+  else if (headname == "varnode_sym_head")
     sym = new VarnodeSymbol();
-  else if (el->getName() == "context_sym_head")
+  else if (headname == "context_sym_head")
     sym = new ContextSymbol();
-  else if (el->getName() == "varlist_sym_head")
+  else if (headname == "varlist_sym_head")
     sym = new VarnodeListSymbol();
-  else if (el->getName() == "operand_sym_head")
+  else if (headname == "operand_sym_head")
     sym = new OperandSymbol();
-  else if (el->getName() == "start_sym_head")
+  else if (headname == "start_sym_head")
     sym = new StartSymbol();
-  else if (el->getName() == "end_sym_head")
+  else if (headname == "end_sym_head")
     sym = new EndSymbol();
-  else if (el->getName() == "subtable_sym_head")
+  else if (headname == "subtable_sym_head")
     sym = new SubtableSymbol();
-  else if (el->getName() == "flowdest_sym_head")
+  else if (headname == "flowdest_sym_head")
     sym = new FlowDestSymbol();
-  else if (el->getName() == "flowref_sym_head")
+  else if (headname == "flowref_sym_head")
     sym = new FlowRefSymbol();
   else
     throw SleighError("Bad symbol xml");
-  sym->restoreXmlHeader(el);	// Restore basic elements of symbol
+  return sym;
+}
+
+void SymbolTable::addSymbolShell(SleighSymbol *sym)
+
+{
   symbollist[sym->id] = sym;	// Put the basic symbol in the table
   table[sym->scopeid]->addSymbol(sym); // to allow recursion
 }
 
+void SymbolTable::restoreSymbolHeader(const Element *el)
+
+{				// Put the shell of a symbol in the symbol table
+				// in order to allow recursion
+  SleighSymbol *sym = newSymbolShell(el->getName());
+  sym->restoreXmlHeader(el);	// Restore basic elements of symbol
+  addSymbolShell(sym);
+}
+
+void SymbolTable::restoreSymbolHeader(XmlStream &s)
+
+{				// Same, from the open header element of a stream, which is closed
+  SleighSymbol *sym = newSymbolShell(s.getName());
+  sym->restoreXmlHeader(s);
+  addSymbolShell(sym);
+  s.closeElement();
+}
+
 void SymbolTable::purge(void)
 
 {				// Get rid of unsavable symbols and scopes
@@ -378,6 +434,28 @@ void SleighSymbol::restoreXmlHeader(const Element *el)
   }
 }
 
+void SleighSymbol::restoreXmlHeader(XmlStream &s)
+
+{
+  name = s.getAttributeValue("name").str();
+  id = s.getAttributeValue("id").toUnsigned();
+  scopeid = s.getAttributeValue("scope").toUnsigned();
+}
+
+void SleighSymbol::restoreXml(XmlStream &s,SleighBase *trans)
+
+{				// Symbol bodies are small, except for subtables,
+				// so by default the body is read as a tree
+  Element *el = s.readCurrent();
+  try {
+    restoreXml(el,trans);
+  } catch(...) {
+    delete el;
+    throw;
+  }
+  delete el;
+}
+
 void UserOpSymbol::saveXml(ostream &s) const
 
 {
@@ -434,7 +512,7 @@ void EpsilonSymbol::getFixedHandle(FixedHandle &hand,ParserWalker &walker) const
   hand.size = 0;		// Cannot provide size
 }
 
-void EpsilonSymbol::print(ostream &s,ParserWalker &walker) const
+void EpsilonSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
   s << '0';
@@ -493,14 +571,11 @@ void ValueSymbol::getFixedHandle(FixedHandle &hand,ParserWalker &walker) const
   hand.size = 0;		// Cannot provide size
 }
 
-void ValueSymbol::print(ostream &s,ParserWalker &walker) const
+void ValueSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
   intb val = patval->getValue(walker);
-  if (val >= 0)
-    s << "0x" << hex << val;
-  else
-    s << "-0x" << hex << -val;
+  s.appendSignedHex(val);
 }
 
 void ValueSymbol::saveXml(ostream &s) const
@@ -570,16 +645,13 @@ void ValueMapSymbol::getFixedHandle(FixedHandle &hand,ParserWalker &walker) cons
   hand.size = 0;		// Cannot provide size
 }
 
-void ValueMapSymbol::print(ostream &s,ParserWalker &walker) const
+void ValueMapSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
   uint4 ind = (uint4)patval->getValue(walker);
   // ind is already checked to be in range by the resolve routine
   intb val = valuetable[ind];
-  if (val >= 0)
-    s << "0x" << hex << val;
-  else
-    s << "-0x" << hex << -val;
+  s.appendSignedHex(val);
 }
 
 void ValueMapSymbol::saveXml(ostream &s) const
@@ -652,7 +724,7 @@ Constructor *NameSymbol::resolve(ParserWalker &walker)
   return (Constructor *)0;
 }
 
-void NameSymbol::print(ostream &s,ParserWalker &walker) const
+void NameSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
   uint4 ind = (uint4)patval->getValue(walker);
@@ -894,7 +966,7 @@ int4 VarnodeListSymbol::getSize(void) const
   throw SleighError("No register attached to: "+getName());
 }
 
-void VarnodeListSymbol::print(ostream &s,ParserWalker &walker) const
+void VarnodeListSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
   uint4 ind = (uint4)patval->getValue(walker);
@@ -1021,7 +1093,7 @@ int4 OperandSymbol::getSize(void) const
   return 0;
 }
 
-void OperandSymbol::print(ostream &s,ParserWalker &walker) const
+void OperandSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
   walker.pushOperand(getIndex());
@@ -1033,10 +1105,7 @@ void OperandSymbol::print(ostream &s,ParserWalker &walker) const
   }
   else {
     intb val = defexp->getValue(walker);
-    if (val >= 0)
-      s << "0x" << hex << val;
-    else
-      s << "-0x" << hex << -val;
+    s.appendSignedHex(val);
   }
   walker.popOperand();
 }
@@ -1159,11 +1228,11 @@ void StartSymbol::getFixedHandle(FixedHandle &hand,ParserWalker &walker) const
   hand.size = hand.space->getAddrSize();
 }
 
-void StartSymbol::print(ostream &s,ParserWalker &walker) const
+void StartSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
-  intb val = (intb) walker.getAddr().getOffset();
-  s << "0x" << hex << val;
+  s << "0x";
+  s.appendHex(walker.getAddr().getOffset());
 }
 
 void StartSymbol::saveXml(ostream &s) const
@@ -1223,11 +1292,11 @@ void EndSymbol::getFixedHandle(FixedHandle &hand,ParserWalker &walker) const
   hand.size = hand.space->getAddrSize();
 }
 
-void EndSymbol::print(ostream &s,ParserWalker &walker) const
+void EndSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
-  intb val = (intb) walker.getNaddr().getOffset();
-  s << "0x" << hex << val;
+  s << "0x";
+  s.appendHex(walker.getNaddr().getOffset());
 }
 
 void EndSymbol::saveXml(ostream &s) const
@@ -1279,11 +1348,11 @@ void FlowDestSymbol::getFixedHandle(FixedHandle &hand,ParserWalker &walker) cons
   hand.size = refAddr.getAddrSize();
 }
 
-void FlowDestSymbol::print(ostream &s,ParserWalker &walker) const
+void FlowDestSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
-  intb val = (intb) walker.getDestAddr().getOffset();
-  s << "0x" << hex << val;
+  s << "0x";
+  s.appendHex(walker.getDestAddr().getOffset());
 }
 
 void FlowDestSymbol::saveXml(ostream &s) const
@@ -1333,11 +1402,11 @@ void FlowRefSymbol::getFixedHandle(FixedHandle &hand,ParserWalker &walker) const
   hand.size = refAddr.getAddrSize();
 }
 
-void FlowRefSymbol::print(ostream &s,ParserWalker &walker) const
+void FlowRefSymbol::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
-  intb val = (intb) walker.getRefAddr().getOffset();
-  s << "0x" << hex << val;
+  s << "0x";
+  s.appendHex(walker.getRefAddr().getOffset());
 }
 
 void FlowRefSymbol::saveXml(ostream &s) const
@@ -1472,7 +1541,7 @@ ConstructTpl *Constructor::getNamedTempl(int4 secnum) const
   return (ConstructTpl *)0;
 }
 
-void Constructor::print(ostream &s,ParserWalker &walker) const
+void Constructor::print(PrintBuffer &s,ParserWalker &walker) const
 
 {
   vector<string>::const_iterator piter;
@@ -1487,7 +1556,7 @@ void Constructor::print(ostream &s,ParserWalker &walker) const
   }
 }
 
-void Constructor::printMnemonic(ostream &s,ParserWalker &walker) const
+void Constructor::printMnemonic(PrintBuffer &s,ParserWalker &walker) const
 
 {
   if (flowthruindex != -1) {
@@ -1510,7 +1579,7 @@ void Constructor::printMnemonic(ostream &s,ParserWalker &walker) const
   }
 }
 
-void Constructor::printBody(ostream &s,ParserWalker &walker) const
+void Constructor::printBody(PrintBuffer &s,ParserWalker &walker) const
 
 {
   if (flowthruindex != -1) {
@@ -1589,6 +1658,16 @@ bool Constructor::isRecursive(void) const
   return false;
 }
 
+bool Constructor::hasCommits(void) const
+
+{ // Does this constructor write context back to the database (globalset)
+  for(int4 i=0;i<context.size();++i) {
+    if (dynamic_cast<ContextCommit *>(context[i]) != (ContextCommit *)0)
+      return true;
+  }
+  return false;
+}
+
 void Constructor::saveXml(ostream &s) const
 
 {
@@ -1708,6 +1787,81 @@ void Constructor::restoreXml(const Element *el,SleighBase *trans)
     flowthruindex = -1;
 }
 
+void Constructor::restoreXml(XmlStream &s,SleighBase *trans)
+
+{				// Same as above, from the open <constructor> element of a stream.
+				// Only the context changes and templates are read as trees
+  parent = (SubtableSymbol *)trans->findSymbol(s.getAttributeValue("parent").toUnsigned());
+  firstwhitespace = s.getAttributeValue("first").toSigned();
+  minimumlength = s.getAttributeValue("length").toSigned();
+  {
+    string src_and_line = s.getAttributeValue("line").str();
+    size_t pos = src_and_line.find(":");
+    src_index = stoi(src_and_line.substr(0, pos),NULL,10);
+    lineno = stoi(src_and_line.substr(pos+1,src_and_line.length()),NULL,10);
+  }
+  while(s.peekElement() != (const string *)0) {
+    const string &nm(s.openElement());
+    if (nm == "oper") {
+      OperandSymbol *sym = (OperandSymbol *)trans->findSymbol(s.getAttributeValue("id").toUnsigned());
+      operands.push_back(sym);
+      s.closeElement();
+    }
+    else if (nm == "print") {
+      printpiece.push_back(s.getAttributeValue("piece").str());
+      s.closeElement();
+    }
+    else if (nm == "opprint") {
+      int4 index = s.getAttributeValue("id").toSigned();
+      string operstring = "\n ";
+      operstring[1] = ('A' + index);
+      printpiece.push_back(operstring);
+      s.closeElement();
+    }
+    else {
+      Element *el = s.readCurrent();
+      try {
+	if (el->getName() == "context_op") {
+	  ContextOp *c_op = new ContextOp();
+	  context.push_back(c_op);
+	  c_op->restoreXml(el,trans);
+	}
+	else if (el->getName() == "commit") {
+	  ContextCommit *c_op = new ContextCommit();
+	  context.push_back(c_op);
+	  c_op->restoreXml(el,trans);
+	}
+	else {
+	  ConstructTpl *cur = new ConstructTpl();
+	  int4 sectionid = cur->restoreXml(el,trans);
+	  if (sectionid < 0) {
+	    if (templ != (ConstructTpl *)0)
+	      throw LowlevelError("Duplicate main section");
+	    templ = cur;
+	  }
+	  else {
+	    while(namedtempl.size() <= sectionid)
+	      namedtempl.push_back((ConstructTpl *)0);
+	    if (namedtempl[sectionid] != (ConstructTpl *)0)
+	      throw LowlevelError("Duplicate named section");
+	    namedtempl[sectionid] = cur;
+	  }
+	}
+      } catch(...) {
+	delete el;
+	throw;
+      }
+      delete el;
+    }
+  }
+  s.closeElement();
+  pattern = (TokenPattern *)0;
+  if ((printpiece.size()==1)&&(printpiece[0][0]=='\n'))
+    flowthruindex = printpiece[0][1] - 'A';
+  else
+    flowthruindex = -1;
+}
+
 void Constructor::orderOperands(void)
 
 {
@@ -1885,6 +2039,7 @@ SubtableSymbol::SubtableSymbol(const string &nm) : TripleSymbol(nm)
   beingbuilt = false;
   pattern = (TokenPattern *)0;
   decisiontree = (DecisionNode *)0;
+  decisiontable = (DecisionTable *)0;
   errors = 0;
 }
 
@@ -1895,6 +2050,8 @@ SubtableSymbol::~SubtableSymbol(void)
     delete pattern;
   if (decisiontree != (DecisionNode *)0)
     delete decisiontree;
+  if (decisiontable != (DecisionTable *)0)
+    delete decisiontable;
   vector<Constructor *>::iterator iter;
   for(iter=construct.begin();iter!=construct.end();++iter)
     delete *iter;
@@ -1950,6 +2107,7 @@ void SubtableSymbol::restoreXml(const Element *el,SleighBase *trans)
     else if ((*iter)->getName() == "decision") {
       decisiontree = new DecisionNode();
       decisiontree->restoreXml(*iter,(DecisionNode *)0,this);
+      decisiontable = new DecisionTable(decisiontree);
     }
     ++iter;
   }
@@ -1958,6 +2116,31 @@ void SubtableSymbol::restoreXml(const Element *el,SleighBase *trans)
   errors = 0;
 }
 
+void SubtableSymbol::restoreXml(XmlStream &s,SleighBase *trans)
+
+{				// Constructors and decision nodes are restored as they are read
+  construct.reserve(s.getAttributeValue("numct").toUnsigned());
+  while(s.peekElement() != (const string *)0) {
+    const string &nm(s.openElement());
+    if (nm == "constructor") {
+      Constructor *ct = new Constructor();
+      addConstructor(ct);
+      ct->restoreXml(s,trans);
+    }
+    else if (nm == "decision") {
+      decisiontree = new DecisionNode();
+      decisiontree->restoreXml(s,(DecisionNode *)0,this);
+      decisiontable = new DecisionTable(decisiontree);
+    }
+    else
+      s.closeElement();
+  }
+  s.closeElement();
+  pattern = (TokenPattern *)0;
+  beingbuilt = false;
+  errors = 0;
+}
+
 void SubtableSymbol::buildDecisionTree(DecisionProperties &props)
 
 {				// Associate pattern disjoints to constructors
@@ -1973,6 +2156,7 @@ void SubtableSymbol::buildDecisionTree(DecisionProperties &props)
 	decisiontree->addConstructorPair(pat->getDisjoint(j),construct[i]);
   }
   decisiontree->split(props);	// Create the decision strategy
+  decisiontable = new DecisionTable(decisiontree);
 }
 
 TokenPattern *SubtableSymbol::buildPattern(ostream &s)
@@ -2340,6 +2524,8 @@ Constructor *DecisionNode::resolve(ParserWalker &walker) const
     s << walker.getAddr().getShortcut();
     walker.getAddr().printRaw(s);
     s << ": Unable to resolve constructor";
+    if (walker.getParserContext()->isOverrun())
+      throw ShortFetchError(s.str());
     throw BadDataError(s.str());
   }
   uintm val;
@@ -2350,6 +2536,227 @@ Constructor *DecisionNode::resolve(ParserWalker &walker) const
   return children[val]->resolve(walker);
 }
 
+bool DecisionTable::addBlock(const PatternBlock *block,int4 &off,int4 &start,int4 &num)
+
+{				// Append the words of a pattern piece, return false if it never matches
+  off = 0;
+  start = words.size() / 2;
+  num = 0;
+  if (block == (const PatternBlock *)0) return true; // No piece, matches anything
+  if (block->alwaysFalse()) return false;
+  if (block->alwaysTrue()) return true;
+  off = block->getOffset();
+  const vector<uintm> &maskvec(block->getMaskVector());
+  const vector<uintm> &valvec(block->getValueVector());
+  for(int4 i=0;i<maskvec.size();++i) {
+    words.push_back(maskvec[i]);
+    words.push_back(valvec[i]);
+  }
+  num = maskvec.size();
+  return true;
+}
+
+void DecisionTable::buildWindow(Node &node)
+
+{				// Lay out the instruction pieces of a leaf over a common window, if they fit
+  node.windowoff = -1;
+  node.windowlast = -1;
+  if (node.count < window_minimum) return;
+  int4 low = -1;
+  int4 high = 0;
+  for(int4 i=0;i<node.count;++i) {
+    const Leaf &leaf(leaves[node.first + i]);
+    if (leaf.never || leaf.instrnum == 0) continue;
+    if (low < 0 || leaf.instroff < low)
+      low = leaf.instroff;
+    int4 end = leaf.instroff + leaf.instrnum * sizeof(uintm);
+    if (end > high)
+      high = end;
+    int4 last = end - sizeof(uintm);
+    if (last > node.windowlast)
+      node.windowlast = last;
+  }
+  if (low < 0)
+    low = 0;			// No instruction bytes are tested at all
+  else if (high - low > 16)
+    return;
+  node.windowoff = low;
+  for(int4 i=0;i<node.count;++i) {
+    const Leaf &leaf(leaves[node.first + i]);
+    uint1 *mask = windowmask.data() + 16*(node.first + i);
+    uint1 *val = windowval.data() + 16*(node.first + i);
+    if (leaf.never) {
+      val[0] = 1;		// Can't equal the masked byte, which is 0
+      continue;
+    }
+    const uintm *word = words.data() + 2*leaf.instrstart;
+    for(int4 j=0;j<leaf.instrnum;++j) {
+      int4 pos = leaf.instroff - low + j*sizeof(uintm);
+      for(int4 k=0;k<sizeof(uintm);++k) {	// Words are big endian in the stream
+	int4 sa = 8*(sizeof(uintm)-1-k);
+	mask[pos + k] = (uint1)(word[0] >> sa);
+	val[pos + k] = (uint1)(word[1] >> sa);
+      }
+      word += 2;
+    }
+  }
+}
+
+int4 DecisionTable::flatten(const DecisionNode *node)
+
+{				// Append node and everything below it, return its index
+  int4 res = nodes.size();
+  nodes.emplace_back();
+  nodes[res].startbit = node->startbit;
+  nodes[res].bitsize = node->bitsize;
+  nodes[res].contextdecision = node->contextdecision;
+  nodes[res].windowoff = -1;
+  nodes[res].windowlast = -1;
+  if (node->bitsize == 0) {	// The node is terminal
+    nodes[res].first = leaves.size();
+    nodes[res].count = node->list.size();
+    for(int4 i=0;i<node->list.size();++i) {
+      const DisjointPattern *pat = node->list[i].first;
+      Leaf leaf;
+      leaf.ct = node->list[i].second;
+      leaf.never = !addBlock(pat->getPatternBlock(true),leaf.contextoff,leaf.contextstart,leaf.contextnum);
+      leaf.never = !addBlock(pat->getPatternBlock(false),leaf.instroff,leaf.instrstart,leaf.instrnum) || leaf.never;
+      leaves.push_back(leaf);
+    }
+    windowmask.resize(16*leaves.size(),0);
+    windowval.resize(16*leaves.size(),0);
+    buildWindow(nodes[res]);
+    return res;
+  }
+  int4 first = children.size();
+  int4 count = node->children.size();
+  nodes[res].first = first;
+  nodes[res].count = count;
+  children.resize(first + count);
+  for(int4 i=0;i<count;++i) {
+    int4 child = flatten(node->children[i]);
+    children[first + i] = child;
+  }
+  return res;
+}
+
+bool DecisionTable::isContextMatch(const Leaf &leaf,ParserWalker &walker) const
+
+{
+  const uintm *word = words.data() + 2*leaf.contextstart;
+  int4 off = leaf.contextoff;
+  for(int4 i=0;i<leaf.contextnum;++i) {
+    uintm data = walker.getContextBytes(off,sizeof(uintm));
+    if ((word[0] & data) != word[1]) return false;
+    word += 2;
+    off += sizeof(uintm);
+  }
+  return true;
+}
+
+bool DecisionTable::isMatch(const Leaf &leaf,ParserWalker &walker) const
+
+{				// Same as DisjointPattern::isMatch for the pattern flattened into leaf
+  if (leaf.never) return false;
+  if (!isContextMatch(leaf,walker)) return false;
+  const uintm *word = words.data() + 2*leaf.instrstart;
+  int4 off = leaf.instroff;
+  for(int4 i=0;i<leaf.instrnum;++i) {
+    uintm data = walker.getInstructionBytes(off,sizeof(uintm));
+    if ((word[0] & data) != word[1]) return false;
+    word += 2;
+    off += sizeof(uintm);
+  }
+  return true;
+}
+
+/// Test up to 32 patterns laid out over the same 16 byte window at once
+/// \param mask is the 16 mask bytes of the first pattern, followed by those of the others
+/// \param val is the 16 value bytes of the first pattern, followed by those of the others
+/// \param num is the number of patterns to test
+/// \param bytes is the window of instruction bytes
+/// \return a bit mask with bit i set if the bytes match pattern i
+uint4 DecisionTable::matchWindow(const uint1 *mask,const uint1 *val,int4 num,const uint1 *bytes)
+
+{
+  uint4 res = 0;
+  int4 i = 0;
+#if defined(__SSE2__)
+  __m128i data = _mm_loadu_si128((const __m128i *)bytes);
+#if defined(__AVX2__)
+  __m256i data2 = _mm256_broadcastsi128_si256(data);
+  for(;i+1<num;i+=2) {		// Two patterns per comparison
+    __m256i m = _mm256_loadu_si256((const __m256i *)(mask + 16*i));
+    __m256i v = _mm256_loadu_si256((const __m256i *)(val + 16*i));
+    uint4 eq = (uint4)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(data2,m),v));
+    if ((eq & 0xffff) == 0xffff)
+      res |= 1u << i;
+    if ((eq >> 16) == 0xffff)
+      res |= 1u << (i+1);
+  }
+#endif
+  for(;i<num;++i) {
+    __m128i m = _mm_loadu_si128((const __m128i *)(mask + 16*i));
+    __m128i v = _mm_loadu_si128((const __m128i *)(val + 16*i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(data,m),v)) == 0xffff)
+      res |= 1u << i;
+  }
+#else
+  uint8 d0,d1;
+  memcpy(&d0,bytes,8);
+  memcpy(&d1,bytes+8,8);
+  for(;i<num;++i) {		// Compare 8 bytes at a time, byte order does not matter
+    uint8 m[2],v[2];
+    memcpy(m,mask + 16*i,16);
+    memcpy(v,val + 16*i,16);
+    if (((d0 & m[0]) == v[0]) && ((d1 & m[1]) == v[1]))
+      res |= 1u << i;
+  }
+#endif
+  return res;
+}
+
+Constructor *DecisionTable::resolve(ParserWalker &walker) const
+
+{				// Iterative version of DecisionNode::resolve
+  const Node *node = &nodes[0];
+  while(node->bitsize != 0) {
+    uintm val;
+    if (node->contextdecision)
+      val = walker.getContextBits(node->startbit,node->bitsize);
+    else
+      val = walker.getInstructionBits(node->startbit,node->bitsize);
+    node = &nodes[ children[node->first + val] ];
+  }
+  const Leaf *leaf = leaves.data() + node->first;
+  // A window can't be used if some word is past the buffer, as reading it is an error
+  if (node->windowoff >= 0 && (int4)walker.getOffset(-1) + node->windowlast < 16) {
+    uint1 bytes[16];
+    walker.getInstructionWindow(node->windowoff,node->windowlast + sizeof(uintm) - node->windowoff,bytes);
+    for(int4 i=0;i<node->count;i+=32) {
+      int4 num = node->count - i;
+      if (num > 32)
+	num = 32;
+      uint4 matches = matchWindow(windowmask.data() + 16*(node->first + i),windowval.data() + 16*(node->first + i),num,bytes);
+      for(int4 j=0;matches!=0;++j,matches>>=1)
+	if ((matches & 1) != 0 && isContextMatch(leaf[i+j],walker))
+	  return leaf[i+j].ct;
+    }
+  }
+  else {
+    for(int4 i=0;i<node->count;++i)
+      if (isMatch(leaf[i],walker))
+	return leaf[i].ct;
+  }
+  ostringstream s;
+  s << walker.getAddr().getShortcut();
+  walker.getAddr().printRaw(s);
+  s << ": Unable to resolve constructor";
+  if (walker.getParserContext()->isOverrun())
+    throw ShortFetchError(s.str());	// The bytes that were not fetched may match
+  throw BadDataError(s.str());
+}
+
 void DecisionNode::saveXml(ostream &s) const
 
 {
@@ -2419,6 +2826,41 @@ void DecisionNode::restoreXml(const Element *el,DecisionNode *par,SubtableSymbol
   }
 }
 
+void DecisionNode::restoreXml(XmlStream &s,DecisionNode *par,SubtableSymbol *sub)
+
+{				// Same as above, from the open <decision> element of a stream
+  parent = par;
+  num = s.getAttributeValue("number").toSigned();
+  contextdecision = s.getAttributeValue("context").toBool();
+  startbit = s.getAttributeValue("start").toSigned();
+  bitsize = s.getAttributeValue("size").toSigned();
+  while(s.peekElement() != (const string *)0) {
+    const string &nm(s.openElement());
+    if (nm == "pair") {
+      Constructor *ct = sub->getConstructor(s.getAttributeValue("id").toUnsigned());
+      Element *el = s.readElement();
+      DisjointPattern *pat;
+      try {
+	pat = DisjointPattern::restoreDisjoint(el);
+      } catch(...) {
+	delete el;
+	throw;
+      }
+      delete el;
+      list.push_back(pair<DisjointPattern *,Constructor *>(pat,ct));
+      s.closeElement();
+    }
+    else if (nm == "decision") {
+      DecisionNode *subnode = new DecisionNode();
+      children.push_back(subnode);
+      subnode->restoreXml(s,this,sub);
+    }
+    else
+      s.closeElement();
+  }
+  s.closeElement();
+}
+
 static void calc_maskword(int4 sbit,int4 ebit,int4 &num,int4 &shift,uintm &mask)
 
 {
@@ -18,9 +18,10 @@
 
 #include "semantics.hh"
 #include "slghpatexpress.hh"
+#include "xmlstream.hh"
 
 class SleighBase;		// Forward declaration
-class SleighSymbol {
+class SleighSymbol : public ArenaObject {
   friend class SymbolTable;
 public:
   enum symbol_type { space_symbol, token_symbol, userop_symbol, value_symbol, valuemap_symbol,
@@ -41,8 +42,10 @@ public:
   virtual symbol_type getType(void) const { return dummy_symbol; }
   virtual void saveXmlHeader(ostream &s) const;
   void restoreXmlHeader(const Element *el);
+  void restoreXmlHeader(XmlStream &s);
   virtual void saveXml(ostream &s) const {}
   virtual void restoreXml(const Element *el,SleighBase *trans) {}
+  virtual void restoreXml(XmlStream &s,SleighBase *trans);	// From the open element, which is closed
 };
 
 struct SymbolCompare {
@@ -74,11 +77,13 @@ class SymbolTable {
   SymbolScope *skipScope(int4 i) const;
   SleighSymbol *findSymbolInternal(SymbolScope *scope,const string &nm) const;
   void renumber(void);
+  static SleighSymbol *newSymbolShell(const string &headname);
+  void addSymbolShell(SleighSymbol *sym);
 public:
   SymbolTable(void) { curscope = (SymbolScope *)0; }
   ~SymbolTable(void);
   SymbolScope *getCurrentScope(void) { return curscope; }
-  SymbolScope *getGlobalScope(void) { return table[0]; }
+  SymbolScope *getGlobalScope(void) const { return table[0]; }
   
   void setCurrentScope(SymbolScope *scope) { curscope = scope; }
   void addScope(void);		// Add new scope off of current scope, make it current
@@ -92,7 +97,9 @@ public:
   void replaceSymbol(SleighSymbol *a,SleighSymbol *b);
   void saveXml(ostream &s) const;
   void restoreXml(const Element *el,SleighBase *trans);
+  void restoreXml(XmlStream &s,SleighBase *trans);
   void restoreSymbolHeader(const Element *el);
+  void restoreSymbolHeader(XmlStream &s);
   void purge(void);
 };
 
@@ -151,7 +158,7 @@ public:
   virtual PatternExpression *getPatternExpression(void) const=0;
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const=0;
   virtual int4 getSize(void) const { return 0; }	// Size out of context
-  virtual void print(ostream &s,ParserWalker &walker) const=0;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const=0;
   virtual void collectLocalValues(vector<uintb> &results) const {}
 };
   
@@ -186,7 +193,7 @@ public:
   EpsilonSymbol(void) {}	// For use with restoreXml
   EpsilonSymbol(const string &nm,AddrSpace *spc) : PatternlessSymbol(nm) { const_space=spc; }
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return epsilon_symbol; }
   virtual VarnodeTpl *getVarnode(void) const;
   virtual void saveXml(ostream &s) const;
@@ -204,7 +211,7 @@ public:
   virtual PatternValue *getPatternValue(void) const { return patval; }
   virtual PatternExpression *getPatternExpression(void) const { return patval; }
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return value_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
@@ -220,7 +227,7 @@ public:
   ValueMapSymbol(const string &nm,PatternValue *pv,const vector<intb> &vt) : ValueSymbol(nm,pv) { valuetable=vt; checkTableFill(); }
   virtual Constructor *resolve(ParserWalker &walker);
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return valuemap_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
@@ -235,7 +242,7 @@ public:
   NameSymbol(void) {}		// For use with restoreXml
   NameSymbol(const string &nm,PatternValue *pv,const vector<string> &nt) : ValueSymbol(nm,pv) { nametable=nt; checkTableFill(); }
   virtual Constructor *resolve(ParserWalker &walker);
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return name_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
@@ -253,7 +260,7 @@ public:
   virtual VarnodeTpl *getVarnode(void) const;
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
   virtual int4 getSize(void) const { return fix.size; }
-  virtual void print(ostream &s,ParserWalker &walker) const {
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const {
     s << getName(); }
   virtual void collectLocalValues(vector<uintb> &results) const;
   virtual symbol_type getType(void) const { return varnode_symbol; }
@@ -303,7 +310,7 @@ public:
   virtual Constructor *resolve(ParserWalker &walker);
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
   virtual int4 getSize(void) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return varnodelist_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
@@ -349,7 +356,7 @@ public:
   virtual PatternExpression *getPatternExpression(void) const { return localexp; }
   virtual void getFixedHandle(FixedHandle &hnd,ParserWalker &walker) const;
   virtual int4 getSize(void) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual void collectLocalValues(vector<uintb> &results) const;
   virtual symbol_type getType(void) const { return operand_symbol; }
   virtual void saveXml(ostream &s) const;
@@ -367,7 +374,7 @@ public:
   virtual VarnodeTpl *getVarnode(void) const;
   virtual PatternExpression *getPatternExpression(void) const { return patexp; }
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return start_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
@@ -384,7 +391,7 @@ public:
   virtual VarnodeTpl *getVarnode(void) const;
   virtual PatternExpression *getPatternExpression(void) const { return patexp; }
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return end_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
@@ -399,7 +406,7 @@ public:
   virtual VarnodeTpl *getVarnode(void) const;
   virtual PatternExpression *getPatternExpression(void) const { throw SleighError("Cannot use symbol in pattern"); }
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return start_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
@@ -414,14 +421,14 @@ public:
   virtual VarnodeTpl *getVarnode(void) const;
   virtual PatternExpression *getPatternExpression(void) const { throw SleighError("Cannot use symbol in pattern"); }
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const;
-  virtual void print(ostream &s,ParserWalker &walker) const;
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const;
   virtual symbol_type getType(void) const { return start_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
   virtual void restoreXml(const Element *el,SleighBase *trans);
 };
 
-class ContextChange {		// Change to context command
+class ContextChange : public ArenaObject {		// Change to context command
 public:
   virtual ~ContextChange(void) {}
   virtual void validate(void) const=0;
@@ -463,7 +470,7 @@ public:
 };
 
 class SubtableSymbol;
-class Constructor {		// This is NOT a symbol
+class Constructor : public ArenaObject {		// This is NOT a symbol
   TokenPattern *pattern;
   SubtableSymbol *parent;
   PatternEquation *pateq;
@@ -509,9 +516,9 @@ public:
   ConstructTpl *getNamedTempl(int4 secnum) const;
   int4 getNumSections(void) const { return namedtempl.size(); }
   void printInfo(ostream &s) const;
-  void print(ostream &s,ParserWalker &pos) const;
-  void printMnemonic(ostream &s,ParserWalker &walker) const;
-  void printBody(ostream &s,ParserWalker &walker) const;
+  void print(PrintBuffer &s,ParserWalker &pos) const;
+  void printMnemonic(PrintBuffer &s,ParserWalker &walker) const;
+  void printBody(PrintBuffer &s,ParserWalker &walker) const;
   void removeTrailingSpace(void);
   void applyContext(ParserWalkerChange &walker) const {
     vector<ContextChange *>::const_iterator iter;
@@ -523,8 +530,10 @@ public:
   void setError(bool val) const { inerror = val; }
   bool isError(void) const { return inerror; }
   bool isRecursive(void) const;
+  bool hasCommits(void) const;
   void saveXml(ostream &s) const;
   void restoreXml(const Element *el,SleighBase *trans);
+  void restoreXml(XmlStream &s,SleighBase *trans);
 };
 
 class DecisionProperties {
@@ -537,7 +546,8 @@ public:
   const vector<pair<Constructor *, Constructor *> > &getConflictErrors(void) const { return conflicterrors; }
 };
 
-class DecisionNode {
+class DecisionNode : public ArenaObject {
+  friend class DecisionTable;
   vector<pair<DisjointPattern *,Constructor *> > list;
   vector<DecisionNode *> children;
   int4 num;			// Total number of patterns we distinguish
@@ -559,6 +569,47 @@ public:
   void orderPatterns(DecisionProperties &props);
   void saveXml(ostream &s) const;
   void restoreXml(const Element *el,DecisionNode *par,SubtableSymbol *sub);
+  void restoreXml(XmlStream &s,DecisionNode *par,SubtableSymbol *sub);
+};
+
+// The decision tree of a table flattened into arrays, which is what is walked when
+// resolving constructors. Nodes refer to their children by index, and each pattern at a
+// leaf is reduced to runs of (mask,value) words compared directly against the
+// instruction and context bytes, without going through the virtual Pattern::isMatch.
+// At leaves with many patterns, the instruction pieces are also laid out as byte masks
+// over a common 16 byte window, so they can all be tested against one copy of the bytes
+class DecisionTable {
+  enum { window_minimum = 4 };	// Fewest patterns at a leaf for which a window is used
+  struct Node {
+    int4 startbit,bitsize;	// Bits on which to base the decision, bitsize is 0 for a leaf
+    bool contextdecision;	// True if the bits are taken from the context
+    int4 first;			// First child (in children), or first pattern (in leaves) for a leaf
+    int4 count;			// Number of children, or of patterns for a leaf
+    int4 windowoff;		// Offset of the byte window of a leaf, -1 if it has none
+    int4 windowlast;		// Offset of the last instruction word read by the patterns of the leaf
+  };
+  struct Leaf {
+    Constructor *ct;		// Constructor selected if the pattern matches
+    bool never;			// True if the pattern can never match
+    int4 contextoff,instroff;	// Byte offset of the first word of each piece
+    int4 contextstart,instrstart;	// Index of the first (mask,value) pair of each piece in words
+    int4 contextnum,instrnum;	// Number of (mask,value) pairs of each piece
+  };
+  vector<Node> nodes;		// All nodes, the root is the first
+  vector<int4> children;	// Child indices of all the internal nodes
+  vector<Leaf> leaves;		// Patterns of all the leaves, in the order they are tried
+  vector<uintm> words;		// Interleaved mask and value words of all the patterns
+  vector<uint1> windowmask;	// 16 mask bytes for each pattern, over the window of its leaf
+  vector<uint1> windowval;	// 16 value bytes for each pattern
+  bool addBlock(const PatternBlock *block,int4 &off,int4 &start,int4 &num);
+  void buildWindow(Node &node);
+  int4 flatten(const DecisionNode *node);
+  bool isContextMatch(const Leaf &leaf,ParserWalker &walker) const;
+  bool isMatch(const Leaf &leaf,ParserWalker &walker) const;
+  static uint4 matchWindow(const uint1 *mask,const uint1 *val,int4 num,const uint1 *bytes);
+public:
+  DecisionTable(const DecisionNode *root) { flatten(root); }
+  Constructor *resolve(ParserWalker &walker) const;
 };
 
 class SubtableSymbol : public TripleSymbol {
@@ -566,8 +617,9 @@ class SubtableSymbol : public TripleSymbol {
   bool beingbuilt,errors;
   vector<Constructor *> construct; // All the Constructors in this table
   DecisionNode *decisiontree;
+  DecisionTable *decisiontable;	// Flattened form of decisiontree, used by resolve
 public:
-  SubtableSymbol(void) { pattern = (TokenPattern *)0; decisiontree = (DecisionNode *)0; } // For use with restoreXml
+  SubtableSymbol(void) { pattern = (TokenPattern *)0; decisiontree = (DecisionNode *)0; decisiontable = (DecisionTable *)0; } // For use with restoreXml
   SubtableSymbol(const string &nm);
   virtual ~SubtableSymbol(void);
   bool isBeingBuilt(void) const { return beingbuilt; }
@@ -578,18 +630,19 @@ public:
   TokenPattern *getPattern(void) const { return pattern; }
   int4 getNumConstructors(void) const { return construct.size(); }
   Constructor *getConstructor(uintm id) const { return construct[id]; }
-  virtual Constructor *resolve(ParserWalker &walker) { return decisiontree->resolve(walker); }
+  virtual Constructor *resolve(ParserWalker &walker) { return decisiontable->resolve(walker); }
   virtual PatternExpression *getPatternExpression(void) const { throw SleighError("Cannot use subtable in expression"); }
   virtual void getFixedHandle(FixedHandle &hand,ParserWalker &walker) const {
     throw SleighError("Cannot use subtable in expression"); }
   virtual int4 getSize(void) const { return -1; }
-  virtual void print(ostream &s,ParserWalker &walker) const {
+  virtual void print(PrintBuffer &s,ParserWalker &walker) const {
     throw SleighError("Cannot use subtable in expression"); }
   virtual void collectLocalValues(vector<uintb> &results) const;
   virtual symbol_type getType(void) const { return subtable_symbol; }
   virtual void saveXml(ostream &s) const;
   virtual void saveXmlHeader(ostream &s) const;
   virtual void restoreXml(const Element *el,SleighBase *trans);
+  virtual void restoreXml(XmlStream &s,SleighBase *trans);
 };
 
 class MacroSymbol : public SleighSymbol { // A user-defined pcode-macro
@@ -21,6 +21,7 @@
 
 #include "error.hh"
 #include "xml.hh"
+#include <atomic>
 
 /// \brief Fundemental address space types
 ///
@@ -94,7 +95,7 @@ private:
   spacetype type;		///< Type of space (PROCESSOR, CONSTANT, INTERNAL, ...)
   AddrSpaceManager *manage;     ///< Manager for processor using this space
   const Translate *trans;	///< Processor translator (for register names etc) for this space
-  int4 refcount;		///< Number of managers using this space
+  atomic<int4> refcount;	///< Number of managers using this space (managers may be on different threads)
   uint4 flags;			///< Attributes of the space
   uintb highest;	        ///< Highest (byte) offset into this space
   uintb pointerLowerBound;	///< Offset below which we don't search for pointers
@@ -439,9 +439,7 @@ AddrSpaceManager::~AddrSpaceManager(void)
   for(vector<AddrSpace *>::iterator iter=baselist.begin();iter!=baselist.end();++iter) {
     AddrSpace *spc = *iter;
     if (spc == (AddrSpace *)0) continue;
-    if (spc->refcount > 1)
-      spc->refcount -= 1;
-    else
+    if (--spc->refcount == 0)	// Atomic, as spaces may be shared with managers on other threads
       delete spc;
   }
   for(int4 i=0;i<resolvelist.size();++i) {
@@ -54,6 +54,17 @@ struct BadDataError : public LowlevelError {
   BadDataError(const string &s) : LowlevelError(s) {}
 };
 
+/// \brief Exception for an instruction that could not be parsed from the bytes fetched for it
+///
+/// Only the first bytes of an instruction may be fetched at first. If the parse fails after
+/// reading past them, it may still succeed once the rest are fetched.
+struct ShortFetchError : public BadDataError {
+  /// \brief Constructor
+  ///
+  /// \param s is a more verbose description of the error
+  ShortFetchError(const string &s) : BadDataError(s) {}
+};
+
 class Translate;
 
 /// \brief Object for describing how a space should be truncated
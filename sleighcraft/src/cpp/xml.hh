@@ -268,6 +268,15 @@ public:
   /// \return the in-memory DOM tree
   Document *openDocument(const string &filename);
 
+  /// \brief Decode an XML document from a buffer in the \e packed binary format
+  ///
+  /// The buffer is not referenced after decoding, so it may be a memory-mapped file.
+  /// An XmlError is thrown if the buffer is not a valid packed document. See XmlPack.
+  /// \param buf is the start of the packed data
+  /// \param size is the number of bytes in the buffer
+  /// \return the in-memory DOM tree
+  Document *unpackDocument(const uint1 *buf,int4 size);
+
   /// \brief Register the given XML Element object under its tag name
   ///
   /// Only one Element can be stored on \b this object per tag name.
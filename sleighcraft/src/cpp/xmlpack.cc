@@ -0,0 +1,216 @@
+/**
+ *  Copyright 2021 StarCrossTech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "xmlpack.hh"
+
+const uint1 XmlPack::magic[4] = { 0x7f, 'S', 'L', 'P' };
+const uint1 XmlPack::version = 1;
+
+/// \param buf is the start of the data
+/// \param size is the number of bytes available
+/// \return \b true if the data starts with the packed document header
+bool XmlPack::isPacked(const uint1 *buf,int4 size)
+
+{
+  if (size < 5) return false;
+  for(int4 i=0;i<4;++i)
+    if (buf[i] != magic[i]) return false;
+  return true;
+}
+
+/// \param str is the string to look up
+/// \return the index of the string in the table
+uint4 XmlPack::internString(const string &str)
+
+{
+  map<string,uint4>::iterator iter = strindex.find(str);
+  if (iter != strindex.end())
+    return (*iter).second;
+  uint4 res = strings.size();
+  iter = strindex.insert(pair<string,uint4>(str,res)).first;
+  strings.push_back(&(*iter).first);
+  return res;
+}
+
+/// \param el is the root of the subtree
+void XmlPack::collectStrings(const Element *el)
+
+{
+  internString(el->getName());
+  int4 num = el->getNumAttributes();
+  for(int4 i=0;i<num;++i) {
+    internString(el->getAttributeName(i));
+    internString(el->getAttributeValue(i));
+  }
+  internString(el->getContent());
+  const List &children(el->getChildren());
+  for(List::const_iterator iter=children.begin();iter!=children.end();++iter)
+    collectStrings(*iter);
+}
+
+/// \param s is the output stream
+/// \param val is the value to write
+void XmlPack::writeNumber(ostream &s,uint8 val)
+
+{
+  do {
+    uint1 byte = val & 0x7f;
+    val >>= 7;
+    if (val != 0)
+      byte |= 0x80;
+    s.put((char)byte);
+  } while(val != 0);
+}
+
+/// \param s is the output stream
+/// \param el is the root of the subtree
+void XmlPack::writeElement(ostream &s,const Element *el) const
+
+{
+  writeNumber(s,(*strindex.find(el->getName())).second);
+  int4 num = el->getNumAttributes();
+  writeNumber(s,num);
+  for(int4 i=0;i<num;++i) {
+    writeNumber(s,(*strindex.find(el->getAttributeName(i))).second);
+    writeNumber(s,(*strindex.find(el->getAttributeValue(i))).second);
+  }
+  writeNumber(s,(*strindex.find(el->getContent())).second);
+  const List &children(el->getChildren());
+  writeNumber(s,children.size());
+  for(List::const_iterator iter=children.begin();iter!=children.end();++iter)
+    writeElement(s,*iter);
+}
+
+/// \param s is the output stream
+/// \param root is the root element of the document
+void XmlPack::pack(ostream &s,const Element *root)
+
+{
+  strindex.clear();
+  strings.clear();
+  internString("");		// Index 0 is always the empty string
+  collectStrings(root);
+
+  s.write((const char *)magic,4);
+  s.put((char)version);
+  writeNumber(s,strings.size());
+  for(int4 i=0;i<strings.size();++i) {
+    const string &str(*strings[i]);
+    writeNumber(s,str.size());
+    s.write(str.data(),str.size());
+  }
+  writeElement(s,root);
+}
+
+uint4 XmlUnpack::readNumber(void)
+
+{
+  uint8 res = 0;
+  int4 shift = 0;
+  for(;;) {
+    if (cur >= end || shift > 28)
+      throw XmlError("Corrupt packed document");
+    uint1 byte = *cur++;
+    res |= ((uint8)(byte & 0x7f)) << shift;
+    if ((byte & 0x80) == 0) break;
+    shift += 7;
+  }
+  if (res > 0xffffffff)
+    throw XmlError("Corrupt packed document");
+  return (uint4)res;
+}
+
+const string &XmlUnpack::readString(void)
+
+{
+  uint4 index = readNumber();
+  if (index >= strings.size())
+    throw XmlError("Bad string index in packed document");
+  return strings[index];
+}
+
+/// \param el is the (already allocated) element to fill in
+void XmlUnpack::readElement(Element *el)
+
+{
+  el->setName(readString());
+  uint4 num = readNumber();
+  for(uint4 i=0;i<num;++i) {
+    const string &nm(readString());
+    el->addAttribute(nm,readString());
+  }
+  const string &content(readString());
+  if (!content.empty())
+    el->addContent(content.data(),0,content.size());
+  num = readNumber();
+  for(uint4 i=0;i<num;++i) {
+    Element *child = new Element(el);
+    el->addChild(child);	// Attach before reading, so it is freed if an exception is thrown
+    readElement(child);
+  }
+}
+
+/// \return the decoded document, owned by the caller
+Document *XmlUnpack::unpack(void)
+
+{
+  if (!XmlPack::isPacked(cur,end-cur))
+    throw XmlError("Not a packed document");
+  if (cur[4] != XmlPack::version)
+    throw XmlError("Unsupported packed document version");
+  cur += 5;
+  uint4 numstrings = readNumber();
+  strings.clear();
+  strings.reserve(numstrings);
+  for(uint4 i=0;i<numstrings;++i) {
+    uint4 len = readNumber();
+    if (len > end - cur)
+      throw XmlError("Corrupt packed document");
+    strings.emplace_back((const char *)cur,len);
+    cur += len;
+  }
+  Document *doc = new Document();
+  try {
+    Element *root = new Element(doc);
+    doc->addChild(root);
+    readElement(root);
+  } catch(XmlError &err) {
+    delete doc;
+    throw;
+  }
+  return doc;
+}
+
+void xml_pack(ostream &s,const Element *root)
+
+{
+  XmlPack packer;
+  packer.pack(s,root);
+}
+
+Document *xml_unpack(const uint1 *buf,int4 size)
+
+{
+  XmlUnpack unpacker(buf,size);
+  return unpacker.unpack();
+}
+
+Document *DocumentStorage::unpackDocument(const uint1 *buf,int4 size)
+
+{
+  doclist.push_back((Document *)0);
+  doclist.back() = xml_unpack(buf,size);
+  return doclist.back();
+}
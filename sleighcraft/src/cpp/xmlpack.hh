@@ -0,0 +1,84 @@
+/**
+ *  Copyright 2021 StarCrossTech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/// \file xmlpack.hh
+/// \brief A compact binary encoding of XML documents, used for pre-compiled SLEIGH specifications
+
+#ifndef __CPUI_XMLPACK__
+#define __CPUI_XMLPACK__
+
+#include "xml.hh"
+
+/// \brief Encoder and decoder for the \e packed XML format
+///
+/// A packed document holds exactly the same DOM tree as its textual counterpart, but
+/// is laid out so that it can be rebuilt without running the character scanner and parser.
+/// Every distinct tag name, attribute name, attribute value and content string is stored once
+/// in a string table at the front of the document, and the tree refers to strings by index.
+///
+/// The layout is:
+///   - 4 magic bytes followed by a 1 byte format version
+///   - the string count, then each string as its length followed by its bytes
+///   - the root element, where each element is its tag index, attribute count,
+///     (name index, value index) for each attribute, content index, child count,
+///     followed by each child element
+///
+/// All counts, lengths and indices are unsigned LEB128 integers. String index 0 is always
+/// the empty string. A packed document never starts with a byte that can begin an XML text
+/// document, so the two forms can be told apart by looking at the first few bytes.
+class XmlPack {
+  map<string,uint4> strindex;		///< Index of each string already in the table
+  vector<const string *> strings;	///< Strings in table order
+  uint4 internString(const string &str);	///< Get the table index for a string, adding it if necessary
+  void collectStrings(const Element *el);	///< Add all strings used by an element subtree to the table
+  static void writeNumber(ostream &s,uint8 val);	///< Write an unsigned LEB128 integer
+  void writeElement(ostream &s,const Element *el) const;	///< Write an element subtree
+public:
+  static const uint1 magic[4];		///< Bytes identifying a packed document
+  static const uint1 version;		///< Current version of the packed format
+  static bool isPacked(const uint1 *buf,int4 size);	///< Does the buffer hold a packed document
+  void pack(ostream &s,const Element *root);		///< Write a packed document rooted at the given element
+};
+
+/// \brief Decode a packed XML document from a memory buffer
+///
+/// The buffer is only read during unpack(), so it may be a memory-mapped file or data embedded
+/// in the executable. An XmlError is thrown if the buffer is truncated or malformed.
+class XmlUnpack {
+  const uint1 *cur;			///< Current read position
+  const uint1 *end;			///< End of the buffer
+  vector<string> strings;		///< The decoded string table
+  uint4 readNumber(void);		///< Read an unsigned LEB128 integer
+  const string &readString(void);	///< Read a string table index and return the string
+  void readElement(Element *el);	///< Fill in an element (and its children) from the buffer
+public:
+  XmlUnpack(const uint1 *buf,int4 size) { cur = buf; end = buf + size; }	///< Constructor given buffer
+  Document *unpack(void);		///< Decode the whole document
+};
+
+/// \brief Write the given XML tree to a stream in the packed format
+///
+/// \param s is the output stream, which should be opened in binary mode
+/// \param root is the root element of the tree to write
+extern void xml_pack(ostream &s,const Element *root);
+
+/// \brief Decode a packed XML document from a buffer into an in-memory document
+///
+/// \param buf is the start of the packed data
+/// \param size is the number of bytes in the buffer
+/// \return the in-memory XML document
+extern Document *xml_unpack(const uint1 *buf,int4 size);
+
+#endif
@@ -0,0 +1,567 @@
+/**
+ *  Copyright 2021 StarCrossTech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "xmlstream.hh"
+#include "xmlpack.hh"
+#include <cstring>
+#include <fstream>
+
+#ifndef _WINDOWS
+// POSIX functions for mapping files
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+#endif
+
+bool XmlView::operator==(const char *str) const
+
+{
+  return (strncmp(ptr,str,len) == 0 && str[len] == '\0');
+}
+
+/// The base is picked the way an istream with no base flags set does: a leading \b 0x
+/// is hexadecimal, any other leading \b 0 is octal, and decimal otherwise. A leading minus
+/// sign negates the value. Reading stops at the first character that is not a digit.
+/// \return the value read
+uintb XmlView::toUnsigned(void) const
+
+{
+  int4 i = 0;
+  while(i < len && (ptr[i]==' ' || ptr[i]=='\t' || ptr[i]=='\n' || ptr[i]=='\r'))
+    i += 1;
+  bool negate = false;
+  if (i < len && (ptr[i]=='-' || ptr[i]=='+')) {
+    negate = (ptr[i] == '-');
+    i += 1;
+  }
+  uintb base = 10;
+  if (i < len && ptr[i] == '0') {
+    if (i+1 < len && (ptr[i+1]=='x' || ptr[i+1]=='X')) {
+      base = 16;
+      i += 2;
+    }
+    else
+      base = 8;
+  }
+  uintb res = 0;
+  for(;i<len;++i) {
+    char c = ptr[i];
+    uintb digit;
+    if (c >= '0' && c <= '9')
+      digit = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      digit = c - 'A' + 10;
+    else
+      break;
+    if (digit >= base) break;
+    res = res * base + digit;
+  }
+  return negate ? -res : res;
+}
+
+/// \return the value read
+intb XmlView::toSigned(void) const
+
+{
+  return (intb)toUnsigned();
+}
+
+/// \return \b true if the value starts with \b t, \b 1 or \b y
+bool XmlView::toBool(void) const
+
+{
+  if (len == 0) return false;
+  char firstc = ptr[0];
+  return (firstc == 't' || firstc == '1' || firstc == 'y');
+}
+
+/// An XmlError is thrown if the current element has no such attribute.
+/// \param nm is the name of the attribute
+/// \return the attribute value
+const XmlView &XmlStream::getAttributeValue(const char *nm) const
+
+{
+  for(int4 i=0;i<attrname.size();++i)
+    if (attrname[i] == nm)
+      return attrvalue[i];
+  throw XmlError("Unknown attribute: "+string(nm));
+}
+
+/// \param buf is the start of the document
+/// \param size is the number of bytes in the document
+XmlTextStream::XmlTextStream(const char *buf,int4 size)
+
+{
+  cur = buf;
+  end = buf + size;
+}
+
+bool XmlTextStream::isNameChar(char c)
+
+{
+  if ((c>='a'&&c<='z')||(c>='A'&&c<='Z')||(c>='0'&&c<='9')) return true;
+  return (c=='_' || c==':' || c=='.' || c=='-');
+}
+
+void XmlTextStream::skipSpace(void)
+
+{
+  while(cur < end && (*cur==' ' || *cur=='\n' || *cur=='\r' || *cur=='\t'))
+    cur += 1;
+}
+
+/// \param c is the character expected next
+void XmlTextStream::expect(char c)
+
+{
+  if (cur >= end || *cur != c)
+    throw XmlError(string("Expected '") + c + "' in xml document");
+  cur += 1;
+}
+
+/// \return a view of the name, in the buffer
+XmlView XmlTextStream::scanName(void)
+
+{
+  const char *start = cur;
+  while(cur < end && isNameChar(*cur))
+    cur += 1;
+  if (cur == start)
+    throw XmlError("Expected a name in xml document");
+  return XmlView(start,cur - start);
+}
+
+/// \param nm is the name, viewed in the buffer
+/// \return the interned name
+const string &XmlTextStream::internName(const XmlView &nm)
+
+{
+  scratch.assign(nm.data(),nm.size());
+  return *names.insert(scratch).first;
+}
+
+/// Only white space may separate the markup of a specification.  This stops at the next
+/// element or end tag, or at the end of the buffer, and throws an XmlError for anything else.
+void XmlTextStream::skipSeparator(void)
+
+{
+  skipSpace();
+  if (cur >= end) return;
+  if (*cur != '<')
+    throw XmlError("Character data is not supported in a specification");
+  if (end - cur >= 2 && (cur[1] == '!' || cur[1] == '?'))
+    throw XmlError("Comments, declarations and CDATA are not supported in a specification");
+}
+
+/// \param raw is the value with references, as it appears in the buffer
+/// \param res will hold the value with each reference replaced by its character
+void XmlTextStream::unescape(const XmlView &raw,string &res) const
+
+{
+  res.clear();
+  const char *ptr = raw.data();
+  const char *stop = ptr + raw.size();
+  while(ptr < stop) {
+    if (*ptr != '&') {
+      res += *ptr++;
+      continue;
+    }
+    const char *semi = (const char *)memchr(ptr,';',stop - ptr);
+    if (semi == (const char *)0)
+      throw XmlError("Unterminated reference in xml document");
+    XmlView ref(ptr+1,semi - ptr - 1);
+    if (ref == "lt") res += '<';
+    else if (ref == "amp") res += '&';
+    else if (ref == "gt") res += '>';
+    else if (ref == "quot") res += '"';
+    else if (ref == "apos") res += '\'';
+    else
+      throw XmlError("Unknown entity reference: "+ref.str());
+    ptr = semi + 1;
+  }
+}
+
+const string *XmlTextStream::peekElement(void)
+
+{
+  if (!stack.empty() && stack.back().empty)
+    return (const string *)0;
+  skipSeparator();
+  if (cur >= end) {
+    if (!stack.empty())
+      throw XmlError("Unexpected end of xml document");
+    return (const string *)0;
+  }
+  if (end - cur >= 2 && cur[1] == '/')
+    return (const string *)0;
+  const char *save = cur;
+  cur += 1;
+  XmlView nm = scanName();
+  cur = save;
+  return &internName(nm);
+}
+
+const string &XmlTextStream::openElement(void)
+
+{
+  const string *nm = peekElement();
+  if (nm == (const string *)0)
+    throw XmlError("Missing xml element");
+  cur += 1 + nm->size();
+  attrname.clear();
+  attrvalue.clear();
+  bool needunescape = false;
+  Frame frame;
+  frame.name = nm;
+  for(;;) {
+    skipSpace();
+    if (cur < end && *cur == '/') {
+      cur += 1;
+      expect('>');
+      frame.empty = true;
+      break;
+    }
+    if (cur < end && *cur == '>') {
+      cur += 1;
+      frame.empty = false;
+      break;
+    }
+    attrname.push_back(scanName());
+    skipSpace();
+    expect('=');
+    skipSpace();
+    expect('"');
+    const char *close = (const char *)memchr(cur,'"',end - cur);
+    if (close == (const char *)0)
+      throw XmlError("Unterminated attribute value");
+    attrvalue.push_back(XmlView(cur,close - cur));
+    if (memchr(cur,'&',close - cur) != (const void *)0)
+      needunescape = true;
+    cur = close + 1;
+  }
+  if (needunescape) {		// Only now, so the storage of the values is not moved once viewed
+    if (unescaped.size() < attrvalue.size())
+      unescaped.resize(attrvalue.size());
+    for(int4 i=0;i<attrvalue.size();++i) {
+      const XmlView &raw(attrvalue[i]);
+      if (memchr(raw.data(),'&',raw.size()) == (const void *)0) continue;
+      unescape(raw,unescaped[i]);
+      attrvalue[i] = XmlView(unescaped[i].data(),unescaped[i].size());
+    }
+  }
+  stack.push_back(frame);
+  curname = nm;
+  return *nm;
+}
+
+void XmlTextStream::closeElement(void)
+
+{
+  if (stack.empty())
+    throw XmlError("No xml element to close");
+  if (!stack.back().empty) {
+    while(peekElement() != (const string *)0) {
+      openElement();
+      closeElement();
+    }
+    cur += 2;			// At the "</" of the end tag
+    XmlView nm = scanName();
+    if (nm != stack.back().name->c_str())
+      throw XmlError("Mismatched end tag: "+nm.str());
+    skipSpace();
+    expect('>');
+  }
+  stack.pop_back();
+  curname = stack.empty() ? (const string *)0 : stack.back().name;
+}
+
+/// \param el is the element being built for the current element
+void XmlTextStream::fillElement(Element *el)
+
+{
+  if (!stack.back().empty) {
+    while(peekElement() != (const string *)0) {
+      const string &nm(openElement());
+      Element *child = new Element(el);
+      el->addChild(child);	// Attach before reading, so it is freed if an exception is thrown
+      child->setName(nm);
+      for(int4 i=0;i<attrname.size();++i)
+	child->addAttribute(attrname[i].str(),attrvalue[i].str());
+      fillElement(child);
+    }
+  }
+  closeElement();
+}
+
+Element *XmlTextStream::readCurrent(void)
+
+{
+  if (stack.empty())
+    throw XmlError("No current xml element");
+  Element *el = new Element((Element *)0);
+  el->setName(*curname);
+  for(int4 i=0;i<attrname.size();++i)
+    el->addAttribute(attrname[i].str(),attrvalue[i].str());
+  try {
+    fillElement(el);
+  } catch(XmlError &err) {
+    delete el;
+    throw;
+  }
+  return el;
+}
+
+/// The document header and string table are read immediately. An XmlError is thrown
+/// if they are malformed.
+/// \param buf is the start of the packed document
+/// \param size is the number of bytes in the document
+XmlPackStream::XmlPackStream(const uint1 *buf,int4 size)
+
+{
+  cur = buf;
+  end = buf + size;
+  if (!XmlPack::isPacked(cur,end-cur))
+    throw XmlError("Not a packed document");
+  if (cur[4] != XmlPack::version)
+    throw XmlError("Unsupported packed document version");
+  cur += 5;
+  uint4 numstrings = readNumber();
+  strings.reserve(numstrings);
+  for(uint4 i=0;i<numstrings;++i) {
+    uint4 len = readNumber();
+    if (len > end - cur)
+      throw XmlError("Corrupt packed document");
+    strings.push_back(XmlView((const char *)cur,len));
+    cur += len;
+  }
+  tagnames.resize(numstrings,(string *)0);
+  Frame document;		// The document itself, whose only child is the root
+  document.name = (const string *)0;
+  document.content = 0;
+  document.remaining = 1;
+  stack.push_back(document);
+}
+
+XmlPackStream::~XmlPackStream(void)
+
+{
+  for(int4 i=0;i<tagnames.size();++i)
+    if (tagnames[i] != (string *)0)
+      delete tagnames[i];
+}
+
+uint4 XmlPackStream::readNumber(void)
+
+{
+  uint8 res = 0;
+  int4 shift = 0;
+  for(;;) {
+    if (cur >= end || shift > 28)
+      throw XmlError("Corrupt packed document");
+    uint1 byte = *cur++;
+    res |= ((uint8)(byte & 0x7f)) << shift;
+    if ((byte & 0x80) == 0) break;
+    shift += 7;
+  }
+  if (res > 0xffffffff)
+    throw XmlError("Corrupt packed document");
+  return (uint4)res;
+}
+
+uint4 XmlPackStream::readIndex(void)
+
+{
+  uint4 index = readNumber();
+  if (index >= strings.size())
+    throw XmlError("Bad string index in packed document");
+  return index;
+}
+
+/// \param index is the string table index of the name
+/// \return the interned name
+const string &XmlPackStream::tagName(uint4 index)
+
+{
+  if (tagnames[index] == (string *)0)
+    tagnames[index] = new string(strings[index].str());
+  return *tagnames[index];
+}
+
+void XmlPackStream::skipElement(void)
+
+{
+  readIndex();
+  uint4 num = readNumber();
+  for(uint4 i=0;i<2*num;++i)
+    readIndex();
+  readIndex();
+  num = readNumber();
+  for(uint4 i=0;i<num;++i)
+    skipElement();
+}
+
+/// \param el is the element to add the children to
+/// \param numchild is the number of children to read
+void XmlPackStream::fillElement(Element *el,uint4 numchild)
+
+{
+  for(uint4 i=0;i<numchild;++i) {
+    Element *child = new Element(el);
+    el->addChild(child);	// Attach before reading, so it is freed if an exception is thrown
+    child->setName(tagName(readIndex()));
+    uint4 num = readNumber();
+    for(uint4 j=0;j<num;++j) {
+      const XmlView &nm(strings[readIndex()]);
+      child->addAttribute(nm.str(),strings[readIndex()].str());
+    }
+    const XmlView &content(strings[readIndex()]);
+    if (!content.empty())
+      child->addContent(content.data(),0,content.size());
+    fillElement(child,readNumber());
+  }
+}
+
+const string *XmlPackStream::peekElement(void)
+
+{
+  if (stack.back().remaining == 0)
+    return (const string *)0;
+  const uint1 *save = cur;
+  uint4 index = readIndex();
+  cur = save;
+  return &tagName(index);
+}
+
+const string &XmlPackStream::openElement(void)
+
+{
+  if (stack.back().remaining == 0)
+    throw XmlError("Missing xml element");
+  stack.back().remaining -= 1;
+  Frame frame;
+  frame.name = &tagName(readIndex());
+  uint4 num = readNumber();
+  attrname.clear();
+  attrvalue.clear();
+  for(uint4 i=0;i<num;++i) {
+    attrname.push_back(strings[readIndex()]);
+    attrvalue.push_back(strings[readIndex()]);
+  }
+  frame.content = readIndex();
+  frame.remaining = readNumber();
+  stack.push_back(frame);
+  curname = frame.name;
+  return *curname;
+}
+
+void XmlPackStream::closeElement(void)
+
+{
+  if (stack.size() <= 1)
+    throw XmlError("No xml element to close");
+  for(;stack.back().remaining > 0;stack.back().remaining -= 1)
+    skipElement();
+  stack.pop_back();
+  curname = stack.back().name;
+}
+
+Element *XmlPackStream::readCurrent(void)
+
+{
+  if (stack.size() <= 1)
+    throw XmlError("No current xml element");
+  Element *el = new Element((Element *)0);
+  el->setName(*curname);
+  for(int4 i=0;i<attrname.size();++i)
+    el->addAttribute(attrname[i].str(),attrvalue[i].str());
+  const XmlView &content(strings[stack.back().content]);
+  if (!content.empty())
+    el->addContent(content.data(),0,content.size());
+  try {
+    fillElement(el,stack.back().remaining);
+  } catch(XmlError &err) {
+    delete el;
+    throw;
+  }
+  stack.back().remaining = 0;
+  closeElement();
+  return el;
+}
+
+/// An XmlError is thrown if the file cannot be opened.
+/// \param path is the path of the document file
+XmlFileBuffer::XmlFileBuffer(const string &path)
+
+{
+  data = (const uint1 *)0;
+  size = 0;
+  mapped = false;
+#ifndef _WINDOWS
+  int fd = open(path.c_str(),O_RDONLY);
+  if (fd < 0)
+    throw XmlError("Unable to open xml document "+path);
+  struct stat st;
+  if ((fstat(fd,&st) == 0)&&(st.st_size > 0)&&(st.st_size < 0x7fffffff)) {
+    void *ptr = mmap((void *)0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (ptr != MAP_FAILED) {
+      data = (const uint1 *)ptr;
+      size = st.st_size;
+      mapped = true;
+    }
+  }
+  close(fd);
+  if (mapped) return;
+#endif
+  readFile(path);		// Fall back to reading the file
+}
+
+XmlFileBuffer::~XmlFileBuffer(void)
+
+{
+#ifndef _WINDOWS
+  if (mapped)
+    munmap((void *)data,size);
+#endif
+}
+
+/// \param path is the path of the document file
+void XmlFileBuffer::readFile(const string &path)
+
+{
+  ifstream s(path.c_str(),ios::binary);
+  if (!s)
+    throw XmlError("Unable to open xml document "+path);
+  buffer.assign(istreambuf_iterator<char>(s),istreambuf_iterator<char>());
+  if (buffer.size() >= 0x7fffffff)
+    throw XmlError("Xml document is too large: "+path);
+  data = buffer.empty() ? (const uint1 *)0 : &buffer[0];
+  size = buffer.size();
+}
+
+/// \param buf is the start of the document
+/// \param size is the number of bytes in the document
+/// \return the new stream, owned by the caller
+XmlStream *xml_stream(const uint1 *buf,int4 size)
+
+{
+  if (XmlPack::isPacked(buf,size))
+    return new XmlPackStream(buf,size);
+  return new XmlTextStream((const char *)buf,size);
+}
@@ -0,0 +1,188 @@
+/**
+ *  Copyright 2021 StarCrossTech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/// \file xmlstream.hh
+/// \brief Pull-style reading of XML documents held in memory, without building a DOM tree
+
+#ifndef __CPUI_XMLSTREAM__
+#define __CPUI_XMLSTREAM__
+
+#include "xml.hh"
+#include <unordered_set>
+
+/// \brief A view of characters held by an XmlStream
+///
+/// The characters are either in the document buffer itself or, for text values
+/// containing entity references, in storage owned by the stream. A view stays valid
+/// until the stream opens another element.
+class XmlView {
+  const char *ptr;		///< Start of the characters
+  int4 len;			///< Number of characters
+public:
+  XmlView(void) { ptr = (const char *)0; len = 0; }	///< Construct an empty view
+  XmlView(const char *p,int4 l) { ptr = p; len = l; }	///< Construct given characters
+  const char *data(void) const { return ptr; }		///< Get the start of the characters
+  int4 size(void) const { return len; }			///< Get the number of characters
+  bool empty(void) const { return (len == 0); }		///< Is the view empty
+  bool operator==(const char *str) const;		///< Compare with a null terminated string
+  bool operator!=(const char *str) const { return !(*this == str); }	///< Compare with a null terminated string
+  string str(void) const { return string(ptr,len); }	///< Copy the characters to a string
+  uintb toUnsigned(void) const;			///< Read an unsigned integer, in C notation
+  intb toSigned(void) const;			///< Read a possibly negative integer, in C notation
+  bool toBool(void) const;			///< Read a boolean, as xml_readbool() does
+};
+
+/// \brief Read an XML document one element at a time
+///
+/// Rather than building the tree of Element objects for the whole document, the
+/// caller walks the elements in document order: openElement() enters the next child of
+/// the current element and makes its attributes available, closeElement() skips whatever
+/// is left of the current element and returns to its parent. A child that is more
+/// convenient to handle as a DOM tree can be read with readElement(), or the rest of the
+/// current element with readCurrent(), and only that subtree is built.
+///
+/// Tag names are interned, so the string returned for an element name is shared by all
+/// the elements with that name. The attributes are those of the element opened last,
+/// so they must be read before opening any of its children. Attribute values are views
+/// (see XmlView). Errors in the document are reported with an XmlError.
+class XmlStream {
+protected:
+  vector<XmlView> attrname;		///< Names of the attributes of the current element
+  vector<XmlView> attrvalue;		///< Values of the attributes of the current element
+  const string *curname;		///< Name of the current element
+public:
+  XmlStream(void) { curname = (const string *)0; }	///< Constructor
+  virtual ~XmlStream(void) {}				///< Destructor
+
+  /// \brief Look at the next child of the current element without entering it
+  ///
+  /// \return the name of the child, or null if the current element has no more children
+  virtual const string *peekElement(void)=0;
+
+  /// \brief Enter the next child of the current element
+  ///
+  /// The child becomes the current element. An XmlError is thrown if there is no child left.
+  /// \return the name of the child
+  virtual const string &openElement(void)=0;
+
+  /// \brief Skip any children left in the current element and leave it
+  virtual void closeElement(void)=0;
+
+  /// \brief Build the rest of the current element as a DOM tree, and leave it
+  ///
+  /// The returned element holds the name and attributes of the current element along
+  /// with the children that have not been opened yet.
+  /// \return the new element, owned by the caller
+  virtual Element *readCurrent(void)=0;
+
+  Element *readElement(void) { openElement(); return readCurrent(); }	///< Build the next child as a DOM tree
+  const string &getName(void) const { return *curname; }		///< Get the name of the current element
+  int4 getNumAttributes(void) const { return attrname.size(); }		///< Get the number of attributes
+  const XmlView &getAttributeName(int4 i) const { return attrname[i]; }	///< Get the name of the i-th attribute
+  const XmlView &getAttributeValue(int4 i) const { return attrvalue[i]; }	///< Get the value of the i-th attribute
+  const XmlView &getAttributeValue(const char *nm) const;		///< Get an attribute value by name
+};
+
+/// \brief Read a specification written by sleighc as XML text, held in a memory buffer
+///
+/// Only the subset of XML that SleighBase::saveXml() writes is accepted: elements separated by
+/// white space, and attribute values in double quotes, which may contain the five predefined
+/// entity references.  Character data, comments, CDATA sections, declarations and character
+/// references are rejected with an XmlError; a general document has to go through the bison
+/// parser (xml_tree()) instead.  Attribute values without references are viewed in place in
+/// the buffer.
+class XmlTextStream : public XmlStream {
+  /// \brief An open element
+  struct Frame {
+    const string *name;		///< Name of the element
+    bool empty;			///< Was it closed by its own tag, so there are no children
+  };
+  const char *cur;			///< Current position in the buffer
+  const char *end;			///< End of the buffer
+  vector<Frame> stack;			///< Open elements, innermost last
+  unordered_set<string> names;		///< Interned tag names
+  string scratch;			///< Storage for looking up a tag name
+  vector<string> unescaped;		///< Attribute values rewritten without references
+  static bool isNameChar(char c);	///< Can the character appear in a tag or attribute name
+  void skipSpace(void);			///< Skip over white space
+  void skipSeparator(void);		///< Skip the white space up to the next markup
+  void expect(char c);			///< Consume the given character or throw an XmlError
+  XmlView scanName(void);		///< Scan a tag or attribute name
+  const string &internName(const XmlView &nm);	///< Get the interned copy of a tag name
+  void unescape(const XmlView &raw,string &res) const;	///< Replace the references in a value
+  void fillElement(Element *el);	///< Add the children of the current element to an element, and leave it
+public:
+  XmlTextStream(const char *buf,int4 size);	///< Construct given the document buffer
+  virtual const string *peekElement(void);
+  virtual const string &openElement(void);
+  virtual void closeElement(void);
+  virtual Element *readCurrent(void);
+};
+
+/// \brief Read a packed XML document (see XmlPack) held in a memory buffer
+///
+/// The string table is viewed in place in the buffer, and each distinct tag name
+/// is only copied into a string the first time it is used.
+class XmlPackStream : public XmlStream {
+  /// \brief An open element
+  struct Frame {
+    const string *name;		///< Name of the element
+    uint4 content;		///< String index of its character content
+    uint4 remaining;		///< Number of children not read yet
+  };
+  const uint1 *cur;			///< Current read position
+  const uint1 *end;			///< End of the buffer
+  vector<XmlView> strings;		///< The string table
+  vector<string *> tagnames;		///< Interned copy of each string used as a tag name
+  vector<Frame> stack;			///< Open elements, innermost last
+  uint4 readNumber(void);		///< Read an unsigned LEB128 integer
+  uint4 readIndex(void);		///< Read a string table index
+  void skipElement(void);		///< Skip over an element and its children
+  void fillElement(Element *el,uint4 numchild);	///< Read children into an element
+  const string &tagName(uint4 index);	///< Get the interned name for a string index
+public:
+  XmlPackStream(const uint1 *buf,int4 size);	///< Construct given the document buffer
+  virtual ~XmlPackStream(void);
+  virtual const string *peekElement(void);
+  virtual const string &openElement(void);
+  virtual void closeElement(void);
+  virtual Element *readCurrent(void);
+};
+
+/// \brief The contents of a document file, to be read with an XmlStream
+///
+/// On POSIX systems the file is mapped read-only instead of being read, so its pages come
+/// straight from the page cache as the stream reaches them, and are shared by every process
+/// loading the same specification. Files that cannot be mapped, or any file on Windows,
+/// are read into a buffer. The contents stay valid for the lifetime of the object.
+class XmlFileBuffer {
+  const uint1 *data;			///< Start of the file contents
+  int4 size;				///< Number of bytes in the file
+  bool mapped;				///< Is the file mapped, rather than read into \b buffer
+  vector<uint1> buffer;			///< The file contents, if they were read
+  void readFile(const string &path);	///< Read the whole file into \b buffer
+  XmlFileBuffer(const XmlFileBuffer &op2);	///< Not copyable
+  XmlFileBuffer &operator=(const XmlFileBuffer &op2);	///< Not assignable
+public:
+  XmlFileBuffer(const string &path);	///< Map (or read) the given file
+  ~XmlFileBuffer(void);			///< Unmap the file
+  const uint1 *getData(void) const { return data; }	///< Get the start of the file contents
+  int4 getSize(void) const { return size; }		///< Get the number of bytes in the file
+};
+
+/// \brief Create a stream over a document buffer, either packed or text
+extern XmlStream *xml_stream(const uint1 *buf,int4 size);
+
+#endif
@@ -14,6 +14,8 @@
 // limitations under the License.
 pub mod error;
 pub mod sleigh;
+pub mod parallel;
 pub mod prelude;
 
 pub use sleigh::*;
+pub use parallel::ParallelDecoder;
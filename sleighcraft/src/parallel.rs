@@ -0,0 +1,219 @@
+//
+//  Copyright 2021 StarCrossTech
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//! Linear disassembly of large buffers on several threads.
+//!
+//! The buffer is cut into one chunk per thread and every worker decodes its chunk
+//! with its own decoder bound to a shared [`SleighLanguage`]. A chunk other than the
+//! first starts at an arbitrary byte, which on variable length architectures may be
+//! in the middle of an instruction. To fix that, each worker keeps decoding `overlap`
+//! bytes into the next chunk, and when merging, the next chunk is only used from the
+//! first instruction start both workers agree on. If they never agree, the next chunk
+//! is decoded again from where the previous one really ended.
+use crate::error::Result;
+use crate::sleigh::*;
+use std::collections::HashSet;
+use std::sync::Arc;
+use std::thread;
+
+/// Chunks smaller than this are not worth a thread.
+const MIN_CHUNK_SIZE: usize = 0x1000;
+
+/// Chunk boundaries are kept aligned, so fixed length architectures never
+/// start decoding in the middle of an instruction.
+const CHUNK_ALIGN: usize = 0x10;
+
+/// What one worker decoded, `next` is the address after its last instruction.
+#[derive(Default)]
+struct ChunkResult {
+    asm: CollectingAssemblyEmit,
+    pcode: CollectingPcodeEmit,
+    next: u64,
+}
+
+fn decode_chunk(
+    language: Arc<SleighLanguage>,
+    mode: Mode,
+    buf: &[u8],
+    base: u64,
+    start: u64,
+    end: u64,
+) -> Result<ChunkResult> {
+    let mut res = ChunkResult::default();
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(base, buf);
+    sleigh_builder.language(language);
+    sleigh_builder.mode(mode);
+    sleigh_builder.asm_emit(&mut res.asm);
+    sleigh_builder.pcode_emit(&mut res.pcode);
+    let mut sleigh = sleigh_builder.try_build()?;
+    let next = sleigh.decode_range(start, end)?;
+    drop(sleigh);
+    res.next = next;
+    Ok(res)
+}
+
+/// Decodes a whole buffer like `Sleigh::decode`, using several threads.
+pub struct ParallelDecoder {
+    language: Arc<SleighLanguage>,
+    mode: Mode,
+    threads: usize,
+    overlap: usize,
+}
+
+impl ParallelDecoder {
+    pub fn new(language: Arc<SleighLanguage>) -> Self {
+        let threads = thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1);
+        Self {
+            language,
+            mode: Mode::MODE16,
+            threads,
+            overlap: 0x100,
+        }
+    }
+
+    pub fn mode(&mut self, mode: Mode) -> &mut Self {
+        self.mode = mode;
+        self
+    }
+
+    /// Number of worker threads, defaults to the available parallelism.
+    pub fn threads(&mut self, threads: usize) -> &mut Self {
+        self.threads = threads.max(1);
+        self
+    }
+
+    /// How far (in bytes) a worker decodes into the next chunk to find a common
+    /// instruction start. It should cover several of the longest instructions.
+    pub fn overlap(&mut self, overlap: usize) -> &mut Self {
+        self.overlap = overlap;
+        self
+    }
+
+    /// Decode all of `buf`, loaded at `start`. The output is in address order and the
+    /// same as decoding the buffer with a single `Sleigh`.
+    pub fn decode(
+        &self,
+        buf: &[u8],
+        start: u64,
+    ) -> Result<(CollectingAssemblyEmit, CollectingPcodeEmit)> {
+        let end = start + buf.len() as u64;
+
+        let min_chunk = MIN_CHUNK_SIZE.max(self.overlap * 4);
+        let nchunks = self.threads.min(buf.len() / min_chunk).max(1);
+        let chunk_size = (buf.len() / nchunks + CHUNK_ALIGN - 1) & !(CHUNK_ALIGN - 1);
+        let bounds: Vec<u64> = (0..nchunks)
+            .map(|i| start + (i * chunk_size) as u64)
+            .chain(std::iter::once(end))
+            .collect();
+
+        // Scoped, so the workers borrow `buf` instead of each getting a copy
+        let results: Vec<Result<ChunkResult>> = thread::scope(|scope| {
+            let workers: Vec<_> = (0..nchunks)
+                .map(|i| {
+                    let language = self.language.clone();
+                    let mode = self.mode;
+                    let chunk_start = bounds[i];
+                    let chunk_end = if i + 1 == nchunks {
+                        end
+                    } else {
+                        (bounds[i + 1] + self.overlap as u64).min(end)
+                    };
+                    scope.spawn(move || {
+                        decode_chunk(language, mode, buf, start, chunk_start, chunk_end)
+                    })
+                })
+                .collect();
+            workers
+                .into_iter()
+                .map(|w| w.join().unwrap_or_else(|e| std::panic::resume_unwind(e)))
+                .collect()
+        });
+
+        let mut results = results.into_iter();
+        let mut merged = results.next().unwrap()?;
+        for (i, res) in results.enumerate() {
+            let chunk_end = if i + 2 == nchunks {
+                end
+            } else {
+                (bounds[i + 2] + self.overlap as u64).min(end)
+            };
+
+            // The first chunk and every merged one start on a real instruction boundary,
+            // so `merged` is right up to its end. Look for the first instruction of the
+            // new chunk that `merged` decoded too.
+            let sync = res.as_ref().ok().and_then(|res| {
+                let known: HashSet<u64> = merged
+                    .asm
+                    .asms
+                    .iter()
+                    .rev()
+                    .take_while(|asm| asm.addr.offset >= bounds[i + 1])
+                    .map(|asm| asm.addr.offset)
+                    .collect();
+                res.asm
+                    .asms
+                    .iter()
+                    .map(|asm| asm.addr.offset)
+                    .find(|off| known.contains(off))
+            });
+            let (res, sync) = match (res, sync) {
+                (Ok(res), Some(sync)) => (res, sync),
+                // A failure before syncing may just come from starting mid-instruction,
+                // start over from where the previous chunk stopped.
+                _ => {
+                    let res = decode_chunk(
+                        self.language.clone(),
+                        self.mode,
+                        buf,
+                        start,
+                        merged.next,
+                        chunk_end,
+                    )?;
+                    let sync = merged.next;
+                    (res, sync)
+                }
+            };
+
+            let keep = merged
+                .asm
+                .asms
+                .partition_point(|asm| asm.addr.offset < sync);
+            merged.asm.asms.truncate(keep);
+            let keep = merged
+                .pcode
+                .pcode_asms
+                .partition_point(|op| op.addr.offset < sync);
+            merged.pcode.pcode_asms.truncate(keep);
+            merged.asm.asms.extend(
+                res.asm
+                    .asms
+                    .into_iter()
+                    .filter(|asm| asm.addr.offset >= sync),
+            );
+            merged.pcode.pcode_asms.extend(
+                res.pcode
+                    .pcode_asms
+                    .into_iter()
+                    .filter(|op| op.addr.offset >= sync),
+            );
+            merged.next = res.next;
+        }
+
+        Ok((merged.asm, merged.pcode))
+    }
+}
@@ -13,4 +13,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-pub use crate::{arch, CollectingAssemblyEmit, CollectingPcodeEmit, PlainLoadImage, SleighBuilder};
+pub use crate::{
+    arch, set_preset_dir, AssemblyBuffer, BlockExit, CollectingAssemblyEmit, CollectingPcodeEmit,
+    ControlFlow, Edge, EdgeKind, Emulator, ParallelDecoder, PcodeBuffer, PlainLoadImage, RunExit,
+    SleighBuilder, SleighLanguage, StopReason,
+};
@@ -14,10 +14,14 @@
 // limitations under the License.
 //
 use crate::error::{Error, Result};
-use cxx::{CxxString, UniquePtr};
+use cxx::{CxxString, SharedPtr, UniquePtr};
 use once_cell::sync::Lazy;
 use sleighcraft_util_macro::def_sla_load_preset;
+use std::borrow::Cow;
 use std::collections::HashMap;
+use std::marker::PhantomData;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
 
 #[cxx::bridge]
 pub mod ffi {
@@ -389,21 +393,142 @@ pub mod ffi {
         // fn get_body(self: &InstructionProxy) -> &CxxString;
 
         type SleighProxy;
-        fn set_spec(self: Pin<&mut SleighProxy>, spec_content: &str, mode: i32);
-        fn new_sleigh_proxy(ld: &mut RustLoadImage) -> UniquePtr<SleighProxy>;
+        fn set_spec(self: Pin<&mut SleighProxy>, spec_content: &[u8], mode: i32) -> Result<()>;
+        fn new_sleigh_proxy(ld: &mut RustLoadImage, context: i32)
+            -> Result<UniquePtr<SleighProxy>>;
+        fn new_sleigh_proxy_with_language(
+            ld: &mut RustLoadImage,
+            lang: &SharedPtr<SleighLanguageProxy>,
+            mode: i32,
+            context: i32,
+        ) -> Result<UniquePtr<SleighProxy>>;
         fn decode_with(
             self: Pin<&mut SleighProxy>,
             asm_emit: &mut RustAssemblyEmit,
             pcode_emit: &mut RustPcodeEmit,
             start: u64,
         ) -> Result<()>;
+        fn decode_range(
+            self: Pin<&mut SleighProxy>,
+            asm_emit: &mut RustAssemblyEmit,
+            pcode_emit: &mut RustPcodeEmit,
+            start: u64,
+            end: u64,
+        ) -> Result<u64>;
+        fn decode_pcode(
+            self: Pin<&mut SleighProxy>,
+            buffer: Pin<&mut PcodeBufferProxy>,
+            start: u64,
+            end: u64,
+        ) -> Result<u64>;
+
+        fn decode_block(
+            self: Pin<&mut SleighProxy>,
+            buffer: Pin<&mut PcodeBufferProxy>,
+            start: u64,
+            max_insns: u32,
+        ) -> Result<u64>;
+        fn decode_asm(
+            self: Pin<&mut SleighProxy>,
+            buffer: Pin<&mut AssemblyBufferProxy>,
+            start: u64,
+            end: u64,
+        ) -> Result<u64>;
+
+        type PcodeBufferProxy;
+        fn new_pcode_buffer() -> UniquePtr<PcodeBufferProxy>;
+
+        type AssemblyBufferProxy;
+        fn new_assembly_buffer() -> UniquePtr<AssemblyBufferProxy>;
+
+        fn explore(
+            self: Pin<&mut SleighProxy>,
+            result: Pin<&mut DescentProxy>,
+            entries: &[u64],
+            threads: u32,
+        ) -> Result<()>;
+
+        type DescentProxy;
+        fn new_descent_result() -> UniquePtr<DescentProxy>;
+
+        fn new_sleigh_proxy_span(context: i32) -> Result<UniquePtr<SleighProxy>>;
+        fn new_sleigh_proxy_span_with_language(
+            lang: &SharedPtr<SleighLanguageProxy>,
+            mode: i32,
+            context: i32,
+        ) -> Result<UniquePtr<SleighProxy>>;
+        fn add_segment(self: Pin<&mut SleighProxy>, start: u64, data: &[u8]) -> Result<()>;
+        fn set_parser_cache(self: Pin<&mut SleighProxy>, size: i32, policy: i32) -> Result<()>;
+        fn parser_cache_hits(self: &SleighProxy) -> u64;
+        fn parser_cache_misses(self: &SleighProxy) -> u64;
+        fn set_translation_cache(self: Pin<&mut SleighProxy>, size: i32) -> Result<()>;
+        fn translation_cache_hits(self: &SleighProxy) -> u64;
+        fn translation_cache_misses(self: &SleighProxy) -> u64;
+        fn invalidate_bytes(self: Pin<&mut SleighProxy>, start: u64, size: u64);
+        fn freeze_context(self: Pin<&mut SleighProxy>) -> Result<()>;
+        fn new_emulator(self: Pin<&mut SleighProxy>) -> Result<UniquePtr<EmulatorProxy>>;
+
+        type EmulatorProxy;
+        fn get_pc(self: &EmulatorProxy) -> u64;
+        fn set_pc(self: Pin<&mut EmulatorProxy>, addr: u64) -> Result<()>;
+        fn get_register(self: &EmulatorProxy, name: &str) -> Result<u64>;
+        fn set_register(self: Pin<&mut EmulatorProxy>, name: &str, val: u64) -> Result<()>;
+        fn read_memory(self: &EmulatorProxy, addr: u64, buf: &mut [u8]) -> Result<()>;
+        fn write_memory(self: Pin<&mut EmulatorProxy>, addr: u64, data: &[u8]) -> Result<()>;
+        fn add_breakpoint(self: Pin<&mut EmulatorProxy>, addr: u64);
+        fn remove_breakpoint(self: Pin<&mut EmulatorProxy>, addr: u64);
+        fn stop_at_userop(self: Pin<&mut EmulatorProxy>, name: &str) -> Result<u32>;
+        fn run(self: Pin<&mut EmulatorProxy>, max_steps: u64) -> Result<u64>;
+        fn get_stop(self: &EmulatorProxy) -> u8;
+        fn get_stop_userop(self: &EmulatorProxy) -> u32;
+        fn snapshot(self: Pin<&mut EmulatorProxy>);
+        fn restore(self: Pin<&mut EmulatorProxy>) -> Result<()>;
+        fn clear(self: Pin<&mut PcodeBufferProxy>);
+        fn get_opcodes(self: &PcodeBufferProxy) -> &[u8];
+        fn get_op_insns(self: &PcodeBufferProxy) -> &[u32];
+        fn get_op_outputs(self: &PcodeBufferProxy) -> &[u8];
+        fn get_op_vars(self: &PcodeBufferProxy) -> &[u32];
+        fn get_var_spaces(self: &PcodeBufferProxy) -> &[u32];
+        fn get_var_offsets(self: &PcodeBufferProxy) -> &[u64];
+        fn get_var_sizes(self: &PcodeBufferProxy) -> &[u32];
+        fn get_insn_addrs(self: &PcodeBufferProxy) -> &[u64];
+        fn get_insn_lengths(self: &PcodeBufferProxy) -> &[u32];
+        fn get_insn_delay_slots(self: &PcodeBufferProxy) -> &[u8];
+        fn get_space_name(self: &PcodeBufferProxy, index: u32) -> &CxxString;
+
+        fn clear(self: Pin<&mut AssemblyBufferProxy>);
+        fn truncate(self: Pin<&mut AssemblyBufferProxy>, ninsns: usize);
+        fn get_text(self: &AssemblyBufferProxy) -> &[u8];
+        fn get_offsets(self: &AssemblyBufferProxy) -> &[u32];
+        fn get_asm_addrs(self: &AssemblyBufferProxy) -> &[u64];
+        fn get_asm_lengths(self: &AssemblyBufferProxy) -> &[u32];
+
+        fn get_insn_addrs(self: &DescentProxy) -> &[u64];
+        fn get_insn_lengths(self: &DescentProxy) -> &[u32];
+        fn get_func_entries(self: &DescentProxy) -> &[u64];
+        fn get_func_first(self: &DescentProxy) -> &[u32];
+        fn get_func_insns(self: &DescentProxy) -> &[u32];
+        fn get_edge_from(self: &DescentProxy) -> &[u64];
+        fn get_edge_to(self: &DescentProxy) -> &[u64];
+        fn get_edge_kinds(self: &DescentProxy) -> &[u8];
+        fn get_bad_addrs(self: &DescentProxy) -> &[u64];
+
+        type SleighLanguageProxy;
+        fn new_sleigh_language(spec_content: &[u8]) -> Result<SharedPtr<SleighLanguageProxy>>;
+        fn new_sleigh_language_from_file(path: &str) -> Result<SharedPtr<SleighLanguageProxy>>;
+        fn new_sleigh_language_from_tree(spec_content: &[u8]) -> Result<SharedPtr<SleighLanguageProxy>>;
+        fn to_xml(self: &SleighLanguageProxy) -> String;
     }
 }
 
+// A loaded language is never modified after construction, every decoder keeps its
+// own context and caches, so it can be shared between threads.
+unsafe impl Send for ffi::SleighLanguageProxy {}
+unsafe impl Sync for ffi::SleighLanguageProxy {}
+
 use crate::Mode::MODE16;
 use ffi::*;
 use num_enum::TryFromPrimitive;
-use std::borrow::BorrowMut;
 use std::pin::Pin;
 
 impl ToString for PcodeOpCode {
@@ -493,10 +618,68 @@ pub enum Mode {
     MODE16 = 0,
     // Address size is 32-bit
     MODE32 = 1,
-    // Address size is 32-bit
+    // Address size is 64-bit, operand size is 32-bit unless REX.W widens it
     MODE64 = 2,
 }
 
+/// How the decoder picks which parsed instruction to forget when its cache is full.
+#[derive(TryFromPrimitive, Copy, Clone, Debug, PartialEq)]
+#[repr(i32)]
+pub enum CachePolicy {
+    // Evict in allocation order
+    ROUNDROBIN = 0,
+    // Evict the least recently used
+    LRU = 1,
+    // Evict one not used since the last sweep, cheaper than LRU on a hit
+    CLOCK = 2,
+}
+
+/// How control goes from one instruction to another in a `ControlFlow`.
+#[derive(TryFromPrimitive, Copy, Clone, Debug, PartialEq)]
+#[repr(u8)]
+pub enum EdgeKind {
+    // Falls through after an instruction that may branch or call
+    FALL = 0,
+    // Unconditional branch
+    BRANCH = 1,
+    // Conditional branch
+    CBRANCH = 2,
+    // Call
+    CALL = 3,
+}
+
+/// A direct control transfer found by `Sleigh::explore`.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Edge {
+    pub from: u64,
+    pub to: u64,
+    pub kind: EdgeKind,
+}
+
+/// How the decoder stores context values (processor modes and the like) by address.
+#[derive(TryFromPrimitive, Copy, Clone, Debug, PartialEq)]
+#[repr(i32)]
+pub enum ContextStore {
+    // A map of the addresses where context changes, always up to date
+    MAP = 0,
+    // Same as MAP until `Sleigh::freeze_context`, then looked up in a sorted array
+    INTERVALS = 1,
+}
+
+/// Lookups in the cache of parsed instructions since the decoder was built.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct ParserCacheStats {
+    pub hits: u64,
+    pub misses: u64,
+}
+
+/// Lookups in the cache of translated instructions since the decoder was built.
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct TranslationCacheStats {
+    pub hits: u64,
+    pub misses: u64,
+}
+
 pub trait AssemblyEmit {
     fn dump(&mut self, addr: &AddressProxy, mnem: &str, body: &str);
 }
@@ -684,17 +867,18 @@ pub struct PlainLoadImage {
 impl LoadImage for PlainLoadImage {
     fn load_fill(&mut self, ptr: &mut [u8], addr: &AddressProxy) {
         let start_off = addr.get_offset() as u64;
-        let size = ptr.len();
-        let max = self.start + (self.buf.len() as u64 - 1);
-
-        for i in 0..size {
-            let cur_off = start_off + i as u64;
-            if self.start <= cur_off && max >= cur_off {
-                let offset = (cur_off - self.start) as usize;
-                ptr[i] = self.buf[offset];
-            } else {
-                ptr[i] = 0;
+        ptr.fill(0);
+        if start_off < self.start {
+            // Only the tail of the request may be in the buffer
+            let skip = self.start - start_off;
+            if skip < ptr.len() as u64 {
+                let len = (ptr.len() - skip as usize).min(self.buf.len());
+                ptr[skip as usize..skip as usize + len].copy_from_slice(&self.buf[..len]);
             }
+        } else if start_off - self.start < self.buf.len() as u64 {
+            let offset = (start_off - self.start) as usize;
+            let len = ptr.len().min(self.buf.len() - offset);
+            ptr[..len].copy_from_slice(&self.buf[offset..offset + len]);
         }
     }
     fn buf_size(&mut self) -> usize {
@@ -738,29 +922,669 @@ impl Instruction {
     }
 }
 
+/// P-code of a batch of instructions, stored column by column (one slice per field)
+/// instead of one `PcodeInstruction` per op. Filled by `Sleigh::decode_pcode`.
+///
+/// Op `i` belongs to instruction `op_insns()[i]` and uses varnodes
+/// `op_vars()[i]..op_vars()[i + 1]`, the output first if `op_outputs()[i]` is set.
+/// The first input of LOAD and STORE holds the index of the accessed space.
+///
+/// An instruction in the delay slot of a branch is listed right after it, flagged in
+/// `insn_delay_slots()`. It has no ops of its own: they are part of the branch's.
+pub struct PcodeBuffer {
+    proxy: UniquePtr<ffi::PcodeBufferProxy>,
+}
+
+impl PcodeBuffer {
+    pub fn new() -> Self {
+        Self {
+            proxy: new_pcode_buffer(),
+        }
+    }
+
+    /// Forget all ops and instructions, keeping the memory for the next batch.
+    pub fn clear(&mut self) {
+        self.proxy.pin_mut().clear()
+    }
+
+    /// Number of ops.
+    pub fn len(&self) -> usize {
+        self.proxy.get_opcodes().len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn opcode(&self, op: usize) -> PcodeOpCode {
+        PcodeOpCode {
+            repr: self.proxy.get_opcodes()[op],
+        }
+    }
+
+    pub fn opcodes(&self) -> &[u8] {
+        self.proxy.get_opcodes()
+    }
+
+    pub fn op_insns(&self) -> &[u32] {
+        self.proxy.get_op_insns()
+    }
+
+    pub fn op_outputs(&self) -> &[u8] {
+        self.proxy.get_op_outputs()
+    }
+
+    pub fn op_vars(&self) -> &[u32] {
+        self.proxy.get_op_vars()
+    }
+
+    pub fn var_spaces(&self) -> &[u32] {
+        self.proxy.get_var_spaces()
+    }
+
+    pub fn var_offsets(&self) -> &[u64] {
+        self.proxy.get_var_offsets()
+    }
+
+    pub fn var_sizes(&self) -> &[u32] {
+        self.proxy.get_var_sizes()
+    }
+
+    pub fn insn_addrs(&self) -> &[u64] {
+        self.proxy.get_insn_addrs()
+    }
+
+    pub fn insn_lengths(&self) -> &[u32] {
+        self.proxy.get_insn_lengths()
+    }
+
+    /// 1 for an instruction in the delay slot of the one before it, 0 otherwise.
+    pub fn insn_delay_slots(&self) -> &[u8] {
+        self.proxy.get_insn_delay_slots()
+    }
+
+    /// Name of a space index found in `var_spaces`.
+    pub fn space_name(&self, index: u32) -> &str {
+        self.proxy.get_space_name(index).to_str().unwrap()
+    }
+}
+
+impl Default for PcodeBuffer {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// How a block decoded by `Sleigh::decode_block` ends.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct BlockExit {
+    /// The address right after the block, past the delay slots of its last instruction.
+    pub next: u64,
+    /// The last op transferring control out of the last instruction. `None` if the block
+    /// stopped at `max_insns` or before an instruction that could not be decoded.
+    pub flow: Option<PcodeOpCode>,
+    /// Direct branch and call targets of the last instruction.
+    pub targets: Vec<u64>,
+}
+
+impl BlockExit {
+    /// Whether execution can go on at `next`, that is the block does not end with an
+    /// unconditional branch or a return.
+    pub fn falls_through(&self) -> bool {
+        match self.flow {
+            Some(op) => {
+                op != PcodeOpCode::BRANCH
+                    && op != PcodeOpCode::BRANCHIND
+                    && op != PcodeOpCode::RETURN
+            }
+            None => true,
+        }
+    }
+
+    // Look at the ops of the last instruction in `buffer`, the same way the decoder does.
+    // Its delay slots have no ops, those of the branch before them are the ones that count.
+    fn from_buffer(buffer: &PcodeBuffer, next: u64) -> Self {
+        let mut exit = BlockExit {
+            next,
+            ..Default::default()
+        };
+        let last = buffer
+            .insn_delay_slots()
+            .iter()
+            .rposition(|&slot| slot == 0)
+            .unwrap() as u32;
+        let first = buffer.op_insns().partition_point(|&insn| insn < last);
+        for op in first..buffer.len() {
+            let opcode = buffer.opcode(op);
+            let target = buffer.op_vars()[op] as usize + buffer.op_outputs()[op] as usize;
+            if opcode == PcodeOpCode::BRANCH
+                || opcode == PcodeOpCode::CBRANCH
+                || opcode == PcodeOpCode::CALL
+            {
+                // A constant target is a relative jump between the ops of the instruction
+                if buffer.var_spaces()[target] != CONSTANT_SPACE_INDEX {
+                    exit.targets.push(buffer.var_offsets()[target]);
+                    exit.flow = Some(opcode);
+                }
+            } else if opcode == PcodeOpCode::BRANCHIND
+                || opcode == PcodeOpCode::CALLIND
+                || opcode == PcodeOpCode::RETURN
+            {
+                exit.flow = Some(opcode);
+            }
+        }
+        exit
+    }
+}
+
+/// The constant space is always the first one of a language.
+const CONSTANT_SPACE_INDEX: u32 = 0;
+
+/// Assembly of a batch of instructions, all the text kept in one buffer that is
+/// reused from batch to batch. Filled by `Sleigh::decode_asm`.
+pub struct AssemblyBuffer {
+    proxy: UniquePtr<ffi::AssemblyBufferProxy>,
+}
+
+impl AssemblyBuffer {
+    pub fn new() -> Self {
+        Self {
+            proxy: new_assembly_buffer(),
+        }
+    }
+
+    /// Forget all instructions, keeping the memory for the next batch.
+    pub fn clear(&mut self) {
+        self.proxy.pin_mut().clear()
+    }
+
+    /// Keep only the first `len` instructions.
+    pub fn truncate(&mut self, len: usize) {
+        if len < self.len() {
+            self.proxy.pin_mut().truncate(len)
+        }
+    }
+
+    /// Number of instructions.
+    pub fn len(&self) -> usize {
+        self.proxy.get_asm_addrs().len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn insn_addrs(&self) -> &[u64] {
+        self.proxy.get_asm_addrs()
+    }
+
+    pub fn insn_lengths(&self) -> &[u32] {
+        self.proxy.get_asm_lengths()
+    }
+
+    pub fn mnemonic(&self, insn: usize) -> &str {
+        self.piece(2 * insn)
+    }
+
+    pub fn body(&self, insn: usize) -> &str {
+        self.piece(2 * insn + 1)
+    }
+
+    fn piece(&self, i: usize) -> &str {
+        let offsets = self.proxy.get_offsets();
+        let text = &self.proxy.get_text()[offsets[i] as usize..offsets[i + 1] as usize];
+        std::str::from_utf8(text).unwrap()
+    }
+}
+
+impl Default for AssemblyBuffer {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// What `Sleigh::explore` found by following control flow from a set of entries.
+pub struct ControlFlow {
+    proxy: UniquePtr<ffi::DescentProxy>,
+}
+
+impl ControlFlow {
+    /// Every instruction decoded, in address order.
+    pub fn insn_addrs(&self) -> &[u64] {
+        self.proxy.get_insn_addrs()
+    }
+
+    pub fn insn_lengths(&self) -> &[u32] {
+        self.proxy.get_insn_lengths()
+    }
+
+    /// Index in `insn_addrs` of the instruction at `addr`.
+    pub fn insn_index(&self, addr: u64) -> Option<usize> {
+        self.insn_addrs().binary_search(&addr).ok()
+    }
+
+    /// Number of functions: the entries and every call target that could be decoded.
+    pub fn num_functions(&self) -> usize {
+        self.proxy.get_func_entries().len()
+    }
+
+    /// Entry address of the `i`-th function, in address order.
+    pub fn function_entry(&self, i: usize) -> u64 {
+        self.proxy.get_func_entries()[i]
+    }
+
+    /// Indices in `insn_addrs` of the instructions reachable from the `i`-th function's
+    /// entry without following calls, sorted. Code shared by functions is in each of them.
+    pub fn function_insns(&self, i: usize) -> &[u32] {
+        let first = self.proxy.get_func_first();
+        &self.proxy.get_func_insns()[first[i] as usize..first[i + 1] as usize]
+    }
+
+    /// Direct branches and calls, and the fall through of instructions which may branch
+    /// or call, sorted by source then target.
+    pub fn edges(&self) -> impl Iterator<Item = Edge> + '_ {
+        let from = self.proxy.get_edge_from();
+        let to = self.proxy.get_edge_to();
+        let kinds = self.proxy.get_edge_kinds();
+        (0..from.len()).map(move |i| Edge {
+            from: from[i],
+            to: to[i],
+            kind: EdgeKind::try_from_primitive(kinds[i]).unwrap(),
+        })
+    }
+
+    /// Addresses the flow reached which are not mapped or could not be decoded.
+    pub fn bad_addrs(&self) -> &[u64] {
+        self.proxy.get_bad_addrs()
+    }
+}
+
 // relative to root?
-def_sla_load_preset!("sleighcraft/sla/", fn load_preset() -> HashMap<&'static str, &'static str>);
+#[cfg(all(feature = "predefined", not(feature = "compressed")))]
+def_sla_load_preset!("sleighcraft/sla/", ".sla", fn load_preset() -> HashMap<&'static str, &'static [u8]>);
+
+// Deflated by the build script, each one is inflated the first time it is asked for
+#[cfg(feature = "compressed")]
+def_sla_load_preset!("sleighcraft/sla/", ".sla.z", fn load_preset() -> HashMap<&'static str, &'static [u8]>);
+
+#[cfg(not(feature = "predefined"))]
+fn load_preset() -> HashMap<&'static str, &'static [u8]> {
+    HashMap::new()
+}
+
+static PRESET: Lazy<HashMap<&'static str, &'static [u8]>> = Lazy::new(|| load_preset());
+
+/// Presets inflated or read from the preset directory, kept for the whole process.
+static LOADED_PRESETS: Lazy<Mutex<HashMap<String, &'static [u8]>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+
+static PRESET_DIR: Lazy<Mutex<Option<PathBuf>>> =
+    Lazy::new(|| Mutex::new(std::env::var_os("SLEIGHCRAFT_SLA_DIR").map(PathBuf::from)));
+
+static PRESET_LANGUAGES: Lazy<Mutex<HashMap<String, Arc<SleighLanguage>>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+
+/// A compiled specification loaded once, which any number of decoders can be
+/// built from (see `SleighBuilder::language`), including on different threads.
+///
+/// Loading the symbol table and decision tree is most of the cost of building
+/// a decoder, so reuse a language instead of passing the same `spec` over and over.
+pub struct SleighLanguage {
+    proxy: SharedPtr<ffi::SleighLanguageProxy>,
+}
+
+impl SleighLanguage {
+    /// Load a language from `.sla` xml text as sleighc writes it, or the packed
+    /// binary format. The spec is restored as it is read, without an xml tree.
+    pub fn from_spec<S: AsRef<[u8]> + ?Sized>(spec: &S) -> Result<Arc<Self>> {
+        let proxy = new_sleigh_language(spec.as_ref()).map_err(|e| Error::CppException(e))?;
+        Ok(Arc::new(Self { proxy }))
+    }
+
+    /// Like `from_spec`, but the xml tree of the whole spec is built before restoring
+    /// from it, as Ghidra does. This takes more time and memory, but any xml document
+    /// is accepted, where `from_spec` only takes what sleighc writes (no comments,
+    /// character data or declarations).
+    pub fn from_spec_tree<S: AsRef<[u8]> + ?Sized>(spec: &S) -> Result<Arc<Self>> {
+        let proxy =
+            new_sleigh_language_from_tree(spec.as_ref()).map_err(|e| Error::CppException(e))?;
+        Ok(Arc::new(Self { proxy }))
+    }
+
+    /// Write the language out as `.sla` xml text, as sleighc does.
+    pub fn to_xml(&self) -> String {
+        self.proxy.to_xml()
+    }
+
+    /// Load a language from a `.sla` file, in either format. The file is memory
+    /// mapped and restored straight from the mapping, rather than read into a buffer.
+    pub fn from_file<P: AsRef<Path>>(path: P) -> Result<Arc<Self>> {
+        let path = path.as_ref().to_str().ok_or_else(|| {
+            Error::IoError(std::io::Error::new(
+                std::io::ErrorKind::InvalidInput,
+                "spec path is not valid unicode",
+            ))
+        })?;
+        let proxy = new_sleigh_language_from_file(path).map_err(|e| Error::CppException(e))?;
+        Ok(Arc::new(Self { proxy }))
+    }
 
-const PRESET: Lazy<HashMap<&'static str, &'static str>> = Lazy::new(|| load_preset());
+    /// Get a preset language by name. Each preset is loaded at most once per process.
+    /// Presets from the preset directory are loaded with `from_file`.
+    pub fn arch(name: &str) -> Result<Arc<Self>> {
+        let name = name.to_lowercase();
+        let mut languages = PRESET_LANGUAGES.lock().unwrap();
+        if let Some(lang) = languages.get(&name) {
+            return Ok(lang.clone());
+        }
+        let embedded = PRESET.contains_key(name.as_str());
+        let lang = if embedded || LOADED_PRESETS.lock().unwrap().contains_key(&name) {
+            Self::from_spec(arch(&name)?)?
+        } else {
+            Self::from_file(find_preset_file(&name)?)?
+        };
+        languages.insert(name, lang.clone());
+        Ok(lang)
+    }
+}
 
 pub struct Sleigh<'a> {
     sleigh_proxy: UniquePtr<ffi::SleighProxy>,
-    asm_emit: RustAssemblyEmit<'a>,
-    pcode_emit: RustPcodeEmit<'a>,
-    _load_image: Pin<Box<RustLoadImage<'a>>>,
+    _language: Option<Arc<SleighLanguage>>,
+    asm_emit: Option<RustAssemblyEmit<'a>>,
+    pcode_emit: Option<RustPcodeEmit<'a>>,
+    _load_image: Option<Pin<Box<RustLoadImage<'a>>>>,
 }
 
 impl<'a> Sleigh<'a> {
     pub fn decode(&mut self, start: u64) -> Result<()> {
         // self.load_image.set_buf(bytes);
-        let assembly_emit = self.asm_emit.borrow_mut();
-        let pcodes_emit = self.pcode_emit.borrow_mut();
+        let (assembly_emit, pcodes_emit) = Self::emits(&mut self.asm_emit, &mut self.pcode_emit)?;
         self.sleigh_proxy
             .as_mut()
             .unwrap()
             .decode_with(assembly_emit, pcodes_emit, start)
             .map_err(|e| Error::CppException(e))
     }
+
+    /// Decode every instruction that starts in `[start, end)`. The last one may extend
+    /// past `end`. Returns the address right after the last decoded instruction.
+    ///
+    /// A branch is decoded together with its delay slots: their p-code is emitted
+    /// with the branch's, then their assembly follows, without any p-code of its own.
+    pub fn decode_range(&mut self, start: u64, end: u64) -> Result<u64> {
+        let (assembly_emit, pcodes_emit) = Self::emits(&mut self.asm_emit, &mut self.pcode_emit)?;
+        self.sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .decode_range(assembly_emit, pcodes_emit, start, end)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// Like `decode_range`, but only p-code is produced, appended to `buffer`. This
+    /// needs no emitters and skips the per-op callbacks and allocations. Delay slots
+    /// are listed after their branch, see `PcodeBuffer`.
+    pub fn decode_pcode(&mut self, buffer: &mut PcodeBuffer, start: u64, end: u64) -> Result<u64> {
+        self.sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .decode_pcode(buffer.proxy.pin_mut(), start, end)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// Decode the basic block at `start`: append the p-code of at most `max_insns`
+    /// instructions to `buffer`, stopping after the first one that branches, calls or
+    /// returns. Only an error on the first instruction is returned, otherwise the
+    /// block ends before the instruction that failed. Delay slots are added with their
+    /// branch and not counted in `max_insns`.
+    pub fn decode_block(
+        &mut self,
+        buffer: &mut PcodeBuffer,
+        start: u64,
+        max_insns: u32,
+    ) -> Result<BlockExit> {
+        let first_insn = buffer.insn_addrs().len();
+        let next = self
+            .sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .decode_block(buffer.proxy.pin_mut(), start, max_insns)
+            .map_err(|e| Error::CppException(e))?;
+        if buffer.insn_addrs().len() == first_insn {
+            return Ok(BlockExit {
+                next,
+                ..Default::default()
+            });
+        }
+        Ok(BlockExit::from_buffer(buffer, next))
+    }
+
+    /// Recursive descent from `entries`: decode along branches, calls and fall
+    /// throughs until every reachable instruction is found. Indirect targets are not
+    /// followed. Only for a decoder built over segments; `threads` decoders work
+    /// together when it was built from a `SleighLanguage`, otherwise a single one.
+    /// Each of them decodes with a copy of this decoder's context. A language where an
+    /// instruction can change the context of others (`globalset`, like ARM `blx` into
+    /// thumb code) is always explored with a single decoder, so that the commits land
+    /// in the order they are found. The result does not depend on the number of threads.
+    pub fn explore(&mut self, entries: &[u64], threads: usize) -> Result<ControlFlow> {
+        let mut flow = ControlFlow {
+            proxy: new_descent_result(),
+        };
+        let threads = threads.max(1).min(u32::MAX as usize) as u32;
+        self.sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .explore(flow.proxy.pin_mut(), entries, threads)
+            .map_err(|e| Error::CppException(e))?;
+        Ok(flow)
+    }
+
+    /// Like `decode_range`, but only assembly is produced, appended to `buffer`.
+    /// On an error, the instructions decoded before the failing one are kept.
+    pub fn decode_asm(&mut self, buffer: &mut AssemblyBuffer, start: u64, end: u64) -> Result<u64> {
+        self.sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .decode_asm(buffer.proxy.pin_mut(), start, end)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// How often an address was found already parsed. Each decoded instruction
+    /// is looked up about twice, more with delay slots.
+    pub fn parser_cache_stats(&self) -> ParserCacheStats {
+        ParserCacheStats {
+            hits: self.sleigh_proxy.parser_cache_hits(),
+            misses: self.sleigh_proxy.parser_cache_misses(),
+        }
+    }
+
+    /// How often p-code was replayed from the translation cache, see
+    /// `SleighBuilder::translation_cache`. Only p-code decoding looks it up.
+    pub fn translation_cache_stats(&self) -> TranslationCacheStats {
+        TranslationCacheStats {
+            hits: self.sleigh_proxy.translation_cache_hits(),
+            misses: self.sleigh_proxy.translation_cache_misses(),
+        }
+    }
+
+    /// Forget the parses and translations of instructions overlapping `[start, start + size)`.
+    /// Call it after the bytes there have changed.
+    pub fn invalidate(&mut self, start: u64, size: u64) {
+        self.sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .invalidate_bytes(start, size)
+    }
+
+    /// Look context up in a sorted array of the points where it currently changes,
+    /// once they are all known (after analysis). Adding a change point later goes
+    /// back to the slower lookups until this is called again. Only for decoders built
+    /// with `ContextStore::INTERVALS`.
+    pub fn freeze_context(&mut self) -> Result<()> {
+        self.sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .freeze_context()
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// Start emulating the p-code of this decoder's language over its image. The
+    /// emulator borrows the decoder, and its translation cache (if any) is used for
+    /// every instruction executed.
+    pub fn emulator(&mut self) -> Result<Emulator<'_>> {
+        let proxy = self
+            .sleigh_proxy
+            .as_mut()
+            .unwrap()
+            .new_emulator()
+            .map_err(|e| Error::CppException(e))?;
+        Ok(Emulator {
+            proxy,
+            _sleigh: PhantomData,
+        })
+    }
+
+    fn emits<'s>(
+        asm_emit: &'s mut Option<RustAssemblyEmit<'a>>,
+        pcode_emit: &'s mut Option<RustPcodeEmit<'a>>,
+    ) -> Result<(&'s mut RustAssemblyEmit<'a>, &'s mut RustPcodeEmit<'a>)> {
+        let asm_emit = asm_emit
+            .as_mut()
+            .ok_or(Error::MissingArg("asm_emit".to_string()))?;
+        let pcode_emit = pcode_emit
+            .as_mut()
+            .ok_or(Error::MissingArg("pcode_emit".to_string()))?;
+        Ok((asm_emit, pcode_emit))
+    }
+}
+
+/// Why `Emulator::run` returned.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum StopReason {
+    /// `max_steps` instructions were executed.
+    StepLimit,
+    /// The next instruction has a breakpoint. It is executed by the next run.
+    Breakpoint,
+    /// The instruction just executed called this user-defined op, see
+    /// `Emulator::stop_at_userop`.
+    Userop(u32),
+}
+
+/// What an `Emulator::run` did.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct RunExit {
+    pub reason: StopReason,
+    /// Number of instructions executed.
+    pub steps: u64,
+}
+
+/// A p-code emulator over the image of a `Sleigh` decoder, built by `Sleigh::emulator`.
+///
+/// Memory starts out as the image, and every other space (registers, temporaries)
+/// as zeros. Writes are kept by the emulator: instructions are always decoded from
+/// the image itself, so code the program writes is not executed. A run executes
+/// whole instructions in C++ and only returns when it stops.
+///
+/// After an error the state is left in the middle of the failing instruction, and
+/// `set_pc` must be called before running again.
+pub struct Emulator<'s> {
+    proxy: UniquePtr<ffi::EmulatorProxy>,
+    _sleigh: PhantomData<&'s mut ()>,
+}
+
+impl<'s> Emulator<'s> {
+    /// Address of the next instruction to execute.
+    pub fn pc(&self) -> u64 {
+        self.proxy.get_pc()
+    }
+
+    /// Go on at `addr`, which is decoded right away. Needed before the first run.
+    pub fn set_pc(&mut self, addr: u64) -> Result<()> {
+        self.proxy
+            .pin_mut()
+            .set_pc(addr)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// Value of a register of at most 8 bytes, by its name in the specification.
+    pub fn register(&self, name: &str) -> Result<u64> {
+        self.proxy
+            .get_register(name)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    pub fn set_register(&mut self, name: &str, val: u64) -> Result<()> {
+        self.proxy
+            .pin_mut()
+            .set_register(name, val)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// Read `buf.len()` bytes of the code space from `addr`.
+    pub fn read_memory(&self, addr: u64, buf: &mut [u8]) -> Result<()> {
+        self.proxy
+            .read_memory(addr, buf)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    pub fn write_memory(&mut self, addr: u64, data: &[u8]) -> Result<()> {
+        self.proxy
+            .pin_mut()
+            .write_memory(addr, data)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// Stop a run before the instruction at `addr` is executed.
+    pub fn add_breakpoint(&mut self, addr: u64) {
+        self.proxy.pin_mut().add_breakpoint(addr)
+    }
+
+    pub fn remove_breakpoint(&mut self, addr: u64) {
+        self.proxy.pin_mut().remove_breakpoint(addr)
+    }
+
+    /// Stop a run after an instruction calling the user-defined op `name` (a system
+    /// call for instance), which does nothing else. Returns the index of the op, as
+    /// found in `StopReason::Userop`. Without this, such an instruction is an error.
+    pub fn stop_at_userop(&mut self, name: &str) -> Result<u32> {
+        self.proxy
+            .pin_mut()
+            .stop_at_userop(name)
+            .map_err(|e| Error::CppException(e))
+    }
+
+    /// Execute at most `max_steps` instructions, stopping early at a breakpoint or at
+    /// a user-defined op passed to `stop_at_userop`.
+    pub fn run(&mut self, max_steps: u64) -> Result<RunExit> {
+        let steps = self
+            .proxy
+            .pin_mut()
+            .run(max_steps)
+            .map_err(|e| Error::CppException(e))?;
+        let reason = match self.proxy.get_stop() {
+            1 => StopReason::Breakpoint,
+            2 => StopReason::Userop(self.proxy.get_stop_userop()),
+            _ => StopReason::StepLimit,
+        };
+        Ok(RunExit { reason, steps })
+    }
+
+    /// Save the registers, the memory and the program counter, to be brought back by
+    /// `restore`. Memory pages are shared with the snapshot until they are written.
+    pub fn snapshot(&mut self) {
+        self.proxy.pin_mut().snapshot()
+    }
+
+    /// Go back to the last snapshot, or to the initial state if none was taken (then
+    /// `set_pc` is needed again). Only the memory pages written since are copied back,
+    /// so this is cheap after a short run however much memory is in use.
+    pub fn restore(&mut self) -> Result<()> {
+        self.proxy
+            .pin_mut()
+            .restore()
+            .map_err(|e| Error::CppException(e))
+    }
 }
 
 #[derive(Default)]
@@ -768,8 +1592,13 @@ pub struct SleighBuilder<'a> {
     asm_emit: Option<RustAssemblyEmit<'a>>,
     pcode_emit: Option<RustPcodeEmit<'a>>,
     load_image: Option<RustLoadImage<'a>>,
-    spec: Option<String>,
+    spec: Option<&'a [u8]>,
+    segments: Vec<(u64, &'a [u8])>,
+    language: Option<Arc<SleighLanguage>>,
     mode: Option<Mode>,
+    parser_cache: Option<(usize, CachePolicy)>,
+    translation_cache: Option<usize>,
+    context_store: Option<ContextStore>,
 }
 impl<'a> SleighBuilder<'a> {
     // TODO: add from_arch(arch_name: &str) -> Self helper function.
@@ -789,9 +1618,50 @@ impl<'a> SleighBuilder<'a> {
         self
     }
 
-    pub fn spec(&mut self, spec: &str) -> &mut Self {
-        // self.load_image = unsafe{Some(Box::from_raw(loader))};
-        self.spec = Some(spec.to_string());
+    /// Keep up to `size` parsed instructions, so addresses that are decoded again
+    /// (when following control flow for instance) are not parsed twice. By default
+    /// only the few the specification needs are kept. Each one costs a few KB.
+    pub fn parser_cache(&mut self, size: usize, policy: CachePolicy) -> &mut Self {
+        self.parser_cache = Some((size, policy));
+        self
+    }
+
+    /// Keep the finished p-code of `size` instructions, so translating one again
+    /// (an emulator running a loop for instance) just replays it. Instructions are
+    /// matched on their address, context and bytes, so changed bytes are never replayed.
+    /// Disabled by default.
+    pub fn translation_cache(&mut self, size: usize) -> &mut Self {
+        self.translation_cache = Some(size);
+        self
+    }
+
+    /// Pick how context values are stored, `ContextStore::MAP` by default.
+    /// `ContextStore::INTERVALS` is faster to look up in once frozen, for images with
+    /// many points where the context changes (ARM/Thumb interworking for instance).
+    pub fn context_store(&mut self, store: ContextStore) -> &mut Self {
+        self.context_store = Some(store);
+        self
+    }
+
+    /// Set the compiled specification, either as `.sla` xml text or in the packed
+    /// binary format produced by `sleighc -p`. The bytes are borrowed, not copied.
+    pub fn spec<S: AsRef<[u8]> + ?Sized>(&mut self, spec: &'a S) -> &mut Self {
+        self.spec = Some(spec.as_ref());
+        self
+    }
+
+    /// Decode with an already loaded language instead of a `spec`.
+    pub fn language(&mut self, language: Arc<SleighLanguage>) -> &mut Self {
+        self.language = Some(language);
+        self
+    }
+
+    /// Decode straight from `data`, mapped at `start`, instead of going through a
+    /// `LoadImage`. The bytes are borrowed, not copied, and are read by the decoder
+    /// without calling back into Rust. Can be called several times to map more
+    /// (non overlapping) ranges. Ignored if a `loader` is set.
+    pub fn segment(&mut self, start: u64, data: &'a [u8]) -> &mut Self {
+        self.segments.push((start, data));
         self
     }
 
@@ -801,40 +1671,140 @@ impl<'a> SleighBuilder<'a> {
     }
 
     pub fn try_build(mut self) -> Result<Sleigh<'a>> {
-        let load_image = self
-            .load_image
-            .ok_or(Error::MissingArg("load_image".to_string()))?;
-        let mut load_image = Box::pin(load_image);
-        let mut sleigh_proxy = new_sleigh_proxy(&mut load_image);
+        if self.load_image.is_none() && self.segments.is_empty() {
+            return Err(Error::MissingArg("load_image".to_string()));
+        }
+        let mut load_image = self.load_image.map(|load_image| Box::pin(load_image));
 
-        let spec = self.spec.ok_or(Error::MissingArg("spec".to_string()))?;
         if self.mode.is_none() {
             // Set default address and Operand size
             self.mode = Some(MODE16);
         };
-        sleigh_proxy
-            .as_mut()
-            .unwrap()
-            .set_spec(spec.as_str(), self.mode.unwrap() as i32);
-
-        let asm_emit = self
-            .asm_emit
-            .ok_or(Error::MissingArg("asm_emit".to_string()))?;
-        let pcode_emit = self
-            .pcode_emit
-            .ok_or(Error::MissingArg("pcode_emit".to_string()))?;
+        let mode = self.mode.unwrap() as i32;
+        let context = self.context_store.unwrap_or(ContextStore::MAP) as i32;
+        let mut sleigh_proxy = if let Some(language) = &self.language {
+            match &mut load_image {
+                Some(load_image) => {
+                    new_sleigh_proxy_with_language(load_image, &language.proxy, mode, context)
+                }
+                None => new_sleigh_proxy_span_with_language(&language.proxy, mode, context),
+            }
+            .map_err(|e| Error::CppException(e))?
+        } else {
+            let spec = self.spec.ok_or(Error::MissingArg("spec".to_string()))?;
+            let mut sleigh_proxy = match &mut load_image {
+                Some(load_image) => new_sleigh_proxy(load_image, context),
+                None => new_sleigh_proxy_span(context),
+            }
+            .map_err(|e| Error::CppException(e))?;
+            sleigh_proxy
+                .as_mut()
+                .unwrap()
+                .set_spec(spec, mode)
+                .map_err(|e| Error::CppException(e))?;
+            sleigh_proxy
+        };
+        if let Some((size, policy)) = self.parser_cache {
+            let size = size.min(i32::MAX as usize) as i32;
+            sleigh_proxy
+                .as_mut()
+                .unwrap()
+                .set_parser_cache(size, policy as i32)
+                .map_err(|e| Error::CppException(e))?;
+        }
+        if let Some(size) = self.translation_cache {
+            let size = size.min(i32::MAX as usize) as i32;
+            sleigh_proxy
+                .as_mut()
+                .unwrap()
+                .set_translation_cache(size)
+                .map_err(|e| Error::CppException(e))?;
+        }
+        if load_image.is_none() {
+            for (start, data) in self.segments {
+                sleigh_proxy
+                    .as_mut()
+                    .unwrap()
+                    .add_segment(start, data)
+                    .map_err(|e| Error::CppException(e))?;
+            }
+        }
 
         Ok(Sleigh {
             sleigh_proxy,
-            asm_emit,
-            pcode_emit,
+            _language: self.language,
+            asm_emit: self.asm_emit,
+            pcode_emit: self.pcode_emit,
             _load_image: load_image,
         })
     }
 }
-pub fn arch(name: &str) -> Result<&str> {
-    let content = *PRESET
-        .get(&name.to_lowercase().as_str())
-        .ok_or(Error::ArchNotFound(name.to_string()))?;
+/// Get the specification of a preset architecture by name (case insensitive).
+///
+/// Presets embedded in the binary come first. Other names are looked up as
+/// `<name>.sla` in the preset directory (see `set_preset_dir`). Whatever has to be
+/// inflated or read is only done once, on first use.
+pub fn arch(name: &str) -> Result<&'static [u8]> {
+    let name = name.to_lowercase();
+    let mut loaded = LOADED_PRESETS.lock().unwrap();
+    if let Some(content) = loaded.get(&name) {
+        return Ok(content);
+    }
+    let content = match PRESET.get(name.as_str()) {
+        Some(data) => match unpack_preset(data)? {
+            Cow::Borrowed(content) => return Ok(content),
+            Cow::Owned(content) => content,
+        },
+        None => read_preset_file(&name)?,
+    };
+    let content: &'static [u8] = Box::leak(content.into_boxed_slice());
+    loaded.insert(name, content);
     Ok(content)
 }
+
+/// Set the directory where `arch` looks for the specifications which are not embedded,
+/// such as the ones left out with the `SLEIGHCRAFT_PRESETS` variable at build time or
+/// all of them without the `predefined` feature. Defaults to `$SLEIGHCRAFT_SLA_DIR`.
+pub fn set_preset_dir<P: Into<PathBuf>>(dir: P) {
+    *PRESET_DIR.lock().unwrap() = Some(dir.into());
+}
+
+#[cfg(not(feature = "compressed"))]
+fn unpack_preset(data: &'static [u8]) -> Result<Cow<'static, [u8]>> {
+    Ok(Cow::Borrowed(data))
+}
+
+#[cfg(feature = "compressed")]
+fn unpack_preset(data: &'static [u8]) -> Result<Cow<'static, [u8]>> {
+    miniz_oxide::inflate::decompress_to_vec(data)
+        .map(Cow::Owned)
+        .map_err(|_| {
+            Error::IoError(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                "corrupted compressed preset",
+            ))
+        })
+}
+
+// `name` is lowercase, the file names are not
+fn find_preset_file(name: &str) -> Result<PathBuf> {
+    let dir = PRESET_DIR.lock().unwrap().clone();
+    let dir = dir.ok_or(Error::ArchNotFound(name.to_string()))?;
+    for entry in std::fs::read_dir(&dir)? {
+        let path = entry?.path();
+        let matches = path.extension().map(|e| e == "sla").unwrap_or(false)
+            && path
+                .file_stem()
+                .and_then(|stem| stem.to_str())
+                .map(|stem| stem.to_lowercase() == name)
+                .unwrap_or(false);
+        if matches {
+            return Ok(path);
+        }
+    }
+    Err(Error::ArchNotFound(name.to_string()))
+}
+
+fn read_preset_file(name: &str) -> Result<Vec<u8>> {
+    Ok(std::fs::read(find_preset_file(name)?)?)
+}
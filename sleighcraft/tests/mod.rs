@@ -1,5 +1,9 @@
 use sleighcraft::prelude::*;
 use sleighcraft::Mode::{MODE32, MODE64};
+use sleighcraft::ffi::AddressProxy;
+use sleighcraft::{CachePolicy, ContextStore, LoadImage};
+use std::cell::RefCell;
+use std::rc::Rc;
 
 // #[test]
 // fn test_custom_spec() {
@@ -92,6 +96,23 @@ fn test_x86_64_bit() {
     println!("{:?}", pcode_emit.pcode_asms);
 }
 
+#[test]
+fn test_x86_64_operand_size() {
+    // mov eax, 1; mov rax, 1; ret: operands are 32-bit unless REX.W widens them
+    let buf = [0xb8, 1, 0, 0, 0, 0x48, 0xb8, 1, 0, 0, 0, 0, 0, 0, 0, 0xc3];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.spec(arch("x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut asm = AssemblyBuffer::new();
+    sleigh.decode_asm(&mut asm, 0, buf.len() as u64).unwrap();
+
+    assert_eq!(asm.insn_lengths(), &[5, 10, 1]);
+    assert_eq!(asm.body(0), "EAX,0x1");
+    assert_eq!(asm.body(1), "RAX,0x1");
+}
+
 #[test]
 fn test_mips32le_bit() {
     let mut sleigh_builder = SleighBuilder::default();
@@ -127,3 +148,751 @@ fn test_mips32le_bit() {
         println!();
     }
 }
+
+#[test]
+fn test_shared_language() {
+    let lang = SleighLanguage::arch("x86-64").unwrap();
+    let buf = [72, 49, 192, 0x90];
+
+    let handles: Vec<_> = (0..4)
+        .map(|_| {
+            let lang = lang.clone();
+            std::thread::spawn(move || {
+                let mut sleigh_builder = SleighBuilder::default();
+                let mut loader = PlainLoadImage::from_buf(&buf, 0);
+                sleigh_builder.loader(&mut loader);
+                sleigh_builder.language(lang);
+                sleigh_builder.mode(MODE64);
+                let mut asm_emit = CollectingAssemblyEmit::default();
+                let mut pcode_emit = CollectingPcodeEmit::default();
+                sleigh_builder.asm_emit(&mut asm_emit);
+                sleigh_builder.pcode_emit(&mut pcode_emit);
+                let mut sleigh = sleigh_builder.try_build().unwrap();
+
+                sleigh.decode(0).unwrap();
+                drop(sleigh);
+
+                asm_emit
+                    .asms
+                    .iter()
+                    .map(|asm| format!("{} {}", asm.mnemonic, asm.body))
+                    .collect::<Vec<_>>()
+            })
+        })
+        .collect();
+
+    let results: Vec<_> = handles.into_iter().map(|h| h.join().unwrap()).collect();
+    assert_eq!(results[0].len(), 2);
+    for r in results.iter() {
+        assert_eq!(r, &results[0]);
+    }
+}
+
+#[test]
+fn test_parallel_decode() {
+    // xor rax, rax; nop; add eax, 1; ret, repeated so the buffer spans several chunks
+    let code = [72, 49, 192, 0x90, 0x05, 1, 0, 0, 0, 0xc3];
+    let buf: Vec<u8> = code.iter().cycle().take(code.len() * 4000).cloned().collect();
+    let lang = SleighLanguage::arch("x86-64").unwrap();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    let mut loader = PlainLoadImage::from_buf(&buf, 0x1000);
+    sleigh_builder.loader(&mut loader);
+    sleigh_builder.language(lang.clone());
+    sleigh_builder.mode(MODE64);
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+    sleigh_builder.asm_emit(&mut asm_emit);
+    sleigh_builder.pcode_emit(&mut pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode(0x1000).unwrap();
+    drop(sleigh);
+
+    let mut decoder = ParallelDecoder::new(lang);
+    decoder.mode(MODE64).threads(4);
+    let (par_asm, par_pcode) = decoder.decode(&buf, 0x1000).unwrap();
+
+    assert_eq!(par_asm.asms.len(), asm_emit.asms.len());
+    for (a, b) in par_asm.asms.iter().zip(asm_emit.asms.iter()) {
+        assert_eq!(a.addr, b.addr);
+        assert_eq!(a.mnemonic, b.mnemonic);
+        assert_eq!(a.body, b.body);
+    }
+    assert_eq!(par_pcode.pcode_asms.len(), pcode_emit.pcode_asms.len());
+}
+
+#[test]
+fn test_pcode_buffer() {
+    let buf = [72, 49, 192, 0x90, 0x05, 1, 0, 0, 0, 0xc3];
+    let lang = SleighLanguage::arch("x86-64").unwrap();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    let mut loader = PlainLoadImage::from_buf(&buf, 0);
+    sleigh_builder.loader(&mut loader);
+    sleigh_builder.language(lang.clone());
+    sleigh_builder.mode(MODE64);
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+    sleigh_builder.asm_emit(&mut asm_emit);
+    sleigh_builder.pcode_emit(&mut pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode(0).unwrap();
+    drop(sleigh);
+
+    // No emitters are needed to decode into a buffer
+    let mut sleigh_builder = SleighBuilder::default();
+    let mut loader = PlainLoadImage::from_buf(&buf, 0);
+    sleigh_builder.loader(&mut loader);
+    sleigh_builder.language(lang);
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut pcode = PcodeBuffer::new();
+    let next = sleigh.decode_pcode(&mut pcode, 0, buf.len() as u64).unwrap();
+
+    assert_eq!(next, buf.len() as u64);
+    assert_eq!(pcode.insn_addrs(), &[0, 3, 4, 9]);
+    assert_eq!(pcode.len(), pcode_emit.pcode_asms.len());
+    for (i, op) in pcode_emit.pcode_asms.iter().enumerate() {
+        assert_eq!(pcode.opcode(i).to_string(), op.opcode.to_string());
+        assert_eq!(pcode.insn_addrs()[pcode.op_insns()[i] as usize], op.addr.offset);
+        let vars = pcode.op_vars()[i] as usize..pcode.op_vars()[i + 1] as usize;
+        let mut vars = vars.skip(pcode.op_outputs()[i] as usize);
+        for v in op.vars.iter() {
+            let idx = vars.next().unwrap();
+            assert_eq!(pcode.space_name(pcode.var_spaces()[idx]), v.space);
+            assert_eq!(pcode.var_sizes()[idx], v.size);
+        }
+    }
+
+    pcode.clear();
+    assert!(pcode.is_empty());
+}
+
+#[test]
+fn test_asm_buffer() {
+    let buf = [72, 49, 192, 0x90, 0x05, 1, 0, 0, 0, 0xc3];
+    let lang = SleighLanguage::arch("x86-64").unwrap();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    let mut loader = PlainLoadImage::from_buf(&buf, 0);
+    sleigh_builder.loader(&mut loader);
+    sleigh_builder.language(lang.clone());
+    sleigh_builder.mode(MODE64);
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+    sleigh_builder.asm_emit(&mut asm_emit);
+    sleigh_builder.pcode_emit(&mut pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode(0).unwrap();
+    drop(sleigh);
+
+    let mut sleigh_builder = SleighBuilder::default();
+    let mut loader = PlainLoadImage::from_buf(&buf, 0);
+    sleigh_builder.loader(&mut loader);
+    sleigh_builder.language(lang);
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut asm = AssemblyBuffer::new();
+    let next = sleigh.decode_asm(&mut asm, 0, buf.len() as u64).unwrap();
+
+    assert_eq!(next, buf.len() as u64);
+    assert_eq!(asm.insn_addrs(), &[0, 3, 4, 9]);
+    assert_eq!(asm.insn_lengths(), &[3, 1, 5, 1]);
+    assert_eq!(asm.len(), asm_emit.asms.len());
+    for (i, insn) in asm_emit.asms.iter().enumerate() {
+        assert_eq!(asm.mnemonic(i), insn.mnemonic);
+        assert_eq!(asm.body(i), insn.body);
+    }
+
+    // Truncating drops the text too, so the next batch continues right after
+    asm.truncate(1);
+    sleigh.decode_asm(&mut asm, 3, 4).unwrap();
+    assert_eq!(asm.len(), 2);
+    assert_eq!(asm.mnemonic(1), asm_emit.asms[1].mnemonic);
+
+    asm.clear();
+    assert!(asm.is_empty());
+
+    // nop; then push es, which does not exist in 64-bit mode
+    let buf = [0x90, 0x06, 0xc3];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.spec(arch("x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    assert!(sleigh.decode_asm(&mut asm, 0, buf.len() as u64).is_err());
+    // The instructions before the bad one are kept, and nothing of the bad one
+    assert_eq!(asm.insn_addrs(), &[0]);
+    assert_eq!(asm.mnemonic(0), "NOP");
+    sleigh.decode_asm(&mut asm, 2, 3).unwrap();
+    assert_eq!(asm.insn_addrs(), &[0, 2]);
+    assert_eq!(asm.mnemonic(1), "RET");
+}
+
+#[test]
+fn test_segment_image() {
+    let buf = [72, 49, 192, 0x90, 0x05, 1, 0, 0, 0, 0xc3];
+    let spec = arch("x86-64").unwrap();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    let mut loader = PlainLoadImage::from_buf(&buf, 0x400000);
+    sleigh_builder.loader(&mut loader);
+    sleigh_builder.spec(spec);
+    sleigh_builder.mode(MODE64);
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+    sleigh_builder.asm_emit(&mut asm_emit);
+    sleigh_builder.pcode_emit(&mut pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode(0x400000).unwrap();
+    drop(sleigh);
+
+    // The same bytes, borrowed in two segments
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0x400000, &buf[..4]);
+    sleigh_builder.segment(0x400004, &buf[4..]);
+    sleigh_builder.spec(spec);
+    sleigh_builder.mode(MODE64);
+    let mut seg_asm_emit = CollectingAssemblyEmit::default();
+    let mut seg_pcode_emit = CollectingPcodeEmit::default();
+    sleigh_builder.asm_emit(&mut seg_asm_emit);
+    sleigh_builder.pcode_emit(&mut seg_pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode(0x400000).unwrap();
+    // Nothing is mapped there
+    assert!(sleigh.decode(0x500000).is_err());
+    drop(sleigh);
+
+    assert_eq!(seg_asm_emit.asms.len(), asm_emit.asms.len());
+    for (a, b) in seg_asm_emit.asms.iter().zip(asm_emit.asms.iter()) {
+        assert_eq!(a.addr, b.addr);
+        assert_eq!(a.body, b.body);
+    }
+    assert_eq!(seg_pcode_emit.pcode_asms.len(), pcode_emit.pcode_asms.len());
+}
+
+#[test]
+fn test_parser_cache() {
+    let buf = [72, 49, 192, 0x90, 0x05, 1, 0, 0, 0, 0xc3];
+    let spec = arch("x86-64").unwrap();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0x400000, &buf);
+    sleigh_builder.spec(spec);
+    sleigh_builder.mode(MODE64);
+    sleigh_builder.parser_cache(64, CachePolicy::LRU);
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+    sleigh_builder.asm_emit(&mut asm_emit);
+    sleigh_builder.pcode_emit(&mut pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode_range(0x400000, 0x40000a).unwrap();
+    let first = sleigh.parser_cache_stats();
+    assert!(first.misses >= 4);
+
+    // Everything fits, so decoding again parses nothing
+    sleigh.decode_range(0x400000, 0x40000a).unwrap();
+    let second = sleigh.parser_cache_stats();
+    assert_eq!(second.misses, first.misses);
+    assert!(second.hits > first.hits);
+    drop(sleigh);
+
+    let n = asm_emit.asms.len() / 2;
+    assert_eq!(n, 4);
+    for (a, b) in asm_emit.asms[..n].iter().zip(asm_emit.asms[n..].iter()) {
+        assert_eq!(a.addr, b.addr);
+        assert_eq!(a.body, b.body);
+    }
+}
+
+#[test]
+fn test_parser_cache_context_change() {
+    // blx 0xc; mov r0,r0; mov r0,r0; then thumb movs r0,#1; movs r0,#2
+    let buf = [
+        0x01, 0x00, 0x00, 0xfa, 0x00, 0x00, 0xa0, 0xe1, 0x00, 0x00, 0xa0, 0xe1, 0x01, 0x20, 0x02,
+        0x20,
+    ];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.spec(arch("ARM7_le").unwrap());
+    sleigh_builder.parser_cache(64, CachePolicy::LRU);
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+    sleigh_builder.asm_emit(&mut asm_emit);
+    sleigh_builder.pcode_emit(&mut pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+
+    // Parsed as ARM and cached, before the blx switches the target to thumb
+    sleigh.decode_range(12, 16).unwrap();
+    sleigh.decode_range(0, 16).unwrap();
+    sleigh.decode_range(0, 16).unwrap();
+    drop(sleigh);
+
+    let bodies: Vec<(u64, &str)> = asm_emit
+        .asms
+        .iter()
+        .map(|asm| (asm.addr.offset, asm.body.as_str()))
+        .collect();
+    let thumb = [(0, "0xc"), (4, "r0,r0"), (8, "r0,r0"), (12, "r0,#0x1"), (14, "r0,#0x2")];
+    assert_eq!(bodies[1..6], thumb);
+    assert_eq!(bodies[6..], thumb);
+}
+
+#[test]
+fn test_context_intervals() {
+    let buf = [72, 49, 192, 0x90, 0x05, 1, 0, 0, 0, 0xc3];
+    let language = SleighLanguage::arch("x86-64").unwrap();
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0x400000, &buf);
+    sleigh_builder.language(language.clone());
+    sleigh_builder.mode(MODE64);
+    sleigh_builder.context_store(ContextStore::INTERVALS);
+    sleigh_builder.asm_emit(&mut asm_emit);
+    sleigh_builder.pcode_emit(&mut pcode_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode_range(0x400000, 0x40000a).unwrap();
+    sleigh.freeze_context().unwrap();
+    sleigh.decode_range(0x400000, 0x40000a).unwrap();
+    drop(sleigh);
+
+    // Frozen lookups find the same context
+    let n = asm_emit.asms.len() / 2;
+    assert_eq!(n, 4);
+    for (a, b) in asm_emit.asms[..n].iter().zip(asm_emit.asms[n..].iter()) {
+        assert_eq!(a.body, b.body);
+    }
+
+    // Only the interval store can be frozen
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0x400000, &buf);
+    sleigh_builder.language(language);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    assert!(sleigh.freeze_context().is_err());
+}
+
+#[test]
+fn test_decode_block() {
+    // nop; jmp 4; nop; call 0; ret
+    let buf = [0x90, 0xeb, 0x01, 0x90, 0xe8, 0xf7, 0xff, 0xff, 0xff, 0xc3];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.language(SleighLanguage::arch("x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut pcode = PcodeBuffer::new();
+
+    let exit = sleigh.decode_block(&mut pcode, 0, 16).unwrap();
+    assert_eq!(pcode.insn_addrs(), &[0, 1]);
+    assert_eq!(exit.next, 3);
+    assert_eq!(exit.flow.unwrap().to_string(), "BRANCH");
+    assert_eq!(exit.targets, vec![4]);
+    assert!(!exit.falls_through());
+
+    // Blocks append to the buffer, a call ends a block that falls through
+    let exit = sleigh.decode_block(&mut pcode, 4, 16).unwrap();
+    assert_eq!(pcode.insn_addrs(), &[0, 1, 4]);
+    assert_eq!(exit.next, 9);
+    assert_eq!(exit.targets, vec![0]);
+    assert!(exit.falls_through());
+
+    let exit = sleigh.decode_block(&mut pcode, 9, 16).unwrap();
+    assert_eq!(exit.flow.unwrap().to_string(), "RETURN");
+    assert!(exit.targets.is_empty());
+
+    pcode.clear();
+    let exit = sleigh.decode_block(&mut pcode, 0, 1).unwrap();
+    assert_eq!(pcode.insn_addrs(), &[0]);
+    assert_eq!(exit.next, 1);
+    assert!(exit.flow.is_none());
+    assert!(exit.falls_through());
+}
+
+#[test]
+fn test_delay_slot() {
+    // j 8; add $1, $2, $3 (in the delay slot); ori $1, $2, 0x64
+    let buf = [2, 0, 0, 8, 32, 8, 67, 0, 100, 0, 65, 52];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.spec(arch("mips32le").unwrap());
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut pcode = PcodeBuffer::new();
+
+    // The slot is listed after the branch, and its ops are part of the branch's
+    let exit = sleigh.decode_block(&mut pcode, 0, 16).unwrap();
+    assert_eq!(pcode.insn_addrs(), &[0, 4]);
+    assert_eq!(pcode.insn_lengths(), &[4, 4]);
+    assert_eq!(pcode.insn_delay_slots(), &[0, 1]);
+    assert!(pcode.op_insns().iter().all(|&insn| insn == 0));
+    assert_eq!(exit.next, 8);
+    assert_eq!(exit.flow.unwrap().to_string(), "BRANCH");
+    assert_eq!(exit.targets, vec![8]);
+
+    pcode.clear();
+    let end = sleigh.decode_pcode(&mut pcode, 0, 12).unwrap();
+    assert_eq!(end, 12);
+    assert_eq!(pcode.insn_addrs(), &[0, 4, 8]);
+    assert_eq!(pcode.insn_delay_slots(), &[0, 1, 0]);
+}
+
+#[test]
+fn test_explore() {
+    // call 0xa; jmp 8; (nop); ret; (nop); nop; ret
+    let buf = [0xe8, 5, 0, 0, 0, 0xeb, 0x01, 0x90, 0xc3, 0x90, 0x90, 0xc3];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.language(SleighLanguage::arch("x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+
+    let flow = sleigh.explore(&[0, 0x100], 2).unwrap();
+    assert_eq!(flow.insn_addrs(), &[0, 5, 8, 0xa, 0xb]);
+    assert_eq!(flow.insn_lengths(), &[5, 2, 1, 1, 1]);
+    assert_eq!(flow.bad_addrs(), &[0x100]);
+
+    // The call target is a function of its own
+    assert_eq!(flow.num_functions(), 2);
+    assert_eq!(flow.function_entry(0), 0);
+    assert_eq!(flow.function_insns(0), &[0, 1, 2]);
+    assert_eq!(flow.function_entry(1), 0xa);
+    assert_eq!(flow.function_insns(1), &[3, 4]);
+
+    let edges: Vec<_> = flow.edges().map(|e| (e.from, e.to, e.kind)).collect();
+    assert_eq!(
+        edges,
+        vec![
+            (0, 5, EdgeKind::FALL),
+            (0, 0xa, EdgeKind::CALL),
+            (5, 8, EdgeKind::BRANCH)
+        ]
+    );
+
+    let single = sleigh.explore(&[0, 0x100], 1).unwrap();
+    assert_eq!(single.insn_addrs(), flow.insn_addrs());
+}
+
+#[test]
+fn test_explore_thumb_interworking() {
+    // blx 0xc; mov r0,r0; bx lr; then thumb movs r0,#1; bx lr
+    let buf = [
+        0x01, 0x00, 0x00, 0xfa, 0x00, 0x00, 0xa0, 0xe1, 0x1e, 0xff, 0x2f, 0xe1, 0x01, 0x20, 0x70,
+        0x47,
+    ];
+    let language = SleighLanguage::arch("ARM7_le").unwrap();
+    let explore = |threads: usize| {
+        let mut sleigh_builder = SleighBuilder::default();
+        sleigh_builder.segment(0, &buf);
+        sleigh_builder.language(language.clone());
+        let mut sleigh = sleigh_builder.try_build().unwrap();
+        sleigh.explore(&[0], threads).unwrap()
+    };
+
+    // The blx switches its target to thumb, whichever worker gets there
+    for _ in 0..8 {
+        let flow = explore(4);
+        assert_eq!(flow.insn_addrs(), &[0, 4, 8, 0xc, 0xe]);
+        assert_eq!(flow.insn_lengths(), &[4, 4, 4, 2, 2]);
+        assert_eq!(flow.num_functions(), 2);
+        assert_eq!(flow.function_entry(1), 0xc);
+    }
+    let single = explore(1);
+    assert_eq!(single.insn_lengths(), &[4, 4, 4, 2, 2]);
+}
+
+#[test]
+fn test_translation_cache() {
+    let buf = [72, 49, 192, 0x90, 0x05, 1, 0, 0, 0, 0xc3];
+    let spec = arch("x86-64").unwrap();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0x400000, &buf);
+    sleigh_builder.spec(spec);
+    sleigh_builder.mode(MODE64);
+    sleigh_builder.translation_cache(64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut first = PcodeBuffer::new();
+    sleigh.decode_pcode(&mut first, 0x400000, 0x40000a).unwrap();
+    assert_eq!(sleigh.translation_cache_stats().hits, 0);
+
+    // The same instructions again are replayed, with the same p-code
+    let mut second = PcodeBuffer::new();
+    sleigh.decode_pcode(&mut second, 0x400000, 0x40000a).unwrap();
+    let stats = sleigh.translation_cache_stats();
+    assert_eq!(stats.hits, 4);
+    assert_eq!(stats.misses, 4);
+    assert_eq!(first.opcodes(), second.opcodes());
+    assert_eq!(first.op_vars(), second.op_vars());
+    assert_eq!(first.var_offsets(), second.var_offsets());
+    assert_eq!(first.var_sizes(), second.var_sizes());
+
+    // Only the instruction overlapping the invalidated bytes is translated again
+    sleigh.invalidate(0x400005, 1);
+    second.clear();
+    sleigh.decode_pcode(&mut second, 0x400000, 0x40000a).unwrap();
+    let stats = sleigh.translation_cache_stats();
+    assert_eq!(stats.hits, 7);
+    assert_eq!(stats.misses, 5);
+    assert_eq!(first.var_offsets(), second.var_offsets());
+}
+
+/// An image whose bytes can be rewritten while a decoder reads from it
+struct SharedImage(Rc<RefCell<Vec<u8>>>);
+
+impl LoadImage for SharedImage {
+    fn load_fill(&mut self, ptr: &mut [u8], addr: &AddressProxy) {
+        let buf = self.0.borrow();
+        let start = (addr.get_offset() as usize).min(buf.len());
+        let len = ptr.len().min(buf.len() - start);
+        ptr.fill(0);
+        ptr[..len].copy_from_slice(&buf[start..start + len]);
+    }
+    fn buf_size(&mut self) -> usize {
+        self.0.borrow().len()
+    }
+}
+
+#[test]
+fn test_translation_cache_changed_bytes() {
+    // add eax, 1; ret, of which the add is then rewritten to xor eax, eax
+    let bytes = Rc::new(RefCell::new(vec![0x05, 1, 0, 0, 0, 0xc3]));
+    let mut loader = SharedImage(bytes.clone());
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut pcode_emit = CollectingPcodeEmit::default();
+    {
+        let mut sleigh_builder = SleighBuilder::default();
+        sleigh_builder.loader(&mut loader);
+        sleigh_builder.spec(arch("x86-64").unwrap());
+        sleigh_builder.mode(MODE64);
+        sleigh_builder.translation_cache(64);
+        sleigh_builder.asm_emit(&mut asm_emit);
+        sleigh_builder.pcode_emit(&mut pcode_emit);
+        let mut sleigh = sleigh_builder.try_build().unwrap();
+        assert_eq!(sleigh.decode_range(0, 1).unwrap(), 5);
+        assert_eq!(sleigh.decode_range(0, 1).unwrap(), 5);
+
+        // The assembly, the p-code and the length all come from the new bytes
+        bytes.borrow_mut()[..2].copy_from_slice(&[0x31, 0xc0]);
+        assert_eq!(sleigh.decode_range(0, 1).unwrap(), 2);
+        let stats = sleigh.translation_cache_stats();
+        assert_eq!(stats.hits, 1);
+        assert_eq!(stats.misses, 2);
+    }
+    let mnemonics: Vec<&str> = asm_emit.asms.iter().map(|asm| asm.mnemonic.as_str()).collect();
+    assert_eq!(mnemonics, vec!["ADD", "ADD", "XOR"]);
+    let ops: Vec<String> = pcode_emit
+        .pcode_asms
+        .iter()
+        .map(|pcode| pcode.opcode.to_string())
+        .collect();
+    let count = |name: &str| ops.iter().filter(|op| op.as_str() == name).count();
+    assert_eq!(count("INT_ADD"), 2);
+    assert_eq!(count("INT_XOR"), 1);
+}
+
+#[test]
+fn test_long_instruction() {
+    // data16 x6, nopw cs:0x0(rax,rax,1) takes 15 bytes, more than are fetched at first,
+    // then xor eax, eax and a ret ending right at the end of the segment
+    let buf = [
+        0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0, 0, 0, 0, 0, 0x31, 0xc0, 0xc3,
+    ];
+    let spec = arch("x86-64").unwrap();
+
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0x400000, &buf);
+    sleigh_builder.spec(spec);
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut pcode = PcodeBuffer::new();
+    let end = sleigh.decode_pcode(&mut pcode, 0x400000, 0x400012).unwrap();
+    assert_eq!(end, 0x400012);
+    assert_eq!(pcode.insn_lengths(), &[15, 2, 1]);
+}
+
+#[test]
+fn test_emulator() {
+    // xor ecx, ecx; add ecx, 10; loop: add eax, ecx; dec ecx; jnz loop;
+    // mov [0x1000], eax; syscall; ret
+    let buf = [
+        0x31, 0xc9, 0x83, 0xc1, 0x0a, 0x01, 0xc8, 0xff, 0xc9, 0x75, 0xfa, 0x89, 0x04, 0x25, 0x00,
+        0x10, 0, 0, 0x0f, 0x05, 0xc3,
+    ];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.spec(arch("x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut emu = sleigh.emulator().unwrap();
+    assert!(emu.run(1).is_err());
+
+    emu.set_pc(0).unwrap();
+    let exit = emu.run(3).unwrap();
+    assert_eq!(exit.reason, StopReason::StepLimit);
+    assert_eq!(exit.steps, 3);
+    assert_eq!(emu.pc(), 7);
+    assert_eq!(emu.register("RCX").unwrap(), 10);
+
+    emu.add_breakpoint(0xb);
+    let exit = emu.run(1000).unwrap();
+    assert_eq!(exit.reason, StopReason::Breakpoint);
+    assert_eq!(exit.steps, 29);
+    assert_eq!(emu.pc(), 0xb);
+    assert_eq!(emu.register("RAX").unwrap(), 55);
+
+    // The next run goes on from the breakpoint, up to the system call
+    let syscall = emu.stop_at_userop("syscall").unwrap();
+    let exit = emu.run(1000).unwrap();
+    assert_eq!(exit.reason, StopReason::Userop(syscall));
+    assert_eq!(exit.steps, 2);
+    assert_eq!(emu.pc(), 0x14);
+    let mut mem = [0; 8];
+    emu.read_memory(0x1000, &mut mem).unwrap();
+    assert_eq!(u64::from_le_bytes(mem), 55);
+
+    emu.set_register("RSP", 0x2000).unwrap();
+    emu.write_memory(0x2000, &7u64.to_le_bytes()).unwrap();
+    emu.run(1).unwrap();
+    assert_eq!(emu.pc(), 7);
+    assert!(emu.register("NOPE").is_err());
+}
+
+#[test]
+fn test_emulator_relative_branch() {
+    // xor ecx, ecx; add ecx, 0x10; bsf eax, ecx, whose p-code loops through relative branches
+    let buf = [0x31, 0xc9, 0x83, 0xc1, 0x10, 0x0f, 0xbc, 0xc1];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.spec(arch("x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut emu = sleigh.emulator().unwrap();
+
+    emu.set_pc(0).unwrap();
+    let exit = emu.run(3).unwrap();
+    assert_eq!(exit.reason, StopReason::StepLimit);
+    assert_eq!(exit.steps, 3);
+    assert_eq!(emu.pc(), 8);
+    assert_eq!(emu.register("RAX").unwrap(), 4);
+}
+
+#[test]
+fn test_emulator_snapshot() {
+    // xor ecx, ecx; add ecx, 10; loop: add eax, ecx; dec ecx; jnz loop;
+    // mov [0x1000], eax; syscall; ret
+    let buf = [
+        0x31, 0xc9, 0x83, 0xc1, 0x0a, 0x01, 0xc8, 0xff, 0xc9, 0x75, 0xfa, 0x89, 0x04, 0x25, 0x00,
+        0x10, 0, 0, 0x0f, 0x05, 0xc3,
+    ];
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0, &buf);
+    sleigh_builder.spec(arch("x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    let mut emu = sleigh.emulator().unwrap();
+    let syscall = emu.stop_at_userop("syscall").unwrap();
+    emu.set_pc(0).unwrap();
+    emu.set_register("RAX", 1).unwrap();
+    emu.write_memory(0x3000, &[1, 2, 3]).unwrap();
+    emu.snapshot();
+
+    for _ in 0..2 {
+        let exit = emu.run(1000).unwrap();
+        assert_eq!(exit.reason, StopReason::Userop(syscall));
+        assert_eq!(emu.register("RAX").unwrap(), 56);
+        // Writes to the image and to new pages are undone as well
+        emu.write_memory(0, &[0xff; 4]).unwrap();
+        emu.write_memory(0x3001, &[0xff; 0x2000]).unwrap();
+        emu.restore().unwrap();
+
+        assert_eq!(emu.pc(), 0);
+        assert_eq!(emu.register("RAX").unwrap(), 1);
+        assert_eq!(emu.register("RCX").unwrap(), 0);
+        let mut mem = [0; 4];
+        emu.read_memory(0x1000, &mut mem).unwrap();
+        assert_eq!(mem, [0; 4]);
+        emu.read_memory(0, &mut mem).unwrap();
+        assert_eq!(mem, buf[..4]);
+        emu.read_memory(0x3000, &mut mem).unwrap();
+        assert_eq!(mem, [1, 2, 3, 0]);
+    }
+
+    // Without a snapshot, everything goes back to the start
+    drop(emu);
+    let mut emu = sleigh.emulator().unwrap();
+    emu.set_pc(0).unwrap();
+    emu.run(2).unwrap();
+    emu.restore().unwrap();
+    assert_eq!(emu.register("RCX").unwrap(), 0);
+    assert!(emu.run(1).is_err());
+}
+
+#[test]
+fn test_preset_dir() {
+    // Architectures which are not embedded are read from the preset directory
+    let dir = std::env::temp_dir().join("sleighcraft_test_presets");
+    std::fs::create_dir_all(&dir).unwrap();
+    std::fs::write(dir.join("Custom-x86-64.sla"), arch("x86-64").unwrap()).unwrap();
+    set_preset_dir(&dir);
+
+    assert_eq!(arch("custom-x86-64").unwrap(), arch("x86-64").unwrap());
+    assert!(arch("not-an-arch").is_err());
+
+    let buf = [0x90, 0xc3];
+    let mut asm_emit = CollectingAssemblyEmit::default();
+    let mut sleigh_builder = SleighBuilder::default();
+    sleigh_builder.segment(0x400000, &buf);
+    sleigh_builder.spec(arch("custom-x86-64").unwrap());
+    sleigh_builder.mode(MODE64);
+    sleigh_builder.asm_emit(&mut asm_emit);
+    let mut sleigh = sleigh_builder.try_build().unwrap();
+    sleigh.decode(0x400000).unwrap();
+    assert_eq!(asm_emit.asms[0].mnemonic, "NOP");
+}
+
+#[test]
+fn test_language_from_file() {
+    // The same preset directory as test_preset_dir, which may be running at the same time
+    let dir = std::env::temp_dir().join("sleighcraft_test_presets");
+    std::fs::create_dir_all(&dir).unwrap();
+    let path = dir.join("Mapped-x86-64.sla");
+    std::fs::write(&path, arch("x86-64").unwrap()).unwrap();
+    assert!(SleighLanguage::from_file(dir.join("missing.sla")).is_err());
+
+    for language in vec![
+        SleighLanguage::from_file(&path).unwrap(),
+        {
+            // Presets in the preset directory are mapped as well
+            set_preset_dir(&dir);
+            SleighLanguage::arch("mapped-x86-64").unwrap()
+        },
+    ] {
+        let buf = [0x90, 0xc3];
+        let mut asm_emit = CollectingAssemblyEmit::default();
+        let mut sleigh_builder = SleighBuilder::default();
+        sleigh_builder.segment(0x400000, &buf);
+        sleigh_builder.language(language);
+        sleigh_builder.mode(MODE64);
+        sleigh_builder.asm_emit(&mut asm_emit);
+        let mut sleigh = sleigh_builder.try_build().unwrap();
+        sleigh.decode(0x400000).unwrap();
+        drop(sleigh);
+        assert_eq!(asm_emit.asms[0].mnemonic, "NOP");
+    }
+}
+
+#[test]
+fn test_language_restore_paths() {
+    // Restoring as the spec is read gives the same language as restoring from the xml tree
+    let packed = arch("x86-64").unwrap();
+    let text = SleighLanguage::from_spec(packed).unwrap().to_xml();
+    assert_eq!(SleighLanguage::from_spec_tree(packed).unwrap().to_xml(), text);
+    assert_eq!(SleighLanguage::from_spec(&text).unwrap().to_xml(), text);
+    assert_eq!(SleighLanguage::from_spec_tree(&text).unwrap().to_xml(), text);
+
+    // Only the xml tree takes what sleighc never writes
+    let commented = text.replacen("\n", "\n<!-- comment -->\n", 1);
+    assert!(SleighLanguage::from_spec(&commented).is_err());
+    assert_eq!(SleighLanguage::from_spec_tree(&commented).unwrap().to_xml(), text);
+}
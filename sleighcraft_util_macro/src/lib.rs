@@ -19,6 +19,7 @@ use syn::{self, parse::Parse, parse_macro_input};
 
 struct DefLoadPresetArg {
     dir: syn::LitStr,
+    ext: syn::LitStr,
     sig: syn::Signature,
 }
 
@@ -26,22 +27,35 @@ impl Parse for DefLoadPresetArg {
     fn parse(input: syn::parse::ParseStream) -> syn::Result<Self> {
         let dir = input.parse()?;
         input.parse::<syn::Token![,]>()?;
+        let ext = input.parse()?;
+        input.parse::<syn::Token![,]>()?;
         let sig = input.parse()?;
-        Ok(Self { dir, sig })
+        Ok(Self { dir, ext, sig })
     }
 }
 
+/// Environment variable with the comma separated names of the architectures to embed,
+/// all of them if it is not set.
+const PRESETS_VAR: &str = "SLEIGHCRAFT_PRESETS";
+
 /// A naive proc-macro to define the architectures based on generated sla files.
-/// Input parameter is the directory containing all sla files.
+/// Input parameters are the directory containing all sla files and the extension
+/// of the files to embed (`.sla`, or `.sla.z` for compressed ones).
 ///
 /// e.g:
 ///
 /// ```
-/// def_sla_load_preset!(fn load_preset() -> HashMap<&'static str, &'static str>);
+/// def_sla_load_preset!("sleighcraft/sla/", ".sla", fn load_preset() -> HashMap<&'static str, &'static [u8]>);
 /// ```
 #[proc_macro]
 pub fn def_sla_load_preset(item: TokenStream) -> TokenStream {
-    let DefLoadPresetArg { dir, sig } = parse_macro_input!(item as DefLoadPresetArg);
+    let DefLoadPresetArg { dir, ext, sig } = parse_macro_input!(item as DefLoadPresetArg);
+    let selected = std::env::var(PRESETS_VAR).ok().map(|names| {
+        names
+            .split(',')
+            .map(|name| name.trim().to_lowercase())
+            .collect::<Vec<_>>()
+    });
     let names = walkdir::WalkDir::new(dir.value())
         .into_iter()
         .filter_map(|e| {
@@ -54,19 +68,27 @@ pub fn def_sla_load_preset(item: TokenStream) -> TokenStream {
                 Err(_) => None
             }
         })
-        .map(|e| {
-            e.file_name().to_str().unwrap().strip_suffix(".sla").unwrap().to_string()
+        .filter_map(|e| {
+            e.file_name().to_str().unwrap().strip_suffix(&ext.value()).map(|name| name.to_string())
+        })
+        .filter(|name| {
+            selected
+                .as_ref()
+                .map(|selected| selected.contains(&name.to_lowercase()))
+                .unwrap_or(true)
         })
         .collect::<Vec<_>>();
     (quote! {
         #sig {
+            // Have the crate rebuilt when the selection changes
+            let _ = option_env!(#PRESETS_VAR);
             let mut map = HashMap::new();
             macro_rules! def_arch {
                 ($name: expr) => {
                     // presets are used across the whole lifetime, it's safe to ignore
                     // the lifetime by leaking its names' memory
                     let name: &'static str = Box::leak($name.to_lowercase().into_boxed_str());
-                    map.insert(name, include_str!(concat!("../sla/", $name, ".sla")));
+                    map.insert(name, &include_bytes!(concat!("../sla/", $name, #ext))[..]);
                 };
             }
 